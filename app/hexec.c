@@ -24,6 +24,8 @@
 #include <stdlib.h>
 
 #include "lib/macros.h"
+#include "app/hexec_reload.h"
+#include "app/hexec_replay.h"
 #include "app/hexec_sync.h"
 
 int main(int argc, char *argv[]) {
@@ -36,12 +38,18 @@ int main(int argc, char *argv[]) {
     int (*func)(int, char **);
   } subcmds[] = {
     {"sync", hexec_sync_main},
+    {"replay", hexec_replay_main},
   };
 
   if (argc < 2) {
     goto usage;
   }
 
+  if (hexec_reload_save_argv(argc, argv) < 0) {
+    perror("hexec_reload_save_argv");
+    return EXIT_FAILURE;
+  }
+
   snprintf(new_argv0, sizeof(new_argv0), "%s-%s", argv[0], argv[1]);
 
   for (i = 0; i < ARRAY_SIZE(subcmds); i++) {
@@ -62,6 +70,7 @@ usage:
       "usage: %s <sub-command> [args]\n"
       "sub-commands:\n"
       "  sync - evaluate SCGI requests in sync mode\n"
+      "  replay - replay requests recorded by sync --record\n"
       , argv0);
   return EXIT_FAILURE;
 }
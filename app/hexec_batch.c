@@ -0,0 +1,946 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/macros.h"
+#include "lib/scgi.h"
+#include "app/hexec_batch.h"
+#include "app/hexec_conn.h"
+
+#define READSZ     16384      /* min buffer space per read */
+#define FRAMESZ    (SCGI_MAXLENDIGITS + 1) /* max "<len>:" length */
+#define MAXBUFKEEP (64 * 1024) /* max buffer size kept for reuse */
+#define HIGHWATER  (256 * 1024) /* max unwritten response, per client */
+#define RETRY_MS   100        /* dispatch retry interval, e.g., on EMFILE */
+
+#define BAD_REQUEST "Status: 400 Bad Request\r\n\r\n"
+#define TOO_LARGE   "Status: 413 Request Entity Too Large\r\n\r\n"
+#define BAD_GATEWAY "Status: 502 Bad Gateway\r\n\r\n"
+
+/* request states */
+#define REQ_FREE    0
+#define REQ_READING 1 /* reading the request from the client */
+#define REQ_QUEUED  2 /* waiting for a batch */
+#define REQ_RUNNING 3 /* in a batch, waiting for the response */
+#define REQ_DONE    4 /* response complete */
+
+/* response framing states */
+#define RESP_LEN   0
+#define RESP_DATA  1
+#define RESP_COMMA 2
+
+struct batch;
+
+/* The request is stored at buf + FRAMESZ, preceded by its netstring
+ * length at buf + start once complete, and followed by ',' */
+struct req {
+  struct iomux_handler h;   /* connection, must be first */
+  int state;
+  int registered;           /* connection is in the iomux context */
+  int enabled;              /* connection waits for writability */
+  int closed;               /* connection is closed */
+  struct batch *batch;      /* batch using the request, or NULL */
+  struct req *next;         /* next in queue, or in free list */
+  struct timespec queued;   /* CLOCK_MONOTONIC */
+  char *buf;
+  size_t cap;
+  size_t start;
+  size_t len;
+  size_t need;              /* request length, 0 until the header is read */
+  char *rbuf;               /* response, not yet written */
+  size_t rcap;
+  size_t rlen;
+  size_t roff;
+};
+
+struct bpipe {
+  struct iomux_handler h;   /* must be first */
+  struct batch *batch;
+};
+
+struct batch {
+  struct bpipe in;          /* stdin of the child, a sink */
+  struct bpipe out;         /* stdout of the child */
+  struct req **reqs;
+  int nreqs;
+  int wcur;                 /* request being written */
+  size_t woff;
+  int rcur;                 /* request receiving its response */
+  int rstate;
+  size_t rleft;             /* response length, or bytes left */
+  int ndigits;              /* # of response length digits read */
+  struct req *blocked;      /* client the output is paused for */
+  int nserved;              /* # of requests served by a worker */
+  int idle;                 /* worker is in the idle list */
+  struct timespec idle_since; /* CLOCK_MONOTONIC */
+  struct batch *next;       /* next in free, or idle, list */
+};
+
+static int batchsize_;
+static int linger_ms_;
+static int persistent_;     /* children are workers, kept between batches */
+static int maxserved_;
+static int idle_ms_;
+static int maxreqs_;
+static struct batch *batches_;
+static struct batch *freebatches_;
+static struct batch *idle_; /* idle workers, most recently used first */
+static struct req **batchreqs_;
+static struct req *reqs_;
+static struct req *freereqs_;
+static struct req *head_;   /* queue */
+static struct req *tail_;
+static int nqueued_;
+static int nconns_;
+static struct iomux_handler timer_;
+static int timer_ms_;
+static struct iomux_handler idletimer_;
+static int (*spawn_)(struct iomux_ctx *ctx, int in, int out, int pipefd);
+static void (*relayed_)(int pipefd, size_t n);
+static void (*on_update_)(struct iomux_ctx *ctx);
+
+static void on_conn(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_stdin(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_stdout(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_timer(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_idle_timer(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void try_dispatch(struct iomux_ctx *ctx);
+
+int hexec_batch_init(int batchsize, int linger_ms, int maxbatches,
+    int (*spawn)(struct iomux_ctx *ctx, int in, int out, int pipefd),
+    void (*relayed)(int pipefd, size_t n),
+    void (*on_update)(struct iomux_ctx *ctx)) {
+  int i;
+
+  maxreqs_ = maxbatches * batchsize;
+  batches_ = calloc(maxbatches, sizeof(struct batch));
+  batchreqs_ = calloc(maxreqs_, sizeof(struct req *));
+  reqs_ = calloc(maxreqs_, sizeof(struct req));
+  if (batches_ == NULL || batchreqs_ == NULL || reqs_ == NULL) {
+    hexec_batch_cleanup();
+    return -1;
+  }
+
+  for (i = maxbatches - 1; i >= 0; i--) {
+    batches_[i].in.h.fd = -1;
+    batches_[i].in.batch = &batches_[i];
+    batches_[i].out.h.fd = -1;
+    batches_[i].out.batch = &batches_[i];
+    batches_[i].reqs = batchreqs_ + (size_t)i * batchsize;
+    batches_[i].next = freebatches_;
+    freebatches_ = &batches_[i];
+  }
+
+  for (i = maxreqs_ - 1; i >= 0; i--) {
+    reqs_[i].h.fd = -1;
+    reqs_[i].next = freereqs_;
+    freereqs_ = &reqs_[i];
+  }
+
+  timer_.fd = -1;
+  idletimer_.fd = -1;
+  batchsize_ = batchsize;
+  linger_ms_ = linger_ms;
+  spawn_ = spawn;
+  relayed_ = relayed;
+  on_update_ = on_update;
+  return 0;
+}
+
+int hexec_batch_init_workers(int maxworkers, int maxrequests, int idle_ms,
+    int (*spawn)(struct iomux_ctx *ctx, int in, int out, int pipefd),
+    void (*relayed)(int pipefd, size_t n),
+    void (*on_update)(struct iomux_ctx *ctx)) {
+  if (hexec_batch_init(1, 0, maxworkers, spawn, relayed, on_update) < 0) {
+    return -1;
+  }
+
+  persistent_ = 1;
+  maxserved_ = maxrequests;
+  idle_ms_ = idle_ms;
+  return 0;
+}
+
+void hexec_batch_cleanup(void) {
+  int i;
+
+  for (i = 0; reqs_ != NULL && i < maxreqs_; i++) {
+    free(reqs_[i].buf);
+    free(reqs_[i].rbuf);
+  }
+
+  free(batches_);
+  free(batchreqs_);
+  free(reqs_);
+  batches_ = NULL;
+  batchreqs_ = NULL;
+  reqs_ = NULL;
+  freebatches_ = NULL;
+  freereqs_ = NULL;
+  idle_ = NULL;
+  persistent_ = 0;
+}
+
+int hexec_batch_accepting(void) {
+  return freereqs_ != NULL;
+}
+
+int hexec_batch_nconns(void) {
+  return nconns_;
+}
+
+static int grow(char **buf, size_t *cap, size_t mincap) {
+  size_t newcap = MAX(*cap, READSZ);
+  char *newbuf;
+
+  while (newcap < mincap) {
+    newcap *= 2;
+  }
+
+  if (newcap == *cap) {
+    return 0;
+  }
+
+  newbuf = realloc(*buf, newcap);
+  if (newbuf == NULL) {
+    return -1;
+  }
+
+  *buf = newbuf;
+  *cap = newcap;
+  return 0;
+}
+
+static void maybe_free_req(struct iomux_ctx *ctx, struct req *r) {
+  if (!r->closed || r->batch != NULL) {
+    return;
+  }
+
+  if (r->cap > MAXBUFKEEP) {
+    free(r->buf);
+    r->buf = NULL;
+    r->cap = 0;
+  }
+
+  if (r->rcap > MAXBUFKEEP) {
+    free(r->rbuf);
+    r->rbuf = NULL;
+    r->rcap = 0;
+  }
+
+  r->state = REQ_FREE;
+  r->next = freereqs_;
+  freereqs_ = r;
+  nconns_--;
+  on_update_(ctx);
+}
+
+/* resume reading the output of a child, paused for a client */
+static void unblock(struct iomux_ctx *ctx, struct batch *b) {
+  b->blocked = NULL;
+  if (b->out.h.fd >= 0 && iomux_enable_source(ctx, &b->out.h) < 0) {
+    perror("batch");
+  }
+}
+
+static void close_conn(struct iomux_ctx *ctx, struct req *r) {
+  if (r->batch != NULL && r->batch->blocked == r) {
+    unblock(ctx, r->batch);
+  }
+
+  hexec_conn_shutdown(r->h.fd);
+  if (r->registered) {
+    iomux_close_source(ctx, &r->h);
+  } else {
+    close(r->h.fd);
+  }
+
+  r->h.fd = -1;
+  r->registered = 0;
+  r->closed = 1;
+  r->rlen = r->roff = 0;
+  maybe_free_req(ctx, r);
+}
+
+/* remove the connection, a source while the request is read, from the
+ * iomux context. Returns -1 on error */
+static int unregister(struct iomux_ctx *ctx, struct req *r) {
+  int fd;
+
+  fd = fcntl(r->h.fd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  iomux_close_source(ctx, &r->h);
+  r->h.fd = fd;
+  r->registered = 0;
+  r->enabled = 0;
+  return 0;
+}
+
+static void set_writable(struct iomux_ctx *ctx, struct req *r, int enable) {
+  int ret = 0;
+
+  if (!r->registered) {
+    if (!enable) {
+      return;
+    }
+
+    r->h.flags = 0;
+    ret = iomux_add_sink(ctx, &r->h);
+    r->registered = ret == 0;
+  } else if (r->enabled != enable) {
+    if (enable) {
+      ret = iomux_enable_source(ctx, &r->h);
+    } else {
+      ret = iomux_disable_source(ctx, &r->h);
+    }
+  }
+
+  if (ret < 0) {
+    perror("batch");
+    close_conn(ctx, r);
+    return;
+  }
+
+  r->enabled = enable;
+}
+
+/* write the buffered response without blocking */
+static void flush_resp(struct iomux_ctx *ctx, struct req *r) {
+  struct batch *b = r->batch;
+  ssize_t n;
+
+  while (r->roff < r->rlen) {
+    n = send(r->h.fd, r->rbuf + r->roff, r->rlen - r->roff,
+        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        set_writable(ctx, r, 1);
+      } else {
+        close_conn(ctx, r); /* the client went away */
+      }
+      return;
+    }
+
+    r->roff += n;
+  }
+
+  r->rlen = r->roff = 0;
+  if (b != NULL && b->blocked == r) {
+    unblock(ctx, b);
+  }
+
+  if (r->state == REQ_DONE) {
+    close_conn(ctx, r);
+  } else {
+    set_writable(ctx, r, 0);
+  }
+}
+
+static void respond(struct iomux_ctx *ctx, struct req *r, const char *data,
+    size_t len) {
+  if (r->closed) {
+    return; /* discard */
+  }
+
+  if (grow(&r->rbuf, &r->rcap, r->rlen + len) < 0) {
+    perror("batch");
+    close_conn(ctx, r);
+    return;
+  }
+
+  memcpy(r->rbuf + r->rlen, data, len);
+  r->rlen += len;
+  flush_resp(ctx, r);
+}
+
+/* reply with an error to a request that is not run */
+static void reject(struct iomux_ctx *ctx, struct req *r, const char *resp) {
+  if (unregister(ctx, r) < 0) {
+    close_conn(ctx, r);
+    return;
+  }
+
+  r->state = REQ_DONE;
+  respond(ctx, r, resp, strlen(resp));
+}
+
+static void enqueue(struct iomux_ctx *ctx, struct req *r) {
+  char frame[FRAMESZ + 1];
+  int n;
+
+  if (unregister(ctx, r) < 0) {
+    close_conn(ctx, r);
+    return;
+  }
+
+  n = snprintf(frame, sizeof(frame), "%zu:", r->len);
+  r->start = FRAMESZ - n;
+  memcpy(r->buf + r->start, frame, n);
+  r->buf[FRAMESZ + r->len] = ',';
+  r->state = REQ_QUEUED;
+  clock_gettime(CLOCK_MONOTONIC, &r->queued);
+  r->next = NULL;
+  if (tail_ == NULL) {
+    head_ = r;
+  } else {
+    tail_->next = r;
+  }
+
+  tail_ = r;
+  nqueued_++;
+  try_dispatch(ctx);
+}
+
+/* reads the request on a connection without blocking, until it is
+ * complete, and queues it then. Invalid or too large requests are
+ * rejected, and incomplete ones closed */
+static void read_req(struct iomux_ctx *ctx, struct req *r) {
+  struct scgi_header hdr;
+  size_t mincap;
+  ssize_t n;
+  int ret;
+
+  for (;;) {
+    /* room for the frame, the request and ',' */
+    mincap = FRAMESZ + (r->need > 0 ? r->need : r->len + READSZ) + 1;
+    if (r->cap < mincap && grow(&r->buf, &r->cap, mincap) < 0) {
+      perror("batch");
+      close_conn(ctx, r);
+      return;
+    }
+
+    n = recv(r->h.fd, r->buf + FRAMESZ + r->len, r->cap - FRAMESZ - 1 - r->len,
+        MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else if (n <= 0) {
+      close_conn(ctx, r); /* incomplete request */
+      return;
+    }
+
+    r->len += n;
+    if (r->need == 0) {
+      ret = scgi_parse(r->buf + FRAMESZ, r->len, &hdr);
+      if (ret < 0) {
+        reject(ctx, r, BAD_REQUEST);
+        return;
+      } else if (ret == 1) {
+        r->need = scgi_request_len(&hdr, HEXEC_BATCH_MAXREQ);
+        if (r->need == 0) {
+          reject(ctx, r, BAD_REQUEST);
+          return;
+        }
+      }
+
+      if (r->need > HEXEC_BATCH_MAXREQ ||
+          (r->need == 0 && r->len > HEXEC_BATCH_MAXREQ)) {
+        reject(ctx, r, TOO_LARGE);
+        return;
+      }
+    }
+
+    if (r->need > 0 && r->len >= r->need) {
+      r->len = r->need; /* SCGI has one request per connection */
+      enqueue(ctx, r);
+      return;
+    }
+  }
+}
+
+static void on_conn(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct req *r = (struct req *)h;
+
+  if (h->fd < 0) {
+    return; /* closed earlier in the same batch of events */
+  } else if (r->state == REQ_READING) {
+    read_req(ctx, r);
+  } else if (r->enabled) {
+    flush_resp(ctx, r);
+  }
+}
+
+void hexec_batch_accept(struct iomux_ctx *ctx, int fd) {
+  struct req *r = freereqs_;
+
+  hexec_conn_hold(fd);
+  r->h.fd = fd;
+  r->h.source_func = on_conn;
+  r->h.flags = 0;
+  if (iomux_add_source(ctx, &r->h) < 0) {
+    perror("batch");
+    r->h.fd = -1;
+    close(fd);
+    return;
+  }
+
+  freereqs_ = r->next;
+  nconns_++;
+  r->state = REQ_READING;
+  r->registered = 1;
+  r->enabled = 0;
+  r->closed = 0;
+  r->batch = NULL;
+  r->len = 0;
+  r->need = 0;
+  r->rlen = r->roff = 0;
+}
+
+static void maybe_free_batch(struct iomux_ctx *ctx, struct batch *b) {
+  struct req *r;
+  int i;
+
+  if (b->in.h.fd >= 0 || b->out.h.fd >= 0) {
+    return;
+  }
+
+  b->next = freebatches_;
+  freebatches_ = b;
+  for (i = 0; i < b->nreqs; i++) {
+    r = b->reqs[i];
+    r->batch = NULL;
+    maybe_free_req(ctx, r);
+  }
+
+  b->nreqs = 0;
+  try_dispatch(ctx);
+}
+
+static void close_stdin(struct iomux_ctx *ctx, struct batch *b) {
+  iomux_close_source(ctx, &b->in.h);
+  b->in.h.fd = -1;
+  maybe_free_batch(ctx, b);
+}
+
+static void on_stdin(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct batch *b = ((struct bpipe *)h)->batch;
+  struct req *r;
+  size_t end;
+  ssize_t n;
+
+  if (h->fd < 0) {
+    return;
+  }
+
+  while (b->wcur < b->nreqs) {
+    r = b->reqs[b->wcur];
+    end = FRAMESZ + r->len + 1;
+    n = write(h->fd, r->buf + r->start + b->woff, end - r->start - b->woff);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      break; /* the child does not read its input */
+    }
+
+    b->woff += n;
+    if (r->start + b->woff == end) {
+      b->wcur++;
+      b->woff = 0;
+    }
+  }
+
+  if (persistent_ && b->wcur == b->nreqs) {
+    /* wait for the next request */
+    if (iomux_disable_source(ctx, h) == 0) {
+      return;
+    }
+    perror("batch");
+  }
+
+  close_stdin(ctx, b);
+}
+
+/* demultiplex netstring framed responses. Returns -1 on framing errors */
+static int parse_resp(struct iomux_ctx *ctx, struct batch *b,
+    const char *data, size_t len) {
+  struct req *r;
+  size_t n;
+
+  while (len > 0) {
+    if (b->rcur == b->nreqs) {
+      return -1; /* more responses than requests */
+    }
+
+    r = b->reqs[b->rcur];
+    switch (b->rstate) {
+    case RESP_LEN:
+      if (*data == ':' && b->ndigits > 0) {
+        b->rstate = b->rleft > 0 ? RESP_DATA : RESP_COMMA;
+      } else if (*data >= '0' && *data <= '9' &&
+          b->ndigits < SCGI_MAXLENDIGITS) {
+        b->rleft = b->rleft * 10 + (*data - '0');
+        b->ndigits++;
+      } else {
+        return -1;
+      }
+      data++;
+      len--;
+      break;
+    case RESP_DATA:
+      n = MIN(len, b->rleft);
+      respond(ctx, r, data, n);
+      data += n;
+      len -= n;
+      b->rleft -= n;
+      if (b->rleft == 0) {
+        b->rstate = RESP_COMMA;
+      }
+      break;
+    case RESP_COMMA:
+      if (*data != ',') {
+        return -1;
+      }
+      data++;
+      len--;
+      r->state = REQ_DONE;
+      flush_resp(ctx, r);
+      b->rcur++;
+      b->rstate = RESP_LEN;
+      b->rleft = 0;
+      b->ndigits = 0;
+      break;
+    }
+
+    if (!r->closed && r->rlen - r->roff > HIGHWATER) {
+      b->blocked = r;
+    }
+  }
+
+  return 0;
+}
+
+static void remove_idle(struct batch *b) {
+  struct batch **curr;
+
+  for (curr = &idle_; *curr != b; curr = &(*curr)->next);
+  *curr = b->next;
+  b->idle = 0;
+}
+
+/* the idle timer runs while there are idle workers that may time out */
+static void update_idle_timer(struct iomux_ctx *ctx) {
+  if (idle_ != NULL && idle_ms_ > 0 && idletimer_.fd < 0) {
+    idletimer_.source_func = on_idle_timer;
+    idletimer_.flags = 0;
+    if (iomux_add_timer(ctx, &idletimer_, MAX(idle_ms_ / 2, 1)) < 0) {
+      perror("batch");
+      idletimer_.fd = -1;
+    }
+  } else if (idle_ == NULL && idletimer_.fd >= 0) {
+    iomux_close_source(ctx, &idletimer_);
+    idletimer_.fd = -1;
+  }
+}
+
+static void reset_batch(struct batch *b) {
+  b->nreqs = 0;
+  b->wcur = 0;
+  b->woff = 0;
+  b->rcur = 0;
+  b->rstate = RESP_LEN;
+  b->rleft = 0;
+  b->ndigits = 0;
+  b->blocked = NULL;
+}
+
+/* a worker has responded to all of its requests: keep it for the next
+ * ones, or stop it by closing its stdin if it has served enough */
+static void release_worker(struct iomux_ctx *ctx, struct batch *b) {
+  struct req *r;
+  int i;
+
+  for (i = 0; i < b->nreqs; i++) {
+    r = b->reqs[i];
+    r->batch = NULL;
+    maybe_free_req(ctx, r);
+  }
+
+  b->nserved += b->nreqs;
+  reset_batch(b);
+  if (maxserved_ > 0 && b->nserved >= maxserved_) {
+    close_stdin(ctx, b); /* freed when the worker exits */
+    return;
+  }
+
+  b->idle = 1;
+  clock_gettime(CLOCK_MONOTONIC, &b->idle_since);
+  b->next = idle_;
+  idle_ = b;
+  try_dispatch(ctx);
+}
+
+static void on_idle_timer(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct batch *b = idle_;
+  struct batch *next;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (b != NULL) {
+    next = b->next;
+    if (hexec_conn_elapsed_ms(&b->idle_since, &now) >= idle_ms_) {
+      remove_idle(b);
+      close_stdin(ctx, b); /* freed when the worker exits */
+    }
+    b = next;
+  }
+
+  update_idle_timer(ctx);
+}
+
+static void close_stdout(struct iomux_ctx *ctx, struct batch *b) {
+  struct req *r;
+  int i;
+
+  relayed_(b->out.h.fd, 0);
+  iomux_close_source(ctx, &b->out.h);
+  b->out.h.fd = -1;
+  b->blocked = NULL;
+  if (b->idle) {
+    remove_idle(b);
+  }
+
+  /* the child no longer responds */
+  if (b->in.h.fd >= 0) {
+    iomux_close_source(ctx, &b->in.h);
+    b->in.h.fd = -1;
+  }
+
+  for (i = b->rcur; i < b->nreqs; i++) {
+    r = b->reqs[i];
+    r->state = REQ_DONE;
+    if (i == b->rcur && (b->rstate != RESP_LEN || b->ndigits > 0)) {
+      flush_resp(ctx, r); /* truncated */
+    } else {
+      respond(ctx, r, BAD_GATEWAY, sizeof(BAD_GATEWAY) - 1);
+    }
+  }
+
+  b->rcur = b->nreqs;
+  maybe_free_batch(ctx, b);
+}
+
+static void on_stdout(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct batch *b = ((struct bpipe *)h)->batch;
+  char buf[READSZ];
+  ssize_t n;
+
+  if (h->fd < 0) {
+    return;
+  }
+
+  while (b->blocked == NULL) {
+    n = read(h->fd, buf, sizeof(buf));
+    if (n > 0) {
+      relayed_(h->fd, n);
+      if (parse_resp(ctx, b, buf, n) < 0) {
+        fprintf(stderr, "batch: invalid response framing\n");
+        goto close_stdout;
+      } else if (persistent_ && b->nreqs > 0 && b->rcur == b->nreqs) {
+        release_worker(ctx, b);
+      }
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      goto close_stdout;
+    }
+  }
+
+  /* stop reading until the client has caught up */
+  if (iomux_disable_source(ctx, h) == 0) {
+    return;
+  }
+  perror("batch");
+close_stdout:
+  close_stdout(ctx, b);
+}
+
+static int set_nonblock_cloexec(int fd) {
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 ||
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void take_reqs(struct batch *b) {
+  struct req *r;
+
+  while (head_ != NULL && b->nreqs < batchsize_) {
+    r = head_;
+    head_ = r->next;
+    r->state = REQ_RUNNING;
+    r->batch = b;
+    b->reqs[b->nreqs++] = r;
+    nqueued_--;
+  }
+
+  if (head_ == NULL) {
+    tail_ = NULL;
+  }
+}
+
+/* spawn a child for the requests at the head of the queue */
+static int start_batch(struct iomux_ctx *ctx) {
+  struct batch *b = freebatches_;
+  int in[2];
+  int out[2];
+  int ret;
+
+  if (b == NULL) {
+    return -1;
+  }
+
+  if (pipe(in) < 0) {
+    return -1;
+  } else if (pipe(out) < 0) {
+    goto close_in;
+  }
+
+  /* the child's ends are close-on-exec too: they are dup'd to stdin and
+   * stdout, and must not leak into other children */
+  if (set_nonblock_cloexec(in[1]) < 0 || set_nonblock_cloexec(out[0]) < 0 ||
+      fcntl(in[0], F_SETFD, FD_CLOEXEC) < 0 ||
+      fcntl(out[1], F_SETFD, FD_CLOEXEC) < 0) {
+    goto close_out;
+  }
+
+  b->in.h.fd = in[1];
+  b->in.h.source_func = on_stdin;
+  b->in.h.flags = 0;
+  if (iomux_add_sink(ctx, &b->in.h) < 0) {
+    goto close_out;
+  }
+
+  b->out.h.fd = out[0];
+  b->out.h.source_func = on_stdout;
+  b->out.h.flags = 0;
+  if (iomux_add_source(ctx, &b->out.h) < 0) {
+    iomux_close_source(ctx, &b->in.h);
+    b->in.h.fd = -1;
+    close(in[0]);
+    close(out[0]);
+    close(out[1]);
+    return -1;
+  }
+
+  ret = spawn_(ctx, in[0], out[1], out[0]);
+  close(in[0]);
+  close(out[1]);
+  if (ret < 0) {
+    iomux_close_source(ctx, &b->in.h);
+    iomux_close_source(ctx, &b->out.h);
+    b->in.h.fd = -1;
+    b->out.h.fd = -1;
+    return -1;
+  }
+
+  freebatches_ = b->next;
+  b->nserved = 0;
+  reset_batch(b);
+  take_reqs(b);
+  return 0;
+
+close_out:
+  close(out[0]);
+  close(out[1]);
+close_in:
+  close(in[0]);
+  close(in[1]);
+  return -1;
+}
+
+/* pass the requests at the head of the queue to an idle worker */
+static void reuse_worker(struct iomux_ctx *ctx, struct batch *b) {
+  remove_idle(b);
+  take_reqs(b);
+  if (iomux_enable_source(ctx, &b->in.h) < 0) {
+    perror("batch");
+    close_stdin(ctx, b); /* the requests fail when the worker exits */
+  }
+}
+
+static void try_dispatch(struct iomux_ctx *ctx) {
+  struct timespec now;
+  int timeout = RETRY_MS;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (nqueued_ > 0) {
+    if (nqueued_ < batchsize_ &&
+        hexec_conn_elapsed_ms(&head_->queued, &now) < linger_ms_) {
+      timeout = MAX(linger_ms_, 1);
+      break; /* wait for more requests */
+    } else if (idle_ != NULL) {
+      reuse_worker(ctx, idle_);
+    } else if (start_batch(ctx) < 0) {
+      break; /* retried when a child exits, or on the timer */
+    }
+  }
+
+  /* the timer runs while requests are queued */
+  if (timer_.fd >= 0 && (nqueued_ == 0 || timer_ms_ != timeout)) {
+    iomux_close_source(ctx, &timer_);
+    timer_.fd = -1;
+  }
+
+  if (nqueued_ > 0 && timer_.fd < 0) {
+    timer_.source_func = on_timer;
+    timer_.flags = 0;
+    timer_ms_ = timeout;
+    if (iomux_add_timer(ctx, &timer_, timeout) < 0) {
+      perror("batch");
+      timer_.fd = -1;
+    }
+  }
+
+  if (persistent_) {
+    update_idle_timer(ctx);
+  }
+}
+
+static void on_timer(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  try_dispatch(ctx);
+}
+
+void hexec_batch_kick(struct iomux_ctx *ctx) {
+  try_dispatch(ctx);
+}
@@ -0,0 +1,107 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef APP_HEXEC_BATCH_H__
+#define APP_HEXEC_BATCH_H__
+
+#include "lib/iomux.h"
+
+/* Batch execution: requests are read in full by hexec and queued. Up to
+ * 'batchsize' queued requests are run by one child, which gets them on
+ * stdin as a stream of netstrings, each holding a complete SCGI request
+ * (header netstring and body):
+ *
+ *   <len>:<SCGI request>,<len>:<SCGI request>,...
+ *
+ * stdin is closed after the last request. The child writes one
+ * netstring-framed response per request to stdout, in request order,
+ * and each response is passed to the client of its request as it
+ * arrives. Clients of requests without a response when stdout is
+ * closed get a 502 response. stderr is not passed to clients.
+ *
+ * A batch is started when 'batchsize' requests are queued, or when the
+ * oldest queued request has waited for 'linger_ms' milliseconds, and a
+ * child may be spawned.
+ *
+ * Workers are children kept running between requests: stdin is left
+ * open and each request is written to an idle worker, or to a newly
+ * spawned one, when it is queued. A worker is stopped by closing its
+ * stdin once it has served 'maxrequests' requests or has been idle for
+ * 'idle_ms' milliseconds. A worker that exits while running a request
+ * fails the request, and is replaced when needed. lib/worker.h
+ * implements the child side of both protocols. */
+
+#define HEXEC_BATCH_DEFAULT_LINGER_MS 2
+#define HEXEC_BATCH_DEFAULT_MAXREQUESTS 1000 /* per worker */
+#define HEXEC_BATCH_DEFAULT_IDLE_MS 10000
+#define HEXEC_BATCH_MAXREQ (1 << 20) /* max request length, with body */
+
+/* hexec_batch_init --
+ *   Sets up batching of up to 'batchsize' requests per child, with at
+ *   most 'maxbatches' batches running at a time. Room is made for
+ *   'maxbatches' * 'batchsize' connections.
+ *
+ *   'spawn' runs a child with stdin 'in' and stdout 'out', the write
+ *   end of a pipe whose read end is 'pipefd', and returns 0 on success,
+ *   or -1 if no child can be spawned now. 'in' and 'out' are closed by
+ *   the caller. 'relayed' is called with the number of bytes 'n' read
+ *   from 'pipefd', and with 0 when it is closed. 'on_update' is called
+ *   when the number of connections held decreases.
+ *
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int hexec_batch_init(int batchsize, int linger_ms, int maxbatches,
+    int (*spawn)(struct iomux_ctx *ctx, int in, int out, int pipefd),
+    void (*relayed)(int pipefd, size_t n),
+    void (*on_update)(struct iomux_ctx *ctx));
+
+/* hexec_batch_init_workers --
+ *   Sets up at most 'maxworkers' workers running one request at a time.
+ *   A 'maxrequests' or 'idle_ms' of 0 means no limit. 'spawn',
+ *   'relayed' and 'on_update' are as for hexec_batch_init.
+ *
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int hexec_batch_init_workers(int maxworkers, int maxrequests, int idle_ms,
+    int (*spawn)(struct iomux_ctx *ctx, int in, int out, int pipefd),
+    void (*relayed)(int pipefd, size_t n),
+    void (*on_update)(struct iomux_ctx *ctx));
+
+/* hexec_batch_cleanup --
+ *   Releases all resources. */
+void hexec_batch_cleanup(void);
+
+/* hexec_batch_accepting --
+ *   Returns 1 if there is room for another connection, 0 otherwise. */
+int hexec_batch_accepting(void);
+
+/* hexec_batch_accept --
+ *   Takes ownership of the accepted connection 'fd'. Must only be called
+ *   if hexec_batch_accepting returns 1. */
+void hexec_batch_accept(struct iomux_ctx *ctx, int fd);
+
+/* hexec_batch_kick --
+ *   Starts queued batches, e.g., after a child has exited. */
+void hexec_batch_kick(struct iomux_ctx *ctx);
+
+/* hexec_batch_nconns --
+ *   Returns the number of connections held. */
+int hexec_batch_nconns(void);
+
+#endif
@@ -0,0 +1,621 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/macros.h"
+#include "lib/scgi.h"
+#include "app/hexec_coalesce.h"
+#include "app/hexec_conn.h"
+
+#define KEYSZ      1024     /* max key length */
+#define READSZ     16384    /* min free output buffer space per read */
+#define MAXREADS   4        /* max reads of the output per event */
+#define MAXOUTPUT  (1 << 20) /* max output buffer size */
+#define MAXBUFKEEP (1 << 20) /* max output buffer size kept for reuse */
+
+/* reading the output pauses while the slowest connection lags this far
+ * behind, and resumes once it lags half as far */
+#define HIGHWATER  (256 * 1024)
+
+struct flight;
+
+struct conn {
+  struct iomux_handler h;   /* connection, must be first */
+  struct flight *flight;
+  size_t off;               /* bytes of output written */
+  int enabled;              /* waiting for writability */
+};
+
+/* a flight is free when neither its pipe nor any connection is open */
+struct flight {
+  struct iomux_handler h;   /* output pipe, must be first */
+  struct flight *next;      /* next in bucket, or in free list */
+  int hashed;               /* in key table */
+  int done;                 /* output complete */
+  int paused;               /* pipe disabled for a slow connection */
+  uint64_t hash;
+  size_t keylen;
+  char key[KEYSZ];
+  char *buf;                /* output from offset 'base' */
+  size_t base;
+  size_t len;
+  size_t cap;
+  struct conn *conns;       /* leader and waiters */
+  int nconns;
+};
+
+static char *fieldbuf_;
+static char **fields_;
+static int nfields_;
+static int maxwaiters_;
+static int maxflights_;
+static struct flight *flights_;
+static struct conn *conns_;
+static struct flight *free_;
+static struct flight **buckets_;
+static size_t mask_;        /* # of buckets - 1 */
+static int nflights_;
+static struct hexec_conn_queue queue_;
+static void (*spawn_)(struct iomux_ctx *ctx, int fd, int outfd,
+    int pipefd);
+static void (*relayed_)(int pipefd, size_t n);
+static void (*on_update_)(struct iomux_ctx *ctx);
+
+static void on_output(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_writable(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg);
+
+int hexec_coalesce_init(const char *fields, int maxflights, int maxwaiters,
+    int maxpending,
+    void (*spawn)(struct iomux_ctx *ctx, int fd, int outfd, int pipefd),
+    void (*relayed)(int pipefd, size_t n),
+    void (*on_update)(struct iomux_ctx *ctx)) {
+  char *tok;
+  char *save;
+  size_t nbuckets = 1;
+  int i;
+
+  while (nbuckets < (size_t)maxflights * 2) {
+    nbuckets <<= 1;
+  }
+
+  fieldbuf_ = strdup(fields);
+  fields_ = calloc(strlen(fields) / 2 + 1, sizeof(char *));
+  flights_ = calloc(maxflights, sizeof(struct flight));
+  conns_ = calloc((size_t)maxflights * (maxwaiters + 1), sizeof(struct conn));
+  buckets_ = calloc(nbuckets, sizeof(struct flight *));
+  if (fieldbuf_ == NULL || fields_ == NULL || flights_ == NULL ||
+      conns_ == NULL || buckets_ == NULL ||
+      hexec_conn_queue_init(&queue_, maxpending, on_ready) < 0) {
+    goto fail;
+  }
+
+  for (tok = strtok_r(fieldbuf_, ",", &save); tok != NULL;
+      tok = strtok_r(NULL, ",", &save)) {
+    fields_[nfields_++] = tok;
+  }
+
+  if (nfields_ == 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  for (i = 0; i < maxflights * (maxwaiters + 1); i++) {
+    conns_[i].h.fd = -1;
+  }
+
+  for (i = maxflights - 1; i >= 0; i--) {
+    flights_[i].h.fd = -1;
+    flights_[i].conns = conns_ + (size_t)i * (maxwaiters + 1);
+    flights_[i].next = free_;
+    free_ = &flights_[i];
+  }
+
+  mask_ = nbuckets - 1;
+  maxflights_ = maxflights;
+  maxwaiters_ = maxwaiters;
+  spawn_ = spawn;
+  relayed_ = relayed;
+  on_update_ = on_update;
+  return 0;
+fail:
+  hexec_coalesce_cleanup();
+  return -1;
+}
+
+void hexec_coalesce_cleanup(void) {
+  int i;
+
+  for (i = 0; flights_ != NULL && i < maxflights_; i++) {
+    free(flights_[i].buf);
+  }
+
+  free(fieldbuf_);
+  free(fields_);
+  free(flights_);
+  free(conns_);
+  free(buckets_);
+  hexec_conn_queue_cleanup(&queue_);
+  fieldbuf_ = NULL;
+  fields_ = NULL;
+  nfields_ = 0;
+  flights_ = NULL;
+  conns_ = NULL;
+  buckets_ = NULL;
+  free_ = NULL;
+}
+
+int hexec_coalesce_nflights(void) {
+  return nflights_;
+}
+
+int hexec_coalesce_npending(void) {
+  return queue_.nwaiting;
+}
+
+/* FNV-1a */
+static uint64_t hash_key(const char *key, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+/* the key is the NUL terminated values of the key fields */
+static int make_key(const struct scgi_header *hdr, char *key,
+    size_t *keylen) {
+  const char *val;
+  size_t len = 0;
+  size_t n;
+  int i;
+
+  for (i = 0; i < nfields_; i++) {
+    val = scgi_get(hdr, fields_[i]);
+    if (val == NULL) {
+      val = "";
+    }
+
+    n = strlen(val) + 1;
+    if (len + n > KEYSZ) {
+      return -1;
+    }
+
+    memcpy(key + len, val, n);
+    len += n;
+  }
+
+  *keylen = len;
+  return 0;
+}
+
+static struct flight *lookup(uint64_t hash, const char *key,
+    size_t keylen) {
+  struct flight *f;
+
+  for (f = buckets_[hash & mask_]; f != NULL; f = f->next) {
+    if (f->hash == hash && f->keylen == keylen &&
+        memcmp(f->key, key, keylen) == 0) {
+      return f;
+    }
+  }
+
+  return NULL;
+}
+
+static void unhash(struct flight *f) {
+  struct flight **curr;
+
+  for (curr = &buckets_[f->hash & mask_]; *curr != NULL;
+      curr = &(*curr)->next) {
+    if (*curr == f) {
+      *curr = f->next;
+      break;
+    }
+  }
+
+  f->hashed = 0;
+  f->next = NULL;
+}
+
+static void maybe_free(struct iomux_ctx *ctx, struct flight *f) {
+  if (f->h.fd >= 0 || f->nconns > 0) {
+    return;
+  }
+
+  if (f->cap > MAXBUFKEEP) {
+    free(f->buf);
+    f->buf = NULL;
+    f->cap = 0;
+  }
+
+  f->base = 0;
+  f->len = 0;
+  f->done = 0;
+  f->paused = 0;
+  f->next = free_;
+  free_ = f;
+  nflights_--;
+  on_update_(ctx);
+}
+
+/* returns the output offset of the slowest connection of 'f', or the end
+ * of the output if it has none */
+static size_t min_off(const struct flight *f) {
+  size_t off = f->base + f->len;
+  int i;
+
+  for (i = 0; i <= maxwaiters_; i++) {
+    if (f->conns[i].h.fd >= 0) {
+      off = MIN(off, f->conns[i].off);
+    }
+  }
+
+  return off;
+}
+
+/* drop the output all connections have been sent. Requests join a
+ * flight at the start of its output, so only once it is unhashed */
+static void compact(struct flight *f) {
+  size_t off;
+
+  if (f->hashed || (off = min_off(f)) == f->base) {
+    return;
+  }
+
+  f->len -= off - f->base;
+  memmove(f->buf, f->buf + (off - f->base), f->len);
+  f->base = off;
+}
+
+/* pause reading the output while the slowest connection lags behind */
+static void update_reading(struct iomux_ctx *ctx, struct flight *f) {
+  size_t lag;
+  int pause;
+  int ret;
+
+  if (f->h.fd < 0) {
+    return;
+  }
+
+  lag = f->base + f->len - min_off(f);
+  pause = lag > (f->paused ? HIGHWATER / 2 : HIGHWATER);
+  if (pause == f->paused) {
+    return;
+  }
+
+  if (pause) {
+    ret = iomux_disable_source(ctx, &f->h);
+  } else {
+    ret = iomux_enable_source(ctx, &f->h);
+  }
+
+  if (ret < 0) {
+    perror("coalesce");
+    return;
+  }
+
+  f->paused = pause;
+}
+
+static void close_conn(struct iomux_ctx *ctx, struct conn *c) {
+  struct flight *f = c->flight;
+
+  hexec_conn_shutdown(c->h.fd);
+  iomux_close_source(ctx, &c->h);
+  c->h.fd = -1;
+  f->nconns--;
+  update_reading(ctx, f);
+  maybe_free(ctx, f);
+}
+
+static void set_enabled(struct iomux_ctx *ctx, struct conn *c, int enable) {
+  int ret;
+
+  if (c->enabled == enable) {
+    return;
+  }
+
+  if (enable) {
+    ret = iomux_enable_source(ctx, &c->h);
+  } else {
+    ret = iomux_disable_source(ctx, &c->h);
+  }
+
+  if (ret < 0) {
+    perror("coalesce");
+    close_conn(ctx, c);
+    return;
+  }
+
+  c->enabled = enable;
+}
+
+/* write buffered output to a connection without blocking */
+static void flush(struct iomux_ctx *ctx, struct conn *c) {
+  struct flight *f = c->flight;
+  ssize_t n;
+
+  while (c->off < f->base + f->len) {
+    n = send(c->h.fd, f->buf + (c->off - f->base),
+        f->base + f->len - c->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        set_enabled(ctx, c, 1);
+      } else {
+        close_conn(ctx, c); /* the client went away */
+      }
+      return;
+    }
+
+    c->off += n;
+  }
+
+  if (f->done) {
+    close_conn(ctx, c);
+  } else {
+    set_enabled(ctx, c, 0);
+  }
+}
+
+static void flush_all(struct iomux_ctx *ctx, struct flight *f) {
+  int i;
+
+  for (i = 0; i <= maxwaiters_; i++) {
+    if (f->conns[i].h.fd >= 0) {
+      flush(ctx, &f->conns[i]);
+    }
+  }
+}
+
+static void on_writable(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct conn *c = (struct conn *)h;
+  struct flight *f = c->flight;
+
+  if (h->fd < 0 || !c->enabled) {
+    return; /* closed or disabled earlier in the same batch of events */
+  }
+
+  flush(ctx, c);
+  update_reading(ctx, f);
+}
+
+/* make room for a read of the output. Returns -1 if there is none */
+static int make_room(struct flight *f) {
+  size_t cap;
+  char *buf;
+
+  if (f->cap - f->len < READSZ) {
+    compact(f);
+  }
+
+  if (f->cap - f->len < READSZ && f->cap < MAXOUTPUT) {
+    cap = f->cap == 0 ? READSZ * 2 : MIN(f->cap * 2, MAXOUTPUT);
+    buf = realloc(f->buf, cap);
+    if (buf == NULL) {
+      perror("coalesce");
+    } else {
+      f->buf = buf;
+      f->cap = cap;
+    }
+  }
+
+  /* requests no longer join a flight whose output does not fit */
+  if (f->len == f->cap && f->hashed) {
+    unhash(f);
+    compact(f);
+  }
+
+  return f->len < f->cap ? 0 : -1;
+}
+
+static void on_output(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct flight *f = (struct flight *)h;
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < MAXREADS; i++) {
+    if (f->base + f->len - min_off(f) > HIGHWATER) {
+      break; /* paused below */
+    } else if (make_room(f) < 0) {
+      goto done; /* truncate the output */
+    }
+
+    n = read(h->fd, f->buf + f->len, f->cap - f->len);
+    if (n > 0) {
+      f->len += n;
+      relayed_(h->fd, n);
+    } else if (n < 0 && errno == EINTR) {
+      i--;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      goto done;
+    }
+  }
+
+  flush_all(ctx, f);
+  update_reading(ctx, f);
+  return;
+
+done:
+  f->done = 1;
+  if (f->hashed) {
+    unhash(f);
+  }
+
+  relayed_(h->fd, 0);
+  iomux_close_source(ctx, h);
+  h->fd = -1;
+
+  /* keep the flight while flushing, the last connection frees it */
+  f->nconns++;
+  flush_all(ctx, f);
+  f->nconns--;
+  maybe_free(ctx, f);
+}
+
+static int add_conn(struct iomux_ctx *ctx, struct flight *f, int fd) {
+  struct conn *c = NULL;
+  int i;
+
+  for (i = 0; i <= maxwaiters_; i++) {
+    if (f->conns[i].h.fd < 0) {
+      c = &f->conns[i];
+      break;
+    }
+  }
+
+  if (c == NULL) {
+    return -1;
+  }
+
+  c->h.fd = fd;
+  c->h.source_func = on_writable;
+  c->h.flags = 0;
+  c->flight = f;
+  c->off = 0;
+  c->enabled = 1;
+  if (iomux_add_sink(ctx, &c->h) < 0) {
+    c->h.fd = -1;
+    return -1;
+  }
+
+  f->nconns++;
+  flush(ctx, c);
+  return 0;
+}
+
+/* start a flight led by connection 'fd'. Returns the flight, with the
+ * write end of its output pipe in 'outfd', or NULL on error */
+static struct flight *lead(struct iomux_ctx *ctx, int fd, uint64_t hash,
+    const char *key, size_t keylen, int *outfd) {
+  struct flight *f = free_;
+  int pfds[2];
+  int connfd;
+  int i;
+
+  if (f == NULL) {
+    return NULL;
+  }
+
+  if (pipe(pfds) < 0) {
+    return NULL;
+  }
+
+  for (i = 0; i < 2; i++) {
+    if (fcntl(pfds[i], F_SETFD, FD_CLOEXEC) < 0) {
+      goto close_pipe;
+    }
+  }
+
+  if (fcntl(pfds[0], F_SETFL, fcntl(pfds[0], F_GETFL) | O_NONBLOCK) < 0) {
+    goto close_pipe;
+  }
+
+  /* the child gets the connection itself */
+  connfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (connfd < 0) {
+    goto close_pipe;
+  }
+
+  f->h.fd = pfds[0];
+  f->h.source_func = on_output;
+  f->h.flags = 0;
+  if (iomux_add_source(ctx, &f->h) < 0) {
+    f->h.fd = -1;
+    goto close_connfd;
+  }
+
+  free_ = f->next;
+  nflights_++;
+  if (add_conn(ctx, f, connfd) < 0) {
+    /* no output can be delivered - the flight ends on the pipe EOF */
+    close(connfd);
+  }
+
+  f->hash = hash;
+  f->keylen = keylen;
+  memcpy(f->key, key, keylen);
+  f->next = buckets_[hash & mask_];
+  buckets_[hash & mask_] = f;
+  f->hashed = 1;
+  *outfd = pfds[1];
+  return f;
+
+close_connfd:
+  close(connfd);
+close_pipe:
+  close(pfds[0]);
+  close(pfds[1]);
+  return NULL;
+}
+
+/* join or lead a flight, or run the request uncoalesced */
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg) {
+  struct flight *f;
+  char key[KEYSZ];
+  size_t keylen;
+  uint64_t hash;
+  int outfd = -1;
+  int pipefd = -1;
+
+  if (hdr != NULL && make_key(hdr, key, &keylen) == 0) {
+    hash = hash_key(key, keylen);
+    f = lookup(hash, key, keylen);
+    if (f == NULL) {
+      f = lead(ctx, fd, hash, key, keylen, &outfd);
+      pipefd = f != NULL ? f->h.fd : -1;
+    } else if (f->nconns <= maxwaiters_ && add_conn(ctx, f, fd) == 0) {
+      fd = -1; /* joined */
+    }
+  }
+
+  if (fd >= 0) {
+    spawn_(ctx, fd, outfd, pipefd);
+  }
+  if (outfd >= 0) {
+    close(outfd);
+  }
+
+  on_update_(ctx);
+}
+
+void hexec_coalesce_accept(struct iomux_ctx *ctx, int fd) {
+  hexec_conn_wait(ctx, &queue_, fd, NULL);
+}
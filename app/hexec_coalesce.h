@@ -0,0 +1,87 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef APP_HEXEC_COALESCE_H__
+#define APP_HEXEC_COALESCE_H__
+
+#include "lib/iomux.h"
+
+/* Request coalescing: concurrent requests with the same key, built from
+ * a set of SCGI headers, share one child. The first request of a key
+ * leads a flight: its child writes to a pipe instead of to the
+ * connection, and the output is copied to the leader and to every
+ * request that joins the flight while the child runs. Joining requests
+ * receive the output from the start. A flight is removed from the key
+ * table when the output is complete, or larger than the output buffer
+ * of a flight, after which only the output all of its connections have
+ * been sent is dropped from the buffer. Reading the output pauses while
+ * the slowest connection lags too far behind.
+ *
+ * The key is read from the start of the request without consuming it.
+ * Connections accepted before the request header has arrived are pending
+ * until it has, for at most a second.
+ *
+ * The number of flights, the number of waiters per flight and the
+ * number of pending connections are bounded. Requests that can not be
+ * coalesced, e.g., because their headers are invalid or incomplete after
+ * a second, or because the bounds are reached, are run as usual. */
+
+#define HEXEC_COALESCE_DEFAULT_MAXWAITERS 64
+
+/* hexec_coalesce_init --
+ *   Sets up coalescing on 'fields', a comma separated list of SCGI
+ *   header names, with room for 'maxflights' flights of 'maxwaiters'
+ *   waiters each and for 'maxpending' pending connections.
+ *
+ *   'spawn' runs the request on connection 'fd', and takes ownership of
+ *   'fd'. If 'outfd' is not -1, the child must write its output to
+ *   'outfd' instead of to the connection, the write end of a pipe whose
+ *   read end is 'pipefd'. 'relayed' is called with the number of bytes
+ *   'n' read from 'pipefd', and with 0 when it is closed. 'on_update' is
+ *   called when the number of pending connections or of flights
+ *   decreases.
+ *
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int hexec_coalesce_init(const char *fields, int maxflights, int maxwaiters,
+    int maxpending,
+    void (*spawn)(struct iomux_ctx *ctx, int fd, int outfd, int pipefd),
+    void (*relayed)(int pipefd, size_t n),
+    void (*on_update)(struct iomux_ctx *ctx));
+
+/* hexec_coalesce_cleanup --
+ *   Releases all resources. */
+void hexec_coalesce_cleanup(void);
+
+/* hexec_coalesce_accept --
+ *   Takes ownership of the accepted connection 'fd', which joins a
+ *   flight, becomes pending or is spawned. */
+void hexec_coalesce_accept(struct iomux_ctx *ctx, int fd);
+
+/* hexec_coalesce_nflights --
+ *   Returns the number of flights with output not yet written to all
+ *   connections. */
+int hexec_coalesce_nflights(void);
+
+/* hexec_coalesce_npending --
+ *   Returns the number of pending connections. */
+int hexec_coalesce_npending(void);
+
+#endif
@@ -0,0 +1,262 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "app/hexec_conn.h"
+
+struct hexec_conn_waiter {
+  struct iomux_handler h;   /* duplicate of the connection, must be
+                               first */
+  struct hexec_conn_queue *q;
+  int fd;                   /* connection, -1 if the entry is free */
+  void *arg;
+  int partial;              /* part of the header has arrived */
+  struct timespec accepted; /* CLOCK_MONOTONIC */
+  struct hexec_conn_waiter *next; /* next in free list */
+};
+
+int hexec_conn_queue_init(struct hexec_conn_queue *q, int max,
+    void (*ready)(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg)) {
+  int i;
+
+  q->waiters = calloc(max, sizeof(struct hexec_conn_waiter));
+  if (q->waiters == NULL) {
+    return -1;
+  }
+
+  q->free = NULL;
+  for (i = max - 1; i >= 0; i--) {
+    q->waiters[i].h.fd = -1;
+    q->waiters[i].fd = -1;
+    q->waiters[i].q = q;
+    q->waiters[i].next = q->free;
+    q->free = &q->waiters[i];
+  }
+
+  q->max = max;
+  q->nwaiting = 0;
+  q->timer.fd = -1;
+  q->ready = ready;
+  return 0;
+}
+
+void hexec_conn_queue_cleanup(struct hexec_conn_queue *q) {
+  free(q->waiters);
+  q->waiters = NULL;
+  q->free = NULL;
+  q->max = 0;
+  q->nwaiting = 0;
+}
+
+void hexec_conn_hold(int fd) {
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+    perror("hexec_conn_hold");
+  }
+}
+
+void hexec_conn_shutdown(int fd) {
+  char buf[1024];
+
+  shutdown(fd, SHUT_WR);
+  while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+}
+
+void hexec_conn_reply(int fd, const char *resp, size_t len) {
+  send(fd, resp, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  hexec_conn_shutdown(fd);
+  close(fd);
+}
+
+int64_t hexec_conn_elapsed_ms(const struct timespec *from,
+    const struct timespec *to) {
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000 +
+      (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/* peeks at the request on 'fd', so that a child still reads all of it,
+ * into 'buf' of HEXEC_CONN_PEEKSZ bytes. Returns 1 if the header is
+ * complete, and parses it into 'hdr', 0 if more data may complete it, or
+ * -1 if it is invalid or will not arrive */
+static int peek(int fd, char *buf, struct scgi_header *hdr) {
+  ssize_t n;
+  int ret;
+
+  n = recv(fd, buf, HEXEC_CONN_PEEKSZ, MSG_PEEK | MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  } else if (n <= 0) {
+    return -1;
+  }
+
+  ret = scgi_parse(buf, n, hdr);
+  if (ret == 0 && n == HEXEC_CONN_PEEKSZ) {
+    return -1; /* too long */
+  }
+
+  return ret;
+}
+
+static void stop_timer(struct iomux_ctx *ctx, struct hexec_conn_queue *q) {
+  if (q->timer.fd >= 0) {
+    iomux_close_source(ctx, &q->timer);
+    q->timer.fd = -1;
+  }
+}
+
+/* stop waiting for a connection, and hand it over with 'hdr' */
+static void resolve(struct iomux_ctx *ctx, struct hexec_conn_waiter *w,
+    const struct scgi_header *hdr) {
+  struct hexec_conn_queue *q = w->q;
+  void *arg = w->arg;
+  int fd = w->fd;
+
+  iomux_close_source(ctx, &w->h);
+  w->h.fd = -1;
+  w->fd = -1;
+  w->next = q->free;
+  q->free = w;
+  if (--q->nwaiting == 0) {
+    stop_timer(ctx, q);
+  }
+
+  q->ready(ctx, fd, hdr, arg);
+}
+
+static void on_data(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct hexec_conn_waiter *w = (struct hexec_conn_waiter *)h;
+  struct scgi_header hdr;
+  char buf[HEXEC_CONN_PEEKSZ];
+  int ret;
+
+  if (h->fd < 0) {
+    return; /* resolved earlier in the same batch of events */
+  }
+
+  ret = peek(w->fd, buf, &hdr);
+  if (ret != 0) {
+    resolve(ctx, w, ret > 0 ? &hdr : NULL);
+    return;
+  }
+
+  /* the unread part of the header would wake the handler again right
+   * away, so the rest of it is polled for by the timer */
+  if (iomux_disable_source(ctx, h) < 0) {
+    resolve(ctx, w, NULL);
+    return;
+  }
+
+  w->partial = 1;
+}
+
+/* hand over connections whose header has completed since the last tick,
+ * and connections whose header has not arrived in time, without it */
+static void on_timer(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct hexec_conn_queue *q = (struct hexec_conn_queue *)((char *)h -
+      offsetof(struct hexec_conn_queue, timer));
+  struct hexec_conn_waiter *w;
+  struct scgi_header hdr;
+  char buf[HEXEC_CONN_PEEKSZ];
+  struct timespec now;
+  int ret;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < q->max; i++) {
+    w = &q->waiters[i];
+    if (w->fd < 0) {
+      continue;
+    }
+
+    ret = w->partial ? peek(w->fd, buf, &hdr) : 0;
+    if (ret != 0) {
+      resolve(ctx, w, ret > 0 ? &hdr : NULL);
+    } else if (hexec_conn_elapsed_ms(&w->accepted, &now) >=
+        HEXEC_CONN_WAIT_MS) {
+      resolve(ctx, w, NULL);
+    }
+  }
+}
+
+/* watch a duplicate of connection 'fd'. Returns -1 if it can not wait */
+static int park(struct iomux_ctx *ctx, struct hexec_conn_queue *q, int fd,
+    void *arg) {
+  struct hexec_conn_waiter *w = q->free;
+  int dupfd;
+
+  if (w == NULL) {
+    return -1;
+  }
+
+  if (q->nwaiting == 0) {
+    q->timer.source_func = on_timer;
+    if (iomux_add_timer(ctx, &q->timer, HEXEC_CONN_INTERVAL_MS) < 0) {
+      q->timer.fd = -1;
+      return -1;
+    }
+  }
+
+  dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  w->h.fd = dupfd;
+  w->h.flags = 0;
+  w->h.source_func = on_data;
+  if (dupfd < 0 || iomux_add_source(ctx, &w->h) < 0) {
+    if (dupfd >= 0) {
+      close(dupfd);
+    }
+    w->h.fd = -1;
+    if (q->nwaiting == 0) {
+      stop_timer(ctx, q);
+    }
+    return -1;
+  }
+
+  q->free = w->next;
+  w->next = NULL;
+  w->fd = fd;
+  w->arg = arg;
+  w->partial = 0;
+  clock_gettime(CLOCK_MONOTONIC, &w->accepted);
+  q->nwaiting++;
+  return 0;
+}
+
+void hexec_conn_wait(struct iomux_ctx *ctx, struct hexec_conn_queue *q,
+    int fd, void *arg) {
+  struct scgi_header hdr;
+  char buf[HEXEC_CONN_PEEKSZ];
+  int ret;
+
+  hexec_conn_hold(fd);
+  ret = peek(fd, buf, &hdr);
+  if (ret == 0 && park(ctx, q, fd, arg) == 0) {
+    return;
+  }
+
+  q->ready(ctx, fd, ret > 0 ? &hdr : NULL, arg);
+}
@@ -0,0 +1,106 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef APP_HEXEC_CONN_H__
+#define APP_HEXEC_CONN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lib/iomux.h"
+#include "lib/scgi.h"
+
+/* Connections held by hexec, rather than passed to a child right away,
+ * in the modes that look at requests before running them.
+ *
+ * A connection is usually accepted before the client has sent its
+ * request. A wait queue holds such connections until the complete SCGI
+ * header has arrived, or for at most HEXEC_CONN_WAIT_MS, and then hands
+ * each over with the header. The header is peeked at, not read, so that
+ * a child still reads the complete request, and the queue watches a
+ * duplicate of the connection, so that the connection remains open when
+ * the watch ends. Once part of a header has arrived, the rest is polled
+ * for every HEXEC_CONN_INTERVAL_MS. */
+
+#define HEXEC_CONN_PEEKSZ       8192 /* max SCGI header length */
+#define HEXEC_CONN_WAIT_MS      1000 /* max wait for the header */
+#define HEXEC_CONN_INTERVAL_MS  100
+
+struct hexec_conn_waiter;
+
+struct hexec_conn_queue {
+  struct hexec_conn_waiter *waiters;
+  struct hexec_conn_waiter *free;
+  int max;
+  int nwaiting;
+  struct iomux_handler timer;
+  void (*ready)(struct iomux_ctx *ctx, int fd,
+      const struct scgi_header *hdr, void *arg);
+};
+
+/* hexec_conn_queue_init --
+ *   Sets up 'q' for at most 'max' waiting connections. 'ready' takes
+ *   ownership of connection 'fd', waited for with 'arg', with its
+ *   header 'hdr', or NULL if no complete header arrived in time or it is
+ *   invalid. 'hdr' is only valid during the call. Returns 0 on success,
+ *   -1 on error. Sets errno. */
+int hexec_conn_queue_init(struct hexec_conn_queue *q, int max,
+    void (*ready)(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg));
+
+/* hexec_conn_queue_cleanup --
+ *   Releases all resources. Waiting connections are not closed. */
+void hexec_conn_queue_cleanup(struct hexec_conn_queue *q);
+
+/* hexec_conn_wait --
+ *   Holds the accepted connection 'fd' in 'q' until its header has
+ *   arrived, and passes it and 'arg' to the ready function then. If the
+ *   header has arrived already, is invalid, or the connection can not
+ *   wait, the ready function is called right away. */
+void hexec_conn_wait(struct iomux_ctx *ctx, struct hexec_conn_queue *q,
+    int fd, void *arg);
+
+/* hexec_conn_hold --
+ *   Marks the accepted connection 'fd' as held by this process. Held
+ *   connections are not inherited by children, or clients would not see
+ *   them closed. */
+void hexec_conn_hold(int fd);
+
+/* hexec_conn_shutdown --
+ *   Shuts down the write side of connection 'fd' after a response, and
+ *   discards unread request data. Closing with unread data would reset
+ *   the connection, possibly before the client has read the response.
+ *   Does not block, or close 'fd'. */
+void hexec_conn_shutdown(int fd);
+
+/* hexec_conn_reply --
+ *   Writes the short response 'resp' of 'len' bytes to connection 'fd',
+ *   shuts it down and closes it. Does not block: a response that does
+ *   not fit the socket buffer is truncated. */
+void hexec_conn_reply(int fd, const char *resp, size_t len);
+
+/* hexec_conn_elapsed_ms --
+ *   Returns the milliseconds from 'from' to 'to'. */
+int64_t hexec_conn_elapsed_ms(const struct timespec *from,
+    const struct timespec *to);
+
+#endif
@@ -0,0 +1,921 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/scgi.h"
+#include "app/hexec_conn.h"
+#include "app/hexec_fanout.h"
+
+#define READSZ     16384    /* min free output buffer space per read */
+#define MAXBUFKEEP (64 * 1024) /* max output buffer size kept for reuse */
+
+#define READ_TIMEOUT_MS     10000 /* max wait for the complete request */
+#define TIMER_INTERVAL_MS   100
+
+#define TOO_LARGE   "Status: 413 Request Entity Too Large\r\n\r\n"
+#define FAILED_HDR  "X-Hexec-Failed-Shards: "
+
+/* fan-out states */
+#define FAN_FREE    0
+#define FAN_PENDING 1 /* waiting for the request header */
+#define FAN_READING 2 /* reading the request from the client */
+#define FAN_RUNNING 3 /* waiting for shards */
+#define FAN_WRITING 4 /* writing the response */
+
+struct fanout;
+
+struct shard {
+  struct iomux_handler h;   /* output pipe, must be first */
+  struct fanout *f;
+  int index;
+  int spawned;              /* spawned, not necessarily running */
+  int exited;
+  int eof;                  /* output pipe closed */
+  int overflow;             /* output over HEXEC_FANOUT_MAXOUTPUT */
+  int resolved;             /* succeeded or failed */
+  int failed;
+  int status;               /* wait status */
+  int seq;                  /* completion order of successful shards */
+  struct timespec started;  /* CLOCK_MONOTONIC */
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/* a fan-out is free when its connection is closed and none of its shards
+ * is running. Until then, the tokens of its shards are not reused */
+struct fanout {
+  struct iomux_handler h;   /* duplicate of the connection while reading,
+                               the connection while writing, must be
+                               first */
+  int fd;                   /* connection, or -1 */
+  int state;
+  struct timespec accepted; /* CLOCK_MONOTONIC */
+  char *req;
+  size_t reqlen;
+  size_t reqsize;
+  int nshards;
+  int nspawned;             /* shards no longer waiting for a slot */
+  int nrunning;             /* spawned and not exited */
+  int nresolved;
+  int nsucceeded;
+  char *resp;
+  size_t resplen;
+  size_t off;               /* bytes of the response written */
+  int enabled;              /* waiting for writability */
+  struct shard *shards;
+  struct fanout *next;      /* next in free list, or waiting for slots */
+};
+
+static const char *header_;
+static int max_;
+static int order_;
+static int partial_;
+static int timeout_ms_;
+static struct fanout *fanouts_;
+static struct shard *shards_;
+static struct fanout *free_;
+static struct fanout *waithead_;
+static struct fanout *waittail_;
+static int nwaiting_;
+static int nheld_;
+static struct iomux_handler timer_;
+static struct hexec_conn_queue queue_;
+static int (*nfree_)(void);
+static int (*spawn_)(struct iomux_ctx *ctx, int in, int out, int pipefd,
+    int token, int shard, int nshards);
+static void (*relayed_)(int pipefd, size_t n);
+static void (*cancel_)(int token);
+static void (*run_)(struct iomux_ctx *ctx, int fd);
+static void (*on_update_)(struct iomux_ctx *ctx);
+
+static void on_conn(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg);
+static void on_writable(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void on_output(struct iomux_ctx *ctx, struct iomux_handler *h);
+static void resolve(struct iomux_ctx *ctx, struct shard *s, int failed);
+
+int hexec_fanout_init(const char *header, int max, int order, int partial,
+    int timeout_ms, int (*nfree)(void),
+    int (*spawn)(struct iomux_ctx *ctx, int in, int out, int pipefd,
+    int token, int shard, int nshards),
+    void (*relayed)(int pipefd, size_t n),
+    void (*cancel)(int token),
+    void (*run)(struct iomux_ctx *ctx, int fd),
+    void (*on_update)(struct iomux_ctx *ctx)) {
+  struct fanout *f;
+  int i;
+  int j;
+
+  if (max <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  fanouts_ = calloc(max, sizeof(struct fanout));
+  shards_ = calloc((size_t)max * HEXEC_FANOUT_MAXSHARDS,
+      sizeof(struct shard));
+  if (fanouts_ == NULL || shards_ == NULL ||
+      hexec_conn_queue_init(&queue_, max, on_ready) < 0) {
+    hexec_fanout_cleanup();
+    return -1;
+  }
+
+  for (i = max - 1; i >= 0; i--) {
+    f = &fanouts_[i];
+    f->h.fd = -1;
+    f->fd = -1;
+    f->shards = shards_ + (size_t)i * HEXEC_FANOUT_MAXSHARDS;
+    for (j = 0; j < HEXEC_FANOUT_MAXSHARDS; j++) {
+      f->shards[j].h.fd = -1;
+      f->shards[j].f = f;
+      f->shards[j].index = j;
+    }
+    f->next = free_;
+    free_ = f;
+  }
+
+  timer_.fd = -1;
+  header_ = header;
+  max_ = max;
+  order_ = order;
+  partial_ = partial;
+  timeout_ms_ = timeout_ms;
+  nfree_ = nfree;
+  spawn_ = spawn;
+  relayed_ = relayed;
+  cancel_ = cancel;
+  run_ = run;
+  on_update_ = on_update;
+  return 0;
+}
+
+void hexec_fanout_cleanup(void) {
+  size_t i;
+
+  for (i = 0; shards_ != NULL && i < (size_t)max_ * HEXEC_FANOUT_MAXSHARDS;
+      i++) {
+    free(shards_[i].buf);
+  }
+
+  for (i = 0; fanouts_ != NULL && i < (size_t)max_; i++) {
+    free(fanouts_[i].req);
+    free(fanouts_[i].resp);
+  }
+
+  hexec_conn_queue_cleanup(&queue_);
+  free(fanouts_);
+  free(shards_);
+  fanouts_ = NULL;
+  shards_ = NULL;
+  free_ = NULL;
+  waithead_ = NULL;
+  waittail_ = NULL;
+}
+
+int hexec_fanout_npending(void) {
+  return queue_.nwaiting;
+}
+
+int hexec_fanout_nwaiting(void) {
+  return nwaiting_;
+}
+
+int hexec_fanout_nheld(void) {
+  return nheld_;
+}
+
+static int token(const struct shard *s) {
+  return (int)(s->f - fanouts_) * HEXEC_FANOUT_MAXSHARDS + s->index;
+}
+
+static void stop_timer(struct iomux_ctx *ctx) {
+  if (timer_.fd >= 0) {
+    iomux_close_source(ctx, &timer_);
+    timer_.fd = -1;
+  }
+}
+
+static void maybe_free(struct iomux_ctx *ctx, struct fanout *f) {
+  if (f->fd >= 0 || f->nrunning > 0 || f->state == FAN_FREE) {
+    return;
+  }
+
+  free(f->req);
+  free(f->resp);
+  f->req = NULL;
+  f->resp = NULL;
+  f->state = FAN_FREE;
+  f->next = free_;
+  free_ = f;
+  if (--nheld_ == 0) {
+    stop_timer(ctx);
+  }
+
+  on_update_(ctx);
+}
+
+/* close the connection, after the response if any */
+static void close_conn(struct iomux_ctx *ctx, struct fanout *f) {
+  hexec_conn_shutdown(f->fd);
+  if (f->h.fd >= 0) {
+    iomux_close_source(ctx, &f->h);
+    f->h.fd = -1;
+  }
+  if (f->state != FAN_WRITING) {
+    close(f->fd); /* the handler watched a duplicate, or nothing */
+  }
+
+  f->fd = -1;
+  maybe_free(ctx, f);
+}
+
+static void close_output(struct iomux_ctx *ctx, struct shard *s) {
+  if (s->h.fd >= 0) {
+    relayed_(s->h.fd, 0);
+    iomux_close_source(ctx, &s->h);
+    s->h.fd = -1;
+  }
+
+  s->eof = 1;
+}
+
+static void set_enabled(struct iomux_ctx *ctx, struct fanout *f,
+    int enable) {
+  int ret;
+
+  if (f->enabled == enable) {
+    return;
+  }
+
+  ret = enable ? iomux_enable_source(ctx, &f->h) :
+      iomux_disable_source(ctx, &f->h);
+  if (ret < 0) {
+    perror("fanout");
+    close_conn(ctx, f);
+    return;
+  }
+
+  f->enabled = enable;
+}
+
+/* write the response without blocking */
+static void flush(struct iomux_ctx *ctx, struct fanout *f) {
+  ssize_t n;
+
+  while (f->off < f->resplen) {
+    n = send(f->fd, f->resp + f->off, f->resplen - f->off,
+        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        set_enabled(ctx, f, 1);
+      } else {
+        close_conn(ctx, f); /* the client went away */
+      }
+      return;
+    }
+
+    f->off += n;
+  }
+
+  close_conn(ctx, f);
+}
+
+static void on_writable(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct fanout *f = (struct fanout *)h;
+
+  if (h->fd < 0 || !f->enabled) {
+    return; /* closed or disabled earlier in the same batch of events */
+  }
+
+  flush(ctx, f);
+}
+
+/* start writing 'f->resp' to the connection */
+static void write_response(struct iomux_ctx *ctx, struct fanout *f) {
+  if (f->h.fd >= 0) {
+    iomux_close_source(ctx, &f->h);
+  }
+
+  f->state = FAN_WRITING;
+  f->off = 0;
+  f->enabled = 1;
+  f->h.fd = f->fd;
+  f->h.flags = 0;
+  f->h.source_func = on_writable;
+  if (iomux_add_sink(ctx, &f->h) < 0) {
+    perror("fanout");
+    f->h.fd = -1;
+    f->state = FAN_RUNNING; /* the connection is closed, not the handler */
+    close_conn(ctx, f);
+    return;
+  }
+
+  flush(ctx, f);
+}
+
+/* sets 'body' to the body of CGI response 's', and returns its status,
+ * or -1 if the response is invalid. Sets 'type' to the Content-Type line,
+ * if any */
+static int parse_output(const struct shard *s, const char **body,
+    const char **type, size_t *typelen) {
+  const char *line = s->buf;
+  const char *end = s->buf + s->len;
+  const char *eol;
+  int status = 200;
+
+  *type = NULL;
+  while (line < end) {
+    eol = memchr(line, '\n', end - line);
+    if (eol == NULL) {
+      return -1;
+    } else if (eol == line || (eol == line + 1 && *line == '\r')) {
+      *body = eol + 1;
+      return status;
+    }
+
+    if (eol - line > 7 && strncasecmp(line, "Status:", 7) == 0) {
+      status = atoi(line + 7);
+    } else if (eol - line > 13 &&
+        strncasecmp(line, "Content-Type:", 13) == 0) {
+      *type = line;
+      *typelen = eol + 1 - line;
+    }
+
+    line = eol + 1;
+  }
+
+  return -1;
+}
+
+static void append(char *buf, size_t *len, const char *data, size_t n) {
+  memcpy(buf + *len, data, n);
+  *len += n;
+}
+
+/* the response of a completed fan-out */
+static void respond(struct iomux_ctx *ctx, struct fanout *f) {
+  struct shard *order[HEXEC_FANOUT_MAXSHARDS];
+  const char *body;
+  const char *type = NULL;
+  const char *t;
+  size_t typelen = 0;
+  size_t tlen;
+  size_t size = 256 + (size_t)f->nshards * 4;
+  char num[16];
+  int nfailed = 0;
+  int norder = 0;
+  int i;
+  int j;
+
+  for (i = 0; i < f->nshards; i++) {
+    nfailed += f->shards[i].failed;
+    size += f->shards[i].len;
+  }
+
+  /* successful shards in output order */
+  for (i = 0; nfailed == 0 || partial_ == HEXEC_FANOUT_PARTIAL_OMIT; i++) {
+    if (order_ == HEXEC_FANOUT_ORDER_SHARD && i < f->nshards) {
+      if (!f->shards[i].failed) {
+        order[norder++] = &f->shards[i];
+      }
+    } else if (order_ == HEXEC_FANOUT_ORDER_COMPLETE && i < f->nsucceeded) {
+      for (j = 0; j < f->nshards; j++) {
+        if (!f->shards[j].failed && f->shards[j].seq == i) {
+          order[norder++] = &f->shards[j];
+        }
+      }
+    } else {
+      break;
+    }
+  }
+
+  f->resp = malloc(size);
+  if (f->resp == NULL) {
+    perror("fanout");
+    close_conn(ctx, f);
+    return;
+  }
+
+  f->resplen = 0;
+  if (nfailed > 0 && partial_ == HEXEC_FANOUT_PARTIAL_FAIL) {
+    append(f->resp, &f->resplen, "Status: 502 Bad Gateway\r\n", 25);
+  } else {
+    append(f->resp, &f->resplen, "Status: 200 OK\r\n", 16);
+    for (i = 0; i < norder && type == NULL; i++) {
+      parse_output(order[i], &body, &t, &tlen);
+      if (t != NULL) {
+        type = t;
+        typelen = tlen;
+      }
+    }
+
+    if (type != NULL) {
+      append(f->resp, &f->resplen, type, typelen);
+    }
+  }
+
+  if (nfailed > 0) {
+    append(f->resp, &f->resplen, FAILED_HDR, sizeof(FAILED_HDR) - 1);
+    for (i = 0, j = 0; i < f->nshards; i++) {
+      if (f->shards[i].failed) {
+        snprintf(num, sizeof(num), j++ > 0 ? ",%d" : "%d", i);
+        append(f->resp, &f->resplen, num, strlen(num));
+      }
+    }
+    append(f->resp, &f->resplen, "\r\n", 2);
+  }
+
+  append(f->resp, &f->resplen, "\r\n", 2);
+  for (i = 0; i < norder; i++) {
+    parse_output(order[i], &body, &t, &tlen);
+    append(f->resp, &f->resplen, body, order[i]->buf + order[i]->len - body);
+  }
+
+  for (i = 0; i < f->nshards; i++) {
+    f->shards[i].len = 0;
+    if (f->shards[i].cap > MAXBUFKEEP) {
+      free(f->shards[i].buf);
+      f->shards[i].buf = NULL;
+      f->shards[i].cap = 0;
+    }
+  }
+
+  write_response(ctx, f);
+}
+
+static void unwait(struct fanout *f) {
+  struct fanout **pp = &waithead_;
+  struct fanout *prev = NULL;
+
+  while (*pp != NULL && *pp != f) {
+    prev = *pp;
+    pp = &prev->next;
+  }
+
+  if (*pp == NULL) {
+    return;
+  }
+
+  *pp = f->next;
+  if (waittail_ == f) {
+    waittail_ = prev;
+  }
+
+  nwaiting_ -= f->nshards - f->nspawned;
+  f->nspawned = f->nshards;
+  f->next = NULL;
+}
+
+/* cancel the unresolved shards of 'f': waiting shards are not spawned,
+ * and running shards are killed. Cancelled shards are not failed */
+static void cancel_all(struct iomux_ctx *ctx, struct fanout *f) {
+  struct shard *s;
+  int i;
+
+  unwait(f);
+  for (i = 0; i < f->nshards; i++) {
+    s = &f->shards[i];
+    if (s->resolved) {
+      continue;
+    }
+
+    if (s->spawned && !s->exited) {
+      cancel_(token(s));
+    }
+
+    close_output(ctx, s);
+    s->resolved = 1;
+    f->nresolved++;
+  }
+}
+
+static void resolve(struct iomux_ctx *ctx, struct shard *s, int failed) {
+  struct fanout *f = s->f;
+
+  s->resolved = 1;
+  s->failed = failed;
+  if (!failed) {
+    s->seq = f->nsucceeded++;
+  }
+
+  f->nresolved++;
+  if (failed && partial_ == HEXEC_FANOUT_PARTIAL_FAIL) {
+    cancel_all(ctx, f);
+  }
+
+  if (f->nresolved == f->nshards) {
+    respond(ctx, f);
+  }
+}
+
+/* resolve a shard once it has exited and its output is complete */
+static void settle(struct iomux_ctx *ctx, struct shard *s) {
+  const char *body;
+  const char *type;
+  size_t typelen;
+  int status;
+
+  if (s->resolved || !s->exited || !s->eof) {
+    return;
+  }
+
+  status = s->overflow ? -1 : parse_output(s, &body, &type, &typelen);
+  resolve(ctx, s, !WIFEXITED(s->status) || WEXITSTATUS(s->status) != 0 ||
+      status < 200 || status > 299);
+}
+
+static void on_output(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct shard *s = (struct shard *)h;
+  size_t cap;
+  char *buf;
+  ssize_t n;
+
+  if (h->fd < 0) {
+    return; /* closed earlier in the same batch of events */
+  }
+
+  for (;;) {
+    if (s->len >= HEXEC_FANOUT_MAXOUTPUT) {
+      s->overflow = 1;
+      break;
+    } else if (s->cap - s->len < READSZ) {
+      cap = s->cap == 0 ? READSZ * 2 : s->cap * 2;
+      buf = realloc(s->buf, cap);
+      if (buf == NULL) {
+        perror("fanout");
+        s->overflow = 1;
+        break;
+      }
+
+      s->buf = buf;
+      s->cap = cap;
+    }
+
+    n = read(h->fd, s->buf + s->len, s->cap - s->len);
+    if (n > 0) {
+      s->len += n;
+      relayed_(h->fd, n);
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      break;
+    }
+  }
+
+  close_output(ctx, s);
+  settle(ctx, s);
+}
+
+void hexec_fanout_exited(struct iomux_ctx *ctx, int token, int status) {
+  struct fanout *f;
+  struct shard *s;
+
+  if (fanouts_ == NULL || token < 0 ||
+      token >= max_ * HEXEC_FANOUT_MAXSHARDS) {
+    return;
+  }
+
+  f = &fanouts_[token / HEXEC_FANOUT_MAXSHARDS];
+  s = &f->shards[token % HEXEC_FANOUT_MAXSHARDS];
+  if (!s->spawned || s->exited) {
+    return;
+  }
+
+  s->exited = 1;
+  s->status = status;
+  f->nrunning--;
+  if (s->resolved) {
+    maybe_free(ctx, f); /* cancelled */
+  } else {
+    settle(ctx, s);
+  }
+}
+
+static int pipe_cloexec(int fds[2]) {
+  if (pipe(fds) < 0) {
+    return -1;
+  } else if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0 ||
+      fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* spawn shard 's' with a copy of the request on stdin. The request must
+ * fit in the pipe */
+static void spawn_shard(struct iomux_ctx *ctx, struct shard *s) {
+  struct fanout *f = s->f;
+  int in[2];
+  int out[2];
+  int ret;
+
+  s->spawned = 0;
+  s->exited = 0;
+  s->eof = 0;
+  s->overflow = 0;
+  s->len = 0;
+  if (pipe_cloexec(in) < 0) {
+    goto fail;
+  } else if (pipe_cloexec(out) < 0) {
+    goto close_in;
+  }
+
+  if (fcntl(in[1], F_SETFL, O_NONBLOCK) < 0 ||
+      fcntl(out[0], F_SETFL, O_NONBLOCK) < 0 ||
+      write(in[1], f->req, f->reqlen) != (ssize_t)f->reqlen) {
+    goto close_out;
+  }
+
+  close(in[1]);
+  in[1] = -1;
+  s->h.fd = out[0];
+  s->h.flags = 0;
+  s->h.source_func = on_output;
+  if (iomux_add_source(ctx, &s->h) < 0) {
+    s->h.fd = -1;
+    goto close_out;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &s->started);
+  ret = spawn_(ctx, in[0], out[1], out[0], token(s), s->index,
+      f->nshards);
+  close(in[0]);
+  close(out[1]);
+  if (ret < 0) {
+    close_output(ctx, s);
+    resolve(ctx, s, 1);
+    return;
+  }
+
+  s->spawned = 1;
+  f->nrunning++;
+  return;
+
+close_out:
+  close(out[0]);
+  close(out[1]);
+close_in:
+  close(in[0]);
+  if (in[1] >= 0) {
+    close(in[1]);
+  }
+fail:
+  perror("fanout");
+  s->eof = 1;
+  resolve(ctx, s, 1);
+}
+
+void hexec_fanout_kick(struct iomux_ctx *ctx) {
+  struct fanout *f;
+  int nspawned = 0;
+
+  while ((f = waithead_) != NULL && nfree_() > 0) {
+    if (f->nspawned + 1 == f->nshards) {
+      waithead_ = f->next;
+      if (waithead_ == NULL) {
+        waittail_ = NULL;
+      }
+      f->next = NULL;
+    }
+
+    nwaiting_--;
+    nspawned++;
+    spawn_shard(ctx, &f->shards[f->nspawned++]);
+  }
+
+  if (nspawned > 0) {
+    on_update_(ctx);
+  }
+}
+
+/* the request is complete: queue its shards */
+static void start(struct iomux_ctx *ctx, struct fanout *f) {
+  int i;
+
+  iomux_close_source(ctx, &f->h);
+  f->h.fd = -1;
+  f->state = FAN_RUNNING;
+  f->nspawned = 0;
+  f->nrunning = 0;
+  f->nresolved = 0;
+  f->nsucceeded = 0;
+  for (i = 0; i < f->nshards; i++) {
+    f->shards[i].resolved = 0;
+    f->shards[i].failed = 0;
+    f->shards[i].spawned = 0;
+  }
+
+  f->next = NULL;
+  if (waittail_ == NULL) {
+    waithead_ = f;
+  } else {
+    waittail_->next = f;
+  }
+
+  waittail_ = f;
+  nwaiting_ += f->nshards;
+  hexec_fanout_kick(ctx);
+}
+
+static void read_request(struct iomux_ctx *ctx, struct fanout *f) {
+  ssize_t n;
+
+  while (f->reqlen < f->reqsize) {
+    n = recv(f->h.fd, f->req + f->reqlen, f->reqsize - f->reqlen,
+        MSG_DONTWAIT);
+    if (n > 0) {
+      f->reqlen += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else {
+      close_conn(ctx, f); /* the client went away */
+      return;
+    }
+  }
+
+  start(ctx, f);
+}
+
+/* returns the # of shards requested by header 'hdr', or 0, and sets
+ * 'size' to the size of the request, or HEXEC_FANOUT_MAXREQ + 1 if it is
+ * larger */
+static int parse_nshards(const struct scgi_header *hdr, size_t *size) {
+  const char *val;
+  char *end;
+  long n;
+
+  if ((val = scgi_get(hdr, header_)) == NULL) {
+    return 0;
+  }
+
+  n = strtol(val, &end, 10);
+  if (*val == '\0' || *end != '\0' || n < 2 ||
+      n > HEXEC_FANOUT_MAXSHARDS) {
+    return 0;
+  }
+
+  *size = scgi_request_len(hdr, HEXEC_FANOUT_MAXREQ);
+  return *size > 0 ? (int)n : 0;
+}
+
+/* fan out the request on 'f', with header 'hdr', or run it */
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg) {
+  struct fanout *f = arg;
+  int dupfd;
+
+  f->nshards = hdr != NULL ? parse_nshards(hdr, &f->reqsize) : 0;
+  if (f->nshards == 0) {
+    f->fd = -1;
+    maybe_free(ctx, f);
+    run_(ctx, fd);
+    return;
+  } else if (f->reqsize > HEXEC_FANOUT_MAXREQ) {
+    f->resp = strdup(TOO_LARGE);
+    if (f->resp == NULL) {
+      close_conn(ctx, f);
+      return;
+    }
+    f->resplen = sizeof(TOO_LARGE) - 1;
+    write_response(ctx, f);
+    return;
+  }
+
+  f->req = malloc(f->reqsize);
+  if (f->req == NULL) {
+    perror("fanout");
+    close_conn(ctx, f);
+    return;
+  }
+
+  /* the request is read from a duplicate, so that the connection remains
+   * open when the handler is closed */
+  dupfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  f->h.fd = dupfd;
+  f->h.flags = 0;
+  f->h.source_func = on_conn;
+  if (dupfd < 0 || iomux_add_source(ctx, &f->h) < 0) {
+    perror("fanout");
+    if (dupfd >= 0) {
+      close(dupfd);
+    }
+    f->h.fd = -1;
+    close_conn(ctx, f);
+    return;
+  }
+
+  f->state = FAN_READING;
+  f->reqlen = 0;
+  read_request(ctx, f);
+}
+
+static void on_conn(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct fanout *f = (struct fanout *)h;
+
+  if (h->fd < 0) {
+    return; /* closed earlier in the same batch of events */
+  } else if (f->state == FAN_READING) {
+    read_request(ctx, f);
+  }
+}
+
+/* drop requests not read in time, and fail shards that have run too
+ * long */
+static void on_timer(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct timespec now;
+  struct fanout *f;
+  struct shard *s;
+  int i;
+  int j;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < max_; i++) {
+    f = &fanouts_[i];
+    if (f->state == FAN_READING &&
+        hexec_conn_elapsed_ms(&f->accepted, &now) >= READ_TIMEOUT_MS) {
+      close_conn(ctx, f);
+    } else if (f->state == FAN_RUNNING && timeout_ms_ > 0) {
+      for (j = 0; j < f->nshards && f->state == FAN_RUNNING; j++) {
+        s = &f->shards[j];
+        if (s->spawned && !s->resolved &&
+            hexec_conn_elapsed_ms(&s->started, &now) >= timeout_ms_) {
+          if (!s->exited) {
+            cancel_(token(s));
+          }
+          close_output(ctx, s);
+          resolve(ctx, s, 1);
+        }
+      }
+    }
+  }
+}
+
+void hexec_fanout_accept(struct iomux_ctx *ctx, int fd) {
+  struct fanout *f = free_;
+
+  if (f == NULL) {
+    run_(ctx, fd);
+    return;
+  }
+
+  if (nheld_ == 0) {
+    timer_.source_func = on_timer;
+    if (iomux_add_timer(ctx, &timer_, TIMER_INTERVAL_MS) < 0) {
+      timer_.fd = -1;
+      run_(ctx, fd);
+      return;
+    }
+  }
+
+  free_ = f->next;
+  f->next = NULL;
+  f->fd = fd;
+  f->state = FAN_PENDING;
+  f->req = NULL;
+  f->resp = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &f->accepted);
+  nheld_++;
+  hexec_conn_wait(ctx, &queue_, fd, f);
+}
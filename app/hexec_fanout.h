@@ -0,0 +1,121 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef APP_HEXEC_FANOUT_H__
+#define APP_HEXEC_FANOUT_H__
+
+#include "lib/iomux.h"
+
+/* Fan-out: a request with a fan-out SCGI header of K, between 2 and
+ * HEXEC_FANOUT_MAXSHARDS, is run by K children in parallel, shards 0 to
+ * K - 1, and their outputs are gathered into one response. hexec reads
+ * the complete request, of at most HEXEC_FANOUT_MAXREQ bytes, and gives
+ * each shard a copy on stdin. Shards are spawned as slots become free,
+ * in the order of their requests, and while shards wait for a slot no
+ * other connections are accepted.
+ *
+ * A shard succeeds if it exits with status 0 and its output is a CGI
+ * response with a 2xx status, or none, of at most HEXEC_FANOUT_MAXOUTPUT
+ * bytes. A shard that runs longer than the shard timeout is killed and
+ * fails. If any shard fails, the response is a 502, and the remaining
+ * shards are cancelled, unless failures are omitted: then the bodies of
+ * the failed shards are left out. Either way, failed shards are listed in
+ * an X-Hexec-Failed-Shards header.
+ *
+ * The response has the Content-Type of the first successful shard, and
+ * the bodies of the successful shards in shard order or in the order they
+ * completed.
+ *
+ * Requests without the header, with an invalid one, or that can not be
+ * fanned out, e.g., since the SCGI header is incomplete after a second or
+ * the max # of fan-out requests is reached, are run as usual, by one
+ * child. */
+
+#define HEXEC_FANOUT_MAXSHARDS      64
+#define HEXEC_FANOUT_MAXREQ         65536
+#define HEXEC_FANOUT_MAXOUTPUT      (1 << 20)
+#define HEXEC_FANOUT_DEFAULT_MAX    16
+
+#define HEXEC_FANOUT_ORDER_SHARD    0
+#define HEXEC_FANOUT_ORDER_COMPLETE 1
+
+#define HEXEC_FANOUT_PARTIAL_FAIL   0
+#define HEXEC_FANOUT_PARTIAL_OMIT   1
+
+/* hexec_fanout_init --
+ *   Sets up fan-out by the SCGI header 'header', for at most 'max'
+ *   concurrent fan-out requests. 'order' and 'partial' are one of the
+ *   HEXEC_FANOUT_ORDER and HEXEC_FANOUT_PARTIAL values, and
+ *   'timeout_ms', if greater than zero, is the max run time of a shard.
+ *
+ *   'nfree' returns the number of free slots. 'spawn' runs 'shard' of
+ *   'nshards', identified by 'token', with 'in' and 'out' as stdin and
+ *   stdout, and returns 0 on success or -1 on error. 'out' is the write
+ *   end of a pipe whose read end is 'pipefd'. 'in' and 'out' are closed
+ *   by the caller. 'relayed' is called with the number of bytes 'n' read
+ *   from 'pipefd', and with 0 when it is closed. 'cancel' kills the shard
+ *   identified by 'token'. 'run' runs a request that is not fanned out,
+ *   and takes ownership of 'fd'. 'on_update' is called when the number
+ *   of held connections or of waiting shards decreases.
+ *
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int hexec_fanout_init(const char *header, int max, int order, int partial,
+    int timeout_ms, int (*nfree)(void),
+    int (*spawn)(struct iomux_ctx *ctx, int in, int out, int pipefd,
+    int token, int shard, int nshards),
+    void (*relayed)(int pipefd, size_t n),
+    void (*cancel)(int token),
+    void (*run)(struct iomux_ctx *ctx, int fd),
+    void (*on_update)(struct iomux_ctx *ctx));
+
+/* hexec_fanout_cleanup --
+ *   Releases all resources. */
+void hexec_fanout_cleanup(void);
+
+/* hexec_fanout_accept --
+ *   Takes ownership of the accepted connection 'fd', which is fanned out
+ *   or run. */
+void hexec_fanout_accept(struct iomux_ctx *ctx, int fd);
+
+/* hexec_fanout_exited --
+ *   Reports the exit of the shard identified by 'token', with wait
+ *   status 'status'. */
+void hexec_fanout_exited(struct iomux_ctx *ctx, int token, int status);
+
+/* hexec_fanout_kick --
+ *   Spawns waiting shards, e.g., after a child has exited. */
+void hexec_fanout_kick(struct iomux_ctx *ctx);
+
+/* hexec_fanout_npending --
+ *   Returns the number of connections not yet known to be fanned out,
+ *   each of which may need a slot. */
+int hexec_fanout_npending(void);
+
+/* hexec_fanout_nwaiting --
+ *   Returns the number of shards waiting for a slot. */
+int hexec_fanout_nwaiting(void);
+
+/* hexec_fanout_nheld --
+ *   Returns the number of connections held. */
+int hexec_fanout_nheld(void);
+
+#endif
@@ -0,0 +1,702 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/jobstore.h"
+#include "lib/jobtable.h"
+#include "lib/macros.h"
+#include "lib/pipeline.h"
+#include "lib/scgi.h"
+#include "app/hexec_conn.h"
+#include "app/hexec_jobs.h"
+
+#define FILESZ     64       /* max size of a pid file */
+#define METASZ     128      /* max size of the metadata of a job */
+#define HEADSZ     256      /* max size of the header of a status reply */
+
+#define STATUS_OK   "Status: 200 OK\r\n" \
+                    "Content-Type: application/octet-stream\r\n"
+#define ACCEPTED    "Status: 202 Accepted\r\n\r\n"
+#define BAD_REQUEST "Status: 400 Bad Request\r\n\r\n"
+#define NOT_FOUND   "Status: 404 Not Found\r\n\r\n"
+#define CONFLICT    "Status: 409 Conflict\r\n\r\n"
+#define UNAVAILABLE "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n"
+
+/* a job found in the store or the spool on load */
+struct found {
+  char id[JOBTABLE_IDSZ];
+  pid_t pid;
+  time_t started;
+  int state;
+  int status;
+  int cancelled;
+  uint64_t ref;             /* record in the store, or 0 */
+  int spooled;              /* found in the spool */
+};
+
+/* a status reply being written: its header, then the output of the job */
+struct reply {
+  struct iomux_handler h;   /* connection, must be first */
+  struct reply *next;       /* next free reply */
+  uint64_t ref;             /* record of the output, or 0 */
+  off_t off;                /* bytes of output written */
+  size_t headoff;           /* bytes of header written */
+  size_t headlen;
+  char head[HEADSZ];
+};
+
+static const char *header_;
+static struct spool *spool_;
+static struct jobstore store_;
+static struct jobtable table_;
+static struct hexec_conn_queue queue_;
+static struct reply replies_[HEXEC_JOBS_MAXREPLIES];
+static struct reply *freereplies_;
+static off_t dead_; /* bytes of removed records, not yet compacted */
+static void (*run_)(struct iomux_ctx *ctx, int fd);
+static void (*submit_)(struct iomux_ctx *ctx, int fd);
+static void (*remove_)(const char *id);
+static void (*on_update_)(struct iomux_ctx *ctx);
+
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg);
+
+/* the records of evicted jobs are reclaimed by compaction */
+static void on_evict(const struct jobtable_entry *ent, void *arg) {
+  struct jobstore_entry rec;
+
+  if (ent->ref != 0 && jobstore_get(&store_, ent->ref, &rec) == 0) {
+    dead_ += rec.metalen + rec.datalen;
+    jobstore_remove(&store_, ent->ref);
+  }
+}
+
+/* once removed records add up to a segment, the oldest segment is
+ * compacted. Jobs are stored as they finish, and the least recently
+ * queried are evicted, so it is mostly removed records. Compaction
+ * copies the live ones in the event loop */
+static void compact(void) {
+  int ret;
+
+  while (dead_ >= store_.segmax) {
+    ret = jobstore_compact(&store_, 1, 0);
+    if (ret < 0) {
+      perror("jobs: compact");
+    }
+
+    if (ret <= 0) {
+      dead_ = 0;
+      break;
+    }
+
+    dead_ -= store_.segmax;
+  }
+}
+
+int hexec_jobs_init(const char *header, struct spool *spool,
+    const char *store, int maxrunning, int maxdone,
+    void (*run)(struct iomux_ctx *ctx, int fd),
+    void (*submit)(struct iomux_ctx *ctx, int fd),
+    void (*remove)(const char *id),
+    void (*on_update)(struct iomux_ctx *ctx)) {
+  int i;
+
+  if (maxrunning <= 0 || maxdone <= 0) {
+    errno = EINVAL;
+    return -1;
+  } else if (jobstore_open(&store_, store, 0) < 0) {
+    return -1;
+  } else if (jobtable_init(&table_, (size_t)maxrunning + maxdone, maxdone,
+      on_evict, NULL) < 0) {
+    goto close_store;
+  } else if (hexec_conn_queue_init(&queue_, HEXEC_JOBS_MAXPENDING,
+      on_ready) < 0) {
+    goto cleanup_table;
+  }
+
+  freereplies_ = NULL;
+  for (i = HEXEC_JOBS_MAXREPLIES - 1; i >= 0; i--) {
+    replies_[i].h.fd = -1;
+    replies_[i].next = freereplies_;
+    freereplies_ = &replies_[i];
+  }
+
+  header_ = header;
+  spool_ = spool;
+  dead_ = 0;
+  run_ = run;
+  submit_ = submit;
+  remove_ = remove;
+  on_update_ = on_update;
+  return 0;
+cleanup_table:
+  jobtable_cleanup(&table_);
+close_store:
+  jobstore_close(&store_);
+  return -1;
+}
+
+void hexec_jobs_cleanup(void) {
+  int i;
+
+  if (header_ == NULL) {
+    return; /* not set up */
+  }
+
+  for (i = 0; i < HEXEC_JOBS_MAXREPLIES; i++) {
+    if (replies_[i].h.fd >= 0) {
+      close(replies_[i].h.fd);
+      replies_[i].h.fd = -1;
+    }
+  }
+
+  hexec_conn_queue_cleanup(&queue_);
+  jobtable_cleanup(&table_);
+  jobstore_close(&store_);
+  header_ = NULL;
+}
+
+int hexec_jobs_npending(void) {
+  return queue_.nwaiting;
+}
+
+/* write 'data' to 'file' in the spool directory of job 'id'. Called from
+ * the event loop: the files are small, and written once */
+static void write_file(const char *id, const char *file, const char *data) {
+  char path[JOBTABLE_IDSZ + 16];
+  size_t len = strlen(data);
+  int dirfd;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", id, file);
+  dirfd = spool_dirfd(spool_, id);
+  fd = dirfd < 0 ? -1 : openat(dirfd, path,
+      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0 || write(fd, data, len) != (ssize_t)len) {
+    fprintf(stderr, "job %s: %s: %s\n", id, file, strerror(errno));
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/* appends the output of job 'id' in its spool directory, with the state
+ * of the job as metadata, to the store, and removes the directory. A job
+ * that failed before its output was opened is stored without output.
+ * Returns the record of the job, or 0 if it could not be stored */
+static uint64_t store(const char *id, pid_t pid, time_t started,
+    int state, int status, int cancelled) {
+  char path[JOBTABLE_IDSZ + 16];
+  char meta[METASZ];
+  struct stat sb;
+  uint64_t ref;
+  int metalen;
+  int dirfd;
+  int fd;
+  int ret;
+
+  metalen = snprintf(meta, sizeof(meta), "%s %d %lld %d %d", id, (int)pid,
+      (long long)started, state, cancelled);
+  snprintf(path, sizeof(path), "%s/output", id);
+  dirfd = spool_dirfd(spool_, id);
+  fd = dirfd < 0 ? -1 : openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+  ref = jobstore_newid(&store_);
+  if (ref == 0) {
+    ret = -1;
+  } else if (fd < 0 && errno == ENOENT) {
+    ret = jobstore_put(&store_, ref, status, meta, metalen, NULL, 0);
+  } else if (fd < 0 || fstat(fd, &sb) < 0) {
+    ret = -1;
+  } else {
+    ret = jobstore_put_fd(&store_, ref, status, meta, metalen, fd,
+        sb.st_size);
+  }
+
+  if (ret < 0) {
+    fprintf(stderr, "job %s: store: %s\n", id, strerror(errno));
+    ref = 0;
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  remove_(id);
+  return ref;
+}
+
+void hexec_jobs_started(const char *id, pid_t pid, time_t started) {
+  char data[FILESZ];
+
+  if (jobtable_add(&table_, id, pid, started) == NULL) {
+    fprintf(stderr, "job %s: %s\n", id, strerror(errno));
+    return;
+  }
+
+  snprintf(data, sizeof(data), "%d %lld\n", (int)pid, (long long)started);
+  write_file(id, HEXEC_JOBS_PIDFILE, data);
+}
+
+void hexec_jobs_exited(const char *id, int status) {
+  struct jobtable_entry *ent;
+
+  ent = jobtable_get(&table_, id);
+  if (ent == NULL || ent->state != JOBTABLE_RUNNING) {
+    remove_(id);
+    return;
+  }
+
+  ent->ref = store(id, ent->pid, ent->started, JOBTABLE_DONE, status,
+      ent->cancelled);
+  jobtable_finish(&table_, ent, JOBTABLE_DONE, status);
+  compact();
+}
+
+/* read 'file' of directory 'dirfd' into 'buf', NUL terminated. Returns 0
+ * on success, -1 on error */
+static int read_file(int dirfd, const char *file, char *buf, size_t len) {
+  ssize_t n;
+  int fd;
+
+  fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  n = read(fd, buf, len - 1);
+  close(fd);
+  if (n < 0) {
+    return -1;
+  }
+
+  buf[n] = '\0';
+  return 0;
+}
+
+/* returns room for another found job in '*found', or NULL on error */
+static struct found *add_found(struct found **found, size_t *nfound,
+    size_t *cap) {
+  struct found *tmp;
+
+  if (*nfound == *cap) {
+    *cap = *cap > 0 ? *cap * 2 : 64;
+    tmp = realloc(*found, *cap * sizeof(struct found));
+    if (tmp == NULL) {
+      return NULL;
+    }
+    *found = tmp;
+  }
+
+  memset(&(*found)[*nfound], 0, sizeof(struct found));
+  return &(*found)[*nfound];
+}
+
+/* appends the finished jobs in the store to 'found' */
+static int load_store(struct found **found, size_t *nfound, size_t *cap) {
+  struct jobstore_entry rec;
+  struct found *f;
+  char meta[METASZ];
+  long long started;
+  uint64_t ref;
+  ssize_t n;
+  int pid;
+
+  for (ref = 1; ref < jobstore_nextid(&store_); ref++) {
+    if (jobstore_get(&store_, ref, &rec) < 0) {
+      continue; /* removed */
+    } else if ((f = add_found(found, nfound, cap)) == NULL) {
+      return -1;
+    }
+
+    n = jobstore_read_meta(&store_, &rec, meta, sizeof(meta) - 1);
+    if (n < 0) {
+      return -1;
+    }
+
+    meta[n] = '\0';
+    if (sscanf(meta, "%47s %d %lld %d %d", f->id, &pid, &started,
+        &f->state, &f->cancelled) != 5) {
+      continue;
+    }
+
+    f->pid = pid;
+    f->started = (time_t)started;
+    f->status = rec.status;
+    f->ref = ref;
+    (*nfound)++;
+  }
+
+  return 0;
+}
+
+/* sets up 'f' from the spool directory 'id' of shard directory 'dirfd'.
+ * Returns 1 for a job, 0 for the directory of another request, which
+ * has no pid file, and -1 on error */
+static int load_job(int dirfd, const char *id, struct found *f,
+    int (*adopt)(pid_t pid, const char *id)) {
+  char path[JOBTABLE_IDSZ + 16];
+  char buf[FILESZ];
+  long long started;
+  int pid;
+
+  if (strlen(id) >= JOBTABLE_IDSZ) {
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "%s/" HEXEC_JOBS_PIDFILE, id);
+  if (read_file(dirfd, path, buf, sizeof(buf)) < 0) {
+    return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+  } else if (sscanf(buf, "%d %lld", &pid, &started) != 2) {
+    return 0;
+  }
+
+  snprintf(f->id, sizeof(f->id), "%s", id);
+  f->pid = pid;
+  f->started = (time_t)started;
+  f->spooled = 1;
+  if (adopt(f->pid, id)) {
+    f->state = JOBTABLE_RUNNING;
+  } else {
+    f->state = JOBTABLE_LOST; /* exited while no hexec was running */
+  }
+
+  return 1;
+}
+
+/* appends the jobs in shard directory 'path' of 'dfd' to 'found' */
+static int load_shard(int dfd, const char *path, struct found **found,
+    size_t *nfound, size_t *cap, int (*adopt)(pid_t pid, const char *id)) {
+  struct dirent *ent;
+  struct found *f;
+  DIR *dir;
+  int fd;
+  int ret = 0;
+
+  fd = openat(dfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  while (ret >= 0 && (ent = readdir(dir)) != NULL) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    } else if ((f = add_found(found, nfound, cap)) == NULL) {
+      ret = -1;
+      break;
+    }
+
+    ret = load_job(dirfd(dir), ent->d_name, f, adopt);
+    if (ret > 0) {
+      (*nfound)++;
+    }
+  }
+
+  closedir(dir);
+  return ret < 0 ? -1 : 0;
+}
+
+/* jobs started at the same time are ordered stored first, so that a job
+ * that was stored, but whose spool directory was not removed before a
+ * crash, is taken from the store */
+static int cmp_started(const void *a, const void *b) {
+  const struct found *fa = a;
+  const struct found *fb = b;
+
+  if (fa->started != fb->started) {
+    return (fa->started > fb->started) - (fa->started < fb->started);
+  }
+
+  return fa->spooled - fb->spooled;
+}
+
+/* shard directories are named by two hex digits */
+static int is_shard(const char *name) {
+  return strlen(name) == 2 && strspn(name, "0123456789abcdef") == 2;
+}
+
+/* adds the job 'f' to the table. Jobs that were lost in the spool are
+ * stored, and stored jobs that do not fit are removed */
+static void add_job(const struct found *f) {
+  struct jobtable_entry *ent;
+
+  ent = jobtable_add(&table_, f->id, f->pid, f->started);
+  if (ent == NULL) {
+    if (errno != EEXIST) {
+      fprintf(stderr, "job %s: %s\n", f->id, strerror(errno));
+    }
+
+    if (f->spooled) {
+      remove_(f->id);
+    } else {
+      jobstore_remove(&store_, f->ref);
+    }
+    return;
+  }
+
+  ent->cancelled = f->cancelled;
+  ent->ref = f->ref;
+  if (f->spooled && f->state == JOBTABLE_LOST) {
+    ent->ref = store(f->id, f->pid, f->started, JOBTABLE_LOST, 0,
+        f->cancelled);
+  }
+
+  if (f->state != JOBTABLE_RUNNING) {
+    jobtable_finish(&table_, ent, f->state, f->status);
+  }
+}
+
+/* jobs are added in the order they were started, so that the oldest
+ * finished jobs are evicted first */
+int hexec_jobs_load(const char *path, int (*adopt)(pid_t pid,
+    const char *id)) {
+  struct found *found = NULL;
+  struct dirent *e1;
+  struct dirent *e2;
+  size_t nfound = 0;
+  size_t cap = 0;
+  size_t i;
+  DIR *d1;
+  DIR *d2;
+  int fd;
+  int ret;
+
+  ret = load_store(&found, &nfound, &cap);
+  d1 = ret < 0 ? NULL : opendir(path);
+  if (d1 == NULL) {
+    free(found);
+    return -1;
+  }
+
+  while (ret == 0 && (e1 = readdir(d1)) != NULL) {
+    if (!is_shard(e1->d_name)) {
+      continue;
+    }
+
+    fd = openat(dirfd(d1), e1->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || (d2 = fdopendir(fd)) == NULL) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      ret = -1;
+      break;
+    }
+
+    while (ret == 0 && (e2 = readdir(d2)) != NULL) {
+      if (is_shard(e2->d_name)) {
+        ret = load_shard(dirfd(d2), e2->d_name, &found, &nfound, &cap,
+            adopt);
+      }
+    }
+
+    closedir(d2);
+  }
+
+  closedir(d1);
+  if (ret < 0) {
+    free(found);
+    return -1;
+  }
+
+  qsort(found, nfound, sizeof(struct found), cmp_started);
+  for (i = 0; i < nfound; i++) {
+    add_job(&found[i]);
+  }
+
+  free(found);
+  compact();
+  return 0;
+}
+
+static const char *state_name(const struct jobtable_entry *ent) {
+  if (ent->state == JOBTABLE_RUNNING) {
+    return "running";
+  } else if (ent->cancelled) {
+    return "cancelled";
+  } else if (ent->state == JOBTABLE_DONE) {
+    return "done";
+  }
+
+  return "lost";
+}
+
+static void free_reply(struct reply *r) {
+  r->h.fd = -1;
+  r->next = freereplies_;
+  freereplies_ = r;
+}
+
+/* writes the header, and then the output, of a status reply without
+ * blocking. The record is looked up for every write, since compaction
+ * moves it. If the job is evicted meanwhile, the reply is cut short of
+ * its content length */
+static void on_reply(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct reply *r = (struct reply *)h;
+  struct jobstore_entry rec;
+  ssize_t n;
+
+  if (h->fd < 0) {
+    return; /* closed earlier in the same batch of events */
+  }
+
+  while (r->headoff < r->headlen) {
+    n = send(h->fd, r->head + r->headoff, r->headlen - r->headoff,
+        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    } else if (n < 0) {
+      goto done; /* the client went away */
+    }
+
+    r->headoff += n;
+  }
+
+  if (r->ref != 0 && jobstore_get(&store_, r->ref, &rec) == 0) {
+    n = jobstore_sendfile(&store_, &rec, h->fd, &r->off);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+        errno == EINTR)) {
+      return;
+    } else if (n > 0 && r->off < (off_t)rec.datalen) {
+      return;
+    }
+  }
+
+done:
+  hexec_conn_shutdown(h->fd);
+  iomux_close_source(ctx, h);
+  free_reply(r);
+}
+
+/* replies with the state of the job in a header, and its output, if
+ * finished, as the body */
+static void status(struct iomux_ctx *ctx, int fd, const char *id) {
+  struct jobtable_entry *ent;
+  struct jobstore_entry rec;
+  struct reply *r;
+  char code[32] = "";
+  int len;
+
+  ent = jobtable_get(&table_, id);
+  if (ent == NULL) {
+    hexec_conn_reply(fd, NOT_FOUND, sizeof(NOT_FOUND) - 1);
+    return;
+  } else if (freereplies_ == NULL) {
+    hexec_conn_reply(fd, UNAVAILABLE, sizeof(UNAVAILABLE) - 1);
+    return;
+  }
+
+  if (ent->state == JOBTABLE_DONE && WIFSIGNALED(ent->status)) {
+    snprintf(code, sizeof(code), " signal=%d", WTERMSIG(ent->status));
+  } else if (ent->state == JOBTABLE_DONE) {
+    snprintf(code, sizeof(code), " status=%d", WEXITSTATUS(ent->status));
+  }
+
+  r = freereplies_;
+  r->ref = 0;
+  rec.datalen = 0;
+  if (ent->ref != 0 && jobstore_get(&store_, ent->ref, &rec) == 0) {
+    r->ref = ent->ref;
+  }
+
+  len = snprintf(r->head, sizeof(r->head), STATUS_OK "Content-Length: "
+      "%zu\r\nX-Hexec-Job-Status: id=%s state=%s pid=%d started=%lld%s"
+      "\r\n\r\n", rec.datalen, ent->id, state_name(ent), (int)ent->pid,
+      (long long)ent->started, code);
+  r->headlen = MIN(len, (int)sizeof(r->head) - 1);
+  r->headoff = 0;
+  r->off = 0;
+  r->h.fd = fd;
+  r->h.source_func = on_reply;
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+      iomux_add_sink(ctx, &r->h) < 0) {
+    perror("jobs");
+    r->h.fd = -1;
+    close(fd);
+    return;
+  }
+
+  freereplies_ = r->next;
+}
+
+/* running jobs are killed, and reported as cancelled once reaped */
+static void cancel(int fd, const char *id) {
+  struct jobtable_entry *ent;
+
+  ent = jobtable_get(&table_, id);
+  if (ent == NULL) {
+    hexec_conn_reply(fd, NOT_FOUND, sizeof(NOT_FOUND) - 1);
+    return;
+  } else if (ent->state != JOBTABLE_RUNNING) {
+    hexec_conn_reply(fd, CONFLICT, sizeof(CONFLICT) - 1);
+    return;
+  }
+
+  if (pipeline_kill(ent->pid, SIGKILL) < 0 && errno != ESRCH) {
+    perror("cancel");
+  }
+
+  ent->cancelled = 1;
+  hexec_conn_reply(fd, ACCEPTED, sizeof(ACCEPTED) - 1);
+}
+
+/* answer, submit or run the request on connection 'fd' */
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg) {
+  const char *action;
+
+  action = hdr != NULL ? scgi_get(hdr, header_) : NULL;
+  if (action == NULL) {
+    run_(ctx, fd);
+  } else if (strcmp(action, "submit") == 0) {
+    submit_(ctx, fd);
+  } else if (strncmp(action, "status:", 7) == 0) {
+    status(ctx, fd, action + 7);
+  } else if (strncmp(action, "cancel:", 7) == 0) {
+    cancel(fd, action + 7);
+  } else {
+    hexec_conn_reply(fd, BAD_REQUEST, sizeof(BAD_REQUEST) - 1);
+  }
+
+  on_update_(ctx);
+}
+
+void hexec_jobs_accept(struct iomux_ctx *ctx, int fd) {
+  hexec_conn_wait(ctx, &queue_, fd, NULL);
+}
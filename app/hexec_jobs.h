@@ -0,0 +1,124 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef APP_HEXEC_JOBS_H__
+#define APP_HEXEC_JOBS_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "lib/iomux.h"
+#include "lib/spool.h"
+
+/* Jobs: a request with the jobs SCGI header is a job request. With a
+ * value of "submit", the request is run asynchronously, as a job: its
+ * child reads the complete request into the spool directory of the
+ * request, replies with a 202 and the ID of the job, the name of the
+ * spool directory, and then runs the application with the request on
+ * stdin and its stdout and stderr written to the "output" file of the
+ * directory. Jobs run until they exit or are cancelled; the timeout
+ * only bounds reading the request.
+ *
+ * When a job exits, its output and state are appended to a job store
+ * (see lib/jobstore.h) in the HEXEC_JOBS_STORE directory of the spool,
+ * and its spool directory is removed, so that finished jobs do not take
+ * a directory and files each.
+ *
+ * With a value of "status:<id>" or "cancel:<id>", the request is
+ * answered by hexec from the job table, without spawning a child.
+ * Status replies carry a line of key=value pairs in a header, with the
+ * state of the job, "running", "done", "cancelled" or "lost", and the
+ * output of a finished job as the body, sent from the store without
+ * blocking. Cancelling kills a running job.
+ *
+ * The job table holds running jobs and at most a max # of finished
+ * ones. When there are more, the record of the least recently queried
+ * finished job is removed from the store, whose segments are compacted
+ * once removed records add up to a segment. The pid of a running job is
+ * written to its spool directory. The table is rebuilt from the store
+ * and the spool on start: jobs that had not finished and were not
+ * inherited on reload are stored as lost. The pid file marks the
+ * directory as the directory of a job, which is not expired by age.
+ *
+ * Connections accepted before the request header has arrived are pending
+ * until it has, for at most a second. Requests without the header, or
+ * whose SCGI header is invalid or incomplete after a second, are run as
+ * usual. */
+
+#define HEXEC_JOBS_PIDFILE         "pid"
+#define HEXEC_JOBS_STORE           "jobs"
+
+#define HEXEC_JOBS_MAXPENDING      64
+#define HEXEC_JOBS_MAXREPLIES      64 /* max # of status replies written */
+#define HEXEC_JOBS_DEFAULT_MAXDONE 1024
+
+/* hexec_jobs_init --
+ *   Sets up jobs by the SCGI header 'header', in 'spool', with the job
+ *   store in directory 'store' and room for 'maxrunning' running and
+ *   'maxdone' finished jobs.
+ *
+ *   'run' runs a request that is not a job request, and 'submit' runs a
+ *   job; both take ownership of 'fd'. 'remove' removes the spool
+ *   directory 'id' of a job once stored. 'on_update' is called when the
+ *   number of pending connections decreases.
+ *
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int hexec_jobs_init(const char *header, struct spool *spool,
+    const char *store, int maxrunning, int maxdone,
+    void (*run)(struct iomux_ctx *ctx, int fd),
+    void (*submit)(struct iomux_ctx *ctx, int fd),
+    void (*remove)(const char *id),
+    void (*on_update)(struct iomux_ctx *ctx));
+
+/* hexec_jobs_cleanup --
+ *   Releases all resources. Pending connections, and connections of
+ *   status replies being written, are closed. */
+void hexec_jobs_cleanup(void);
+
+/* hexec_jobs_load --
+ *   Rebuilds the job table from the store and the spool directory at
+ *   'path'. 'adopt' returns 1, and takes note of job 'id', if 'pid' is a
+ *   running child, and 0 otherwise. Returns 0 on success, -1 on error.
+ *   Sets errno. */
+int hexec_jobs_load(const char *path, int (*adopt)(pid_t pid,
+    const char *id));
+
+/* hexec_jobs_accept --
+ *   Takes ownership of the accepted connection 'fd', which is answered
+ *   or run. */
+void hexec_jobs_accept(struct iomux_ctx *ctx, int fd);
+
+/* hexec_jobs_started --
+ *   Adds job 'id', run by 'pid' since 'started'. */
+void hexec_jobs_started(const char *id, pid_t pid, time_t started);
+
+/* hexec_jobs_exited --
+ *   Reports the exit of job 'id', with wait status 'status', and stores
+ *   its output. */
+void hexec_jobs_exited(const char *id, int status);
+
+/* hexec_jobs_npending --
+ *   Returns the number of connections not yet known to be job
+ *   requests, each of which may need a slot. */
+int hexec_jobs_npending(void);
+
+#endif
@@ -0,0 +1,540 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/macros.h"
+#include "lib/scgi.h"
+#include "app/hexec_conn.h"
+#include "app/hexec_lanes.h"
+
+#define NAMESZ     32
+
+/* interval of checks of queued requests for hangups and deadlines */
+#define QUEUED_INTERVAL_MS  100
+
+/* weight of a new run time in the average run time of a lane, 1/n */
+#define RUN_WEIGHT          8
+
+#define NO_DEADLINE         INT64_MAX
+
+/* response to requests dropped for their deadline */
+#define EXPIRED_RESPONSE "Status: 504 Gateway Timeout\r\n\r\n"
+
+/* a held connection is pending until its request data has arrived, and
+ * then queued in a lane */
+struct held {
+  int fd;                   /* connection, -1 if the entry is free */
+  int lane;                 /* -1 while pending */
+  struct timespec accepted; /* CLOCK_MONOTONIC */
+  int64_t deadline_us;      /* CLOCK_MONOTONIC, or NO_DEADLINE */
+  struct held *prev;        /* previous in lane */
+  struct held *next;        /* next in lane, or in free list */
+};
+
+struct lane {
+  char name[NAMESZ];
+  int min;
+  int running;
+  int queued;
+  struct held *head;
+  struct held *tail;
+  uint64_t admitted;
+  int64_t wait_us;
+  int64_t maxwait_us;
+  uint64_t expired;
+  uint64_t cancelled;
+  int64_t run_us;
+};
+
+static struct lane lanes_[HEXEC_LANES_MAX];
+static int nlanes_;
+static const char *header_;
+static const char *deadline_header_;
+static int deadline_ms_;
+static struct held *held_;
+static struct held *free_;
+static int maxheld_;
+static int nheld_;
+static int nqueued_;
+static struct pollfd *pfds_;
+static struct hexec_conn_queue queue_;
+static struct iomux_handler qtimer_;
+static int (*nfree_)(void);
+static int (*spawn_)(struct iomux_ctx *ctx, int fd, int lane,
+    const struct timespec *accepted);
+static void (*on_update_)(struct iomux_ctx *ctx);
+
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg);
+
+int hexec_lanes_add(const char *spec) {
+  struct lane *l = &lanes_[nlanes_];
+  const char *sep;
+  size_t len;
+  char *end;
+  long min = 0;
+
+  /* names are logged unquoted */
+  len = strspn(spec, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+      "0123456789_.-");
+  sep = spec[len] == ':' ? spec + len : NULL;
+  if (nlanes_ == HEXEC_LANES_MAX || len == 0 || len >= NAMESZ ||
+      (sep == NULL && spec[len] != '\0')) {
+    goto invalid;
+  }
+
+  if (sep != NULL) {
+    min = strtol(sep + 1, &end, 10);
+    if (sep[1] == '\0' || *end != '\0' || min < 0 || min > INT_MAX) {
+      goto invalid;
+    }
+  }
+
+  memset(l, 0, sizeof(*l));
+  memcpy(l->name, spec, len);
+  l->min = (int)min;
+  nlanes_++;
+  return 0;
+invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+int hexec_lanes_nlanes(void) {
+  return nlanes_;
+}
+
+int hexec_lanes_nreserved(void) {
+  int nreserved = 0;
+  int i;
+
+  for (i = 0; i < nlanes_; i++) {
+    nreserved += lanes_[i].min;
+  }
+
+  return nreserved;
+}
+
+void hexec_lanes_deadline(const char *header, int default_ms) {
+  deadline_header_ = header;
+  deadline_ms_ = default_ms;
+}
+
+int hexec_lanes_init(const char *header, int maxqueued, int (*nfree)(void),
+    int (*spawn)(struct iomux_ctx *ctx, int fd, int lane,
+    const struct timespec *accepted),
+    void (*on_update)(struct iomux_ctx *ctx)) {
+  int i;
+
+  if (nlanes_ == 0 || maxqueued <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  held_ = calloc(maxqueued, sizeof(struct held));
+  pfds_ = calloc(maxqueued, sizeof(struct pollfd));
+  if (held_ == NULL || pfds_ == NULL ||
+      hexec_conn_queue_init(&queue_, maxqueued, on_ready) < 0) {
+    free(held_);
+    free(pfds_);
+    held_ = NULL;
+    pfds_ = NULL;
+    return -1;
+  }
+
+  for (i = maxqueued - 1; i >= 0; i--) {
+    held_[i].fd = -1;
+    held_[i].next = free_;
+    free_ = &held_[i];
+  }
+
+  qtimer_.fd = -1;
+  header_ = header;
+  maxheld_ = maxqueued;
+  nfree_ = nfree;
+  spawn_ = spawn;
+  on_update_ = on_update;
+  return 0;
+}
+
+void hexec_lanes_cleanup(void) {
+  hexec_conn_queue_cleanup(&queue_);
+  free(held_);
+  free(pfds_);
+  held_ = NULL;
+  pfds_ = NULL;
+  free_ = NULL;
+  nlanes_ = 0;
+}
+
+int hexec_lanes_accepting(void) {
+  return free_ != NULL;
+}
+
+int hexec_lanes_nheld(void) {
+  return nheld_;
+}
+
+const char *hexec_lanes_name(int lane) {
+  return lanes_[lane].name;
+}
+
+int hexec_lanes_stats(int lane, struct hexec_lane_stats *stats) {
+  struct lane *l;
+
+  if (lane < 0 || lane >= nlanes_) {
+    return -1;
+  }
+
+  l = &lanes_[lane];
+  stats->name = l->name;
+  stats->min = l->min;
+  stats->running = l->running;
+  stats->queued = l->queued;
+  stats->admitted = l->admitted;
+  stats->wait_us = l->wait_us;
+  stats->maxwait_us = l->maxwait_us;
+  stats->expired = l->expired;
+  stats->cancelled = l->cancelled;
+  stats->run_us = l->run_us;
+  l->admitted = 0;
+  l->wait_us = 0;
+  l->maxwait_us = 0;
+  l->expired = 0;
+  l->cancelled = 0;
+  return 0;
+}
+
+void hexec_lanes_done(int lane, int64_t run_us) {
+  struct lane *l;
+
+  if (lane < 0 || lane >= nlanes_) {
+    return;
+  }
+
+  l = &lanes_[lane];
+  if (l->running > 0) {
+    l->running--;
+  }
+
+  if (run_us >= 0) {
+    l->run_us = l->run_us == 0 ? run_us :
+        l->run_us + (run_us - l->run_us) / RUN_WEIGHT;
+  }
+}
+
+/* returns the highest lane with queued requests that may use one of
+ * 'nfree' free slots, or -1. A lane is protected from borrowing by a
+ * lane above it while it has queued requests */
+static int pick(int nfree) {
+  int qunused = 0; /* unused reservations of lanes with queued requests */
+  int higher = 0;  /* unused reservations of higher lanes */
+  int qhigher = 0; /* ... of those, with queued requests */
+  int unused;
+  int lower;
+  int i;
+
+  for (i = 0; i < nlanes_; i++) {
+    if (lanes_[i].queued > 0) {
+      qunused += MAX(lanes_[i].min - lanes_[i].running, 0);
+    }
+  }
+
+  for (i = 0; i < nlanes_; i++) {
+    unused = MAX(lanes_[i].min - lanes_[i].running, 0);
+    if (lanes_[i].queued > 0) {
+      lower = qunused - qhigher - unused;
+      if (unused > 0 || nfree > higher + lower) {
+        return i;
+      }
+      qhigher += unused;
+    }
+    higher += unused;
+  }
+
+  return -1;
+}
+
+static void on_queued_timer(struct iomux_ctx *ctx, struct iomux_handler *h);
+
+/* queue 'h' in 'lane' after the requests with an earlier or the same
+ * deadline. Requests without a deadline, e.g., without deadlines at all,
+ * are queued last, in order. The lane is searched from the tail, so that
+ * requests with the default deadline, or none, are queued in O(1) */
+static void enqueue(struct iomux_ctx *ctx, struct held *h, int lane) {
+  struct lane *l = &lanes_[lane];
+  struct held *prev = l->tail;
+
+  while (prev != NULL && prev->deadline_us > h->deadline_us) {
+    prev = prev->prev;
+  }
+
+  h->lane = lane;
+  h->prev = prev;
+  h->next = prev == NULL ? l->head : prev->next;
+  if (prev == NULL) {
+    l->head = h;
+  } else {
+    prev->next = h;
+  }
+
+  if (h->next == NULL) {
+    l->tail = h;
+  } else {
+    h->next->prev = h;
+  }
+
+  l->queued++;
+  if (nqueued_++ == 0 && qtimer_.fd < 0) {
+    qtimer_.source_func = on_queued_timer;
+    if (iomux_add_timer(ctx, &qtimer_, QUEUED_INTERVAL_MS) < 0) {
+      perror("lanes");
+      qtimer_.fd = -1;
+    }
+  }
+}
+
+/* remove 'h' from its lane */
+static void unlink_queued(struct held *h) {
+  struct lane *l = &lanes_[h->lane];
+
+  if (h->prev == NULL) {
+    l->head = h->next;
+  } else {
+    h->prev->next = h->next;
+  }
+
+  if (h->next == NULL) {
+    l->tail = h->prev;
+  } else {
+    h->next->prev = h->prev;
+  }
+
+  l->queued--;
+  nqueued_--;
+}
+
+static struct held *dequeue(int lane) {
+  struct held *h = lanes_[lane].head;
+
+  unlink_queued(h);
+  return h;
+}
+
+static void release(struct held *h) {
+  h->fd = -1;
+  h->next = free_;
+  free_ = h;
+  nheld_--;
+}
+
+static int64_t elapsed_us(const struct timespec *from,
+    const struct timespec *to) {
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+      (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int64_t timespec_us(const struct timespec *ts) {
+  return (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+/* returns the lane of the request on held connection 'h', by its
+ * header 'hdr', or the last lane if 'hdr' is NULL, and sets the deadline
+ * of 'h' */
+static int classify(struct held *h, const struct scgi_header *hdr) {
+  const char *val;
+  char *end;
+  long ms = deadline_ms_;
+  int lane = nlanes_ - 1;
+  int i;
+
+  if (hdr != NULL && header_ != NULL &&
+      (val = scgi_get(hdr, header_)) != NULL) {
+    for (i = 0; i < nlanes_ - 1; i++) {
+      if (strcmp(lanes_[i].name, val) == 0) {
+        lane = i;
+        break;
+      }
+    }
+  }
+
+  /* invalid deadlines are ignored, like unknown lanes */
+  if (hdr != NULL && deadline_header_ != NULL &&
+      (val = scgi_get(hdr, deadline_header_)) != NULL) {
+    errno = 0;
+    ms = strtol(val, &end, 10);
+    if (errno != 0 || *val == '\0' || *end != '\0' || ms <= 0 ||
+        ms > INT_MAX) {
+      ms = deadline_ms_;
+    }
+  }
+
+  h->deadline_us = ms > 0 ?
+      timespec_us(&h->accepted) + (int64_t)ms * 1000 : NO_DEADLINE;
+  return lane;
+}
+
+/* returns 1 if the request on 'h' can not finish before its deadline
+ * when started at 'now_us'. The average run time is only counted while
+ * requests wait: a request started on a free slot keeps the average
+ * current, even if it is longer than the deadlines */
+static int doomed(struct held *h, int64_t now_us, int waiting) {
+  return h->deadline_us != NO_DEADLINE &&
+      now_us + (waiting ? lanes_[h->lane].run_us : 0) >= h->deadline_us;
+}
+
+/* reply to a request dropped for its deadline, and close it. Does not
+ * block */
+static void expire(struct held *h) {
+  lanes_[h->lane].expired++;
+  hexec_conn_reply(h->fd, EXPIRED_RESPONSE, sizeof(EXPIRED_RESPONSE) - 1);
+}
+
+static int dispatch(struct iomux_ctx *ctx) {
+  struct timespec now;
+  struct held *h;
+  struct lane *l;
+  int64_t wait_us;
+  int nfree;
+  int ndispatched = 0;
+  int lane;
+
+  while ((nfree = nfree_()) > 0 && (lane = pick(nfree)) >= 0) {
+    h = dequeue(lane);
+    l = &lanes_[lane];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (doomed(h, timespec_us(&now), l->queued > 0)) {
+      expire(h);
+      release(h);
+      ndispatched++;
+      continue;
+    }
+
+    wait_us = elapsed_us(&h->accepted, &now);
+    l->admitted++;
+    l->wait_us += wait_us;
+    l->maxwait_us = MAX(l->maxwait_us, wait_us);
+
+    /* a request that can not be spawned is dropped, as without lanes */
+    if (spawn_(ctx, h->fd, lane, &h->accepted) == 0) {
+      l->running++;
+    }
+
+    close(h->fd);
+    release(h);
+    ndispatched++;
+  }
+
+  return ndispatched;
+}
+
+void hexec_lanes_kick(struct iomux_ctx *ctx) {
+  if (dispatch(ctx) > 0) {
+    on_update_(ctx);
+  }
+}
+
+/* drop queued requests of clients that have hung up, or that can not
+ * finish in time. A client may shut down its side of the connection after
+ * sending the request, so only a hangup in both directions cancels */
+static void on_queued_timer(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct timespec now;
+  struct held *held;
+  int64_t now_us;
+  int ndropped = 0;
+  int npfds = 0;
+  int i;
+
+  if (nqueued_ == 0) {
+    iomux_close_source(ctx, &qtimer_);
+    qtimer_.fd = -1;
+    return;
+  }
+
+  for (i = 0; i < maxheld_; i++) {
+    if (held_[i].fd >= 0 && held_[i].lane >= 0) {
+      pfds_[npfds].fd = held_[i].fd;
+      pfds_[npfds].events = 0;
+      pfds_[npfds].revents = 0;
+      npfds++;
+    }
+  }
+
+  /* on error, no revents are set and only deadlines are checked */
+  (void)poll(pfds_, npfds, 0);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  now_us = timespec_us(&now);
+  for (i = 0, npfds = 0; i < maxheld_; i++) {
+    held = &held_[i];
+    if (held->fd < 0 || held->lane < 0) {
+      continue;
+    }
+
+    if (pfds_[npfds++].revents & (POLLHUP | POLLERR)) {
+      unlink_queued(held);
+      lanes_[held->lane].cancelled++;
+      close(held->fd);
+      release(held);
+      ndropped++;
+    } else if (doomed(held, now_us, 1)) {
+      unlink_queued(held);
+      expire(held);
+      release(held);
+      ndropped++;
+    }
+  }
+
+  if (ndropped > 0) {
+    on_update_(ctx);
+  }
+}
+
+/* queue a held connection once its request data has arrived. Requests
+ * that have not arrived in time are queued in the last lane, and the
+ * child times out as usual */
+static void on_ready(struct iomux_ctx *ctx, int fd,
+    const struct scgi_header *hdr, void *arg) {
+  struct held *h = arg;
+
+  enqueue(ctx, h, classify(h, hdr));
+  hexec_lanes_kick(ctx);
+}
+
+void hexec_lanes_accept(struct iomux_ctx *ctx, int fd) {
+  struct held *h = free_;
+
+  free_ = h->next;
+  nheld_++;
+  h->fd = fd;
+  h->lane = -1;
+  clock_gettime(CLOCK_MONOTONIC, &h->accepted);
+  hexec_conn_wait(ctx, &queue_, fd, h);
+}
@@ -0,0 +1,141 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef APP_HEXEC_LANES_H__
+#define APP_HEXEC_LANES_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "lib/iomux.h"
+
+/* Priority lanes: connections are accepted by hexec, put in a lane by
+ * the value of an SCGI header and queued until a child may be spawned.
+ * Lanes are added in priority order, and requests without a matching
+ * header value go to the last lane.
+ *
+ * Each lane has a minimum number of slots, reserved for it. A lane
+ * below its minimum may always use a free slot. Beyond its minimum, a
+ * lane may use free slots not reserved by a higher lane, nor by a lower
+ * lane with queued requests: idle reservations of lower lanes are
+ * borrowed. When a slot is free, the highest lane that may use it gets
+ * it. Running children are never stopped to make room for a lane.
+ *
+ * Requests may carry a deadline, in milliseconds after they were
+ * accepted, from an SCGI header or a default. Within a lane, requests are
+ * queued earliest deadline first, and requests without a deadline last.
+ * A request is dropped with a 504 instead of being spawned once its
+ * deadline has passed or, while it waits, is closer than the average run
+ * time of the lane. Queued requests are also dropped when the client
+ * hangs up.
+ *
+ * Connections accepted before the request header has arrived are held
+ * until it has, for at most a second. The number of held connections is
+ * bounded. */
+
+#define HEXEC_LANES_MAX                8
+#define HEXEC_LANES_DEFAULT_MAXQUEUED  256
+
+struct hexec_lane_stats {
+  const char *name;
+  int min;
+  int running;
+  int queued;
+  uint64_t admitted;        /* since the last call */
+  int64_t wait_us;          /* total wait of admitted requests */
+  int64_t maxwait_us;       /* max wait of admitted requests */
+  uint64_t expired;         /* dropped for their deadline */
+  uint64_t cancelled;       /* dropped for a hangup */
+  int64_t run_us;           /* average run time */
+};
+
+/* hexec_lanes_add --
+ *   Adds the lane 'spec', "<name>[:<min>]", below the lanes added
+ *   before. Returns 0 on success, -1 on error. Sets errno. */
+int hexec_lanes_add(const char *spec);
+
+/* hexec_lanes_nlanes --
+ *   Returns the number of lanes added. */
+int hexec_lanes_nlanes(void);
+
+/* hexec_lanes_nreserved --
+ *   Returns the total number of reserved slots. */
+int hexec_lanes_nreserved(void);
+
+/* hexec_lanes_deadline --
+ *   Takes the deadline of requests from the SCGI header 'header', if not
+ *   NULL, or else sets it to 'default_ms', if greater than zero. Must be
+ *   called before hexec_lanes_init. */
+void hexec_lanes_deadline(const char *header, int default_ms);
+
+/* hexec_lanes_init --
+ *   Sets up the lanes, chosen by the SCGI header 'header', with room for
+ *   'maxqueued' held connections.
+ *
+ *   'nfree' returns the number of free slots. 'spawn' runs the request
+ *   on connection 'fd' in lane 'lane', accepted at 'accepted', and
+ *   returns 0 on success or -1 on error. 'fd' is closed by the caller.
+ *   'on_update' is called when the number of held connections
+ *   decreases.
+ *
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int hexec_lanes_init(const char *header, int maxqueued, int (*nfree)(void),
+    int (*spawn)(struct iomux_ctx *ctx, int fd, int lane,
+    const struct timespec *accepted),
+    void (*on_update)(struct iomux_ctx *ctx));
+
+/* hexec_lanes_cleanup --
+ *   Releases all resources. */
+void hexec_lanes_cleanup(void);
+
+/* hexec_lanes_accepting --
+ *   Returns 1 if there is room for another connection, 0 otherwise. */
+int hexec_lanes_accepting(void);
+
+/* hexec_lanes_accept --
+ *   Takes ownership of the accepted connection 'fd'. Must only be called
+ *   if hexec_lanes_accepting returns 1. */
+void hexec_lanes_accept(struct iomux_ctx *ctx, int fd);
+
+/* hexec_lanes_done --
+ *   Releases the slot of a child spawned in 'lane', that ran for
+ *   'run_us'. */
+void hexec_lanes_done(int lane, int64_t run_us);
+
+/* hexec_lanes_kick --
+ *   Spawns queued requests, e.g., after a child has exited. */
+void hexec_lanes_kick(struct iomux_ctx *ctx);
+
+/* hexec_lanes_nheld --
+ *   Returns the number of connections held. */
+int hexec_lanes_nheld(void);
+
+/* hexec_lanes_name --
+ *   Returns the name of 'lane'. */
+const char *hexec_lanes_name(int lane);
+
+/* hexec_lanes_stats --
+ *   Sets 'stats' to the state of 'lane', and resets the counters of
+ *   admitted and dropped requests. Returns -1 if there is no such lane. */
+int hexec_lanes_stats(int lane, struct hexec_lane_stats *stats);
+
+#endif
@@ -0,0 +1,361 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "app/hexec_conn.h"
+#include "app/hexec_peers.h"
+
+#define PEER_MAGIC   0x68785052 /* hxPR */
+#define MSG_LOAD     1          /* advertisement of free slots */
+#define MSG_CONN     2          /* a passed connection */
+#define MAXRECV      64         /* max messages received per event */
+
+struct peer_msg {
+  uint32_t magic;
+  uint32_t type;
+  int32_t nfree;
+};
+
+struct peer {
+  const char *path;
+  struct sockaddr_un addr;
+  int nfree;                /* as advertised, less connections passed */
+  struct timespec updated;  /* CLOCK_MONOTONIC, of the advertisement */
+};
+
+static struct peer peers_[HEXEC_PEERS_MAX];
+static int npeers_;
+static const char *path_;
+static struct iomux_handler sock_ = {.fd = -1};
+static struct iomux_handler timer_;
+static int held_[HEXEC_PEERS_MAXHELD]; /* ring of held connections */
+static int heldhead_;
+static int nheld_;
+static int (*nfree_)(void);
+static void (*run_)(struct iomux_ctx *ctx, int fd);
+static void (*shed_)(int fd);
+
+static int mkaddr(struct sockaddr_un *addr, const char *path) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int hexec_peers_add(const char *path) {
+  struct peer *p = &peers_[npeers_];
+
+  if (npeers_ == HEXEC_PEERS_MAX) {
+    errno = E2BIG;
+    return -1;
+  } else if (*path == '\0' || mkaddr(&p->addr, path) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  p->path = path;
+  p->nfree = 0;
+  npeers_++;
+  return 0;
+}
+
+int hexec_peers_npeers(void) {
+  return npeers_;
+}
+
+int hexec_peers_init(const char *path, int (*nfree)(void),
+    void (*run)(struct iomux_ctx *ctx, int fd), void (*shed)(int fd)) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (mkaddr(&addr, path) < 0) {
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  /* the socket of an earlier process, e.g., before a reload */
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  sock_.fd = fd;
+  path_ = path;
+  nfree_ = nfree;
+  run_ = run;
+  shed_ = shed;
+  return 0;
+}
+
+void hexec_peers_cleanup(void) {
+  while (nheld_ > 0) {
+    close(held_[heldhead_]);
+    heldhead_ = (heldhead_ + 1) % HEXEC_PEERS_MAXHELD;
+    nheld_--;
+  }
+
+  if (sock_.fd >= 0) {
+    close(sock_.fd);
+    unlink(path_);
+    sock_.fd = -1;
+  }
+}
+
+int hexec_peers_nheld(void) {
+  return nheld_;
+}
+
+/* returns the peer that advertised the most free slots, or NULL */
+static struct peer *best_peer(void) {
+  struct peer *best = NULL;
+  struct timespec now;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (i = 0; i < npeers_; i++) {
+    if (peers_[i].nfree > 0 &&
+        hexec_conn_elapsed_ms(&peers_[i].updated, &now) <
+        HEXEC_PEERS_STALE_MS &&
+        (best == NULL || peers_[i].nfree > best->nfree)) {
+      best = &peers_[i];
+    }
+  }
+
+  return best;
+}
+
+int hexec_peers_available(void) {
+  return best_peer() != NULL;
+}
+
+static void hold(int fd) {
+  if (nheld_ == HEXEC_PEERS_MAXHELD) {
+    shed_(fd);
+    return;
+  }
+
+  held_[(heldhead_ + nheld_) % HEXEC_PEERS_MAXHELD] = fd;
+  nheld_++;
+}
+
+void hexec_peers_kick(struct iomux_ctx *ctx) {
+  int fd;
+
+  while (nheld_ > 0 && nfree_() > 0) {
+    fd = held_[heldhead_];
+    heldhead_ = (heldhead_ + 1) % HEXEC_PEERS_MAXHELD;
+    nheld_--;
+    run_(ctx, fd);
+  }
+}
+
+static int send_conn(const struct peer *p, int fd) {
+  struct peer_msg msg = {PEER_MAGIC, MSG_CONN, 0};
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsg;
+  struct msghdr mh = {0};
+  struct iovec iov;
+  struct cmsghdr *c;
+
+  iov.iov_base = &msg;
+  iov.iov_len = sizeof(msg);
+  memset(&cmsg, 0, sizeof(cmsg));
+  mh.msg_name = (void *)&p->addr;
+  mh.msg_namelen = sizeof(p->addr);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cmsg.buf;
+  mh.msg_controllen = sizeof(cmsg.buf);
+  c = CMSG_FIRSTHDR(&mh);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  return sendmsg(sock_.fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+void hexec_peers_pass(struct iomux_ctx *ctx, int fd) {
+  struct peer *p;
+
+  /* a peer that can not be reached, or has a full socket buffer, is
+   * not tried again until its next advertisement */
+  while ((p = best_peer()) != NULL) {
+    if (send_conn(p, fd) == 0) {
+      p->nfree--;
+      close(fd);
+      return;
+    }
+
+    p->nfree = 0;
+  }
+
+  hold(fd);
+}
+
+static struct peer *find_peer(const struct sockaddr_un *addr,
+    socklen_t addrlen) {
+  int i;
+
+  if (addrlen <= offsetof(struct sockaddr_un, sun_path)) {
+    return NULL; /* unbound sender */
+  }
+
+  for (i = 0; i < npeers_; i++) {
+    if (strncmp(peers_[i].addr.sun_path, addr->sun_path,
+        sizeof(addr->sun_path)) == 0) {
+      return &peers_[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* a passed connection is run, or held until it can be */
+static void on_conn(struct iomux_ctx *ctx, int fd) {
+  if (nheld_ == 0 && nfree_() > 0) {
+    run_(ctx, fd);
+  } else {
+    hold(fd);
+  }
+}
+
+static void on_sock(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cmsg;
+  struct sockaddr_un from;
+  struct peer_msg msg;
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *c;
+  struct peer *p;
+  ssize_t n;
+  int flags = MSG_DONTWAIT;
+  int fd;
+  int i;
+
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+  for (i = 0; i < MAXRECV && h->fd >= 0; i++) {
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_name = &from;
+    mh.msg_namelen = sizeof(from);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cmsg.buf;
+    mh.msg_controllen = sizeof(cmsg.buf);
+    n = recvmsg(h->fd, &mh, flags);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("peers");
+      }
+      return;
+    }
+
+    fd = -1;
+    c = CMSG_FIRSTHDR(&mh);
+    if (c != NULL && c->cmsg_level == SOL_SOCKET &&
+        c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(int))) {
+      memcpy(&fd, CMSG_DATA(c), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+    }
+
+    p = find_peer(&from, mh.msg_namelen);
+    if (p == NULL || n != sizeof(msg) || msg.magic != PEER_MAGIC ||
+        (mh.msg_flags & MSG_CTRUNC)) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    } else if (msg.type == MSG_LOAD) {
+      p->nfree = msg.nfree;
+      clock_gettime(CLOCK_MONOTONIC, &p->updated);
+      if (fd >= 0) {
+        close(fd);
+      }
+    } else if (msg.type == MSG_CONN && fd >= 0) {
+      on_conn(ctx, fd);
+    } else if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+/* free slots are advertised less the held connections, which take them
+ * first */
+static void on_timer(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct peer_msg msg = {PEER_MAGIC, MSG_LOAD, 0};
+  int nfree;
+  int i;
+
+  hexec_peers_kick(ctx);
+  nfree = nfree_() - nheld_;
+  msg.nfree = nfree > 0 ? nfree : 0;
+  for (i = 0; i < npeers_; i++) {
+    sendto(sock_.fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL,
+        (struct sockaddr *)&peers_[i].addr, sizeof(peers_[i].addr));
+  }
+}
+
+int hexec_peers_start(struct iomux_ctx *ctx) {
+  sock_.source_func = on_sock;
+  if (iomux_add_source(ctx, &sock_) < 0) {
+    return -1;
+  }
+
+  timer_.source_func = on_timer;
+  if (iomux_add_timer(ctx, &timer_, HEXEC_PEERS_INTERVAL_MS) < 0) {
+    return -1;
+  }
+
+  on_timer(ctx, &timer_);
+  return 0;
+}
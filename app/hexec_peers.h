@@ -0,0 +1,100 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef APP_HEXEC_PEERS_H__
+#define APP_HEXEC_PEERS_H__
+
+#include "lib/iomux.h"
+
+/* Peers: hexec processes on the same host, e.g., serving the same
+ * application from other containers, that take each other's overflow.
+ * Each process binds a datagram socket, its peer socket, and advertises
+ * its number of free slots to the peer sockets of its peers every
+ * HEXEC_PEERS_INTERVAL_MS. Advertisements older than
+ * HEXEC_PEERS_STALE_MS are ignored.
+ *
+ * A connection accepted while the process can not take it, since its
+ * slots are full or it is under pressure, is passed to the peer that
+ * advertised the most free slots. The connection descriptor itself is
+ * passed, over the peer socket: no data is copied, and the peer reads
+ * the request and its child writes the response as if it had accepted
+ * the connection. A passed connection is not passed again. A peer that
+ * can not run a passed connection right away holds it, as it holds the
+ * connections it failed to pass, and runs held connections before it
+ * accepts new ones. At most HEXEC_PEERS_MAXHELD connections are held,
+ * and connections beyond that are shed.
+ *
+ * Connections and advertisements are only taken from the peer sockets
+ * of configured peers. */
+
+#define HEXEC_PEERS_MAX         32
+#define HEXEC_PEERS_MAXHELD     64
+#define HEXEC_PEERS_INTERVAL_MS 100
+#define HEXEC_PEERS_STALE_MS    500
+
+/* hexec_peers_add --
+ *   Adds the peer with the peer socket at 'path', which must remain
+ *   valid. Returns 0 on success, -1 on error. */
+int hexec_peers_add(const char *path);
+
+/* hexec_peers_npeers --
+ *   Returns the number of peers added. */
+int hexec_peers_npeers(void);
+
+/* hexec_peers_init --
+ *   Binds the peer socket of this process at 'path'. 'nfree' returns the
+ *   number of connections this process could run right away. 'run' runs
+ *   a connection, and takes ownership of it. 'shed' rejects a
+ *   connection, and takes ownership of it.
+ *
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int hexec_peers_init(const char *path, int (*nfree)(void),
+    void (*run)(struct iomux_ctx *ctx, int fd), void (*shed)(int fd));
+
+/* hexec_peers_start --
+ *   Starts to receive from, and advertise to, peers. Returns 0 on
+ *   success, -1 on error. Sets errno. */
+int hexec_peers_start(struct iomux_ctx *ctx);
+
+/* hexec_peers_cleanup --
+ *   Closes the peer socket, and releases all resources. Held connections
+ *   are closed. */
+void hexec_peers_cleanup(void);
+
+/* hexec_peers_available --
+ *   Returns 1 if a peer advertised free slots, 0 otherwise. */
+int hexec_peers_available(void);
+
+/* hexec_peers_pass --
+ *   Passes the accepted connection 'fd' to a peer, or holds it. Takes
+ *   ownership of 'fd'. */
+void hexec_peers_pass(struct iomux_ctx *ctx, int fd);
+
+/* hexec_peers_kick --
+ *   Runs held connections while 'nfree' is positive. */
+void hexec_peers_kick(struct iomux_ctx *ctx);
+
+/* hexec_peers_nheld --
+ *   Returns the number of held connections. */
+int hexec_peers_nheld(void);
+
+#endif
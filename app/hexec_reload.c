@@ -0,0 +1,244 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "app/hexec_reload.h"
+
+#define ENV_LISTEN_FD "HEXEC_LISTEN_FD"
+#define ENV_CHILDREN  "HEXEC_CHILDREN"
+
+static char **argv_;
+
+int hexec_reload_save_argv(int argc, char **argv) {
+  int i;
+
+  argv_ = calloc(argc + 1, sizeof(char *));
+  if (argv_ == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < argc; i++) {
+    argv_[i] = argv[i];
+  }
+
+  return 0;
+}
+
+static int set_cloexec(int fd, int on) {
+  int flags;
+
+  flags = fcntl(fd, F_GETFD);
+  if (flags < 0) {
+    return -1;
+  }
+
+  flags = on ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC;
+  return fcntl(fd, F_SETFD, flags);
+}
+
+/* length of a "pid:pfd:errfd" entry, and separator, in HEXEC_CHILDREN */
+#define CHILDLEN 36
+
+int hexec_reload_exec(int lfd, const struct hexec_reload_child *children,
+    size_t nchildren) {
+  sigset_t set;
+  sigset_t oset;
+  char fdstr[16];
+  char *env;
+  size_t len;
+  size_t i;
+  int err;
+  int ret;
+
+  if (argv_ == NULL || argv_[0] == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* "pid:pfd:errfd,pid:pfd:errfd,..." */
+  env = malloc(nchildren * CHILDLEN + 1);
+  if (env == NULL) {
+    return -1;
+  }
+
+  env[0] = '\0';
+  for (i = 0, len = 0; i < nchildren; i++) {
+    ret = snprintf(env + len, CHILDLEN + 1, "%s%d:%d:%d", i > 0 ? "," : "",
+        (int)children[i].pid, children[i].pfd, children[i].errfd);
+    len += ret;
+  }
+
+  snprintf(fdstr, sizeof(fdstr), "%d", lfd);
+  if (setenv(ENV_LISTEN_FD, fdstr, 1) < 0 ||
+      setenv(ENV_CHILDREN, env, 1) < 0 ||
+      set_cloexec(lfd, 0) < 0) {
+    goto restore;
+  }
+
+  for (i = 0; i < nchildren; i++) {
+    if ((children[i].pfd >= 0 && set_cloexec(children[i].pfd, 0) < 0) ||
+        (children[i].errfd >= 0 && set_cloexec(children[i].errfd, 0) < 0)) {
+      goto restore;
+    }
+  }
+
+  /* a reload signal before the new image has installed its handlers
+   * would terminate it, with the listening socket and children */
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGUSR2);
+  if (sigprocmask(SIG_BLOCK, &set, &oset) < 0) {
+    goto restore;
+  }
+
+  fflush(NULL);
+  execvp(argv_[0], argv_);
+  err = errno;
+  sigprocmask(SIG_SETMASK, &oset, NULL);
+  errno = err;
+
+restore:
+  err = errno;
+  for (i = 0; i < nchildren; i++) {
+    if (children[i].pfd >= 0) {
+      set_cloexec(children[i].pfd, 1);
+    }
+    if (children[i].errfd >= 0) {
+      set_cloexec(children[i].errfd, 1);
+    }
+  }
+  set_cloexec(lfd, 1);
+  unsetenv(ENV_LISTEN_FD);
+  unsetenv(ENV_CHILDREN);
+  free(env);
+  errno = err;
+  return -1;
+}
+
+static int parse_int(const char *s, char **end) {
+  long val;
+
+  errno = 0;
+  val = strtol(s, end, 10);
+  if (errno != 0 || *end == s || val < 0 || val > INT_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return (int)val;
+}
+
+int hexec_reload_inherit(int *lfd, struct hexec_reload_child **children,
+    size_t *nchildren) {
+  struct hexec_reload_child *child;
+  struct stat sb;
+  const char *s;
+  char *end;
+  size_t n;
+  int val;
+
+  *lfd = -1;
+  *children = NULL;
+  *nchildren = 0;
+
+  s = getenv(ENV_LISTEN_FD);
+  if (s == NULL) {
+    unsetenv(ENV_CHILDREN);
+    return 0;
+  }
+
+  val = parse_int(s, &end);
+  if (val < 0 || *end != '\0') {
+    goto fail;
+  }
+
+  if (fstat(val, &sb) < 0 || !S_ISSOCK(sb.st_mode) ||
+      set_cloexec(val, 1) < 0) {
+    goto fail;
+  }
+
+  s = getenv(ENV_CHILDREN);
+  if (s != NULL && *s != '\0') {
+    for (n = 1, end = (char *)s; *end != '\0'; end++) {
+      if (*end == ',') {
+        n++;
+      }
+    }
+
+    *children = calloc(n, sizeof(struct hexec_reload_child));
+    if (*children == NULL) {
+      goto fail;
+    }
+
+    /* "pid:pfd:errfd" entries, or "pid:pfd" or just "pid" from an older
+     * hexec */
+    for (*nchildren = 0; *nchildren < n; (*nchildren)++) {
+      child = &(*children)[*nchildren];
+      child->pid = parse_int(s, &end);
+      child->pfd = -1;
+      child->errfd = -1;
+      if (child->pid > 0 && *end == ':') {
+        s = end + 1;
+        child->pfd = parse_int(s, &end);
+        if (child->pfd >= 0 && set_cloexec(child->pfd, 1) < 0) {
+          child->pfd = -1;
+        }
+      }
+
+      if (child->pid > 0 && *end == ':') {
+        s = end + 1;
+        child->errfd = parse_int(s, &end);
+        if (child->errfd >= 0 && set_cloexec(child->errfd, 1) < 0) {
+          child->errfd = -1;
+        }
+      }
+
+      if (child->pid <= 0 || (*end != ',' && *end != '\0')) {
+        free(*children);
+        *children = NULL;
+        *nchildren = 0;
+        goto fail;
+      }
+      s = end + 1;
+    }
+  }
+
+  *lfd = val;
+  unsetenv(ENV_LISTEN_FD);
+  unsetenv(ENV_CHILDREN);
+  return 0;
+
+fail:
+  errno = EINVAL;
+  unsetenv(ENV_LISTEN_FD);
+  unsetenv(ENV_CHILDREN);
+  return -1;
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef APP_HEXEC_RELOAD_H__
+#define APP_HEXEC_RELOAD_H__
+
+#include <sys/types.h>
+
+/* Binary reload: the running process re-executes the hexec binary with
+ * its original arguments. The listening socket and the PIDs and process
+ * descriptors of running children are passed in the environment
+ * (HEXEC_LISTEN_FD, HEXEC_CHILDREN). Since the PID is kept across
+ * execve(2), the new image remains the parent of the children and can
+ * reap them. */
+
+struct hexec_reload_child {
+  pid_t pid;
+  int pfd;      /* process descriptor, or -1 */
+  int errfd;    /* read end of the stderr pipe, or -1 */
+};
+
+/* hexec_reload_save_argv --
+ *   Saves a copy of the argument vector hexec was started with. Must be
+ *   called before the vector is modified. Returns 0 on success, -1 on
+ *   error. */
+int hexec_reload_save_argv(int argc, char **argv);
+
+/* hexec_reload_exec --
+ *   Re-executes hexec, passing the listening socket 'lfd' and the
+ *   'nchildren' running children in 'children'. SIGHUP and SIGUSR2 are
+ *   blocked across the exec, and remain blocked in the new image until
+ *   it unblocks them, once it handles them. Only returns on failure, in
+ *   which case the state of the process, including the signal mask, is
+ *   restored and -1 is returned. Sets errno. */
+int hexec_reload_exec(int lfd, const struct hexec_reload_child *children,
+    size_t nchildren);
+
+/* hexec_reload_inherit --
+ *   Checks the environment for state passed by hexec_reload_exec and
+ *   removes it from the environment. On return, '*lfd' is the inherited
+ *   listening socket, or -1 if none was passed. '*children' is an
+ *   allocated array of '*nchildren' inherited children, or NULL. The
+ *   process descriptor and the stderr pipe of a child are -1 if they were
+ *   not passed, e.g., by an older hexec. Returns 0 on success, -1 on
+ *   error. Sets errno. */
+int hexec_reload_inherit(int *lfd, struct hexec_reload_child **children,
+    size_t *nchildren);
+
+#endif
@@ -0,0 +1,452 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/capture.h"
+#include "lib/iomux.h"
+#include "lib/macros.h"
+#include "app/hexec_replay.h"
+
+#define DEFAULT_NCONCURRENT 64
+#define TICK_MS             1  /* pace of dispatching requests */
+#define NBUCKETS            40 /* latency histogram, by powers of two */
+
+/* a request in flight. The response is read on 'h', and the rest of a
+ * request that did not fit the socket buffer is written on 'out', a
+ * duplicate of the socket */
+struct conn {
+  struct iomux_handler h;   /* must be first */
+  struct iomux_handler out; /* fd is -1 unless writing */
+  const struct capture_rec *rec;
+  size_t off;               /* bytes of the request written */
+  struct timespec sent;     /* CLOCK_MONOTONIC, at connect */
+  struct conn *next;        /* free list */
+};
+
+static struct capture_rec *recs_;
+static size_t nrecs_;
+static size_t next_;        /* next request to send */
+static double speed_;       /* 0 for as fast as possible */
+static struct timespec start_;
+static const char *path_;
+static struct conn *conns_;
+static struct conn *freeconns_;
+static int nconns_;
+static int ninflight_;
+static int dispatching_;
+static struct iomux_handler ticker_;
+static int64_t *latencies_; /* us, of completed requests */
+static size_t ncompleted_;
+static size_t nfailed_;
+static uint64_t nbytes_;    /* response bytes */
+
+static const char *optstr_ = "s:n:h";
+
+static struct option options_[] = {
+  {"speed",        required_argument, NULL, 's'},
+  {"nconcurrent",  required_argument, NULL, 'n'},
+  {"help",         no_argument,       NULL, 'h'},
+  {NULL,           0,                 NULL, 0},
+};
+
+static int64_t elapsed_us(const struct timespec *from,
+    const struct timespec *to) {
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+      (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int cmp_rec(const void *a, const void *b) {
+  const struct capture_rec *ra = a;
+  const struct capture_rec *rb = b;
+
+  return ra->ts_us < rb->ts_us ? -1 : ra->ts_us > rb->ts_us;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+  int64_t ia = *(const int64_t *)a;
+  int64_t ib = *(const int64_t *)b;
+
+  return ia < ib ? -1 : ia > ib;
+}
+
+static void dispatch(struct iomux_ctx *ctx);
+
+/* complete a request, and send the next ones that are due */
+static void finish(struct iomux_ctx *ctx, struct conn *c, int failed) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (failed) {
+    nfailed_++;
+  } else {
+    latencies_[ncompleted_++] = elapsed_us(&c->sent, &now);
+  }
+
+  if (c->out.fd >= 0) {
+    iomux_close_source(ctx, &c->out);
+    c->out.fd = -1;
+  }
+
+  if (c->h.fd >= 0 && iomux_close_source(ctx, &c->h) < 0) {
+    perror("iomux_close_source");
+  }
+
+  c->h.fd = -1;
+  c->next = freeconns_;
+  freeconns_ = c;
+  ninflight_--;
+  dispatch(ctx);
+}
+
+/* write as much of the request as the socket takes. Returns 1 when the
+ * request is written, 0 if more remains and -1 on error */
+static int send_request(struct conn *c) {
+  ssize_t n;
+
+  while (c->off < c->rec->len) {
+    n = send(c->h.fd, c->rec->data + c->off, c->rec->len - c->off,
+        MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    } else if (n < 0) {
+      return -1;
+    }
+    c->off += n;
+  }
+
+  /* as a client that has nothing more to send */
+  shutdown(c->h.fd, SHUT_WR);
+  return 1;
+}
+
+static void on_writable(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct conn *c = (struct conn *)((char *)h - offsetof(struct conn, out));
+  int ret;
+
+  ret = send_request(c);
+  if (ret < 0) {
+    finish(ctx, c, 1);
+  } else if (ret > 0) {
+    iomux_close_source(ctx, &c->out);
+    c->out.fd = -1;
+  }
+}
+
+static void on_response(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct conn *c = (struct conn *)h;
+  char buf[8192];
+  ssize_t n;
+
+  n = recv(h->fd, buf, sizeof(buf), 0);
+  if (n > 0) {
+    nbytes_ += n;
+  } else if (n == 0) {
+    finish(ctx, c, 0);
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    finish(ctx, c, 1);
+  }
+}
+
+static int connect_socket(void) {
+  struct sockaddr_un addr = {0};
+  int flags;
+  int fd;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+    goto fail;
+  }
+
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path_, sizeof(addr.sun_path) - 1);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+      errno != EINPROGRESS) {
+    goto fail;
+  }
+
+  return fd;
+fail:
+  close(fd);
+  return -1;
+}
+
+static void start(struct iomux_ctx *ctx, const struct capture_rec *rec) {
+  struct conn *c = freeconns_;
+  int ret;
+
+  freeconns_ = c->next;
+  ninflight_++;
+  c->rec = rec;
+  c->off = 0;
+  c->out.fd = -1;
+  clock_gettime(CLOCK_MONOTONIC, &c->sent);
+  c->h.fd = connect_socket();
+  c->h.source_func = on_response;
+  if (c->h.fd >= 0 && iomux_add_source(ctx, &c->h) < 0) {
+    close(c->h.fd);
+    c->h.fd = -1;
+  }
+
+  ret = c->h.fd >= 0 ? send_request(c) : -1;
+  if (ret < 0) {
+    finish(ctx, c, 1);
+  } else if (ret == 0) {
+    c->out.fd = fcntl(c->h.fd, F_DUPFD_CLOEXEC, 0);
+    c->out.source_func = on_writable;
+    if (c->out.fd < 0) {
+      finish(ctx, c, 1);
+    } else if (iomux_add_sink(ctx, &c->out) < 0) {
+      close(c->out.fd);
+      c->out.fd = -1;
+      finish(ctx, c, 1);
+    }
+  }
+}
+
+/* send the requests that are due, as connections allow. The time of a
+ * request is its time in the capture since the first request, divided
+ * by the speed */
+static void dispatch(struct iomux_ctx *ctx) {
+  struct timespec now;
+  int64_t elapsed;
+
+  /* requests that fail at once are finished from within the loop */
+  if (dispatching_) {
+    return;
+  }
+
+  dispatching_ = 1;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = elapsed_us(&start_, &now);
+  while (next_ < nrecs_ && freeconns_ != NULL && (speed_ == 0 ||
+      (recs_[next_].ts_us - recs_[0].ts_us) / speed_ <= elapsed)) {
+    start(ctx, &recs_[next_++]);
+  }
+
+  dispatching_ = 0;
+  if (next_ == nrecs_ && ninflight_ == 0 && ticker_.fd >= 0) {
+    iomux_close_source(ctx, &ticker_);
+    ticker_.fd = -1;
+  }
+}
+
+static void on_tick(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  dispatch(ctx);
+}
+
+static void report(const struct timespec *end) {
+  size_t hist[NBUCKETS] = {0};
+  double secs;
+  size_t maxcount = 0;
+  size_t i;
+  int last;
+  int b;
+
+  secs = elapsed_us(&start_, end) / 1e6;
+  printf("requests=%zu completed=%zu failed=%zu elapsed_s=%.3f "
+      "rps=%.1f bytes=%llu\n", nrecs_, ncompleted_, nfailed_, secs,
+      secs > 0 ? ncompleted_ / secs : 0.0, (unsigned long long)nbytes_);
+  if (ncompleted_ == 0) {
+    return;
+  }
+
+  qsort(latencies_, ncompleted_, sizeof(*latencies_), cmp_int64);
+  printf("latency_us min=%lld p50=%lld p90=%lld p99=%lld p999=%lld "
+      "max=%lld\n", (long long)latencies_[0],
+      (long long)latencies_[ncompleted_ * 50 / 100],
+      (long long)latencies_[ncompleted_ * 90 / 100],
+      (long long)latencies_[ncompleted_ * 99 / 100],
+      (long long)latencies_[ncompleted_ * 999 / 1000],
+      (long long)latencies_[ncompleted_ - 1]);
+
+  for (i = 0; i < ncompleted_; i++) {
+    for (b = 0; b < NBUCKETS - 1 && latencies_[i] >= (2LL << b); b++);
+    hist[b]++;
+    maxcount = MAX(maxcount, hist[b]);
+  }
+
+  /* one line per bucket, from the first to the last non-empty one */
+  for (b = 0; hist[b] == 0; b++);
+  for (last = NBUCKETS - 1; hist[last] == 0; last--);
+  for (; b <= last; b++) {
+    printf("  < %10lld us %8zu %.*s\n", 2LL << b, hist[b],
+        (int)(hist[b] * 50 / maxcount), "##################################"
+        "################");
+  }
+}
+
+static int replay(int nconcurrent) {
+  struct iomux_ctx ctx;
+  struct timespec end;
+  int status = EXIT_FAILURE;
+  int i;
+
+  conns_ = calloc(nconcurrent, sizeof(struct conn));
+  latencies_ = calloc(MAX(nrecs_, 1), sizeof(int64_t));
+  if (conns_ == NULL || latencies_ == NULL) {
+    perror("calloc");
+    goto done;
+  }
+
+  nconns_ = nconcurrent;
+  for (i = nconns_ - 1; i >= 0; i--) {
+    conns_[i].next = freeconns_;
+    freeconns_ = &conns_[i];
+  }
+
+  if (iomux_init(&ctx) < 0) {
+    perror("iomux_init");
+    goto done;
+  }
+
+  ticker_.source_func = on_tick;
+  if (iomux_add_timer(&ctx, &ticker_, TICK_MS) < 0) {
+    perror("iomux_add_timer");
+    goto iomux_cleanup;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start_);
+  dispatch(&ctx);
+  if (iomux_run(&ctx) == 0) {
+    status = EXIT_SUCCESS;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  report(&end);
+iomux_cleanup:
+  iomux_cleanup(&ctx);
+done:
+  free(conns_);
+  free(latencies_);
+  return status;
+}
+
+int hexec_replay_main(int argc, char *argv[]) {
+  struct capture c;
+  struct capture_rec rec;
+  struct capture_rec *recs;
+  size_t cap = 0;
+  const char *argv0 = argv[0];
+  int nconcurrent = DEFAULT_NCONCURRENT;
+  int status = EXIT_FAILURE;
+  char *end;
+  int ret;
+
+  speed_ = 1;
+  while ((ret = getopt_long(argc, argv, optstr_, options_, NULL)) != -1) {
+    switch (ret) {
+    case 's':
+      if (strcmp(optarg, "max") == 0) {
+        speed_ = 0;
+        break;
+      }
+
+      speed_ = strtod(optarg, &end);
+      if (*end != '\0' || !(speed_ > 0)) {
+        fprintf(stderr, "speed: invalid value\n");
+        goto usage;
+      }
+      break;
+    case 'n':
+      nconcurrent = (int)strtol(optarg, &end, 10);
+      if (*end != '\0' || nconcurrent <= 0) {
+        fprintf(stderr, "nconcurrent: invalid value\n");
+        goto usage;
+      }
+      break;
+    case 'h':
+    default:
+      goto usage;
+    }
+  }
+
+  argv += optind;
+  argc -= optind;
+  if (argc != 2) {
+    goto usage;
+  }
+
+  if (capture_load(&c, argv[0]) < 0) {
+    perror(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  while ((ret = capture_next(&c, &rec)) == 1) {
+    if (nrecs_ == cap) {
+      cap = cap > 0 ? cap * 2 : 1024;
+      recs = realloc(recs_, cap * sizeof(*recs_));
+      if (recs == NULL) {
+        perror("realloc");
+        goto cleanup;
+      }
+      recs_ = recs;
+    }
+    recs_[nrecs_++] = rec;
+  }
+
+  if (ret < 0) {
+    fprintf(stderr, "%s: truncated record, replaying %zu records\n",
+        argv[0], nrecs_);
+  }
+
+  /* records are appended by children, in roughly the order of accept */
+  qsort(recs_, nrecs_, sizeof(*recs_), cmp_rec);
+  path_ = argv[1];
+  status = replay(nconcurrent);
+cleanup:
+  free(recs_);
+  capture_cleanup(&c);
+  return status;
+usage:
+  fprintf(stderr,
+      "usage: %s [opts] <capture> <socket>\n"
+      "opts:\n"
+      "  -s, --speed <x>              Replay at x times the recorded pace,\n"
+      "                               or max for as fast as possible\n"
+      "                               (default: 1)\n"
+      "  -n, --nconcurrent <n>        Max # of requests in flight\n"
+      "                               (default: %d)\n"
+      "  -h, --help                   This text\n"
+      , argv0, DEFAULT_NCONCURRENT);
+  return EXIT_FAILURE;
+}
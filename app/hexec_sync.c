@@ -20,22 +20,147 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <limits.h>
+#include <time.h>
 
+#include "lib/accesslog.h"
+#include "lib/budget.h"
+#include "lib/capture.h"
+#include "lib/climit.h"
+#include "lib/envbuf.h"
+#include "lib/errlog.h"
+#include "lib/exefile.h"
+#include "lib/pipeline.h"
 #include "lib/fs.h"
+#include "lib/iomux.h"
+#include "lib/macros.h"
+#include "lib/placement.h"
+#include "lib/pressure.h"
+#include "lib/proc.h"
+#include "lib/scgi.h"
+#include "lib/spool.h"
+#include "lib/sweep.h"
+#include "lib/trace.h"
+#include "app/hexec_reload.h"
+#include "app/hexec_batch.h"
+#include "app/hexec_coalesce.h"
+#include "app/hexec_conn.h"
+#include "app/hexec_fanout.h"
+#include "app/hexec_jobs.h"
+#include "app/hexec_lanes.h"
+#include "app/hexec_peers.h"
 #include "app/hexec_sync.h"
 
 #define DEFAULT_BACKLOG        SOMAXCONN
 #define DEFAULT_SYNC_TIMEOUT   10
 #define DEFAULT_NCONCURRENT    64
+#define ADAPTIVE_INITIAL       4 /* initial adaptive concurrency limit */
+#define DEFAULT_PRESSURE_INTERVAL   1000 /* ms */
+#define DEFAULT_PRESSURE_HYSTERESIS 20   /* % */
+
+/* per-request environment variables set by hexec, and their total size */
+#define ENV_NSLOTVARS          8
+#define ENV_SLOTSIZE           512
+
+/* long-only options */
+#define OPT_ACCESS_LOG_FORMAT  256
+#define OPT_ACCESS_LOG_SIZE    257
+#define OPT_ADAPTIVE           258
+#define OPT_MAX_CPU_PRESSURE   259
+#define OPT_MAX_MEM_PRESSURE   260
+#define OPT_MAX_IO_PRESSURE    261
+#define OPT_MIN_MEM_AVAILABLE  262
+#define OPT_PRESSURE_HYSTERESIS 263
+#define OPT_PRESSURE_INTERVAL  264
+#define OPT_SHED               265
+#define OPT_COALESCE           266
+#define OPT_COALESCE_MAX_KEYS  267
+#define OPT_COALESCE_MAX_WAITERS 268
+#define OPT_BATCH              269
+#define OPT_BATCH_LINGER       270
+#define OPT_WORKER             271
+#define OPT_WORKER_MAX_REQUESTS 272
+#define OPT_WORKER_IDLE        273
+#define OPT_SPOOL              274
+#define OPT_SPOOL_MAX_AGE      275
+#define OPT_SPOOL_THREADS      276
+#define OPT_CPUS               277
+#define OPT_CPU_PLACEMENT      278
+#define OPT_SUPERVISOR_CPU     279
+#define OPT_SCHED              280
+#define OPT_SCHED_HEADER       281
+#define OPT_SCHED_CLASS        282
+#define OPT_LANE               283
+#define OPT_LANE_HEADER        284
+#define OPT_LANE_MAX_QUEUED    285
+#define OPT_LANE_STATS         286
+#define OPT_TRACE              287
+#define OPT_TRACE_SAMPLE       288
+#define OPT_BUDGET             289
+#define OPT_BUDGET_LIMIT       290
+#define OPT_BUDGET_WEIGHT      291
+#define OPT_STDERR_LOG         292
+#define OPT_STDERR_MAX_BYTES   293
+#define OPT_STDERR_RATE        294
+#define OPT_RECORD             295
+#define OPT_RECORD_SAMPLE      296
+#define OPT_DEADLINE           297
+#define OPT_DEADLINE_HEADER    298
+#define OPT_EVENT_BATCH        299
+#define OPT_BUSY_POLL          300
+#define OPT_FANOUT_HEADER      301
+#define OPT_FANOUT_MAX         302
+#define OPT_FANOUT_ORDER       303
+#define OPT_FANOUT_PARTIAL     304
+#define OPT_FANOUT_TIMEOUT     305
+#define OPT_STAGE              306
+#define OPT_PIPE_SIZE          307
+#define OPT_PEER_LISTEN        308
+#define OPT_PEER               309
+#define OPT_JOBS               310
+#define OPT_JOBS_MAX_DONE      311
+
+#define BUDGET_INTERVAL        100 /* ms, between retries of the budget */
+#define BUDGET_RECLAIM_TICKS   10  /* intervals between reclaims */
+
+#define DEFAULT_SPOOL_MAX_AGE  86400 /* seconds */
+#define DEFAULT_SPOOL_THREADS  2
+#define SPOOL_NAMESZ           48
+#define SPOOL_MAXPATH          256
+
+/* max size of a job request, written to the spool */
+#define JOB_MAXREQ             ((size_t)SSIZE_MAX)
+
+/* max size of stderr output read from a child per event */
+#define STDERR_READSIZE        4096
+
+/* max size of the request headers read to choose a scheduling class */
+#define SCHED_PEEKSIZE         8192
+
+/* response to connections shed under pressure */
+#define SHED_RESPONSE \
+    "Status: 503 Service Unavailable\r\nRetry-After: 1\r\n\r\n"
+
+/* the scheduling class of requests with a value of the sched header */
+struct sched_rule {
+  const char *value;
+  size_t valuelen;
+  struct placement_class class;
+};
 
 struct opts {
   char **argv;
@@ -44,37 +169,1231 @@ struct opts {
   int backlog;
   int timeout;
   int nconcurrent;
+  int adaptive;
+  struct pressure_limits pressure;
+  int pressure_interval;
+  int shed;
+  const char *coalesce;
+  int coalesce_max_keys;
+  int coalesce_max_waiters;
+  int batch;
+  int batch_linger;
+  int worker;
+  int worker_max_requests;
+  int worker_idle;
+  const char *spool;
+  int spool_max_age;
+  int spool_threads;
+  const char *cpus;
+  int cpu_placement;
+  int supervisor_cpu;
+  int sched_set;
+  struct placement_class sched;
+  const char *sched_header;
+  struct sched_rule *sched_rules;
+  int nsched_rules;
+  const char *lane_header;
+  int lane_max_queued;
+  int lane_stats;
+  int env_clear;
+  const char **envs;
+  int nenvs;
+  const char *access_log;
+  int access_log_format;
+  int access_log_size;
+  const char *trace;
+  int trace_sample;
+  const char *budget;
+  int budget_limit;
+  int budget_weight;
+  const char *stderr_log;
+  int stderr_max_bytes;
+  int stderr_rate;
+  const char *record;
+  int record_sample;
+  int deadline;
+  const char *deadline_header;
+  int event_batch;
+  int busy_poll;
+  const char *fanout_header;
+  int fanout_max;
+  int fanout_order;
+  int fanout_partial;
+  int fanout_timeout;
+  struct pipeline pipeline;
+  int pipe_size;
+  const char *peer_listen;
+  const char *jobs;
+  int jobs_max_done;
 };
 
-static const char *optstr_ = "l:b:t:n:h";
+static const char *optstr_ = "l:b:t:n:Ee:a:h";
 
 static struct option options_[] = {
   {"listen",       required_argument, NULL, 'l'},
   {"backlog",      required_argument, NULL, 'b'},
   {"timeout",      required_argument, NULL, 't'},
   {"nconcurrent",  required_argument, NULL, 'n'},
+  {"adaptive",     no_argument,       NULL, OPT_ADAPTIVE},
+  {"max-cpu-pressure",    required_argument, NULL, OPT_MAX_CPU_PRESSURE},
+  {"max-memory-pressure", required_argument, NULL, OPT_MAX_MEM_PRESSURE},
+  {"max-io-pressure",     required_argument, NULL, OPT_MAX_IO_PRESSURE},
+  {"min-mem-available",   required_argument, NULL, OPT_MIN_MEM_AVAILABLE},
+  {"pressure-hysteresis", required_argument, NULL, OPT_PRESSURE_HYSTERESIS},
+  {"pressure-interval",   required_argument, NULL, OPT_PRESSURE_INTERVAL},
+  {"shed",         no_argument,       NULL, OPT_SHED},
+  {"coalesce",     required_argument, NULL, OPT_COALESCE},
+  {"coalesce-max-keys",    required_argument, NULL, OPT_COALESCE_MAX_KEYS},
+  {"coalesce-max-waiters", required_argument, NULL, OPT_COALESCE_MAX_WAITERS},
+  {"batch",        required_argument, NULL, OPT_BATCH},
+  {"batch-linger", required_argument, NULL, OPT_BATCH_LINGER},
+  {"worker",       no_argument,       NULL, OPT_WORKER},
+  {"worker-max-requests", required_argument, NULL, OPT_WORKER_MAX_REQUESTS},
+  {"worker-idle",  required_argument, NULL, OPT_WORKER_IDLE},
+  {"spool",        required_argument, NULL, OPT_SPOOL},
+  {"spool-max-age", required_argument, NULL, OPT_SPOOL_MAX_AGE},
+  {"spool-threads", required_argument, NULL, OPT_SPOOL_THREADS},
+  {"cpus",         required_argument, NULL, OPT_CPUS},
+  {"cpu-placement", required_argument, NULL, OPT_CPU_PLACEMENT},
+  {"supervisor-cpu", required_argument, NULL, OPT_SUPERVISOR_CPU},
+  {"sched",        required_argument, NULL, OPT_SCHED},
+  {"sched-header", required_argument, NULL, OPT_SCHED_HEADER},
+  {"sched-class",  required_argument, NULL, OPT_SCHED_CLASS},
+  {"lane",         required_argument, NULL, OPT_LANE},
+  {"lane-header",  required_argument, NULL, OPT_LANE_HEADER},
+  {"lane-max-queued", required_argument, NULL, OPT_LANE_MAX_QUEUED},
+  {"lane-stats",   required_argument, NULL, OPT_LANE_STATS},
+  {"env-clear",    no_argument,       NULL, 'E'},
+  {"env",          required_argument, NULL, 'e'},
+  {"access-log",   required_argument, NULL, 'a'},
+  {"access-log-format", required_argument, NULL, OPT_ACCESS_LOG_FORMAT},
+  {"access-log-size",   required_argument, NULL, OPT_ACCESS_LOG_SIZE},
+  {"trace",        required_argument, NULL, OPT_TRACE},
+  {"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+  {"budget",       required_argument, NULL, OPT_BUDGET},
+  {"budget-limit", required_argument, NULL, OPT_BUDGET_LIMIT},
+  {"budget-weight", required_argument, NULL, OPT_BUDGET_WEIGHT},
+  {"stderr-log",   required_argument, NULL, OPT_STDERR_LOG},
+  {"stderr-max-bytes", required_argument, NULL, OPT_STDERR_MAX_BYTES},
+  {"stderr-rate",  required_argument, NULL, OPT_STDERR_RATE},
+  {"record",       required_argument, NULL, OPT_RECORD},
+  {"record-sample", required_argument, NULL, OPT_RECORD_SAMPLE},
+  {"deadline",     required_argument, NULL, OPT_DEADLINE},
+  {"deadline-header", required_argument, NULL, OPT_DEADLINE_HEADER},
+  {"event-batch",  required_argument, NULL, OPT_EVENT_BATCH},
+  {"busy-poll",    required_argument, NULL, OPT_BUSY_POLL},
+  {"fanout-header", required_argument, NULL, OPT_FANOUT_HEADER},
+  {"fanout-max",   required_argument, NULL, OPT_FANOUT_MAX},
+  {"fanout-order", required_argument, NULL, OPT_FANOUT_ORDER},
+  {"fanout-partial", required_argument, NULL, OPT_FANOUT_PARTIAL},
+  {"fanout-timeout", required_argument, NULL, OPT_FANOUT_TIMEOUT},
+  {"stage",        required_argument, NULL, OPT_STAGE},
+  {"pipe-size",    required_argument, NULL, OPT_PIPE_SIZE},
+  {"peer-listen",  required_argument, NULL, OPT_PEER_LISTEN},
+  {"peer",         required_argument, NULL, OPT_PEER},
+  {"jobs",         required_argument, NULL, OPT_JOBS},
+  {"jobs-max-done", required_argument, NULL, OPT_JOBS_MAX_DONE},
   {"help",         no_argument,       NULL, 'h'},
   {NULL,           0,                 NULL, 0},
 };
 
-static volatile sig_atomic_t got_sigchld_;
+/* the read end of the stderr pipe of a child, with --stderr-log */
+struct errpipe {
+  struct iomux_handler h;   /* must be first */
+  struct errlog_stream s;
+};
+
+/* a duplicate of the connection of a child, watched by hexec until its
+ * request has arrived to be recorded, with --record */
+struct recorder {
+  struct iomux_handler h;   /* must be first */
+  const struct timespec *conn;
+};
+
+/* a child slot is free if its pid is 0. Children inherited on reload
+ * have a reqid of 0 and no timestamps */
+struct child {
+  struct iomux_handler h;   /* process descriptor, must be first */
+  pid_t pid;
+  uint64_t reqid;
+  int limit;                /* concurrency limit at accept */
+  struct timespec conn;     /* CLOCK_REALTIME, at accept */
+  struct timespec ready;    /* CLOCK_MONOTONIC, listener readable */
+  struct timespec accepted; /* CLOCK_MONOTONIC, at accept */
+  struct timespec spawned;  /* CLOCK_MONOTONIC, after fork */
+  int spooled;              /* has a spool directory */
+  int cpu;                  /* placement, or -1 */
+  int lane;                 /* priority lane, or -1 */
+  int shard;                /* fan-out token, or -1 */
+  int relay;                /* output pipe read by hexec, or -1 */
+  int64_t bytes;            /* output read by hexec, -1 if not relayed */
+  char job[SPOOL_NAMESZ];   /* job ID, or empty */
+  struct errpipe err;       /* fd is -1 unless stderr is captured */
+  struct recorder rec;      /* fd is -1 unless waiting to record */
+};
+
+/* a shard of a fan-out request */
+struct shard {
+  int token;
+  int index;
+  int count;
+};
+
+struct listener {
+  struct iomux_handler h;   /* must be first */
+  struct opts *opts;
+  int enabled;
+};
+
+static int sigpipe_[2] = {-1, -1}; /* written to by signal handlers */
+
+static struct child *children_;
+static int nslots_;
+static int *freeslots_; /* stack of free slot indices */
+static int nfree_;
 static int nchildren_;
+static struct envbuf env_;
+static uint64_t nrequests_;
+static struct accesslog *accesslog_;
+static struct accesslog *tracelog_; /* NULL unless --trace */
+static struct errlog *errlog_; /* NULL unless --stderr-log */
+static int record_fd_ = -1; /* capture, unless -1 */
+static struct listener listener_;
+static struct climit *climit_; /* NULL unless --adaptive */
+static struct pressure *pressure_; /* NULL unless pressure is checked */
+static int overloaded_;
+static int reload_pending_; /* reload once no connections are held */
+static struct spool *spool_; /* NULL unless --spool */
+static struct sweep *sweep_;
+static uint64_t spool_epoch_; /* distinguishes names across reloads */
+static struct placement *placement_; /* NULL unless children are placed */
+static struct budget *budget_; /* NULL unless --budget */
+static int prepaid_; /* a budget slot was taken for the next spawn */
+static const struct shard *shard_; /* the next spawn is a shard, if set */
+static int job_; /* the next spawn is a job */
+static int relay_ = -1; /* hexec reads the output of the next spawn here */
+static int budget_ticks_;
+static struct exefile exe_ = {NULL, NULL, -1, -1}; /* executable of children */
+
+static int64_t elapsed_us(const struct timespec *from,
+    const struct timespec *to) {
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+      (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static int64_t timeval_us(const struct timeval *tv) {
+  return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static int set_nonblock_cloexec(int fd) {
+  int flags;
+
+  flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+      fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static void on_child_exit(struct iomux_ctx *ctx, struct iomux_handler *h);
+
+static void add_child(int slot, pid_t pid, int pfd) {
+  children_[slot].h.source_func = on_child_exit;
+  children_[slot].h.fd = pfd;
+  children_[slot].pid = pid;
+  nchildren_++;
+}
+
+static void remove_child(int slot) {
+  if (placement_ != NULL) {
+    placement_put(placement_, children_[slot].cpu);
+  }
+
+  if (budget_ != NULL) {
+    budget_give(budget_);
+  }
+
+  children_[slot].pid = 0;
+  children_[slot].h.fd = -1;
+  freeslots_[nfree_++] = slot;
+  nchildren_--;
+}
+
+static void spool_name(uint64_t reqid, char *buf) {
+  snprintf(buf, SPOOL_NAMESZ, "%llx-%llu", (unsigned long long)spool_epoch_,
+      (unsigned long long)reqid);
+}
+
+/* creates the spool directory of a request. Returns 0 on success, -1 on
+ * error */
+static int mkspool(uint64_t reqid, char *path) {
+  char name[SPOOL_NAMESZ];
+
+  spool_name(reqid, name);
+  if (spool_mkdir(spool_, name, 0700) < 0 ||
+      spool_path(spool_, name, path, SPOOL_MAXPATH) < 0) {
+    perror("spool");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* spool directories are removed in the background. If the sweeper is
+ * busy, they are left to expire */
+static void remove_spool(const char *name) {
+  int dirfd;
+
+  dirfd = spool_dirfd(spool_, name);
+  if (dirfd >= 0) {
+    sweep_remove(sweep_, dirfd, name);
+  }
+}
+
+static void rmspool(uint64_t reqid) {
+  char name[SPOOL_NAMESZ];
+
+  spool_name(reqid, name);
+  remove_spool(name);
+}
+
+/* the interval of expiry scans of the spool, and of refreshes of the
+ * spool directories of running children, for a max age of 'max_age'
+ * seconds */
+static int spool_interval_ms(int max_age) {
+  return MIN(max_age, 120) * 500;
+}
 
-static int mask_sigchld(int how) {
-  sigset_t sigmask;
+/* spool directories expire by mtime, so the directories of running
+ * children, e.g., of long-lived workers, are touched to keep them.
+ * Children inherited on reload are not known by their directories,
+ * which expire as leftovers */
+static void on_spool_refresh(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  char name[SPOOL_NAMESZ];
+  int dirfd;
+  int i;
 
-  sigemptyset(&sigmask);
-  sigaddset(&sigmask, SIGCHLD);
-  return sigprocmask(how, &sigmask, NULL);
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].pid <= 0 || !children_[i].spooled) {
+      continue;
+    }
+
+    spool_name(children_[i].reqid, name);
+    dirfd = spool_dirfd(spool_, name);
+    if (dirfd < 0 || utimensat(dirfd, name, NULL, 0) < 0) {
+      fprintf(stderr, "spool %s: %s\n", name, strerror(errno));
+    }
+  }
+}
+
+/* set up the per-request environment of a slot. Does not allocate */
+static char **slot_envp(int slot, uint64_t reqid, const char *spool,
+    const struct shard *shard) {
+  char reqidstr[24];
+  char num[12];
+
+  snprintf(reqidstr, sizeof(reqidstr), "%llu", (unsigned long long)reqid);
+  envbuf_slot_reset(&env_, slot);
+  envbuf_slot_set(&env_, slot, "HEXEC_REQUEST_ID", reqidstr);
+  if (spool != NULL) {
+    envbuf_slot_set(&env_, slot, "HEXEC_SPOOL", spool);
+  }
+  if (shard != NULL) {
+    snprintf(num, sizeof(num), "%d", shard->index);
+    envbuf_slot_set(&env_, slot, "HEXEC_SHARD", num);
+    snprintf(num, sizeof(num), "%d", shard->count);
+    envbuf_slot_set(&env_, slot, "HEXEC_SHARDS", num);
+  }
+  return envbuf_slot_envp(&env_, slot);
+}
+
+/* returns the scheduling class of the request on connection 'fd', by
+ * the value of the sched header, or the default class. Called in the
+ * child, where it may block: the headers are peeked at, and waited for
+ * until they have arrived, for at most HEXEC_CONN_WAIT_MS. Requests
+ * whose header is incomplete then are of the default class */
+static const struct placement_class *classify(struct opts *opts, int fd) {
+  static const struct timespec retry = {0, 1000000};
+  char buf[SCHED_PEEKSIZE];
+  struct scgi_header hdr;
+  const char *value;
+  ssize_t n;
+  int ret = 0;
+  int i;
+
+  for (i = 0; i < HEXEC_CONN_WAIT_MS; i++) {
+    n = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+        errno == EINTR)) {
+      ret = 0;
+    } else {
+      ret = n > 0 ? scgi_parse(buf, n, &hdr) : -1;
+    }
+
+    if (ret != 0 || n == sizeof(buf)) {
+      break;
+    }
+
+    nanosleep(&retry, NULL);
+  }
+
+  value = ret == 1 ? scgi_get(&hdr, opts->sched_header) : NULL;
+  for (i = 0; value != NULL && i < opts->nsched_rules; i++) {
+    if (strlen(value) == opts->sched_rules[i].valuelen && strncmp(value,
+        opts->sched_rules[i].value, opts->sched_rules[i].valuelen) == 0) {
+      return &opts->sched_rules[i].class;
+    }
+  }
+
+  return opts->sched_set ? &opts->sched : NULL;
+}
+
+/* record the request on connection 'fd', accepted at 'conn', to the
+ * capture, if it has arrived. Runs in hexec, without blocking: the
+ * request is peeked at, since the child reads it. Returns 0 if nothing
+ * has arrived yet, and 1 otherwise. Requests that are incomplete when
+ * first seen, larger than a record, or without a valid CONTENT_LENGTH,
+ * are not recorded */
+static int record(int fd, const struct timespec *conn) {
+  static char buf[CAPTURE_MAXSIZE];
+  struct scgi_header hdr;
+  size_t len;
+  ssize_t n;
+
+  n = recv(fd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  } else if (n <= 0 || scgi_parse(buf, n, &hdr) != 1) {
+    return 1;
+  }
+
+  len = scgi_request_len(&hdr, sizeof(buf));
+  if (len > 0 && len <= (size_t)n && capture_write(record_fd_,
+      (int64_t)conn->tv_sec * 1000000 + conn->tv_nsec / 1000, buf,
+      len) < 0) {
+    perror("record");
+  }
+
+  return 1;
+}
+
+static void stop_record(struct iomux_ctx *ctx, struct recorder *rec) {
+  if (iomux_close_source(ctx, &rec->h) < 0) {
+    perror("iomux_close_source");
+  }
+
+  rec->h.fd = -1;
+}
+
+/* the request of a child arrived after the child was spawned. It is
+ * recorded unless the child read it first */
+static void on_record(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct recorder *rec = (struct recorder *)h;
+
+  /* closed by on_child_exit, for an event of the same iteration */
+  if (h->fd < 0) {
+    return;
+  }
+
+  if (record(h->fd, rec->conn) != 0) {
+    stop_record(ctx, rec);
+  }
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
 }
 
-static void on_accept(struct opts *opts, int fd) {
+/* read the complete request on connection 'fd' into the request file of
+ * spool directory 'dir', and reply with the ID of job 'id'. Called in
+ * the child, where it may block. Returns the request file, at offset 0,
+ * or -1 on error */
+static int read_job(int fd, const char *dir, const char *id) {
+  char buf[SCHED_PEEKSIZE];
+  char path[SPOOL_MAXPATH];
+  struct scgi_header hdr;
+  size_t len = 0;
+  size_t nread = 0;
+  ssize_t n;
+  int rfd;
   int ret;
+
+  snprintf(path, sizeof(path), "%s/request", dir);
+  rfd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (rfd < 0) {
+    return -1;
+  }
+
+  /* the header is read until complete, and its length plus the content
+   * length is the size of the request. Requests without a valid content
+   * length fail */
+  while (len == 0) {
+    n = nread < sizeof(buf) ? read(fd, buf + nread, sizeof(buf) - nread) : 0;
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      goto fail;
+    }
+
+    nread += n;
+    ret = scgi_parse(buf, nread, &hdr);
+    if (ret == 1) {
+      len = scgi_request_len(&hdr, JOB_MAXREQ);
+    }
+
+    if (ret < 0 || (ret == 1 && (len == 0 || len > JOB_MAXREQ))) {
+      errno = EINVAL;
+      goto fail;
+    }
+  }
+
+  if (write_all(rfd, buf, MIN(nread, len)) < 0) {
+    goto fail;
+  }
+
+  while (nread < len) {
+    n = read(fd, buf, MIN(sizeof(buf), len - nread));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0 || write_all(rfd, buf, n) < 0) {
+      goto fail;
+    }
+    nread += n;
+  }
+
+  n = snprintf(buf, sizeof(buf), "Status: 202 Accepted\r\n"
+      "Content-Type: text/plain\r\nX-Hexec-Job: %s\r\n\r\n%s\n", id, id);
+  if (write_all(fd, buf, n) < 0 || lseek(rfd, 0, SEEK_SET) < 0) {
+    goto fail;
+  }
+
+  return rfd;
+fail:
+  close(rfd);
+  return -1;
+}
+
+/* returns the current concurrency limit */
+static int max_children(void) {
+  if (climit_ != NULL) {
+    return climit_get(climit_);
+  }
+
+  return listener_.opts->nconcurrent;
+}
+
+/* log an exited child, and trace it if it is sampled. 'exited' is when
+ * the exit was noticed, and 'now' when the child was reaped */
+static void log_child(struct child *child, int status,
+    const struct rusage *ru, const struct timespec *exited,
+    const struct timespec *now) {
+  struct accesslog_rec rec;
+  int traced;
+
+  traced = tracelog_ != NULL &&
+      child->reqid % listener_.opts->trace_sample == 0;
+  if ((accesslog_ == NULL && !traced) || child->reqid == 0) {
+    return;
+  }
+
+  rec.reqid = child->reqid;
+  rec.limit = child->limit;
+  rec.conn = child->conn;
+  rec.queue_us = elapsed_us(&child->ready, &child->accepted);
+  rec.spawn_us = elapsed_us(&child->accepted, &child->spawned);
+  rec.wall_us = elapsed_us(&child->spawned, exited);
+  rec.reap_us = elapsed_us(exited, now);
+  rec.utime_us = timeval_us(&ru->ru_utime);
+  rec.stime_us = timeval_us(&ru->ru_stime);
+  rec.maxrss_kb = ru->ru_maxrss;
+  rec.bytes = child->bytes;
+  rec.pid = child->pid;
+  rec.slot = child - children_;
+  rec.lane = child->lane >= 0 ? hexec_lanes_name(child->lane) : NULL;
+  if (WIFSIGNALED(status)) {
+    rec.status = -1;
+    rec.signal = WTERMSIG(status);
+  } else {
+    rec.status = WEXITSTATUS(status);
+    rec.signal = 0;
+  }
+
+  if (accesslog_ != NULL) {
+    accesslog_push(accesslog_, &rec);
+  }
+
+  if (traced) {
+    accesslog_push(tracelog_, &rec);
+  }
+}
+
+/* returns 1 if requests are read by hexec and run by batch children or
+ * workers */
+static int batching(void) {
+  return listener_.opts->batch > 0 || listener_.opts->worker;
+}
+
+/* returns 1 if requests are queued in priority lanes by hexec */
+static int laning(void) {
+  return hexec_lanes_nlanes() > 0;
+}
+
+/* returns 1 if requests may be fanned out to shards */
+static int fanning(void) {
+  return listener_.opts->fanout_header != NULL;
+}
+
+/* returns 1 if job requests are answered by hexec, and jobs run in
+ * the background */
+static int jobbing(void) {
+  return listener_.opts->jobs != NULL;
+}
+
+/* returns the number of children that may be spawned within the
+ * host-wide budget */
+static int budget_nfree(void) {
+  return budget_ != NULL ? budget_available(budget_) : INT_MAX;
+}
+
+/* returns 1 if this process can take another connection, to run it or
+ * to queue it */
+static int taking(void) {
+  if (reload_pending_ || overloaded_) {
+    return 0;
+  } else if (batching()) {
+    return hexec_batch_accepting();
+  } else if (laning()) {
+    return hexec_lanes_accepting();
+  } else if (fanning()) {
+    /* shards waiting for a slot go first, and pending connections will
+     * need a slot too */
+    return hexec_fanout_nwaiting() == 0 &&
+        nchildren_ + hexec_fanout_npending() < max_children() &&
+        hexec_fanout_npending() < budget_nfree();
+  } else if (jobbing()) {
+    /* status queries do not need a slot, requests that do are shed
+     * without one */
+    return hexec_jobs_npending() < HEXEC_JOBS_MAXPENDING;
+  }
+
+  /* pending coalesced connections will need a slot too */
+  return nchildren_ + hexec_coalesce_npending() < max_children() &&
+      hexec_coalesce_npending() < budget_nfree();
+}
+
+/* returns 1 if connections should be accepted: to be taken, passed to a
+ * peer or, under pressure, shed. Connections held for lack of a peer
+ * are taken first */
+static int accepting(void) {
+  if (reload_pending_) {
+    return 0;
+  } else if (hexec_peers_nheld() == 0 && taking()) {
+    return 1;
+  }
+
+  return hexec_peers_available() || (overloaded_ && listener_.opts->shed);
+}
+
+/* reply with an error and close a connection without spawning a child.
+ * Does not block */
+static void shed(int fd) {
+  hexec_conn_reply(fd, SHED_RESPONSE, sizeof(SHED_RESPONSE) - 1);
+}
+
+/* accept connections only while there are free child slots */
+static void update_listener(struct iomux_ctx *ctx) {
+  int enable;
+  int ret;
+
+  enable = accepting();
+  if (enable == listener_.enabled) {
+    return;
+  }
+
+  if (enable) {
+    ret = iomux_enable_source(ctx, &listener_.h);
+  } else {
+    ret = iomux_disable_source(ctx, &listener_.h);
+  }
+
+  if (ret < 0) {
+    perror("update_listener");
+    iomux_err(ctx);
+    return;
+  }
+
+  listener_.enabled = enable;
+}
+
+/* read a chunk of stderr output. Returns the number of bytes read, 0 on
+ * end of file or error and -1 if no output is available */
+static ssize_t read_stderr(struct errpipe *ep) {
+  char buf[STDERR_READSIZE];
+  ssize_t n;
+
+  n = read(ep->h.fd, buf, sizeof(buf));
+  if (n > 0) {
+    errlog_write(errlog_, &ep->s, buf, n);
+  } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+      errno == EINTR)) {
+    return -1;
+  } else if (n < 0) {
+    perror("read_stderr");
+    n = 0;
+  }
+
+  return n;
+}
+
+static void close_stderr(struct iomux_ctx *ctx, struct errpipe *ep) {
+  errlog_end(errlog_, &ep->s);
+  if (iomux_close_source(ctx, &ep->h) < 0) {
+    perror("iomux_close_source");
+  }
+  ep->h.fd = -1;
+}
+
+/* output is read in chunks of bounded size, so that a child writing
+ * continuously does not hold up the event loop */
+static void on_stderr(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct errpipe *ep = (struct errpipe *)h;
+
+  /* closed by on_child_exit, for an event of the same iteration */
+  if (h->fd < 0) {
+    return;
+  }
+
+  if (read_stderr(ep) == 0) {
+    close_stderr(ctx, ep);
+  }
+}
+
+/* the pipe of an exited child is read until empty, and closed with its
+ * slot. Output written later, e.g., by its own children, is lost */
+static void drain_stderr(struct iomux_ctx *ctx, struct errpipe *ep) {
+  int i;
+
+  for (i = 0; i < 16 && read_stderr(ep) > 0; i++);
+  close_stderr(ctx, ep);
+}
+
+static void on_child_exit(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct child *child = (struct child *)h;
+  struct timespec exited;
+  struct timespec now;
+  struct rusage ru;
+  int status;
+  int unread;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &exited);
+  TRACE2(exit, child->reqid, child->pid);
+  ret = proc_wait(h->fd, child->pid, &status, &ru);
+  if (ret == 0) {
+    return; /* not exited yet */
+  } else if (ret < 0) {
+    perror("proc_wait");
+    status = 0;
+    memset(&ru, 0, sizeof(ru));
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  TRACE3(reap, child->reqid, child->pid, status);
+
+  /* the lifetime of a worker or a job is not the latency of a request */
+  if (climit_ != NULL && child->reqid != 0 && !listener_.opts->worker &&
+      child->job[0] == '\0') {
+    climit_sample(climit_, elapsed_us(&child->accepted, &now), nchildren_);
+  }
+
+  /* output left in the pipe is relayed after the child */
+  if (child->relay >= 0) {
+    if (ioctl(child->relay, FIONREAD, &unread) == 0) {
+      child->bytes += unread;
+    }
+    child->relay = -1;
+  }
+
+  log_child(child, status, &ru, &exited, &now);
+  if (child->err.h.fd >= 0) {
+    drain_stderr(ctx, &child->err);
+  }
+
+  /* the connection is not held open after the child */
+  if (child->rec.h.fd >= 0) {
+    stop_record(ctx, &child->rec);
+  }
+
+  /* the output of a job is stored, and its spool directory removed */
+  if (child->job[0] != '\0') {
+    hexec_jobs_exited(child->job, status);
+  } else if (child->spooled) {
+    rmspool(child->reqid);
+  }
+
+  if (iomux_close_source(ctx, h) < 0) {
+    perror("iomux_close_source");
+  }
+
+  hexec_lanes_done(child->lane, elapsed_us(&child->spawned, &exited));
+  if (child->shard >= 0) {
+    hexec_fanout_exited(ctx, child->shard, status);
+  }
+
+  remove_child(child - children_);
+  if (batching()) {
+    hexec_batch_kick(ctx);
+  } else if (laning()) {
+    hexec_lanes_kick(ctx);
+  } else if (fanning()) {
+    hexec_fanout_kick(ctx);
+  }
+  hexec_peers_kick(ctx);
+  update_listener(ctx);
+}
+
+/* execute the application, the first stage of a pipeline if any. Only
+ * returns on error */
+static void exec_app(char *const envp[]) {
+  exefile_exec(&exe_, listener_.opts->argv, envp);
+  perror(listener_.opts->argv[0]);
+}
+
+/* spawn a child with 'in', 'out' and 'err' as stdin, stdout and stderr.
+ * 'ready' is when the listener became readable, and 'lane' is the
+ * priority lane of the request or -1. The descriptors are not closed.
+ * Takes a slot of the budget unless prepaid. Returns 0 on success, -1
+ * on error, with errno set to EAGAIN if the budget is exhausted */
+static int spawn(struct iomux_ctx *ctx, int in, int out, int err,
+    const struct timespec *ready, int lane) {
+  struct opts *opts = listener_.opts;
+  struct child *child;
+  const struct placement_class *class;
+  char spool[SPOOL_MAXPATH];
+  char path[SPOOL_MAXPATH + 8];
+  int slot;
+  int pfd;
+  int conn;
+  char **envp;
+  int errp[2] = {-1, -1};
+  int recording;
   pid_t pid;
 
-  for (;;) {
-    ret = accept(fd, NULL, 0);
+  if (budget_ != NULL && !prepaid_ && budget_take(budget_) < 0) {
+    return -1;
+  }
+
+  prepaid_ = 0;
+  slot = freeslots_[--nfree_];
+  child = &children_[slot];
+  child->reqid = ++nrequests_;
+  child->limit = max_children();
+  child->lane = lane;
+  child->ready = *ready;
+  clock_gettime(CLOCK_MONOTONIC, &child->accepted);
+  clock_gettime(CLOCK_REALTIME, &child->conn);
+  TRACE1(spawn_start, child->reqid);
+  child->spooled = spool_ != NULL && mkspool(child->reqid, spool) == 0;
+  child->cpu = placement_ != NULL ? placement_get(placement_) : -1;
+  child->shard = shard_ != NULL ? shard_->token : -1;
+  child->relay = accesslog_ != NULL || tracelog_ != NULL ? relay_ : -1;
+  child->bytes = relay_ >= 0 ? 0 : -1;
+  if (job_ && child->spooled) {
+    spool_name(child->reqid, child->job);
+  } else {
+    child->job[0] = '\0';
+  }
+  envp = slot_envp(slot, child->reqid, child->spooled ? spool : NULL,
+      shard_);
+
+  /* sampled requests are recorded by hexec if they have arrived, or
+   * else watched for until the child has read them */
+  recording = record_fd_ >= 0 && shard_ == NULL &&
+      child->reqid % opts->record_sample == 0 &&
+      record(in, &child->conn) == 0;
+
+  /* captured stderr is not written to the client. Jobs are run from
+   * their spool directory */
+  if (job_ && !child->spooled) {
+    pid = -1;
+  } else if (errlog_ != NULL && (pipe(errp) < 0 ||
+      set_nonblock_cloexec(errp[0]) < 0 ||
+      fcntl(errp[1], F_SETFD, FD_CLOEXEC) < 0)) {
+    perror("pipe");
+    pid = -1;
+  } else if ((pid = proc_fork(&pfd)) < 0) {
+    perror("fork");
+  }
+
+  if (pid < 0) {
+    if (errp[0] >= 0) {
+      close(errp[0]);
+      close(errp[1]);
+    }
+    if (child->spooled) {
+      rmspool(child->reqid);
+    }
+    if (placement_ != NULL) {
+      placement_put(placement_, child->cpu);
+    }
+    if (budget_ != NULL) {
+      budget_give(budget_);
+    }
+    child->lane = -1;
+    child->shard = -1;
+    child->job[0] = '\0';
+    freeslots_[nfree_++] = slot;
+    return -1;
+  } else if (pid == 0) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    /* workers outlive requests */
+    if (opts->timeout > 0 && !opts->worker) {
+      alarm(opts->timeout);
+    }
+
+    /* placement errors are reported on the stderr of hexec, not to the
+     * client. Batches, workers and shards read requests from hexec */
+    if (placement_ != NULL && placement_apply(placement_, child->cpu) < 0) {
+      perror("placement_apply");
+    }
+
+    class = opts->sched_header != NULL && !batching() && shard_ == NULL ?
+        classify(opts, in) : opts->sched_set ? &opts->sched : NULL;
+    if (class != NULL && placement_apply_class(class) < 0) {
+      perror("placement_apply_class");
+    }
+
+    if (errp[1] >= 0) {
+      err = errp[1];
+    }
+
+    /* a job reads its request from the spool and writes its output
+     * there, once the client has its ID. It is not timed out */
+    if (job_) {
+      conn = in;
+      in = read_job(conn, spool, child->job);
+      snprintf(path, sizeof(path), "%s/output", spool);
+      if (in < 0 || (out = open(path, O_WRONLY | O_CREAT | O_TRUNC |
+          O_CLOEXEC, 0600)) < 0) {
+        perror("job");
+        _exit(EXIT_FAILURE);
+      }
+      err = out;
+      close(conn);
+      alarm(0);
+    }
+
+    dup2(in, STDIN_FILENO);
+    dup2(out, STDOUT_FILENO);
+    dup2(err, STDERR_FILENO);
+    if (in > STDERR_FILENO) {
+      close(in);
+    }
+    if (out > STDERR_FILENO && out != in) {
+      close(out);
+    }
+    if (err > STDERR_FILENO && err != in && err != out) {
+      close(err);
+    }
+    close(listener_.h.fd);
+    TRACE1(exec, child->reqid);
+    if (opts->pipeline.nstages > 0) {
+      pipeline_run(&opts->pipeline, opts->pipe_size, exec_app, envp);
+      perror("pipeline");
+    } else {
+      exec_app(envp);
+    }
+    _exit(EXIT_FAILURE);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &child->spawned);
+  TRACE2(spawn_done, child->reqid, pid);
+  if (child->job[0] != '\0') {
+    hexec_jobs_started(child->job, pid, child->conn.tv_sec);
+  }
+  if (errp[0] >= 0) {
+    close(errp[1]);
+    child->err.h.fd = errp[0];
+    child->err.h.source_func = on_stderr;
+    errlog_begin(&child->err.s, child->reqid, pid);
+    if (iomux_add_source(ctx, &child->err.h) < 0) {
+      perror("iomux_add_source");
+      close(errp[0]);
+      child->err.h.fd = -1;
+    }
+  }
+
+  if (recording) {
+    child->rec.h.fd = fcntl(in, F_DUPFD_CLOEXEC, 0);
+    child->rec.h.source_func = on_record;
+    child->rec.conn = &child->conn;
+    if (child->rec.h.fd >= 0 && iomux_add_source(ctx, &child->rec.h) < 0) {
+      perror("iomux_add_source");
+      close(child->rec.h.fd);
+      child->rec.h.fd = -1;
+    }
+  }
+
+  add_child(slot, pid, pfd);
+  if (iomux_add_proc(ctx, &child->h) < 0) {
+    /* the child can not be reaped without its process descriptor */
+    perror("iomux_add_proc");
+    iomux_err(ctx);
+  }
+
+  return 0;
+}
+
+/* coalesced requests are spawned after the listener was readable. The
+ * output of a coalesced request is copied by hexec. Requests pending
+ * for data may find the budget taken by other processes meanwhile */
+static void on_coalesce_spawn(struct iomux_ctx *ctx, int fd, int outfd,
+    int pipefd) {
+  struct timespec now;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (outfd >= 0) {
+    relay_ = pipefd;
+    ret = spawn(ctx, fd, outfd, outfd, &now, -1);
+    relay_ = -1;
+  } else {
+    ret = spawn(ctx, fd, fd, fd, &now, -1);
+  }
+
+  if (ret < 0 && errno == EAGAIN) {
+    shed(fd);
+  } else {
+    close(fd);
+  }
+}
+
+/* batches and workers are run when a child may be spawned. Their
+ * stderr can not be passed to clients */
+static int on_batch_spawn(struct iomux_ctx *ctx, int in, int out,
+    int pipefd) {
+  struct timespec now;
+  int ret;
+
+  if (overloaded_ || nchildren_ >= max_children() || budget_nfree() <= 0) {
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  relay_ = pipefd;
+  ret = spawn(ctx, in, out, STDERR_FILENO, &now, -1);
+  relay_ = -1;
+  return ret;
+}
+
+/* the output of children relayed by hexec is counted as it is read, for
+ * the access log */
+static void on_relayed(int pipefd, size_t n) {
+  int i;
+
+  if ((accesslog_ == NULL && tracelog_ == NULL) || pipefd < 0) {
+    return;
+  }
+
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].pid > 0 && children_[i].relay == pipefd) {
+      if (n > 0) {
+        children_[i].bytes += n;
+      } else {
+        children_[i].relay = -1; /* closed, the number may be reused */
+      }
+      return;
+    }
+  }
+}
+
+static int on_lane_nfree(void) {
+  return overloaded_ ? 0 :
+      MIN(MAX(max_children() - nchildren_, 0), budget_nfree());
+}
+
+/* queued requests wait from accept, not from a readable listener */
+static int on_lane_spawn(struct iomux_ctx *ctx, int fd, int lane,
+    const struct timespec *accepted) {
+  return spawn(ctx, fd, fd, fd, accepted, lane);
+}
+
+/* shards may not take the slots of pending connections */
+static int on_fanout_nfree(void) {
+  return MAX(on_lane_nfree() - hexec_fanout_npending(), 0);
+}
+
+/* shards read the request from a pipe and write to a pipe. Their stderr
+ * can not be passed to clients */
+static int on_fanout_spawn(struct iomux_ctx *ctx, int in, int out,
+    int pipefd, int token, int index, int count) {
+  struct shard shard = {token, index, count};
+  struct timespec now;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  shard_ = &shard;
+  relay_ = pipefd;
+  ret = spawn(ctx, in, out, STDERR_FILENO, &now, -1);
+  shard_ = NULL;
+  relay_ = -1;
+  return ret;
+}
+
+static void on_fanout_cancel(int token) {
+  int i;
+
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].pid > 0 && children_[i].shard == token) {
+      pipeline_kill(children_[i].pid, SIGKILL);
+      return;
+    }
+  }
+}
+
+/* requests that are not fanned out are run as coalesced ones are */
+static void on_fanout_run(struct iomux_ctx *ctx, int fd) {
+  on_coalesce_spawn(ctx, fd, -1, -1);
+}
+
+/* requests that are not job requests, and jobs, are shed without a
+ * free slot rather than held, so that job requests answered by hexec
+ * are not held up */
+static void on_job_run(struct iomux_ctx *ctx, int fd) {
+  if (on_lane_nfree() <= 0) {
+    shed(fd);
+    return;
+  }
+
+  on_coalesce_spawn(ctx, fd, -1, -1);
+}
+
+static void on_job_submit(struct iomux_ctx *ctx, int fd) {
+  if (on_lane_nfree() <= 0) {
+    shed(fd);
+    return;
+  }
+
+  job_ = 1;
+  on_coalesce_spawn(ctx, fd, -1, -1);
+  job_ = 0;
+}
+
+/* jobs run by children inherited on reload keep running */
+static int on_job_adopt(pid_t pid, const char *id) {
+  int i;
+
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].pid == pid) {
+      snprintf(children_[i].job, sizeof(children_[i].job), "%s", id);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* run, or queue, the accepted connection 'fd'. Connections that were not
+ * prepaid may find the budget taken by other processes */
+static void take(struct iomux_ctx *ctx, int fd, const struct timespec *ready) {
+  struct opts *opts = listener_.opts;
+
+  if (batching()) {
+    hexec_batch_accept(ctx, fd);
+  } else if (opts->coalesce != NULL) {
+    hexec_coalesce_accept(ctx, fd);
+  } else if (laning()) {
+    hexec_lanes_accept(ctx, fd);
+  } else if (fanning()) {
+    hexec_fanout_accept(ctx, fd);
+  } else if (jobbing()) {
+    hexec_jobs_accept(ctx, fd);
+  } else if (spawn(ctx, fd, fd, fd, ready, -1) < 0 && errno == EAGAIN) {
+    shed(fd);
+  } else {
+    close(fd);
+  }
+}
+
+/* the number of connections that could be taken right away, as
+ * advertised to peers. Connections are queued one at a time */
+static int on_peer_nfree(void) {
+  if (!taking()) {
+    return 0;
+  } else if (batching() || laning() || fanning() || jobbing()) {
+    return 1;
+  }
+
+  return MAX(MIN(max_children() - nchildren_, budget_nfree()) -
+      hexec_coalesce_npending(), 1);
+}
+
+/* connections passed by peers were accepted elsewhere */
+static void on_peer_run(struct iomux_ctx *ctx, int fd) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  take(ctx, fd, &now);
+}
+
+/* connections spawned on accept take their budget slot before accept,
+ * so that they are not refused once accepted */
+static int prepay(void) {
+  if (budget_ == NULL || overloaded_ || batching() || laning() ||
+      fanning() || jobbing() || listener_.opts->coalesce != NULL) {
+    return 0;
+  } else if (budget_take(budget_) < 0) {
+    return -1;
+  }
+
+  prepaid_ = 1;
+  return 0;
+}
+
+static void on_accept(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct listener *listener = (struct listener *)h;
+  struct opts *opts = listener->opts;
+  struct timespec ready;
+  int local;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &ready);
+  TRACE0(accept_ready);
+  while (accepting() && (ctx->flags & IOMUXF_RUNNING)) {
+    /* decided before prepay, which takes from the budget */
+    local = hexec_peers_nheld() == 0 && taking();
+    if (local && prepay() < 0) {
+      break;
+    }
+
+    ret = accept(h->fd, NULL, 0);
     if (ret < 0) {
+      if (prepaid_) {
+        budget_give(budget_);
+        prepaid_ = 0;
+      }
+
       if (errno == ECONNABORTED || errno == EINTR) {
         continue; /* possibly more connections in queue - try again */
       } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
@@ -85,103 +1404,469 @@ static void on_accept(struct opts *opts, int fd) {
       }
     }
 
-    pid = fork();
-    if (pid < 0) {
-      perror("fork");
-      close(ret);
-      continue;
-    } else if (pid == 0) {
-      mask_sigchld(SIG_UNBLOCK);
-      signal(SIGCHLD, SIG_DFL);
-      signal(SIGINT, SIG_DFL);
-      signal(SIGHUP, SIG_DFL);
-      signal(SIGTERM, SIG_DFL);
-      dup2(ret, STDIN_FILENO);
-      dup2(ret, STDOUT_FILENO);
-      dup2(ret, STDERR_FILENO);
-      close(ret);
-      close(fd);
-
-      if (opts->timeout > 0) {
-        alarm(opts->timeout);
-      }
-
-      execv(opts->argv[0], opts->argv);
-      perror(opts->argv[0]);
-      _exit(EXIT_FAILURE);
+    TRACE1(accept, ret);
+    if (local) {
+      take(ctx, ret, &ready);
+    } else if (hexec_peers_available() || !overloaded_ || !opts->shed) {
+      hexec_peers_pass(ctx, ret);
     } else {
-      nchildren_++;
-      close(ret);
+      shed(ret);
+    }
+  }
+
+  update_listener(ctx);
+}
+
+static void on_pressure(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct pressure_sample s;
+  int high;
+
+  if (pressure_sample(pressure_, &s) < 0) {
+    perror("pressure_sample");
+    return;
+  }
+
+  high = pressure_check(&listener_.opts->pressure, &s, overloaded_);
+  if (high != overloaded_) {
+    fprintf(stderr, "pressure %s: cpu=%.2f memory=%.2f io=%.2f "
+        "mem_avail_kb=%ld\n", high ? "high" : "normal",
+        s.psi[PRESSURE_CPU], s.psi[PRESSURE_MEMORY], s.psi[PRESSURE_IO],
+        s.mem_avail_kb);
+    overloaded_ = high;
+    if (!overloaded_ && batching()) {
+      hexec_batch_kick(ctx);
+    } else if (!overloaded_ && laning()) {
+      hexec_lanes_kick(ctx);
+    } else if (!overloaded_ && fanning()) {
+      hexec_fanout_kick(ctx);
     }
+    hexec_peers_kick(ctx);
+    update_listener(ctx);
   }
+}
 
-  return;
+/* returns the number of connections held by this process, rather than
+ * by children */
+static int nheld(void) {
+  return hexec_coalesce_nflights() + hexec_coalesce_npending() +
+      hexec_batch_nconns() + hexec_lanes_nheld() + hexec_fanout_nheld() +
+      hexec_jobs_npending() + hexec_peers_nheld();
 }
 
-static void on_sigchld(int sig) {
-  got_sigchld_ = 1;
+/* returns 1 if connections are waiting for this process to spawn a
+ * child */
+static int waiting(void) {
+  struct pollfd pfd = {.fd = listener_.h.fd, .events = POLLIN};
+
+  return nheld() > 0 || poll(&pfd, 1, 0) > 0;
 }
 
-static void reap_children(void) {
-  pid_t pid;
-  int status;
+/* slots given back by other processes are not signalled, so a process
+ * out of budget retries periodically. Marking it as wanting keeps its
+ * share from being borrowed meanwhile */
+static void on_budget(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  int n;
+
+  if (++budget_ticks_ >= BUDGET_RECLAIM_TICKS) {
+    budget_ticks_ = 0;
+    n = budget_reclaim(budget_);
+    if (n > 0) {
+      fprintf(stderr, "budget: reclaimed slots of %d dead processes\n", n);
+    }
+  }
+
+  if (overloaded_ || reload_pending_ || nchildren_ >= max_children()) {
+    return;
+  }
+
+  if (budget_nfree() <= 0) {
+    if (waiting()) {
+      budget_want(budget_);
+    }
+    return;
+  }
+
+  if (batching()) {
+    hexec_batch_kick(ctx);
+  } else if (laning()) {
+    hexec_lanes_kick(ctx);
+  } else if (fanning()) {
+    hexec_fanout_kick(ctx);
+  }
+  hexec_peers_kick(ctx);
+  update_listener(ctx);
+}
+
+static void on_lane_stats(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct hexec_lane_stats s;
+  int i;
+
+  for (i = 0; hexec_lanes_stats(i, &s) == 0; i++) {
+    fprintf(stderr, "lane %s: min=%d running=%d queued=%d admitted=%llu "
+        "wait_avg_us=%lld wait_max_us=%lld expired=%llu cancelled=%llu "
+        "run_avg_us=%lld\n", s.name, s.min, s.running, s.queued,
+        (unsigned long long)s.admitted,
+        s.admitted > 0 ? (long long)(s.wait_us / (int64_t)s.admitted) : 0LL,
+        (long long)s.maxwait_us, (unsigned long long)s.expired,
+        (unsigned long long)s.cancelled, (long long)s.run_us);
+  }
+}
+
+static void on_sigreload(int sig) {
+  int err = errno;
+  char c = 0;
+
+  (void)write(sigpipe_[1], &c, 1);
+  errno = err;
+}
+
+/* re-execute hexec, handing over the listening socket and children */
+static void reload(int fd) {
+  struct hexec_reload_child *rchildren;
+  int nrchildren = 0;
+  int i;
+
+  rchildren = malloc(MAX(nchildren_, 1) * sizeof(*rchildren));
+  if (rchildren == NULL) {
+    perror("reload");
+    return;
+  }
+
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].pid > 0) {
+      rchildren[nrchildren].pid = children_[i].pid;
+      rchildren[nrchildren].pfd = children_[i].h.fd;
+      rchildren[nrchildren].errfd = children_[i].err.h.fd;
+      nrchildren++;
+    }
+  }
+
+  if (accesslog_ != NULL) {
+    accesslog_flush(accesslog_);
+  }
+
+  if (tracelog_ != NULL) {
+    accesslog_flush(tracelog_);
+  }
+
+  /* incomplete lines of captured stderr are lost */
+  if (errlog_ != NULL) {
+    errlog_flush(errlog_);
+  }
+
+  /* the reserved CPU is not inherited, it is reserved again */
+  if (listener_.opts->supervisor_cpu >= 0 &&
+      placement_apply(placement_, -1) < 0) {
+    perror("placement_apply");
+  }
+
+  if (hexec_reload_exec(fd, rchildren, nrchildren) < 0) {
+    perror("reload");
+  }
 
-  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-    nchildren_--;
+  if (listener_.opts->supervisor_cpu >= 0 &&
+      placement_pin(listener_.opts->supervisor_cpu) < 0) {
+    perror("placement_pin");
   }
+
+  free(rchildren);
+}
+
+/* re-open the executable of children when it is replaced. On error, the
+ * open executable is kept */
+static void on_exe_change(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  if (exefile_refresh(&exe_) < 0) {
+    perror(exe_.path);
+  }
+}
+
+static void on_signal(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  char buf[64];
+
+  while (read(h->fd, buf, sizeof(buf)) == sizeof(buf));
+
+  /* connections held by this process would be lost on exec */
+  if (nheld() > 0) {
+    reload_pending_ = 1;
+    update_listener(ctx);
+    return;
+  }
+
+  reload(listener_.h.fd);
+}
+
+static void on_update(struct iomux_ctx *ctx) {
+  if (reload_pending_ && nheld() == 0) {
+    reload_pending_ = 0;
+    reload(listener_.h.fd); /* returns on failure */
+  }
+
+  hexec_peers_kick(ctx);
+  update_listener(ctx);
 }
 
-static int hexec_sync_run(struct opts *opts, int fd) {
-  sigset_t sigmask;
-  struct sigaction sa = {0};
-  fd_set readfds;
-  int ret;
-  int status = EXIT_FAILURE;
+/* allocate the child slots, 'ninherited' of which are used by
+ * 'inherited' */
+static int init_children(int nslots,
+    const struct hexec_reload_child *inherited, size_t ninherited) {
+  int slot;
+  int pfd;
+  int i;
+
+  children_ = calloc(nslots, sizeof(struct child));
+  freeslots_ = calloc(nslots, sizeof(int));
+  if (children_ == NULL || freeslots_ == NULL) {
+    free(children_);
+    free(freeslots_);
+    return -1;
+  }
+
+  nslots_ = nslots;
+  for (i = nslots - 1; i >= 0; i--) {
+    children_[i].h.fd = -1;
+    children_[i].cpu = -1;
+    children_[i].lane = -1;
+    children_[i].shard = -1;
+    children_[i].relay = -1;
+    children_[i].bytes = -1;
+    children_[i].err.h.fd = -1;
+    children_[i].rec.h.fd = -1;
+    freeslots_[nfree_++] = i;
+  }
+
+  for (i = 0; i < ninherited; i++) {
+    /* hexec without process descriptors passes only PIDs */
+    pfd = inherited[i].pfd;
+    if (pfd < 0 && (pfd = proc_open(inherited[i].pid)) < 0) {
+      fprintf(stderr, "child %d: %s\n", (int)inherited[i].pid,
+          strerror(errno));
+      if (inherited[i].errfd >= 0) {
+        close(inherited[i].errfd);
+      }
+      continue;
+    }
+
+    slot = freeslots_[--nfree_];
+    children_[slot].err.h.fd = inherited[i].errfd;
+    children_[slot].err.h.source_func = on_stderr;
+    errlog_begin(&children_[slot].err.s, 0, inherited[i].pid);
+    add_child(slot, inherited[i].pid, pfd);
+  }
+
+  return 0;
+}
+
+static void cleanup_children(void) {
+  int i;
+
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].h.fd >= 0) {
+      close(children_[i].h.fd);
+    }
+  }
+
+  free(children_);
+  free(freeslots_);
+}
+
+/* build the static part of the child environment */
+static int init_env(struct opts *opts) {
+  int i;
+
+  envbuf_init(&env_);
+  if (!opts->env_clear && envbuf_inherit(&env_, NULL) < 0) {
+    goto fail;
+  }
+
+  for (i = 0; i < opts->nenvs; i++) {
+    if (strchr(opts->envs[i], '=') != NULL) {
+      if (envbuf_add(&env_, opts->envs[i]) < 0) {
+        goto fail;
+      }
+    } else if (envbuf_inherit(&env_, opts->envs[i]) < 0) {
+      goto fail;
+    }
+  }
+
+  if (envbuf_finalize(&env_, nslots_, ENV_NSLOTVARS, ENV_SLOTSIZE) < 0) {
+    goto fail;
+  }
+
+  return 0;
+fail:
+  envbuf_cleanup(&env_);
+  return -1;
+}
+
+/* reload signals are delivered to the event loop through a pipe */
+static int init_signals(void) {
+  struct sigaction sa = {0};
+  sigset_t set;
+
+  if (pipe(sigpipe_) < 0) {
+    return -1;
+  }
+
+  if (set_nonblock_cloexec(sigpipe_[0]) < 0 ||
+      set_nonblock_cloexec(sigpipe_[1]) < 0) {
+    goto close_pipe;
+  }
+
+  sa.sa_flags = SA_RESTART;
+  sa.sa_handler = on_sigreload;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGHUP, &sa, NULL) < 0 ||
+      sigaction(SIGUSR2, &sa, NULL) < 0) {
+    goto default_signals;
+  }
+
+  /* blocked across the exec of a reload, until handled */
+  sigemptyset(&set);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGUSR2);
+  if (sigprocmask(SIG_UNBLOCK, &set, NULL) < 0) {
+    goto default_signals;
+  }
+
+  /* children are reaped through their process descriptors, which an
+   * inherited SIG_IGN would have the kernel do instead */
+  signal(SIGCHLD, SIG_DFL);
+
+  /* clients and batch children may go away before their output is
+   * written */
+  signal(SIGPIPE, SIG_IGN);
+  return 0;
+default_signals:
+  signal(SIGUSR2, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+close_pipe:
+  close(sigpipe_[0]);
+  close(sigpipe_[1]);
+  return -1;
+}
+
+static int hexec_sync_run(struct opts *opts, int fd) {
+  struct iomux_ctx ctx;
+  struct iomux_handler sigh = {0};
+  struct iomux_handler pressureh = {0};
+  struct iomux_handler lanestatsh = {0};
+  struct iomux_handler budgeth = {0};
+  struct iomux_handler spoolh = {0};
+  struct iomux_handler exeh = {0};
+  int status = EXIT_FAILURE;
+  int i;
+
+  if (iomux_init(&ctx) < 0) {
+    perror("iomux_init");
+    goto done;
+  }
+
+  /* validated with the options */
+  iomux_set_batch(&ctx, opts->event_batch);
+  iomux_set_spin(&ctx, opts->busy_poll);
+
+  /* children handed over on reload may have exited during the exec, in
+   * which case their process descriptors are readable immediately */
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].pid > 0 && iomux_add_proc(&ctx, &children_[i].h) < 0) {
+      perror("iomux_add_proc");
+      goto iomux_cleanup;
+    }
+  }
+
+  /* the stderr of inherited children is captured, as it was before */
+  for (i = 0; i < nslots_; i++) {
+    if (children_[i].err.h.fd < 0) {
+      continue;
+    } else if (errlog_ == NULL) {
+      close(children_[i].err.h.fd);
+      children_[i].err.h.fd = -1;
+    } else if (iomux_add_source(&ctx, &children_[i].err.h) < 0) {
+      perror("iomux_add_source");
+      goto iomux_cleanup;
+    }
+  }
 
-  /* block SIGCHLD from delivery - should only be delivered to pselect(2) */
-  ret = mask_sigchld(SIG_BLOCK);
-  if (ret < 0) {
-    goto done;
+  if (init_signals() < 0) {
+    perror("init_signals");
+    goto iomux_cleanup;
   }
 
-  /* set up SIGCHLD handler */
-  sa.sa_flags = 0;
-  sa.sa_handler = on_sigchld;
-  sigemptyset(&sa.sa_mask);
-  ret = sigaction(SIGCHLD, &sa, NULL);
-  if (ret < 0) {
-    goto unblock_sigchld;
+  sigh.fd = sigpipe_[0];
+  sigh.source_func = on_signal;
+  if (iomux_add_source(&ctx, &sigh) < 0) {
+    perror("iomux_add_source");
+    close(sigpipe_[0]);
+    goto default_signals;
   }
 
-  sigemptyset(&sigmask); /* mask within pselect */
-  for (;;) {
-    FD_ZERO(&readfds);
+  listener_.h.fd = fd;
+  listener_.h.source_func = on_accept;
+  listener_.opts = opts;
+  listener_.enabled = 1;
+  if (iomux_add_source(&ctx, &listener_.h) < 0) {
+    perror("iomux_add_source");
+    goto default_signals;
+  }
 
-    if (nchildren_ < opts->nconcurrent) {
-      FD_SET(fd, &readfds);
+  if (pressure_ != NULL) {
+    pressureh.source_func = on_pressure;
+    if (iomux_add_timer(&ctx, &pressureh, opts->pressure_interval) < 0) {
+      perror("iomux_add_timer");
+      goto default_signals;
     }
+    on_pressure(&ctx, &pressureh);
+  }
 
-    ret = pselect(fd + 1, &readfds, NULL, NULL, NULL, &sigmask);
-    if (ret < 0 && errno != EINTR) {
-      perror("pselect");
-      goto default_sigchld;
+  if (laning() && opts->lane_stats > 0) {
+    lanestatsh.source_func = on_lane_stats;
+    if (iomux_add_timer(&ctx, &lanestatsh, opts->lane_stats) < 0) {
+      perror("iomux_add_timer");
+      goto default_signals;
     }
+  }
 
-    if (got_sigchld_) {
-      got_sigchld_ = 0;
-      reap_children();
+  if (budget_ != NULL) {
+    budgeth.source_func = on_budget;
+    if (iomux_add_timer(&ctx, &budgeth, BUDGET_INTERVAL) < 0) {
+      perror("iomux_add_timer");
+      goto default_signals;
     }
+  }
 
-    if (FD_ISSET(fd, &readfds)) {
-      on_accept(opts, fd);
+  if (spool_ != NULL && opts->spool_max_age > 0) {
+    spoolh.source_func = on_spool_refresh;
+    if (iomux_add_timer(&ctx, &spoolh,
+        spool_interval_ms(opts->spool_max_age)) < 0) {
+      perror("iomux_add_timer");
+      goto default_signals;
     }
   }
 
-  status = EXIT_SUCCESS;
-default_sigchld:
-  signal(SIGCHLD, SIG_DFL);
-unblock_sigchld:
-  mask_sigchld(SIG_UNBLOCK);
+  if (hexec_peers_npeers() > 0 && hexec_peers_start(&ctx) < 0) {
+    perror("peers");
+    goto default_signals;
+  }
+
+  exeh.fd = exefile_watchfd(&exe_);
+  exeh.source_func = on_exe_change;
+  if (exeh.fd >= 0 && iomux_add_source(&ctx, &exeh) < 0) {
+    perror("iomux_add_source");
+    goto default_signals;
+  }
+
+  update_listener(&ctx);
+  if (iomux_run(&ctx) == 0) {
+    status = EXIT_SUCCESS;
+  }
+
+default_signals:
+  signal(SIGPIPE, SIG_DFL);
+  signal(SIGUSR2, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  close(sigpipe_[1]);
+iomux_cleanup:
+  iomux_cleanup(&ctx);
 done:
   return status;
 }
@@ -199,17 +1884,68 @@ static int int_or_die(const char *name, const char *s) {
   return (int)val;
 }
 
+static int percent_or_die(const char *name, const char *s) {
+  int val;
+
+  val = int_or_die(name, s);
+  if (val < 0 || val > 100) {
+    fprintf(stderr, "%s: invalid percentage\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  return val;
+}
+
 int hexec_sync_main(int argc, char *argv[]) {
   int ret;
   int lfd;
+  struct climit climit;
+  struct pressure pressure;
+  struct spool spool;
+  struct sweep sweep;
+  struct placement placement;
+  struct budget budget;
+  struct sched_rule *rule;
+  struct timespec now;
+  struct hexec_reload_child *inherited;
+  size_t ninherited;
+  struct accesslog accesslog;
+  struct accesslog tracelog;
+  struct errlog errlog;
+  char jobstore[SPOOL_MAXPATH];
   int status = EXIT_FAILURE;
   const char *argv0 = argv[0];
   static struct opts opts = {
     .backlog      = DEFAULT_BACKLOG,
     .timeout      = DEFAULT_SYNC_TIMEOUT,
     .nconcurrent  = DEFAULT_NCONCURRENT,
+    .pressure_interval   = DEFAULT_PRESSURE_INTERVAL,
+    .pressure.hysteresis = DEFAULT_PRESSURE_HYSTERESIS,
+    .coalesce_max_waiters = HEXEC_COALESCE_DEFAULT_MAXWAITERS,
+    .batch_linger = HEXEC_BATCH_DEFAULT_LINGER_MS,
+    .worker_max_requests = HEXEC_BATCH_DEFAULT_MAXREQUESTS,
+    .worker_idle  = HEXEC_BATCH_DEFAULT_IDLE_MS,
+    .spool_max_age = DEFAULT_SPOOL_MAX_AGE,
+    .spool_threads = DEFAULT_SPOOL_THREADS,
+    .supervisor_cpu = -1,
+    .lane_max_queued = HEXEC_LANES_DEFAULT_MAXQUEUED,
+    .trace_sample = 1,
+    .budget_weight = 1,
+    .stderr_max_bytes = ERRLOG_DEFAULT_MAXBYTES,
+    .stderr_rate = ERRLOG_DEFAULT_RATE,
+    .record_sample = 1,
+    .event_batch = IOMUX_MAXNEVS,
+    .fanout_max = HEXEC_FANOUT_DEFAULT_MAX,
+    .jobs_max_done = HEXEC_JOBS_DEFAULT_MAXDONE,
   };
 
+  opts.envs = calloc(argc, sizeof(char *));
+  opts.sched_rules = calloc(argc, sizeof(struct sched_rule));
+  if (opts.envs == NULL || opts.sched_rules == NULL) {
+    perror("calloc");
+    goto done;
+  }
+
   while ((ret = getopt_long(argc, argv, optstr_, options_, NULL)) != -1) {
     switch (ret) {
     case 'l':
@@ -232,6 +1968,347 @@ int hexec_sync_main(int argc, char *argv[]) {
         goto usage;
       }
       break;
+    case OPT_ADAPTIVE:
+      opts.adaptive = 1;
+      break;
+    case OPT_MAX_CPU_PRESSURE:
+      opts.pressure.psi[PRESSURE_CPU] = percent_or_die("max-cpu-pressure",
+          optarg);
+      break;
+    case OPT_MAX_MEM_PRESSURE:
+      opts.pressure.psi[PRESSURE_MEMORY] = percent_or_die(
+          "max-memory-pressure", optarg);
+      break;
+    case OPT_MAX_IO_PRESSURE:
+      opts.pressure.psi[PRESSURE_IO] = percent_or_die("max-io-pressure",
+          optarg);
+      break;
+    case OPT_MIN_MEM_AVAILABLE:
+      ret = int_or_die("min-mem-available", optarg);
+      if (ret <= 0) {
+        fprintf(stderr, "min-mem-available: invalid value\n");
+        goto usage;
+      }
+      opts.pressure.mem_avail_kb = (long)ret * 1024;
+      break;
+    case OPT_PRESSURE_HYSTERESIS:
+      opts.pressure.hysteresis = percent_or_die("pressure-hysteresis",
+          optarg);
+      break;
+    case OPT_PRESSURE_INTERVAL:
+      opts.pressure_interval = int_or_die("pressure-interval", optarg);
+      if (opts.pressure_interval <= 0) {
+        fprintf(stderr, "pressure-interval: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_SHED:
+      opts.shed = 1;
+      break;
+    case OPT_COALESCE:
+      opts.coalesce = optarg;
+      break;
+    case OPT_COALESCE_MAX_KEYS:
+      opts.coalesce_max_keys = int_or_die("coalesce-max-keys", optarg);
+      if (opts.coalesce_max_keys <= 0) {
+        fprintf(stderr, "coalesce-max-keys: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_COALESCE_MAX_WAITERS:
+      opts.coalesce_max_waiters = int_or_die("coalesce-max-waiters", optarg);
+      if (opts.coalesce_max_waiters <= 0) {
+        fprintf(stderr, "coalesce-max-waiters: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_BATCH:
+      opts.batch = int_or_die("batch", optarg);
+      if (opts.batch <= 0) {
+        fprintf(stderr, "batch: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_SPOOL:
+      opts.spool = optarg;
+      break;
+    case OPT_SPOOL_MAX_AGE:
+      opts.spool_max_age = int_or_die("spool-max-age", optarg);
+      if (opts.spool_max_age < 0) {
+        fprintf(stderr, "spool-max-age: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_SPOOL_THREADS:
+      opts.spool_threads = int_or_die("spool-threads", optarg);
+      if (opts.spool_threads <= 0) {
+        fprintf(stderr, "spool-threads: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_CPUS:
+      opts.cpus = optarg;
+      break;
+    case OPT_CPU_PLACEMENT:
+      if (strcmp(optarg, "set") == 0) {
+        opts.cpu_placement = PLACEMENT_SET;
+      } else if (strcmp(optarg, "rr") == 0) {
+        opts.cpu_placement = PLACEMENT_RR;
+      } else if (strcmp(optarg, "least") == 0) {
+        opts.cpu_placement = PLACEMENT_LEAST;
+      } else {
+        fprintf(stderr, "cpu-placement: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_SUPERVISOR_CPU:
+      opts.supervisor_cpu = int_or_die("supervisor-cpu", optarg);
+      if (opts.supervisor_cpu < 0) {
+        fprintf(stderr, "supervisor-cpu: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_SCHED:
+      if (placement_parse_class(optarg, &opts.sched) < 0) {
+        fprintf(stderr, "sched: invalid class\n");
+        goto usage;
+      }
+      opts.sched_set = 1;
+      break;
+    case OPT_SCHED_HEADER:
+      opts.sched_header = optarg;
+      break;
+    case OPT_SCHED_CLASS:
+      rule = &opts.sched_rules[opts.nsched_rules];
+      rule->value = optarg;
+      rule->valuelen = strcspn(optarg, "=");
+      if (optarg[rule->valuelen] != '=' || placement_parse_class(
+          optarg + rule->valuelen + 1, &rule->class) < 0) {
+        fprintf(stderr, "sched-class: invalid class\n");
+        goto usage;
+      }
+      opts.nsched_rules++;
+      break;
+    case OPT_LANE:
+      if (hexec_lanes_add(optarg) < 0) {
+        fprintf(stderr, "lane: invalid lane\n");
+        goto usage;
+      }
+      break;
+    case OPT_LANE_HEADER:
+      opts.lane_header = optarg;
+      break;
+    case OPT_LANE_MAX_QUEUED:
+      opts.lane_max_queued = int_or_die("lane-max-queued", optarg);
+      if (opts.lane_max_queued <= 0) {
+        fprintf(stderr, "lane-max-queued: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_LANE_STATS:
+      opts.lane_stats = int_or_die("lane-stats", optarg);
+      if (opts.lane_stats < 0) {
+        fprintf(stderr, "lane-stats: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_WORKER:
+      opts.worker = 1;
+      break;
+    case OPT_WORKER_MAX_REQUESTS:
+      opts.worker_max_requests = int_or_die("worker-max-requests", optarg);
+      if (opts.worker_max_requests < 0) {
+        fprintf(stderr, "worker-max-requests: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_WORKER_IDLE:
+      opts.worker_idle = int_or_die("worker-idle", optarg);
+      if (opts.worker_idle < 0) {
+        fprintf(stderr, "worker-idle: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_BATCH_LINGER:
+      opts.batch_linger = int_or_die("batch-linger", optarg);
+      if (opts.batch_linger < 0) {
+        fprintf(stderr, "batch-linger: invalid value\n");
+        goto usage;
+      }
+      break;
+    case 'E':
+      opts.env_clear = 1;
+      break;
+    case 'e':
+      opts.envs[opts.nenvs++] = optarg;
+      break;
+    case 'a':
+      opts.access_log = optarg;
+      break;
+    case OPT_ACCESS_LOG_FORMAT:
+      if (strcmp(optarg, "text") == 0) {
+        opts.access_log_format = ACCESSLOG_TEXT;
+      } else if (strcmp(optarg, "json") == 0) {
+        opts.access_log_format = ACCESSLOG_JSON;
+      } else {
+        fprintf(stderr, "access-log-format: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_ACCESS_LOG_SIZE:
+      opts.access_log_size = int_or_die("access-log-size", optarg);
+      if (opts.access_log_size <= 0) {
+        fprintf(stderr, "access-log-size: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_TRACE:
+      opts.trace = optarg;
+      break;
+    case OPT_TRACE_SAMPLE:
+      opts.trace_sample = int_or_die("trace-sample", optarg);
+      if (opts.trace_sample <= 0) {
+        fprintf(stderr, "trace-sample: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_BUDGET:
+      opts.budget = optarg;
+      break;
+    case OPT_BUDGET_LIMIT:
+      opts.budget_limit = int_or_die("budget-limit", optarg);
+      if (opts.budget_limit <= 0) {
+        fprintf(stderr, "budget-limit: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_BUDGET_WEIGHT:
+      opts.budget_weight = int_or_die("budget-weight", optarg);
+      if (opts.budget_weight <= 0) {
+        fprintf(stderr, "budget-weight: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_STDERR_LOG:
+      opts.stderr_log = optarg;
+      break;
+    case OPT_STDERR_MAX_BYTES:
+      opts.stderr_max_bytes = int_or_die("stderr-max-bytes", optarg);
+      if (opts.stderr_max_bytes < 0) {
+        fprintf(stderr, "stderr-max-bytes: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_STDERR_RATE:
+      opts.stderr_rate = int_or_die("stderr-rate", optarg);
+      if (opts.stderr_rate < 0) {
+        fprintf(stderr, "stderr-rate: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_RECORD:
+      opts.record = optarg;
+      break;
+    case OPT_RECORD_SAMPLE:
+      opts.record_sample = int_or_die("record-sample", optarg);
+      if (opts.record_sample <= 0) {
+        fprintf(stderr, "record-sample: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_DEADLINE:
+      opts.deadline = int_or_die("deadline", optarg);
+      if (opts.deadline <= 0) {
+        fprintf(stderr, "deadline: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_DEADLINE_HEADER:
+      opts.deadline_header = optarg;
+      break;
+    case OPT_EVENT_BATCH:
+      opts.event_batch = int_or_die("event-batch", optarg);
+      if (opts.event_batch <= 0 || opts.event_batch > IOMUX_MAXNEVS) {
+        fprintf(stderr, "event-batch: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_BUSY_POLL:
+      opts.busy_poll = int_or_die("busy-poll", optarg);
+      if (opts.busy_poll < 0) {
+        fprintf(stderr, "busy-poll: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_FANOUT_HEADER:
+      opts.fanout_header = optarg;
+      break;
+    case OPT_FANOUT_MAX:
+      opts.fanout_max = int_or_die("fanout-max", optarg);
+      if (opts.fanout_max <= 0) {
+        fprintf(stderr, "fanout-max: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_FANOUT_ORDER:
+      if (strcmp(optarg, "shard") == 0) {
+        opts.fanout_order = HEXEC_FANOUT_ORDER_SHARD;
+      } else if (strcmp(optarg, "complete") == 0) {
+        opts.fanout_order = HEXEC_FANOUT_ORDER_COMPLETE;
+      } else {
+        fprintf(stderr, "fanout-order: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_FANOUT_PARTIAL:
+      if (strcmp(optarg, "fail") == 0) {
+        opts.fanout_partial = HEXEC_FANOUT_PARTIAL_FAIL;
+      } else if (strcmp(optarg, "omit") == 0) {
+        opts.fanout_partial = HEXEC_FANOUT_PARTIAL_OMIT;
+      } else {
+        fprintf(stderr, "fanout-partial: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_STAGE:
+      if (pipeline_add(&opts.pipeline, optarg) < 0) {
+        fprintf(stderr, "stage: %s\n", strerror(errno));
+        goto usage;
+      }
+      break;
+    case OPT_PIPE_SIZE:
+      opts.pipe_size = int_or_die("pipe-size", optarg);
+      if (opts.pipe_size <= 0) {
+        fprintf(stderr, "pipe-size: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_PEER_LISTEN:
+      opts.peer_listen = optarg;
+      break;
+    case OPT_PEER:
+      if (hexec_peers_add(optarg) < 0) {
+        fprintf(stderr, "peer: invalid or too many peers\n");
+        goto usage;
+      }
+      break;
+    case OPT_JOBS:
+      opts.jobs = optarg;
+      break;
+    case OPT_JOBS_MAX_DONE:
+      opts.jobs_max_done = int_or_die("jobs-max-done", optarg);
+      if (opts.jobs_max_done <= 0) {
+        fprintf(stderr, "jobs-max-done: invalid value\n");
+        goto usage;
+      }
+      break;
+    case OPT_FANOUT_TIMEOUT:
+      opts.fanout_timeout = int_or_die("fanout-timeout", optarg);
+      if (opts.fanout_timeout <= 0) {
+        fprintf(stderr, "fanout-timeout: invalid value\n");
+        goto usage;
+      }
+      break;
     case 'h':
     default:
       goto usage;
@@ -244,7 +2321,8 @@ int hexec_sync_main(int argc, char *argv[]) {
     goto usage;
   }
 
-  if (access(argv[0], F_OK|X_OK) != 0) {
+  /* children are run from the file opened here, and not by path */
+  if (exefile_open(&exe_, argv[0]) < 0) {
     perror(argv[0]);
     goto done;
   }
@@ -254,18 +2332,324 @@ int hexec_sync_main(int argc, char *argv[]) {
     goto done;
   }
 
-  lfd = fs_mksock(opts.listen, opts.backlog);
-  if (lfd < 0) {
-    perror(opts.listen);
+  if ((opts.batch > 0) + opts.worker + (opts.coalesce != NULL) +
+      (opts.lane_header != NULL || opts.deadline > 0 ||
+      opts.deadline_header != NULL) + (opts.fanout_header != NULL) +
+      (opts.jobs != NULL) > 1) {
+    fprintf(stderr, "batch, worker, coalesce, lanes or deadlines, fanout "
+        "and jobs are mutually exclusive\n");
+    goto done;
+  }
+
+  if (opts.jobs != NULL && opts.spool == NULL) {
+    fprintf(stderr, "jobs: jobs need a spool\n");
+    goto done;
+  }
+
+  if ((opts.peer_listen != NULL) != (hexec_peers_npeers() > 0)) {
+    fprintf(stderr, "peer: peers need both peer and peer-listen\n");
+    goto done;
+  }
+
+  if ((opts.lane_header != NULL) != (hexec_lanes_nlanes() > 0)) {
+    fprintf(stderr, "lane: lanes need both lane and lane-header\n");
+    goto done;
+  } else if (hexec_lanes_nreserved() > opts.nconcurrent) {
+    fprintf(stderr, "lane: more slots reserved than nconcurrent\n");
+    goto done;
+  }
+
+  /* deadlines are kept by queueing requests in hexec, in a single lane
+   * if no lanes are set */
+  if ((opts.deadline > 0 || opts.deadline_header != NULL) &&
+      hexec_lanes_nlanes() == 0) {
+    hexec_lanes_add("default");
+  }
+
+  /* batches and workers read requests from hexec, not the connection */
+  if (opts.record != NULL && (opts.batch > 0 || opts.worker)) {
+    fprintf(stderr, "record: not supported with batch or worker\n");
+    goto done;
+  }
+
+  if (opts.nsched_rules > 0 && opts.sched_header == NULL) {
+    fprintf(stderr, "sched-class: missing sched-header\n");
+    goto done;
+  }
+
+  /* children are watched through process descriptors, so fail here
+   * rather than on every spawn */
+  if (proc_check() < 0) {
+    perror("process descriptors (pidfd_open and waitid P_PIDFD, Linux 5.4 "
+        "or later)");
+    goto done;
+  }
+
+  /* the children's CPUs exclude the one reserved for hexec, which is
+   * then pinned to it */
+  if (opts.cpus != NULL || opts.cpu_placement != PLACEMENT_SET ||
+      opts.supervisor_cpu >= 0) {
+    if (placement_init(&placement, opts.cpus, opts.cpu_placement) < 0) {
+      perror("cpus");
+      goto done;
+    } else if (opts.supervisor_cpu >= 0 &&
+        (placement_remove(&placement, opts.supervisor_cpu) < 0 ||
+        placement_pin(opts.supervisor_cpu) < 0)) {
+      perror("supervisor-cpu");
+      goto done;
+    }
+    placement_ = &placement;
+  }
+
+  /* on reload, the listening socket and children are inherited */
+  ret = hexec_reload_inherit(&lfd, &inherited, &ninherited);
+  if (ret < 0) {
+    perror("hexec_reload_inherit");
     goto done;
   }
 
+  if (lfd < 0) {
+    lfd = fs_mksock(opts.listen, opts.backlog);
+    if (lfd < 0) {
+      perror(opts.listen);
+      goto done;
+    }
+  }
+
+  if (init_children(MAX(opts.nconcurrent, ninherited), inherited,
+      ninherited) < 0) {
+    perror("init_children");
+    goto close_lfd;
+  }
+
+  if (init_env(&opts) < 0) {
+    perror("init_env");
+    goto cleanup_children;
+  }
+
+  if (opts.access_log != NULL) {
+    if (accesslog_open(&accesslog, opts.access_log, opts.access_log_format,
+        opts.access_log_size) < 0) {
+      perror(opts.access_log);
+      goto cleanup_env;
+    }
+    accesslog_ = &accesslog;
+  }
+
+  if (opts.trace != NULL) {
+    if (accesslog_open(&tracelog, opts.trace, ACCESSLOG_CHROME,
+        opts.access_log_size) < 0) {
+      perror(opts.trace);
+      goto close_accesslog;
+    }
+    tracelog_ = &tracelog;
+  }
+
+  if (opts.stderr_log != NULL) {
+    if (errlog_open(&errlog, opts.stderr_log, opts.stderr_max_bytes,
+        opts.stderr_rate) < 0) {
+      perror(opts.stderr_log);
+      goto close_tracelog;
+    }
+    errlog_ = &errlog;
+  }
+
+  if (opts.record != NULL) {
+    record_fd_ = capture_open(opts.record);
+    if (record_fd_ < 0) {
+      perror(opts.record);
+      goto close_errlog;
+    }
+  }
+
+  if (opts.adaptive) {
+    climit_init(&climit, 1, opts.nconcurrent, ADAPTIVE_INITIAL);
+    climit_ = &climit;
+  }
+
+  if (opts.pressure.psi[PRESSURE_CPU] > 0 ||
+      opts.pressure.psi[PRESSURE_MEMORY] > 0 ||
+      opts.pressure.psi[PRESSURE_IO] > 0 || opts.pressure.mem_avail_kb > 0) {
+    if (pressure_open(&pressure) < 0) {
+      perror("pressure_open");
+      goto close_record;
+    }
+    pressure_ = &pressure;
+  }
+
+  /* children inherited on reload hold slots of the budget already */
+  if (opts.budget != NULL) {
+    if (opts.budget_limit == 0) {
+      opts.budget_limit = MAX((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+
+    if (budget_open(&budget, opts.budget, opts.budget_limit,
+        opts.budget_weight) < 0) {
+      perror("budget");
+      goto close_pressure;
+    }
+    budget_adopt(&budget, nchildren_);
+    budget_ = &budget;
+  }
+
+  if (opts.spool != NULL) {
+    if (strlen(opts.spool) + SPOOL_NAMESZ + 8 > SPOOL_MAXPATH) {
+      fprintf(stderr, "spool: path too long\n");
+      goto close_budget;
+    } else if (spool_open(&spool, opts.spool, 0) < 0) {
+      perror(opts.spool);
+      goto close_budget;
+    } else if (sweep_open(&sweep, opts.spool_threads, 0) < 0) {
+      perror("sweep_open");
+      spool_close(&spool);
+      goto close_budget;
+    }
+
+    /* leftovers, e.g., of children running at a reload, expire. Entries
+     * are two levels below the spool directory. The directories of
+     * running children are refreshed, and those of running jobs, which
+     * may have been inherited, are marked by their pid files */
+    if (opts.jobs != NULL) {
+      sweep_expire_keep(&sweep, HEXEC_JOBS_PIDFILE);
+    }
+
+    if (opts.spool_max_age > 0 && sweep_expire(&sweep, opts.spool, 3,
+        opts.spool_max_age, spool_interval_ms(opts.spool_max_age)) < 0) {
+      perror("sweep_expire");
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    spool_epoch_ = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    spool_ = &spool;
+    sweep_ = &sweep;
+  }
+
+  if (opts.coalesce != NULL) {
+    /* each flight has a child, so there are at most nconcurrent flights
+     * unless limited further */
+    if (opts.coalesce_max_keys == 0 ||
+        opts.coalesce_max_keys > opts.nconcurrent) {
+      opts.coalesce_max_keys = opts.nconcurrent;
+    }
+
+    if (hexec_coalesce_init(opts.coalesce, opts.coalesce_max_keys,
+        opts.coalesce_max_waiters, nslots_, on_coalesce_spawn, on_relayed,
+        on_update) < 0) {
+      perror("coalesce");
+      goto close_spool;
+    }
+  }
+
+  if (opts.batch > 0 && hexec_batch_init(opts.batch, opts.batch_linger,
+      nslots_, on_batch_spawn, on_relayed, on_update) < 0) {
+    perror("batch");
+    goto cleanup_coalesce;
+  } else if (opts.worker && hexec_batch_init_workers(nslots_,
+      opts.worker_max_requests, opts.worker_idle, on_batch_spawn,
+      on_relayed, on_update) < 0) {
+    perror("worker");
+    goto cleanup_coalesce;
+  }
+
+  hexec_lanes_deadline(opts.deadline_header, opts.deadline);
+  if (hexec_lanes_nlanes() > 0 && hexec_lanes_init(opts.lane_header,
+      opts.lane_max_queued, on_lane_nfree, on_lane_spawn, on_update) < 0) {
+    perror("lane");
+    goto cleanup_coalesce;
+  }
+
+  if (opts.fanout_header != NULL && hexec_fanout_init(opts.fanout_header,
+      opts.fanout_max, opts.fanout_order, opts.fanout_partial,
+      opts.fanout_timeout, on_fanout_nfree, on_fanout_spawn, on_relayed,
+      on_fanout_cancel, on_fanout_run, on_update) < 0) {
+    perror("fanout");
+    goto cleanup_lanes;
+  }
+
+  /* finished jobs are kept in a store in the spool. Jobs of inherited
+   * children are adopted, and other jobs that had not finished are
+   * lost */
+  if (opts.jobs != NULL) {
+    snprintf(jobstore, sizeof(jobstore), "%s/" HEXEC_JOBS_STORE,
+        opts.spool);
+    if (hexec_jobs_init(opts.jobs, spool_, jobstore, nslots_,
+        opts.jobs_max_done, on_job_run, on_job_submit, remove_spool,
+        on_update) < 0) {
+      perror("jobs");
+      goto cleanup_fanout;
+    } else if (hexec_jobs_load(opts.spool, on_job_adopt) < 0) {
+      perror(opts.spool);
+      goto cleanup_jobs;
+    }
+  }
+
+  if (opts.peer_listen != NULL && hexec_peers_init(opts.peer_listen,
+      on_peer_nfree, on_peer_run, shed) < 0) {
+    perror("peer-listen");
+    goto cleanup_jobs;
+  }
+
   opts.argc = argc;
   opts.argv = argv;
   status = hexec_sync_run(&opts, lfd);
-/* close_lfd: */
+  hexec_peers_cleanup();
+cleanup_jobs:
+  hexec_jobs_cleanup();
+cleanup_fanout:
+  hexec_fanout_cleanup();
+cleanup_lanes:
+  hexec_lanes_cleanup();
+  hexec_batch_cleanup();
+cleanup_coalesce:
+  hexec_coalesce_cleanup();
+close_spool:
+  if (spool_ != NULL) {
+    sweep_close(sweep_);
+    spool_close(spool_);
+    sweep_ = NULL;
+    spool_ = NULL;
+  }
+close_budget:
+  if (budget_ != NULL) {
+    budget_close(budget_);
+    budget_ = NULL;
+  }
+close_pressure:
+  if (pressure_ != NULL) {
+    pressure_close(pressure_);
+    pressure_ = NULL;
+  }
+close_record:
+  if (record_fd_ >= 0) {
+    close(record_fd_);
+    record_fd_ = -1;
+  }
+close_errlog:
+  if (errlog_ != NULL) {
+    errlog_close(errlog_);
+    errlog_ = NULL;
+  }
+close_tracelog:
+  if (tracelog_ != NULL) {
+    accesslog_close(tracelog_);
+    tracelog_ = NULL;
+  }
+close_accesslog:
+  if (accesslog_ != NULL) {
+    accesslog_close(accesslog_);
+    accesslog_ = NULL;
+  }
+cleanup_env:
+  envbuf_cleanup(&env_);
+cleanup_children:
+  cleanup_children();
+close_lfd:
+  free(inherited);
   close(lfd);
 done:
+  pipeline_free(&opts.pipeline);
+  exefile_close(&exe_);
+  placement_ = NULL;
   return status;
 usage:
   fprintf(stderr,
@@ -275,7 +2659,127 @@ usage:
       "  -b, --backlog         <n>    Max number of pending connections\n"
       "  -t, --timeout         <n>    Execution timeout, in seconds\n"
       "  -n, --nconcurrent     <n>    Max number of concurrent processes\n"
+      "      --adaptive               Adapt the concurrency limit, up to\n"
+      "                               nconcurrent, to observed latencies\n"
+      "      --max-cpu-pressure <%%>   Stop accepting above this CPU, memory\n"
+      "      --max-memory-pressure <%%> or IO pressure (PSI some avg10)\n"
+      "      --max-io-pressure <%%>\n"
+      "      --min-mem-available <MB> Stop accepting below this available\n"
+      "                               memory\n"
+      "      --pressure-hysteresis <%%> Resume accepting this far below a\n"
+      "                               threshold (default: 20)\n"
+      "      --pressure-interval <ms> Pressure sampling interval\n"
+      "      --shed                   Reply 503 under pressure instead of\n"
+      "                               leaving connections pending\n"
+      "      --coalesce <name,...>    Let concurrent requests with the same\n"
+      "                               values of these SCGI headers share\n"
+      "                               one child and its output\n"
+      "      --coalesce-max-keys <n>  Max # of coalesced requests running\n"
+      "      --coalesce-max-waiters <n> Max # of requests sharing one child\n"
+      "                               (default: 64)\n"
+      "      --batch <n>              Run up to n requests per child, framed\n"
+      "                               as netstrings on stdin and stdout\n"
+      "      --batch-linger <ms>      Max wait for a batch to fill\n"
+      "                               (default: 2)\n"
+      "      --worker                 Keep children running between\n"
+      "                               requests, framed as for --batch\n"
+      "      --worker-max-requests <n> Requests per worker, 0 for no limit\n"
+      "                               (default: 1000)\n"
+      "      --worker-idle <ms>       Stop workers idle this long, 0 to\n"
+      "                               keep them (default: 10000)\n"
+      "      --spool <dir>            Give each child a scratch directory\n"
+      "                               in dir, passed as HEXEC_SPOOL\n"
+      "      --spool-max-age <s>      Remove leftover scratch directories\n"
+      "                               this old, 0 to keep (default: 86400)\n"
+      "      --spool-threads <n>      # of threads removing scratch\n"
+      "                               directories (default: 2)\n"
+      "      --cpus <list>            Run children on these CPUs, e.g.,\n"
+      "                               0-3,6\n"
+      "      --cpu-placement <p>      set (default): children share the\n"
+      "                               CPUs, rr: one CPU per child,\n"
+      "                               round-robin, least: one CPU per\n"
+      "                               child, with the fewest children\n"
+      "      --supervisor-cpu <n>     Run hexec on CPU n, and children on\n"
+      "                               other CPUs\n"
+      "      --sched <class>          Scheduling class of children, e.g.,\n"
+      "                               nice:10,batch,io:be/7 (policies:\n"
+      "                               other, batch, idle; io: rt/n, be/n,\n"
+      "                               idle)\n"
+      "      --sched-header <name>    Choose the class of a request by the\n"
+      "                               value of this SCGI header\n"
+      "      --sched-class <value>=<class> Class of requests with this\n"
+      "                               header value\n"
+      "      --lane <name>[:<min>]    Add a priority lane, below the lanes\n"
+      "                               before it, with min reserved slots\n"
+      "      --lane-header <name>     Queue requests in the lane named by\n"
+      "                               this SCGI header, or in the last lane\n"
+      "      --lane-max-queued <n>    Max # of queued requests (default: 256)\n"
+      "      --lane-stats <ms>        Log lane statistics at this interval\n"
+      "      --deadline <ms>          Drop requests not started within this\n"
+      "                               time after accept, less the average\n"
+      "                               run time, and queue requests by\n"
+      "                               deadline\n"
+      "      --deadline-header <name> Take the deadline of a request, in ms,\n"
+      "                               from this SCGI header\n"
+      "      --fanout-header <name>   Run requests with this SCGI header set\n"
+      "                               to n, 2 to 64, as n shards\n"
+      "      --fanout-max <n>         Max # of fanned out requests (default:\n"
+      "                               16)\n"
+      "      --fanout-order <order>   Order of shard outputs: shard\n"
+      "                               (default), complete\n"
+      "      --fanout-partial <p>     On shard failure: fail (default), omit\n"
+      "      --fanout-timeout <ms>    Kill shards running longer than this\n"
+      "      --stage <path [args]>    Pipe the output of the application\n"
+      "                               through this executable, and of it\n"
+      "                               through the next stage, if any\n"
+      "      --pipe-size <n>          Size of the pipes between stages, in\n"
+      "                               bytes, where it can be set\n"
+      "      --peer-listen <path>     Bind the peer socket of this process\n"
+      "                               here, to exchange load and overflow\n"
+      "                               connections with peers\n"
+      "      --peer <path>            Pass connections that can not be\n"
+      "                               taken to the peer with this peer\n"
+      "                               socket, if it has free slots\n"
+      "      --jobs <header>          Run requests with this SCGI header set\n"
+      "                               to submit as background jobs, and\n"
+      "                               answer status:<id> and cancel:<id>\n"
+      "      --jobs-max-done <n>      # of finished jobs kept (default:\n"
+      "                               1024), in the jobs directory of\n"
+      "                               the spool\n"
+      "  -E, --env-clear              Do not pass the environment to children\n"
+      "  -e, --env  <name[=value]>    Pass, or set, an environment variable\n"
+      "  -a, --access-log   <path>    Access log path, or - for stderr\n"
+      "      --access-log-format <f>  Access log format: text (default), json\n"
+      "      --access-log-size   <n>  Max # of buffered access log records\n"
+      "      --trace <path>           Write request phases as Chrome trace\n"
+      "                               events\n"
+      "      --trace-sample <n>       Trace one in n requests (default: 1)\n"
+      "      --budget <name>          Share a budget of children with other\n"
+      "                               hexec processes using this name\n"
+      "      --budget-limit <n>       Max # of children of all processes\n"
+      "                               sharing the budget (default: # CPUs)\n"
+      "      --budget-weight <n>      Weight of the share of this process\n"
+      "                               (default: 1)\n"
+      "      --stderr-log <path>      Write the stderr of children to this\n"
+      "                               log, or - for stderr, instead of to\n"
+      "                               clients\n"
+      "      --stderr-max-bytes <n>   Max # of stderr bytes logged per child\n"
+      "                               (default: 65536, 0: unbounded)\n"
+      "      --stderr-rate <n>        Max # of stderr bytes logged per second\n"
+      "                               (default: 1048576, 0: unbounded)\n"
+      "      --record <path>          Record requests to this capture, for\n"
+      "                               hexec replay\n"
+      "      --record-sample <n>      Record one in n requests (default: 1)\n"
+      "      --event-batch <n>        Max # of events handled per wait, 16\n"
+      "                               or less for a fixed batch (default:\n"
+      "                               256)\n"
+      "      --busy-poll <us>         Poll for events this long before\n"
+      "                               blocking, using a spare CPU\n"
+      "                               (default: 0)\n"
       "  -h, --help                   This text\n"
+      "signals:\n"
+      "  SIGHUP, SIGUSR2    Re-execute hexec, keeping the listening socket\n"
+      "                     and running children\n"
       , argv0);
   return EXIT_FAILURE;
 }
@@ -0,0 +1,349 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "lib/accesslog.h"
+
+#define LINESZ 1024
+
+static void sleep_ms(long ms) {
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+}
+
+/* writes the phases of a record as trace events, in microseconds since
+ * the epoch */
+static size_t format_chrome(char *buf, const struct accesslog_rec *rec) {
+  int64_t spawned;
+  int64_t exited;
+  int64_t ts;
+  int pid = (int)getpid();
+  int ret;
+
+  ts = (int64_t)rec->conn.tv_sec * 1000000 + rec->conn.tv_nsec / 1000;
+  spawned = ts + rec->spawn_us;
+  exited = spawned + rec->wall_us;
+  ret = snprintf(buf, LINESZ,
+      "{\"name\":\"queue\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+      "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%llu}},\n"
+      "{\"name\":\"spawn\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+      "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%llu}},\n"
+      "{\"name\":\"run\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+      "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%llu,\"pid\":%d,"
+      "\"status\":%d,\"signal\":%d,\"utime_us\":%lld,\"stime_us\":%lld,"
+      "\"maxrss_kb\":%ld,\"lane\":\"%s\"}},\n"
+      "{\"name\":\"reap\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+      "\"pid\":%d,\"tid\":%d,\"args\":{\"id\":%llu}},\n",
+      (long long)(ts - rec->queue_us), (long long)rec->queue_us, pid,
+      rec->slot, (unsigned long long)rec->reqid,
+      (long long)ts, (long long)rec->spawn_us, pid, rec->slot,
+      (unsigned long long)rec->reqid,
+      (long long)spawned, (long long)rec->wall_us, pid, rec->slot,
+      (unsigned long long)rec->reqid, (int)rec->pid, rec->status,
+      rec->signal, (long long)rec->utime_us, (long long)rec->stime_us,
+      rec->maxrss_kb, rec->lane != NULL ? rec->lane : "",
+      (long long)exited, (long long)rec->reap_us, pid, rec->slot,
+      (unsigned long long)rec->reqid);
+  return ret < 0 ? 0 : ret >= LINESZ ? LINESZ - 1 : ret;
+}
+
+static size_t format_rec(struct accesslog *al, char *buf,
+    const struct accesslog_rec *rec) {
+  char tstr[32];
+  char bytes[24];
+  char lane[48] = "";
+  struct tm tm;
+  int ret;
+
+  if (al->format == ACCESSLOG_CHROME) {
+    return format_chrome(buf, rec);
+  }
+
+  gmtime_r(&rec->conn.tv_sec, &tm);
+  strftime(tstr, sizeof(tstr), "%Y-%m-%dT%H:%M:%S", &tm);
+  if (rec->bytes < 0) {
+    snprintf(bytes, sizeof(bytes), "%s",
+        al->format == ACCESSLOG_JSON ? "null" : "-");
+  } else {
+    snprintf(bytes, sizeof(bytes), "%lld", (long long)rec->bytes);
+  }
+
+  if (rec->lane != NULL) {
+    snprintf(lane, sizeof(lane), al->format == ACCESSLOG_JSON ?
+        ",\"lane\":\"%s\"" : " lane=%s", rec->lane);
+  }
+
+  if (al->format == ACCESSLOG_JSON) {
+    ret = snprintf(buf, LINESZ,
+        "{\"time\":\"%s.%06ldZ\",\"id\":%llu,\"pid\":%d,\"limit\":%d,"
+        "\"queue_us\":%lld,\"spawn_us\":%lld,\"wall_us\":%lld,"
+        "\"utime_us\":%lld,\"stime_us\":%lld,\"maxrss_kb\":%ld,"
+        "\"status\":%d,\"signal\":%d,\"bytes\":%s%s}\n",
+        tstr, rec->conn.tv_nsec / 1000, (unsigned long long)rec->reqid,
+        (int)rec->pid, rec->limit, (long long)rec->queue_us,
+        (long long)rec->spawn_us, (long long)rec->wall_us,
+        (long long)rec->utime_us, (long long)rec->stime_us, rec->maxrss_kb,
+        rec->status, rec->signal, bytes, lane);
+  } else {
+    ret = snprintf(buf, LINESZ,
+        "time=%s.%06ldZ id=%llu pid=%d limit=%d queue_us=%lld spawn_us=%lld "
+        "wall_us=%lld utime_us=%lld stime_us=%lld maxrss_kb=%ld status=%d "
+        "signal=%d bytes=%s%s\n",
+        tstr, rec->conn.tv_nsec / 1000, (unsigned long long)rec->reqid,
+        (int)rec->pid, rec->limit, (long long)rec->queue_us,
+        (long long)rec->spawn_us, (long long)rec->wall_us,
+        (long long)rec->utime_us, (long long)rec->stime_us, rec->maxrss_kb,
+        rec->status, rec->signal, bytes, lane);
+  }
+
+  return ret < 0 ? 0 : ret >= LINESZ ? LINESZ - 1 : ret;
+}
+
+static size_t format_dropped(struct accesslog *al, char *buf,
+    uint64_t dropped) {
+  struct timespec now;
+  int ret;
+
+  if (al->format == ACCESSLOG_CHROME) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    ret = snprintf(buf, LINESZ, "{\"name\":\"dropped\",\"ph\":\"i\","
+        "\"s\":\"g\",\"ts\":%lld,\"pid\":%d,\"tid\":0,"
+        "\"args\":{\"dropped\":%llu}},\n",
+        (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000, (int)getpid(),
+        (unsigned long long)dropped);
+  } else if (al->format == ACCESSLOG_JSON) {
+    ret = snprintf(buf, LINESZ, "{\"dropped\":%llu}\n",
+        (unsigned long long)dropped);
+  } else {
+    ret = snprintf(buf, LINESZ, "dropped=%llu\n",
+        (unsigned long long)dropped);
+  }
+
+  return ret < 0 ? 0 : ret;
+}
+
+static void writev_all(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t n;
+
+  while (iovcnt > 0) {
+    n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; /* nowhere to report the error - drop the batch */
+    }
+
+    while (iovcnt > 0 && n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/* write at most ACCESSLOG_BATCH records. Returns the number written */
+static size_t drain(struct accesslog *al,
+    char lines[ACCESSLOG_BATCH + 1][LINESZ], struct iovec *iov) {
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  size_t nrecs;
+  size_t i;
+  int niov = 0;
+
+  tail = atomic_load_explicit(&al->tail, memory_order_relaxed);
+  head = atomic_load_explicit(&al->head, memory_order_acquire);
+  nrecs = head - tail;
+  if (nrecs > ACCESSLOG_BATCH) {
+    nrecs = ACCESSLOG_BATCH;
+  }
+
+  dropped = accesslog_dropped(al);
+  if (dropped != al->reported) {
+    iov[niov].iov_base = lines[niov];
+    iov[niov].iov_len = format_dropped(al, lines[niov], dropped);
+    niov++;
+    al->reported = dropped;
+  }
+
+  for (i = 0; i < nrecs; i++) {
+    iov[niov].iov_base = lines[niov];
+    iov[niov].iov_len = format_rec(al, lines[niov],
+        &al->recs[(tail + i) & al->mask]);
+    niov++;
+  }
+
+  if (niov > 0) {
+    writev_all(al->fd, iov, niov);
+  }
+
+  /* release the records after the write, for accesslog_flush */
+  atomic_store_explicit(&al->tail, tail + nrecs, memory_order_release);
+
+  return nrecs;
+}
+
+static void *writer(void *arg) {
+  char lines[ACCESSLOG_BATCH + 1][LINESZ];
+  struct iovec iov[ACCESSLOG_BATCH + 1];
+  struct accesslog *al = arg;
+  int running;
+
+  for (;;) {
+    running = atomic_load_explicit(&al->running, memory_order_acquire);
+    if (drain(al, lines, iov) == 0) {
+      if (!running) {
+        break;
+      }
+      sleep_ms(ACCESSLOG_INTERVAL_MS);
+    }
+  }
+
+  return NULL;
+}
+
+/* start the array of trace events, unless appending to a trace */
+static int open_array(int fd) {
+  struct stat st;
+  ssize_t n;
+
+  if (fstat(fd, &st) < 0) {
+    return -1;
+  } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    return 0;
+  }
+
+  do {
+    n = write(fd, "[\n", 2);
+  } while (n < 0 && errno == EINTR);
+
+  return n < 0 ? -1 : 0;
+}
+
+int accesslog_open(struct accesslog *al, const char *path, int format,
+    size_t nrecs) {
+  size_t n = 1;
+  int err;
+
+  memset(al, 0, sizeof(*al));
+  if (nrecs == 0) {
+    nrecs = ACCESSLOG_DEFAULT_NRECS;
+  }
+
+  while (n < nrecs) {
+    n <<= 1;
+  }
+
+  al->recs = calloc(n, sizeof(struct accesslog_rec));
+  if (al->recs == NULL) {
+    return -1;
+  }
+
+  al->mask = n - 1;
+  al->format = format;
+  if (strcmp(path, "-") == 0) {
+    al->fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+  } else {
+    al->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  }
+
+  if (al->fd < 0) {
+    goto free_recs;
+  }
+
+  if (format == ACCESSLOG_CHROME && open_array(al->fd) < 0) {
+    goto close_fd;
+  }
+
+  atomic_store(&al->running, 1);
+  err = pthread_create(&al->writer, NULL, writer, al);
+  if (err != 0) {
+    errno = err;
+    goto close_fd;
+  }
+
+  return 0;
+close_fd:
+  err = errno;
+  close(al->fd);
+  errno = err;
+free_recs:
+  free(al->recs);
+  al->recs = NULL;
+  return -1;
+}
+
+int accesslog_close(struct accesslog *al) {
+  int status = 0;
+
+  atomic_store_explicit(&al->running, 0, memory_order_release);
+  if (pthread_join(al->writer, NULL) != 0) {
+    status = -1;
+  }
+
+  if (close(al->fd) < 0) {
+    status = -1;
+  }
+
+  free(al->recs);
+  al->recs = NULL;
+  return status;
+}
+
+int accesslog_push(struct accesslog *al, const struct accesslog_rec *rec) {
+  uint64_t head;
+  uint64_t tail;
+
+  head = atomic_load_explicit(&al->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&al->tail, memory_order_acquire);
+  if (head - tail > al->mask) {
+    atomic_fetch_add_explicit(&al->dropped, 1, memory_order_relaxed);
+    return -1;
+  }
+
+  al->recs[head & al->mask] = *rec;
+  atomic_store_explicit(&al->head, head + 1, memory_order_release);
+  return 0;
+}
+
+void accesslog_flush(struct accesslog *al) {
+  while (atomic_load_explicit(&al->tail, memory_order_acquire) !=
+      atomic_load_explicit(&al->head, memory_order_relaxed)) {
+    sleep_ms(1);
+  }
+}
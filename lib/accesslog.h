@@ -0,0 +1,113 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_ACCESSLOG_H__
+#define LIB_ACCESSLOG_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* The access log is a fixed size ring of binary records with a single
+ * producer and a single consumer. The producer, the supervisor loop,
+ * never blocks or allocates: if the ring is full, the record is dropped
+ * and counted. The consumer is a writer thread that formats records and
+ * writes them in batches with writev(2).
+ *
+ * In the Chrome format, the log is a JSON array of trace events, as read
+ * by chrome://tracing and Perfetto. Each record is written as complete
+ * events for its queue, spawn, run and reap phases, on a thread per
+ * child slot. The array is opened when the log is empty and, as the
+ * format allows, never closed, so that a log can be appended to and
+ * read while it is written. */
+
+#define ACCESSLOG_TEXT 0 /* key=value fields, one record per line */
+#define ACCESSLOG_JSON 1 /* JSON object, one record per line */
+#define ACCESSLOG_CHROME 2 /* Chrome trace events, one phase per line */
+
+#define ACCESSLOG_DEFAULT_NRECS 4096
+#define ACCESSLOG_BATCH         64 /* max # of records per writev(2) */
+#define ACCESSLOG_INTERVAL_MS   100 /* writer poll interval */
+
+struct accesslog_rec {
+  uint64_t reqid;
+  struct timespec conn;   /* time of accept(2), CLOCK_REALTIME */
+  int64_t queue_us;       /* from readable listener to accept(2) */
+  int64_t spawn_us;       /* from accept(2) to running child */
+  int64_t wall_us;        /* from running child to exited child */
+  int64_t reap_us;        /* from exited child to reaped child */
+  int64_t utime_us;       /* user CPU time of the child */
+  int64_t stime_us;       /* system CPU time of the child */
+  long maxrss_kb;         /* max resident set size of the child */
+  int64_t bytes;          /* response bytes, -1 if unknown */
+  pid_t pid;
+  int slot;               /* child slot */
+  int limit;              /* concurrency limit at accept(2) */
+  int status;             /* exit status, -1 if terminated by signal */
+  int signal;             /* terminating signal, or 0 */
+  const char *lane;       /* priority lane, or NULL. Must outlive the log */
+};
+
+struct accesslog {
+  struct accesslog_rec *recs;
+  size_t mask;            /* # of records - 1 */
+  _Atomic uint64_t head;  /* next record to write, owned by producer */
+  _Atomic uint64_t tail;  /* next record to read, owned by consumer */
+  _Atomic uint64_t dropped;
+  _Atomic int running;
+  uint64_t reported;      /* dropped records reported by the writer */
+  int fd;
+  int format;
+  pthread_t writer;
+};
+
+/* accesslog_open --
+ *   Opens 'path' for appending, or uses stderr if 'path' is "-", and
+ *   starts the writer thread. 'nrecs' is rounded up to a power of two;
+ *   zero means ACCESSLOG_DEFAULT_NRECS. Returns 0 on success, -1 on
+ *   error. Sets errno. */
+int accesslog_open(struct accesslog *al, const char *path, int format,
+    size_t nrecs);
+
+/* accesslog_close --
+ *   Writes any remaining records, stops the writer thread and releases
+ *   all resources. Returns 0 on success, -1 on error. */
+int accesslog_close(struct accesslog *al);
+
+/* accesslog_push --
+ *   Copies a record to the ring. Returns 0 on success, -1 if the ring is
+ *   full and the record was dropped. Must only be called from one
+ *   thread. */
+int accesslog_push(struct accesslog *al, const struct accesslog_rec *rec);
+
+/* accesslog_flush --
+ *   Waits until the writer thread has written all pushed records. */
+void accesslog_flush(struct accesslog *al);
+
+/* accesslog_dropped --
+ *   Returns the total number of dropped records. */
+static inline uint64_t accesslog_dropped(struct accesslog *al) {
+  return atomic_load_explicit(&al->dropped, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,266 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "lib/accesslog.h"
+#include "lib/test.h"
+
+#define TESTFILE ".accesslog_test"
+
+static char buf_[1 << 20];
+
+/* reads TESTFILE into buf_ and counts record and drop lines */
+static int read_log(size_t *nrecs, unsigned long long *ndropped) {
+  FILE *fp;
+  size_t len;
+  char *curr;
+  char *end;
+
+  fp = fopen(TESTFILE, "r");
+  if (fp == NULL) {
+    TEST_LOGF("%s: %s", TESTFILE, strerror(errno));
+    return -1;
+  }
+
+  len = fread(buf_, 1, sizeof(buf_) - 1, fp);
+  fclose(fp);
+  unlink(TESTFILE);
+  buf_[len] = '\0';
+
+  *nrecs = 0;
+  *ndropped = 0;
+  for (curr = buf_; *curr != '\0'; curr = end + 1) {
+    end = strchr(curr, '\n');
+    if (end == NULL) {
+      TEST_LOG("unterminated line");
+      return -1;
+    }
+
+    if (strncmp(curr, "dropped=", 8) == 0) {
+      *ndropped = strtoull(curr + 8, NULL, 10);
+    } else if (strncmp(curr, "{\"dropped\":", 11) == 0) {
+      *ndropped = strtoull(curr + 11, NULL, 10);
+    } else {
+      (*nrecs)++;
+    }
+  }
+
+  return 0;
+}
+
+static void fill_rec(struct accesslog_rec *rec, uint64_t reqid) {
+  memset(rec, 0, sizeof(*rec));
+  rec->reqid = reqid;
+  rec->conn.tv_sec = 1234567890;
+  rec->conn.tv_nsec = 42000;
+  rec->queue_us = 1;
+  rec->spawn_us = 2;
+  rec->wall_us = 3;
+  rec->utime_us = 5;
+  rec->stime_us = 6;
+  rec->maxrss_kb = 7;
+  rec->bytes = -1;
+  rec->pid = 4711;
+  rec->limit = 8;
+  rec->status = -1;
+  rec->signal = 9;
+}
+
+static int test_text(void) {
+  struct accesslog al;
+  struct accesslog_rec rec;
+  unsigned long long ndropped;
+  size_t nrecs;
+  const char *expected = "time=2009-02-13T23:31:30.000042Z id=1 pid=4711 limit=8 "
+      "queue_us=1 spawn_us=2 wall_us=3 utime_us=5 stime_us=6 maxrss_kb=7 "
+      "status=-1 signal=9 bytes=-\n";
+
+  unlink(TESTFILE);
+  if (accesslog_open(&al, TESTFILE, ACCESSLOG_TEXT, 0) < 0) {
+    TEST_LOGF("accesslog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  fill_rec(&rec, 1);
+  accesslog_push(&al, &rec);
+  fill_rec(&rec, 2);
+  accesslog_push(&al, &rec);
+  accesslog_flush(&al);
+  if (accesslog_close(&al) < 0 || read_log(&nrecs, &ndropped) < 0) {
+    return TEST_FAIL;
+  }
+
+  if (nrecs != 2 || ndropped != 0 ||
+      strncmp(buf_, expected, strlen(expected)) != 0) {
+    TEST_LOGF("unexpected log: %s", buf_);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_json(void) {
+  struct accesslog al;
+  struct accesslog_rec rec;
+  unsigned long long ndropped;
+  size_t nrecs;
+  const char *expected = "{\"time\":\"2009-02-13T23:31:30.000042Z\","
+      "\"id\":7,\"pid\":4711,\"limit\":8,\"queue_us\":1,\"spawn_us\":2,\"wall_us\":3,"
+      "\"utime_us\":5,\"stime_us\":6,\"maxrss_kb\":7,\"status\":-1,\"signal\":9,\"bytes\":null}\n";
+
+  unlink(TESTFILE);
+  if (accesslog_open(&al, TESTFILE, ACCESSLOG_JSON, 0) < 0) {
+    TEST_LOGF("accesslog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  fill_rec(&rec, 7);
+  accesslog_push(&al, &rec);
+  if (accesslog_close(&al) < 0 || read_log(&nrecs, &ndropped) < 0) {
+    return TEST_FAIL;
+  }
+
+  if (nrecs != 1 || strcmp(buf_, expected) != 0) {
+    TEST_LOGF("unexpected log: %s", buf_);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_lane(void) {
+  struct accesslog al;
+  struct accesslog_rec rec;
+  unsigned long long ndropped;
+  size_t nrecs;
+  const char *expected = "status=-1 signal=9 bytes=- lane=health\n";
+
+  unlink(TESTFILE);
+  if (accesslog_open(&al, TESTFILE, ACCESSLOG_TEXT, 0) < 0) {
+    TEST_LOGF("accesslog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  fill_rec(&rec, 1);
+  rec.lane = "health";
+  accesslog_push(&al, &rec);
+  if (accesslog_close(&al) < 0 || read_log(&nrecs, &ndropped) < 0) {
+    return TEST_FAIL;
+  }
+
+  if (nrecs != 1 || strstr(buf_, expected) == NULL) {
+    TEST_LOGF("unexpected log: %s", buf_);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+/* a trace is appended to, and opened once */
+static int test_chrome(void) {
+  struct accesslog al;
+  struct accesslog_rec rec;
+  unsigned long long ndropped;
+  size_t nrecs;
+  int i;
+  const char *expected = "[\n"
+      "{\"name\":\"queue\",\"ph\":\"X\",\"ts\":1234567890000041,"
+      "\"dur\":1,";
+
+  unlink(TESTFILE);
+  for (i = 0; i < 2; i++) {
+    if (accesslog_open(&al, TESTFILE, ACCESSLOG_CHROME, 0) < 0) {
+      TEST_LOGF("accesslog_open: %s", strerror(errno));
+      return TEST_FAIL;
+    }
+
+    fill_rec(&rec, i + 1);
+    accesslog_push(&al, &rec);
+    if (accesslog_close(&al) < 0) {
+      return TEST_FAIL;
+    }
+  }
+
+  if (read_log(&nrecs, &ndropped) < 0) {
+    return TEST_FAIL;
+  }
+
+  /* the opening bracket, and four phases per record */
+  if (nrecs != 9 || strncmp(buf_, expected, strlen(expected)) != 0 ||
+      strchr(buf_ + 1, '[') != NULL ||
+      strstr(buf_, "{\"name\":\"run\",\"ph\":\"X\","
+      "\"ts\":1234567890000044,\"dur\":3,") == NULL) {
+    TEST_LOGF("unexpected log: %s", buf_);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+/* every pushed record is either written or counted as dropped */
+static int test_dropped(void) {
+  struct accesslog al;
+  struct accesslog_rec rec;
+  unsigned long long ndropped;
+  size_t nrecs;
+  int i;
+  int npushed = 2000;
+
+  unlink(TESTFILE);
+  if (accesslog_open(&al, TESTFILE, ACCESSLOG_TEXT, 4) < 0) {
+    TEST_LOGF("accesslog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  for (i = 0; i < npushed; i++) {
+    fill_rec(&rec, i);
+    accesslog_push(&al, &rec);
+  }
+
+  if (accesslog_dropped(&al) == 0) {
+    TEST_LOG("expected dropped records");
+    accesslog_close(&al);
+    return TEST_FAIL;
+  }
+
+  if (accesslog_close(&al) < 0 || read_log(&nrecs, &ndropped) < 0) {
+    return TEST_FAIL;
+  }
+
+  if (nrecs + ndropped != npushed) {
+    TEST_LOGF("%zu written + %llu dropped != %d pushed", nrecs, ndropped,
+        npushed);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"text", test_text},
+  {"json", test_json},
+  {"lane", test_lane},
+  {"chrome", test_chrome},
+  {"dropped", test_dropped},
+);
@@ -0,0 +1,303 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/budget.h"
+
+#define NAMESZ 256
+
+static int shm_name(const char *name, char *buf) {
+  const char *cptr;
+  int ret;
+
+  for (cptr = name; *cptr != '\0'; cptr++) {
+    if (!((*cptr >= 'a' && *cptr <= 'z') || (*cptr >= 'A' && *cptr <= 'Z') ||
+        (*cptr >= '0' && *cptr <= '9') || *cptr == '_' || *cptr == '.' ||
+        *cptr == '-')) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  ret = snprintf(buf, NAMESZ, "/hexec-%s", name);
+  if (cptr == name || ret < 0 || ret >= NAMESZ) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int64_t now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* tally --
+ *   Sets 'total' to the number of slots taken, 'share' to the share of
+ *   this process and 'reserved' to the unused shares of other members
+ *   that want slots. */
+static void tally(struct budget *b, int limit, int *total, int *share,
+    int *reserved) {
+  struct budget_member *m;
+  int64_t now;
+  int weights = 0;
+  int mshare;
+  int used;
+  int i;
+
+  *total = 0;
+  *reserved = 0;
+  for (i = 0; i < BUDGET_MAXMEMBERS; i++) {
+    m = &b->shm->members[i];
+    *total += atomic_load(&m->used);
+    if (atomic_load(&m->pid) > 0) {
+      weights += atomic_load(&m->weight);
+    }
+  }
+
+  if (weights <= 0) {
+    *share = limit;
+    return;
+  }
+
+  *share = MAX((int)((int64_t)limit * atomic_load(&b->self->weight) /
+      weights), 1);
+  now = now_ms();
+  for (i = 0; i < BUDGET_MAXMEMBERS; i++) {
+    m = &b->shm->members[i];
+    if (m == b->self || atomic_load(&m->pid) <= 0 ||
+        now - atomic_load(&m->wanted_ms) >= BUDGET_WANT_MS) {
+      continue;
+    }
+
+    mshare = MAX((int)((int64_t)limit * atomic_load(&m->weight) / weights),
+        1);
+    used = atomic_load(&m->used);
+    if (used < mshare) {
+      *reserved += mshare - used;
+    }
+  }
+}
+
+int budget_open(struct budget *b, const char *name, int limit, int weight) {
+  char path[NAMESZ];
+  struct budget_member *m = NULL;
+  struct stat st;
+  int32_t pid;
+  int32_t expected;
+  void *mem;
+  int err;
+  int fd;
+  int i;
+
+  if (limit <= 0 || weight <= 0 || shm_name(name, path) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  fd = shm_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+
+  /* concurrent creators truncate to the same size; new memory is zeroed,
+   * which is a valid empty state */
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size < (off_t)sizeof(struct budget_shm) &&
+      ftruncate(fd, sizeof(struct budget_shm)) < 0)) {
+    goto close_fd;
+  }
+
+  mem = mmap(NULL, sizeof(struct budget_shm), PROT_READ | PROT_WRITE,
+      MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    goto close_fd;
+  }
+
+  close(fd);
+  b->shm = mem;
+
+  /* a process attaching again after exec keeps its member */
+  pid = (int32_t)getpid();
+  for (i = 0; i < BUDGET_MAXMEMBERS; i++) {
+    if (atomic_load(&b->shm->members[i].pid) == pid) {
+      m = &b->shm->members[i];
+      break;
+    }
+  }
+
+  for (i = 0; m == NULL && i < BUDGET_MAXMEMBERS; i++) {
+    expected = 0;
+    if (atomic_compare_exchange_strong(&b->shm->members[i].pid, &expected,
+        pid)) {
+      m = &b->shm->members[i];
+      atomic_store(&m->used, 0);
+    }
+  }
+
+  if (m == NULL) {
+    munmap(b->shm, sizeof(struct budget_shm));
+    b->shm = NULL;
+    errno = ENOSPC;
+    return -1;
+  }
+
+  atomic_store(&m->wanted_ms, 0);
+  atomic_store(&m->weight, weight);
+  atomic_store(&b->shm->limit, limit);
+  b->self = m;
+  return 0;
+
+close_fd:
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+void budget_close(struct budget *b) {
+  if (b->shm == NULL) {
+    return;
+  }
+
+  atomic_store(&b->self->used, 0);
+  atomic_store(&b->self->weight, 0);
+  atomic_store(&b->self->pid, 0);
+  munmap(b->shm, sizeof(struct budget_shm));
+  b->shm = NULL;
+  b->self = NULL;
+}
+
+int budget_unlink(const char *name) {
+  char path[NAMESZ];
+
+  if (shm_name(name, path) < 0) {
+    return -1;
+  }
+
+  return shm_unlink(path);
+}
+
+int budget_available(struct budget *b) {
+  int limit;
+  int total;
+  int share;
+  int reserved;
+  int used;
+
+  /* slots within our share, then slots not reserved by others */
+  limit = atomic_load(&b->shm->limit);
+  tally(b, limit, &total, &share, &reserved);
+  used = atomic_load(&b->self->used);
+  return MAX(MAX(MIN(limit - total, share - used), limit - total - reserved),
+      0);
+}
+
+int budget_take(struct budget *b) {
+  int limit;
+  int total;
+  int share;
+  int reserved;
+  int used;
+
+  /* counted before it is checked, so that of concurrent takers at least
+   * one sees the other */
+  used = atomic_fetch_add(&b->self->used, 1) + 1;
+  limit = atomic_load(&b->shm->limit);
+  tally(b, limit, &total, &share, &reserved);
+  if (total > limit || (used > share && total + reserved > limit)) {
+    atomic_fetch_sub(&b->self->used, 1);
+    budget_want(b);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  return 0;
+}
+
+void budget_give(struct budget *b) {
+  int32_t used;
+
+  used = atomic_load(&b->self->used);
+  while (used > 0 &&
+      !atomic_compare_exchange_weak(&b->self->used, &used, used - 1));
+}
+
+void budget_adopt(struct budget *b, int n) {
+  atomic_store(&b->self->used, n > 0 ? n : 0);
+}
+
+void budget_want(struct budget *b) {
+  atomic_store(&b->self->wanted_ms, now_ms());
+}
+
+int budget_reclaim(struct budget *b) {
+  struct budget_member *m;
+  int32_t pid;
+  int nreclaimed = 0;
+  int i;
+
+  for (i = 0; i < BUDGET_MAXMEMBERS; i++) {
+    m = &b->shm->members[i];
+    pid = atomic_load(&m->pid);
+    if (pid <= 0 || m == b->self || kill(pid, 0) == 0 || errno != ESRCH) {
+      continue;
+    }
+
+    /* claim the member so that only one process frees it */
+    if (!atomic_compare_exchange_strong(&m->pid, &pid, -1)) {
+      continue;
+    }
+
+    atomic_store(&m->used, 0);
+    atomic_store(&m->weight, 0);
+    atomic_store(&m->wanted_ms, 0);
+    atomic_store(&m->pid, 0);
+    nreclaimed++;
+  }
+
+  return nreclaimed;
+}
+
+int budget_used(struct budget *b) {
+  int total = 0;
+  int i;
+
+  for (i = 0; i < BUDGET_MAXMEMBERS; i++) {
+    total += atomic_load(&b->shm->members[i].used);
+  }
+
+  return total;
+}
@@ -0,0 +1,119 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_BUDGET_H__
+#define LIB_BUDGET_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A host-wide budget of slots, shared by the processes attached to the
+ * same named shared memory object. The total number of slots taken is
+ * bounded by a limit, set by the last process to attach.
+ *
+ * Each member has a weight, and a share of the limit in proportion to
+ * its weight among the members. A member may take slots beyond its
+ * share, but not ones within the unused share of another member that
+ * wants slots, i.e., that has been refused a slot recently. Idle shares
+ * are thus borrowed, but a member that wants its share gets it as slots
+ * are given back.
+ *
+ * The state is a table of members, each with the number of slots it has
+ * taken, updated with lock-free atomic operations only. The total is the
+ * sum over the table, so that a process that dies at any point leaves a
+ * consistent state. A slot is taken by counting it first and giving it
+ * back if the total is then over the limit; concurrent takers may both
+ * be refused, but never both admitted over the limit. The slots of a
+ * member that has died are reclaimed by the other members, which must
+ * share a PID namespace. */
+
+#define BUDGET_MAXMEMBERS 64
+#define BUDGET_WANT_MS    1000 /* a refused member wants slots this long */
+
+struct budget_member {
+  _Atomic int32_t pid;        /* 0 if free, -1 while reclaimed */
+  _Atomic int32_t weight;
+  _Atomic int32_t used;
+  _Atomic int64_t wanted_ms;  /* CLOCK_MONOTONIC, when last refused */
+};
+
+struct budget_shm {
+  _Atomic int32_t limit;
+  struct budget_member members[BUDGET_MAXMEMBERS];
+};
+
+struct budget {
+  struct budget_shm *shm;
+  struct budget_member *self;
+};
+
+/* budget_open --
+ *   Attaches to the budget 'name', created if needed, with a 'limit'
+ *   for all members and a 'weight' for this process. A process that
+ *   attaches again, e.g., after exec, keeps its slots. Returns 0 on
+ *   success, -1 on error. Sets errno. */
+int budget_open(struct budget *b, const char *name, int limit, int weight);
+
+/* budget_close --
+ *   Gives back all slots of this process, and detaches. The budget
+ *   itself is kept for other processes. */
+void budget_close(struct budget *b);
+
+/* budget_unlink --
+ *   Removes the budget 'name'. Attached processes keep using it.
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int budget_unlink(const char *name);
+
+/* budget_available --
+ *   Returns the number of slots that could be taken. */
+int budget_available(struct budget *b);
+
+/* budget_take --
+ *   Takes a slot. Returns 0 on success, -1 if no slot is available.
+ *   Sets errno, to EAGAIN. */
+int budget_take(struct budget *b);
+
+/* budget_give --
+ *   Gives back a slot. */
+void budget_give(struct budget *b);
+
+/* budget_adopt --
+ *   Sets the number of slots held by this process to 'n', e.g., to the
+ *   number of children inherited on exec. */
+void budget_adopt(struct budget *b, int n);
+
+/* budget_want --
+ *   Marks this process as wanting slots, e.g., while connections are
+ *   waiting. */
+void budget_want(struct budget *b);
+
+/* budget_reclaim --
+ *   Reclaims the slots of members that have died. Returns the number of
+ *   members reclaimed. */
+int budget_reclaim(struct budget *b);
+
+/* budget_used --
+ *   Returns the total number of slots taken. */
+int budget_used(struct budget *b);
+
+#endif
@@ -0,0 +1,262 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/budget.h"
+#include "lib/test.h"
+
+static char name_[64];
+
+static const char *budget_name(void) {
+  snprintf(name_, sizeof(name_), "test-%d", (int)getpid());
+  return name_;
+}
+
+/* child --
+ *   Runs a member in a child process: for each byte read from 'cmdfd',
+ *   takes ('t') or gives ('g') a slot and writes back the result, until
+ *   EOF. Exits without detaching on 'x'. */
+static pid_t child(int limit, int *cmdfd, int *resfd) {
+  struct budget b;
+  int cmd[2];
+  int res[2];
+  char ch;
+  pid_t pid;
+
+  if (pipe(cmd) < 0 || pipe(res) < 0) {
+    return -1;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    return -1;
+  } else if (pid == 0) {
+    close(cmd[1]);
+    close(res[0]);
+    if (budget_open(&b, name_, limit, 1) < 0) {
+      _exit(1);
+    }
+
+    while (read(cmd[0], &ch, 1) == 1) {
+      if (ch == 't') {
+        ch = budget_take(&b) == 0 ? '1' : '0';
+      } else if (ch == 'g') {
+        budget_give(&b);
+        ch = '1';
+      } else if (ch == 'x') {
+        _exit(0);
+      }
+
+      if (write(res[1], &ch, 1) != 1) {
+        break;
+      }
+    }
+
+    budget_close(&b);
+    _exit(0);
+  }
+
+  close(cmd[0]);
+  close(res[1]);
+  *cmdfd = cmd[1];
+  *resfd = res[0];
+  return pid;
+}
+
+static int request(int cmdfd, int resfd, char cmd) {
+  char ch = '0';
+
+  if (write(cmdfd, &cmd, 1) != 1 || read(resfd, &ch, 1) != 1) {
+    return -1;
+  }
+
+  return ch == '1';
+}
+
+static int test_take(void) {
+  struct budget b;
+  int status = TEST_FAIL;
+
+  if (budget_open(&b, budget_name(), 2, 1) < 0) {
+    TEST_LOGF("budget_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (budget_available(&b) != 2 || budget_take(&b) < 0 || budget_take(&b) < 0) {
+    TEST_LOG("expected two slots");
+    goto done;
+  }
+
+  if (budget_available(&b) || budget_take(&b) == 0) {
+    TEST_LOG("expected no third slot");
+    goto done;
+  }
+
+  budget_give(&b);
+  if (budget_used(&b) != 1 || budget_take(&b) < 0) {
+    TEST_LOG("expected a slot after give");
+    goto done;
+  }
+
+  budget_give(&b);
+  budget_give(&b);
+  budget_give(&b);
+  if (budget_used(&b) != 0) {
+    TEST_LOGF("expected no slots used, got %d", budget_used(&b));
+    goto done;
+  }
+
+  budget_adopt(&b, 2);
+  if (budget_available(&b)) {
+    TEST_LOG("expected adopted slots to be used");
+    goto done;
+  }
+
+  status = TEST_OK;
+done:
+  budget_close(&b);
+  budget_unlink(name_);
+  return status;
+}
+
+static int test_share(void) {
+  struct budget b;
+  int status = TEST_FAIL;
+  int cmdfd = -1;
+  int resfd = -1;
+  pid_t pid;
+  int i;
+
+  if (budget_open(&b, budget_name(), 4, 1) < 0) {
+    TEST_LOGF("budget_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  pid = child(4, &cmdfd, &resfd);
+  if (pid < 0) {
+    TEST_LOGF("child: %s", strerror(errno));
+    goto done;
+  }
+
+  /* the child is idle: its share is borrowed */
+  for (i = 0; i < 3; i++) {
+    if (budget_take(&b) < 0) {
+      TEST_LOGF("take %d: expected to borrow", i);
+      goto done;
+    }
+  }
+
+  /* the child takes the last slot, and then wants its share */
+  if (request(cmdfd, resfd, 't') != 1 || request(cmdfd, resfd, 't') != 0) {
+    TEST_LOG("expected one slot for the child");
+    goto done;
+  }
+
+  /* a slot given back above our share goes to the child */
+  budget_give(&b);
+  if (budget_take(&b) == 0) {
+    TEST_LOG("expected the wanted share to be left");
+    goto done;
+  }
+
+  if (request(cmdfd, resfd, 't') != 1) {
+    TEST_LOG("expected the child to get its share");
+    goto done;
+  }
+
+  status = TEST_OK;
+done:
+  if (cmdfd >= 0) {
+    close(cmdfd);
+    close(resfd);
+    waitpid(pid, NULL, 0);
+  }
+
+  budget_close(&b);
+  budget_unlink(name_);
+  return status;
+}
+
+static int test_reclaim(void) {
+  struct budget b;
+  int status = TEST_FAIL;
+  int cmdfd;
+  int resfd;
+  pid_t pid;
+
+  if (budget_open(&b, budget_name(), 2, 1) < 0) {
+    TEST_LOGF("budget_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  pid = child(2, &cmdfd, &resfd);
+  if (pid < 0) {
+    TEST_LOGF("child: %s", strerror(errno));
+    goto done;
+  }
+
+  /* the child dies holding both slots */
+  if (request(cmdfd, resfd, 't') != 1 || request(cmdfd, resfd, 't') != 1) {
+    TEST_LOG("expected two slots for the child");
+    goto cleanup_child;
+  }
+
+  request(cmdfd, resfd, 'x');
+  waitpid(pid, NULL, 0);
+  pid = -1;
+  if (budget_available(&b)) {
+    TEST_LOG("expected no slots before reclaim");
+    goto cleanup_child;
+  }
+
+  if (budget_reclaim(&b) != 1 || budget_reclaim(&b) != 0) {
+    TEST_LOG("expected one member reclaimed");
+    goto cleanup_child;
+  }
+
+  if (budget_used(&b) != 0 || budget_take(&b) < 0) {
+    TEST_LOG("expected slots after reclaim");
+    goto cleanup_child;
+  }
+
+  status = TEST_OK;
+cleanup_child:
+  close(cmdfd);
+  close(resfd);
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+done:
+  budget_close(&b);
+  budget_unlink(name_);
+  return status;
+}
+
+TEST_ENTRY(
+  {"take", test_take},
+  {"share", test_share},
+  {"reclaim", test_reclaim},
+);
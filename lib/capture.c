@@ -0,0 +1,190 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/capture.h"
+
+static void put_le(unsigned char *buf, uint64_t val, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    buf[i] = (val >> (i * 8)) & 0xff;
+  }
+}
+
+static uint64_t get_le(const unsigned char *buf, size_t len) {
+  uint64_t val = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    val |= (uint64_t)buf[i] << (i * 8);
+  }
+
+  return val;
+}
+
+int capture_open(const char *path) {
+  struct stat st;
+  ssize_t n;
+  int err;
+  int fd;
+
+  fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    goto close_fd;
+  } else if (st.st_size > 0) {
+    return fd;
+  }
+
+  do {
+    n = write(fd, CAPTURE_MAGIC, CAPTURE_MAGICSZ);
+  } while (n < 0 && errno == EINTR);
+
+  if (n != CAPTURE_MAGICSZ) {
+    errno = n < 0 ? errno : EIO;
+    goto close_fd;
+  }
+
+  return fd;
+close_fd:
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+int capture_write(int fd, int64_t ts_us, const char *data, size_t len) {
+  unsigned char hdr[CAPTURE_HDRSZ];
+  struct iovec iov[2];
+  ssize_t n;
+
+  if (len > CAPTURE_MAXSIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  put_le(hdr, (uint64_t)ts_us, 8);
+  put_le(hdr + 8, len, 4);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = len;
+  do {
+    n = writev(fd, iov, 2);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    return -1;
+  } else if (n != sizeof(hdr) + len) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+int capture_load(struct capture *c, const char *path) {
+  struct stat st;
+  ssize_t n;
+  int err;
+  int fd;
+
+  memset(c, 0, sizeof(*c));
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fstat(fd, &st) < 0) {
+    goto close_fd;
+  }
+
+  c->buf = malloc(st.st_size > 0 ? st.st_size : 1);
+  if (c->buf == NULL) {
+    goto close_fd;
+  }
+
+  while (c->len < st.st_size) {
+    n = read(fd, c->buf + c->len, st.st_size - c->len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      break;
+    }
+    c->len += n;
+  }
+
+  close(fd);
+  if (c->len < CAPTURE_MAGICSZ ||
+      memcmp(c->buf, CAPTURE_MAGIC, CAPTURE_MAGICSZ) != 0) {
+    capture_cleanup(c);
+    errno = EINVAL;
+    return -1;
+  }
+
+  c->off = CAPTURE_MAGICSZ;
+  return 0;
+close_fd:
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+}
+
+int capture_next(struct capture *c, struct capture_rec *rec) {
+  const unsigned char *hdr;
+
+  if (c->off == c->len) {
+    return 0;
+  } else if (c->len - c->off < CAPTURE_HDRSZ) {
+    return -1;
+  }
+
+  hdr = (const unsigned char *)c->buf + c->off;
+  rec->ts_us = (int64_t)get_le(hdr, 8);
+  rec->len = get_le(hdr + 8, 4);
+  if (c->len - c->off - CAPTURE_HDRSZ < rec->len) {
+    return -1;
+  }
+
+  rec->data = c->buf + c->off + CAPTURE_HDRSZ;
+  c->off += CAPTURE_HDRSZ + rec->len;
+  return 1;
+}
+
+void capture_cleanup(struct capture *c) {
+  free(c->buf);
+  c->buf = NULL;
+  c->len = 0;
+  c->off = 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_CAPTURE_H__
+#define LIB_CAPTURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A capture is a file of recorded requests, for replay. It starts with
+ * CAPTURE_MAGIC, followed by records of a 12 byte header and the request
+ * data. The header is the time of the request, in microseconds since the
+ * epoch, as a 64 bit integer, and the length of the data as a 32 bit
+ * integer, both little-endian.
+ *
+ * Records are appended with a single write(2) each, so that processes
+ * may record to the same capture concurrently. */
+
+#define CAPTURE_MAGIC   "hexeccap"
+#define CAPTURE_MAGICSZ 8
+#define CAPTURE_HDRSZ   12
+#define CAPTURE_MAXSIZE 65536 /* max size of a recorded request */
+
+struct capture_rec {
+  int64_t ts_us;
+  const char *data;
+  size_t len;
+};
+
+struct capture {
+  char *buf;
+  size_t len;
+  size_t off;
+};
+
+/* capture_open --
+ *   Opens the capture 'path' for appending, created if needed. Returns a
+ *   close-on-exec descriptor on success, -1 on error. Sets errno. */
+int capture_open(const char *path);
+
+/* capture_write --
+ *   Appends a record of 'len' bytes of 'data', at 'ts_us', to the capture
+ *   'fd'. Returns 0 on success, -1 on error. Sets errno. */
+int capture_write(int fd, int64_t ts_us, const char *data, size_t len);
+
+/* capture_load --
+ *   Reads the capture 'path' into memory. Returns 0 on success, -1 on
+ *   error. Sets errno, to EINVAL if 'path' is not a capture. */
+int capture_load(struct capture *c, const char *path);
+
+/* capture_next --
+ *   Sets 'rec' to the next record of 'c'. Returns 1 on success, 0 at the
+ *   end of the capture and -1 if the record is truncated. */
+int capture_next(struct capture *c, struct capture_rec *rec);
+
+/* capture_cleanup --
+ *   Releases the resources of a loaded capture. */
+void capture_cleanup(struct capture *c);
+
+#endif
@@ -0,0 +1,140 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/capture.h"
+#include "lib/test.h"
+
+#define TESTFILE ".capture_test"
+
+static int test_roundtrip(void) {
+  struct capture c;
+  struct capture_rec rec;
+  int status = TEST_FAIL;
+  int fd;
+
+  unlink(TESTFILE);
+  fd = capture_open(TESTFILE);
+  if (fd < 0) {
+    TEST_LOGF("capture_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (capture_write(fd, 1234567890123456LL, "3:a\0b,", 6) < 0 ||
+      capture_write(fd, 1234567890123457LL, "", 0) < 0) {
+    TEST_LOGF("capture_write: %s", strerror(errno));
+    close(fd);
+    goto done;
+  }
+  close(fd);
+
+  /* appending to a capture does not repeat its magic */
+  fd = capture_open(TESTFILE);
+  if (fd < 0 || capture_write(fd, 42, "x", 1) < 0) {
+    TEST_LOGF("capture_open: %s", strerror(errno));
+    goto done;
+  }
+  close(fd);
+
+  if (capture_load(&c, TESTFILE) < 0) {
+    TEST_LOGF("capture_load: %s", strerror(errno));
+    goto done;
+  }
+
+  if (capture_next(&c, &rec) != 1 || rec.ts_us != 1234567890123456LL ||
+      rec.len != 6 || memcmp(rec.data, "3:a\0b,", 6) != 0) {
+    TEST_LOG("unexpected first record");
+    goto cleanup;
+  }
+
+  if (capture_next(&c, &rec) != 1 || rec.ts_us != 1234567890123457LL ||
+      rec.len != 0) {
+    TEST_LOG("unexpected second record");
+    goto cleanup;
+  }
+
+  if (capture_next(&c, &rec) != 1 || rec.ts_us != 42 || rec.len != 1 ||
+      capture_next(&c, &rec) != 0) {
+    TEST_LOG("unexpected third record");
+    goto cleanup;
+  }
+
+  status = TEST_OK;
+cleanup:
+  capture_cleanup(&c);
+done:
+  unlink(TESTFILE);
+  return status;
+}
+
+static int test_invalid(void) {
+  struct capture c;
+  struct capture_rec rec;
+  int status = TEST_FAIL;
+  int fd;
+
+  fd = open(TESTFILE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0 || write(fd, "not a capture", 13) != 13) {
+    TEST_LOGF("%s: %s", TESTFILE, strerror(errno));
+    goto done;
+  }
+  close(fd);
+
+  if (capture_load(&c, TESTFILE) == 0 || errno != EINVAL) {
+    TEST_LOG("expected EINVAL");
+    goto done;
+  }
+
+  /* a record cut short, e.g., by a full disk */
+  unlink(TESTFILE);
+  fd = capture_open(TESTFILE);
+  if (fd < 0 || capture_write(fd, 1, "abc", 3) < 0 ||
+      ftruncate(fd, CAPTURE_MAGICSZ + CAPTURE_HDRSZ + 2) < 0) {
+    TEST_LOGF("%s: %s", TESTFILE, strerror(errno));
+    goto done;
+  }
+  close(fd);
+
+  if (capture_load(&c, TESTFILE) < 0) {
+    TEST_LOGF("capture_load: %s", strerror(errno));
+    goto done;
+  }
+
+  if (capture_next(&c, &rec) != -1) {
+    TEST_LOG("expected a truncated record");
+  } else {
+    status = TEST_OK;
+  }
+
+  capture_cleanup(&c);
+done:
+  unlink(TESTFILE);
+  return status;
+}
+
+TEST_ENTRY(
+  {"roundtrip", test_roundtrip},
+  {"invalid", test_invalid},
+);
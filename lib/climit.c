@@ -0,0 +1,78 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <string.h>
+
+#include "lib/climit.h"
+
+/* integer square root, to avoid libm */
+static int isqrt(int n) {
+  int r = 0;
+
+  while ((r + 1) * (r + 1) <= n) {
+    r++;
+  }
+
+  return r;
+}
+
+static double ewma(double avg, double sample, int window) {
+  return avg + (sample - avg) / window;
+}
+
+void climit_init(struct climit *cl, int min, int max, int initial) {
+  memset(cl, 0, sizeof(*cl));
+  cl->min = min < 1 ? 1 : min;
+  cl->max = max < cl->min ? cl->min : max;
+  cl->limit = initial < cl->min ? cl->min :
+      initial > cl->max ? cl->max : initial;
+}
+
+void climit_sample(struct climit *cl, int64_t latency_us, int inflight) {
+  double gradient;
+  double limit;
+
+  if (latency_us <= 0) {
+    latency_us = 1;
+  }
+
+  if (cl->base_us == 0) {
+    cl->base_us = cl->avg_us = latency_us;
+  } else {
+    cl->avg_us = ewma(cl->avg_us, latency_us, CLIMIT_WINDOW);
+    if (latency_us < cl->base_us) {
+      cl->base_us = latency_us;
+    } else if (inflight <= CLIMIT_NOLOAD || inflight <= cl->min) {
+      cl->base_us = cl->avg_us < cl->base_us ? cl->base_us : cl->avg_us;
+    }
+  }
+
+  /* an unused limit can not be verified - do not let it grow */
+  if (inflight < cl->limit / 2) {
+    return;
+  }
+
+  gradient = CLIMIT_TOLERANCE * cl->base_us / cl->avg_us;
+  gradient = gradient < 0.5 ? 0.5 : gradient > 1.0 ? 1.0 : gradient;
+  limit = cl->limit * gradient + isqrt((int)cl->limit);
+  limit = cl->limit * (1 - CLIMIT_SMOOTHING) + limit * CLIMIT_SMOOTHING;
+  cl->limit = limit < cl->min ? cl->min : limit > cl->max ? cl->max : limit;
+}
@@ -0,0 +1,65 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_CLIMIT_H__
+#define LIB_CLIMIT_H__
+
+#include <stdint.h>
+
+/* An adaptive concurrency limit, adjusted from observed latencies with
+ * a gradient algorithm. The baseline is the lowest observed latency,
+ * i.e., the latency without queueing. The limit grows by a queue
+ * allowance of sqrt(limit) while the average latency is within a
+ * tolerance of the baseline, and is scaled down by the ratio between
+ * the two when latency rises. A latency sampled with few requests in
+ * flight is a no-load latency, so such samples also move the baseline
+ * up, which lets the limit recover if the work itself became slower. */
+
+#define CLIMIT_WINDOW     10   /* # of samples in the average latency */
+#define CLIMIT_TOLERANCE  1.5  /* accepted latency increase */
+#define CLIMIT_SMOOTHING  0.2  /* weight of a new limit */
+#define CLIMIT_NOLOAD     4    /* max # of requests in flight at no load */
+
+struct climit {
+  double limit;
+  double base_us;   /* baseline latency, 0 before the first sample */
+  double avg_us;
+  int min;
+  int max;
+};
+
+/* climit_init --
+ *   Initializes a limit within ['min', 'max'], starting at 'initial'. */
+void climit_init(struct climit *cl, int min, int max, int initial);
+
+/* climit_sample --
+ *   Updates the limit with the latency of a completed request.
+ *   'inflight' is the number of requests in flight when it completed,
+ *   including itself. The limit does not grow while it is not used. */
+void climit_sample(struct climit *cl, int64_t latency_us, int inflight);
+
+/* climit_get --
+ *   Returns the current limit. */
+static inline int climit_get(const struct climit *cl) {
+  return (int)cl->limit;
+}
+
+#endif
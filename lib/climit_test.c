@@ -0,0 +1,149 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+#include "lib/climit.h"
+#include "lib/test.h"
+
+/* run the limit against a server whose latency grows linearly with the
+ * load above 'knee' concurrent requests, saturated with requests */
+static int simulate(struct climit *cl, int knee, int nsamples) {
+  int64_t latency;
+  int limit;
+  int i;
+
+  for (i = 0; i < nsamples; i++) {
+    limit = climit_get(cl);
+    latency = 10000;
+    if (limit > knee) {
+      latency = latency * limit / knee;
+    }
+    climit_sample(cl, latency, limit);
+  }
+
+  return climit_get(cl);
+}
+
+static int test_grow(void) {
+  struct climit cl;
+  int limit;
+
+  climit_init(&cl, 1, 64, 4);
+  limit = simulate(&cl, 1000, 200);
+  if (limit != 64) {
+    TEST_LOGF("limit %d, expected 64", limit);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_knee(void) {
+  struct climit cl;
+  int limit;
+
+  climit_init(&cl, 1, 256, 4);
+  limit = simulate(&cl, 20, 5000);
+  if (limit < 20 || limit > 40) {
+    TEST_LOGF("limit %d, expected near 20", limit);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_shrink(void) {
+  struct climit cl;
+  int i;
+
+  climit_init(&cl, 2, 64, 64);
+  for (i = 0; i < 100; i++) {
+    climit_sample(&cl, 10000, 64);
+  }
+
+  for (i = 0; i < 100; i++) {
+    climit_sample(&cl, 100000, 64);
+  }
+
+  if (climit_get(&cl) >= 32) {
+    TEST_LOGF("limit %d after latency increase", climit_get(&cl));
+    return TEST_FAIL;
+  }
+
+  for (i = 0; i < 10000; i++) {
+    climit_sample(&cl, 1000000, 64);
+  }
+
+  if (climit_get(&cl) < 2) {
+    TEST_LOGF("limit %d below min", climit_get(&cl));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+/* the work itself becomes slower: the limit first collapses and then
+ * recovers once the baseline has been re-learned */
+static int test_recover(void) {
+  struct climit cl;
+  int limit;
+  int i;
+
+  climit_init(&cl, 1, 64, 64);
+  for (i = 0; i < 100; i++) {
+    climit_sample(&cl, 10000, 64);
+  }
+
+  for (i = 0; i < 1000; i++) {
+    limit = climit_get(&cl);
+    climit_sample(&cl, 100000, limit);
+  }
+
+  if (climit_get(&cl) != 64) {
+    TEST_LOGF("limit %d, expected 64", climit_get(&cl));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_unused(void) {
+  struct climit cl;
+  int i;
+
+  climit_init(&cl, 1, 64, 8);
+  for (i = 0; i < 100; i++) {
+    climit_sample(&cl, 10000, 1);
+  }
+
+  if (climit_get(&cl) != 8) {
+    TEST_LOGF("unused limit changed to %d", climit_get(&cl));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"grow", test_grow},
+  {"knee", test_knee},
+  {"shrink", test_shrink},
+  {"recover", test_recover},
+  {"unused", test_unused},
+);
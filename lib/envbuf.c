@@ -0,0 +1,218 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/envbuf.h"
+
+extern char **environ;
+
+void envbuf_init(struct envbuf *eb) {
+  memset(eb, 0, sizeof(*eb));
+}
+
+void envbuf_cleanup(struct envbuf *eb) {
+  size_t i;
+
+  if (eb->vars != NULL) {
+    for (i = 0; i < eb->nvars; i++) {
+      free(eb->vars[i]);
+    }
+  }
+
+  if (eb->slots != NULL) {
+    for (i = 0; i < eb->nslots; i++) {
+      free(eb->slots[i].envp);
+      free(eb->slots[i].buf);
+    }
+  }
+
+  free(eb->slots);
+  free(eb->arena);
+  free(eb->vars);
+  memset(eb, 0, sizeof(*eb));
+}
+
+static size_t namelen(const char *var) {
+  const char *eq;
+
+  eq = strchr(var, '=');
+  return eq == NULL ? strlen(var) : eq - var;
+}
+
+int envbuf_add(struct envbuf *eb, const char *var) {
+  size_t len;
+  size_t i;
+  char **vars;
+  char *dup;
+
+  if (eb->arena != NULL || strchr(var, '=') == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  dup = strdup(var);
+  if (dup == NULL) {
+    return -1;
+  }
+
+  len = namelen(var);
+  for (i = 0; i < eb->nvars; i++) {
+    if (namelen(eb->vars[i]) == len &&
+        strncmp(eb->vars[i], var, len) == 0) {
+      free(eb->vars[i]);
+      eb->vars[i] = dup;
+      return 0;
+    }
+  }
+
+  if (eb->nvars == eb->cap) {
+    vars = realloc(eb->vars, (eb->cap + 32) * sizeof(char *));
+    if (vars == NULL) {
+      free(dup);
+      return -1;
+    }
+
+    eb->vars = vars;
+    eb->cap += 32;
+  }
+
+  eb->vars[eb->nvars++] = dup;
+  return 0;
+}
+
+int envbuf_inherit(struct envbuf *eb, const char *name) {
+  char **curr;
+  size_t len;
+
+  if (environ == NULL) {
+    return 0;
+  }
+
+  len = name == NULL ? 0 : strlen(name);
+  for (curr = environ; *curr != NULL; curr++) {
+    if (strchr(*curr, '=') == NULL) {
+      continue;
+    }
+
+    if (name == NULL || (namelen(*curr) == len &&
+        strncmp(*curr, name, len) == 0)) {
+      if (envbuf_add(eb, *curr) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int envbuf_finalize(struct envbuf *eb, size_t nslots, size_t nslotvars,
+    size_t slotsize) {
+  struct envbuf_slot *slot;
+  size_t arenalen = 0;
+  size_t len;
+  size_t i;
+  size_t j;
+  char *curr;
+
+  if (eb->arena != NULL || nslots == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < eb->nvars; i++) {
+    arenalen += strlen(eb->vars[i]) + 1;
+  }
+
+  eb->arena = malloc(arenalen > 0 ? arenalen : 1);
+  eb->slots = calloc(nslots, sizeof(struct envbuf_slot));
+  if (eb->arena == NULL || eb->slots == NULL) {
+    goto fail;
+  }
+
+  eb->nslots = nslots;
+  eb->nslotvars = nslotvars;
+  eb->slotsize = slotsize;
+  for (i = 0; i < nslots; i++) {
+    slot = &eb->slots[i];
+    slot->envp = calloc(eb->nvars + nslotvars + 1, sizeof(char *));
+    slot->buf = malloc(slotsize > 0 ? slotsize : 1);
+    if (slot->envp == NULL || slot->buf == NULL) {
+      goto fail;
+    }
+  }
+
+  /* lay out the static variables and point each slot vector to them */
+  for (i = 0, curr = eb->arena; i < eb->nvars; i++) {
+    len = strlen(eb->vars[i]) + 1;
+    memcpy(curr, eb->vars[i], len);
+    for (j = 0; j < nslots; j++) {
+      eb->slots[j].envp[i] = curr;
+    }
+    curr += len;
+    free(eb->vars[i]);
+  }
+
+  free(eb->vars);
+  eb->vars = NULL;
+  eb->cap = 0;
+  return 0;
+
+fail:
+  envbuf_cleanup(eb);
+  errno = ENOMEM;
+  return -1;
+}
+
+void envbuf_slot_reset(struct envbuf *eb, size_t slot) {
+  struct envbuf_slot *s = &eb->slots[slot];
+
+  s->used = 0;
+  s->nvars = 0;
+  s->envp[eb->nvars] = NULL;
+}
+
+int envbuf_slot_set(struct envbuf *eb, size_t slot, const char *name,
+    const char *value) {
+  struct envbuf_slot *s = &eb->slots[slot];
+  size_t nlen;
+  size_t vlen;
+  char *curr;
+
+  nlen = strlen(name);
+  vlen = strlen(value);
+  if (s->nvars >= eb->nslotvars ||
+      eb->slotsize - s->used < nlen + vlen + 2) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  curr = s->buf + s->used;
+  memcpy(curr, name, nlen);
+  curr[nlen] = '=';
+  memcpy(curr + nlen + 1, value, vlen + 1);
+  s->envp[eb->nvars + s->nvars++] = curr;
+  s->envp[eb->nvars + s->nvars] = NULL;
+  s->used += nlen + vlen + 2;
+  return 0;
+}
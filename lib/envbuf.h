@@ -0,0 +1,97 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_ENVBUF_H__
+#define LIB_ENVBUF_H__
+
+#include <stddef.h>
+
+/* An envbuf builds environment vectors for execve(2) without allocating
+ * memory on the spawn path. The static part of the environment is
+ * collected at startup with envbuf_add/envbuf_inherit and laid out in a
+ * contiguous arena by envbuf_finalize. Each of 'nslots' slots has its
+ * own vector, pre-filled with the static part, followed by room for
+ * per-request variables stored in a fixed size slot region. */
+
+struct envbuf_slot {
+  char **envp;  /* static part, slot vars, NULL */
+  char *buf;    /* slot region */
+  size_t used;  /* bytes used in slot region */
+  size_t nvars; /* # of slot vars */
+};
+
+struct envbuf {
+  char **vars;     /* static variables, before envbuf_finalize */
+  size_t nvars;
+  size_t cap;
+  char *arena;     /* static variables, after envbuf_finalize */
+  struct envbuf_slot *slots;
+  size_t nslots;
+  size_t nslotvars;
+  size_t slotsize;
+};
+
+/* envbuf_init --
+ *   Initializes an empty envbuf. */
+void envbuf_init(struct envbuf *eb);
+
+/* envbuf_cleanup --
+ *   Releases all resources associated with an envbuf. */
+void envbuf_cleanup(struct envbuf *eb);
+
+/* envbuf_add --
+ *   Adds a static "NAME=VALUE" variable, replacing any previous variable
+ *   with the same name. Must be called before envbuf_finalize. Returns 0
+ *   on success, -1 on error. Sets errno. */
+int envbuf_add(struct envbuf *eb, const char *var);
+
+/* envbuf_inherit --
+ *   Adds variable 'name' from the environment of the current process as
+ *   a static variable. If 'name' is NULL, all variables are added. A
+ *   variable missing from the environment is not an error. Returns 0 on
+ *   success, -1 on error. Sets errno. */
+int envbuf_inherit(struct envbuf *eb, const char *name);
+
+/* envbuf_finalize --
+ *   Lays out the static variables in the arena and allocates 'nslots'
+ *   slots with room for 'nslotvars' variables of 'slotsize' bytes in
+ *   total. Returns 0 on success, -1 on error. Sets errno. */
+int envbuf_finalize(struct envbuf *eb, size_t nslots, size_t nslotvars,
+    size_t slotsize);
+
+/* envbuf_slot_reset --
+ *   Removes all slot variables from a slot. */
+void envbuf_slot_reset(struct envbuf *eb, size_t slot);
+
+/* envbuf_slot_set --
+ *   Appends variable 'name' with 'value' to a slot. Does not check for
+ *   duplicates. Returns 0 on success, -1 if the slot is full. Sets
+ *   errno. */
+int envbuf_slot_set(struct envbuf *eb, size_t slot, const char *name,
+    const char *value);
+
+/* envbuf_slot_envp --
+ *   Returns the NULL terminated environment vector of a slot. */
+static inline char **envbuf_slot_envp(struct envbuf *eb, size_t slot) {
+  return eb->slots[slot].envp;
+}
+
+#endif
@@ -0,0 +1,134 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+#include <errno.h>
+#include <string.h>
+
+#include "lib/envbuf.h"
+#include "lib/test.h"
+
+/* compare a NULL terminated vector to the expected strings */
+static int check_envp(char **envp, const char **expected, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (envp[i] == NULL || strcmp(envp[i], expected[i]) != 0) {
+      TEST_LOGF("envp[%zu]: expected %s, got %s", i, expected[i],
+          envp[i] == NULL ? "NULL" : envp[i]);
+      return TEST_FAIL;
+    }
+  }
+
+  if (envp[n] != NULL) {
+    TEST_LOGF("envp[%zu]: expected NULL, got %s", n, envp[n]);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_static(void) {
+  struct envbuf eb;
+  int status = TEST_FAIL;
+  const char *expected[] = {"FOO=baz", "BAR=1", "ENVBUF_TEST=yes"};
+
+  setenv("ENVBUF_TEST", "yes", 1);
+  envbuf_init(&eb);
+  if (envbuf_add(&eb, "FOO=bar") < 0 ||
+      envbuf_add(&eb, "BAR=1") < 0 ||
+      envbuf_add(&eb, "FOO=baz") < 0 ||
+      envbuf_inherit(&eb, "ENVBUF_TEST") < 0 ||
+      envbuf_inherit(&eb, "ENVBUF_TEST_MISSING") < 0) {
+    TEST_LOGF("envbuf_add: %s", strerror(errno));
+    goto cleanup;
+  }
+
+  if (envbuf_add(&eb, "NOVALUE") == 0) {
+    TEST_LOG("envbuf_add: expected failure for variable without '='");
+    goto cleanup;
+  }
+
+  if (envbuf_finalize(&eb, 2, 4, 64) < 0) {
+    TEST_LOGF("envbuf_finalize: %s", strerror(errno));
+    goto cleanup;
+  }
+
+  if (check_envp(envbuf_slot_envp(&eb, 0), expected, 3) != TEST_OK ||
+      check_envp(envbuf_slot_envp(&eb, 1), expected, 3) != TEST_OK) {
+    goto cleanup;
+  }
+
+  status = TEST_OK;
+cleanup:
+  envbuf_cleanup(&eb);
+  unsetenv("ENVBUF_TEST");
+  return status;
+}
+
+static int test_slots(void) {
+  struct envbuf eb;
+  int status = TEST_FAIL;
+  const char *expected0[] = {"A=1", "X=slot0", "Y=2"};
+  const char *expected1[] = {"A=1", "X=slot1"};
+
+  envbuf_init(&eb);
+  if (envbuf_add(&eb, "A=1") < 0 || envbuf_finalize(&eb, 2, 2, 16) < 0) {
+    TEST_LOGF("envbuf: %s", strerror(errno));
+    goto cleanup;
+  }
+
+  envbuf_slot_reset(&eb, 0);
+  envbuf_slot_reset(&eb, 1);
+  if (envbuf_slot_set(&eb, 0, "X", "slot0") < 0 ||
+      envbuf_slot_set(&eb, 0, "Y", "2") < 0 ||
+      envbuf_slot_set(&eb, 1, "X", "slot1") < 0) {
+    TEST_LOGF("envbuf_slot_set: %s", strerror(errno));
+    goto cleanup;
+  }
+
+  /* out of variables in slot 0, out of space in slot 1 */
+  if (envbuf_slot_set(&eb, 0, "Z", "3") == 0 ||
+      envbuf_slot_set(&eb, 1, "LONGNAME", "toolong") == 0) {
+    TEST_LOG("envbuf_slot_set: expected failure on full slot");
+    goto cleanup;
+  }
+
+  if (check_envp(envbuf_slot_envp(&eb, 0), expected0, 3) != TEST_OK ||
+      check_envp(envbuf_slot_envp(&eb, 1), expected1, 2) != TEST_OK) {
+    goto cleanup;
+  }
+
+  /* a reset slot is reusable */
+  envbuf_slot_reset(&eb, 0);
+  if (envbuf_slot_set(&eb, 0, "X", "slot1") < 0 ||
+      check_envp(envbuf_slot_envp(&eb, 0), expected1, 2) != TEST_OK) {
+    goto cleanup;
+  }
+
+  status = TEST_OK;
+cleanup:
+  envbuf_cleanup(&eb);
+  return status;
+}
+
+TEST_ENTRY(
+  {"static", test_static},
+  {"slots", test_slots},
+);
@@ -0,0 +1,332 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "lib/errlog.h"
+
+#define TAGSZ 48 /* "id=%llu pid=%d " */
+
+static void sleep_ms(long ms) {
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+}
+
+static void writev_all(int fd, struct iovec *iov, int iovcnt) {
+  ssize_t n;
+
+  while (iovcnt > 0) {
+    n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; /* nowhere to report the error - drop the batch */
+    }
+
+    while (iovcnt > 0 && n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/* write all logged lines. Returns the number of bytes written */
+static size_t drain(struct errlog *el) {
+  char note[64];
+  struct iovec iov[3];
+  uint64_t head;
+  uint64_t tail;
+  uint64_t dropped;
+  size_t off;
+  size_t len;
+  int niov = 0;
+  int ret;
+
+  tail = atomic_load_explicit(&el->tail, memory_order_relaxed);
+  head = atomic_load_explicit(&el->head, memory_order_acquire);
+  dropped = errlog_dropped(el);
+  if (dropped != el->reported) {
+    ret = snprintf(note, sizeof(note), "dropped=%llu\n",
+        (unsigned long long)dropped);
+    iov[niov].iov_base = note;
+    iov[niov].iov_len = ret;
+    niov++;
+    el->reported = dropped;
+  }
+
+  /* the lines may wrap around the end of the ring */
+  off = tail & el->mask;
+  len = head - tail;
+  if (off + len > el->mask + 1) {
+    iov[niov].iov_base = el->buf + off;
+    iov[niov].iov_len = el->mask + 1 - off;
+    niov++;
+    iov[niov].iov_base = el->buf;
+    iov[niov].iov_len = len - (el->mask + 1 - off);
+    niov++;
+  } else if (len > 0) {
+    iov[niov].iov_base = el->buf + off;
+    iov[niov].iov_len = len;
+    niov++;
+  }
+
+  if (niov > 0) {
+    writev_all(el->fd, iov, niov);
+  }
+
+  /* release the lines after the write, for errlog_flush */
+  atomic_store_explicit(&el->tail, head, memory_order_release);
+  return len;
+}
+
+static void *writer(void *arg) {
+  struct errlog *el = arg;
+  int running;
+
+  for (;;) {
+    running = atomic_load_explicit(&el->running, memory_order_acquire);
+    if (drain(el) == 0) {
+      if (!running) {
+        break;
+      }
+      sleep_ms(ERRLOG_INTERVAL_MS);
+    }
+  }
+
+  return NULL;
+}
+
+/* take 'n' bytes from the token bucket. Returns 0 on success, -1 if
+ * over the rate */
+static int take_tokens(struct errlog *el, size_t n) {
+  struct timespec now;
+  int64_t elapsed_us;
+  int64_t refill;
+
+  if (el->rate <= 0) {
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed_us = (int64_t)(now.tv_sec - el->refilled.tv_sec) * 1000000 +
+      (now.tv_nsec - el->refilled.tv_nsec) / 1000;
+  refill = el->rate * elapsed_us / 1000000;
+
+  /* the refill time is kept until a whole byte is refilled */
+  if (refill > 0) {
+    el->tokens = el->tokens + refill > el->rate ? el->rate :
+        el->tokens + refill;
+    el->refilled = now;
+  }
+
+  if (el->tokens < (int64_t)n) {
+    return -1;
+  }
+
+  el->tokens -= n;
+  return 0;
+}
+
+/* copy 'len' bytes to the ring at 'head', wrapping around its end */
+static void copy(struct errlog *el, uint64_t head, const char *data,
+    size_t len) {
+  size_t off = head & el->mask;
+  size_t n;
+
+  n = el->mask + 1 - off;
+  if (n > len) {
+    n = len;
+  }
+
+  memcpy(el->buf + off, data, n);
+  memcpy(el->buf, data + n, len - n);
+}
+
+/* log a line of stream 's', tagged and terminated by a newline. Notes
+ * of hexec, at most one per stream, are not limited by the rate */
+static void push(struct errlog *el, struct errlog_stream *s,
+    const char *data, size_t len, int note) {
+  char tag[TAGSZ];
+  uint64_t head;
+  uint64_t tail;
+  size_t taglen;
+  int ret;
+
+  ret = snprintf(tag, sizeof(tag), "id=%llu pid=%d ",
+      (unsigned long long)s->reqid, (int)s->pid);
+  taglen = ret < 0 ? 0 : (size_t)ret;
+  head = atomic_load_explicit(&el->head, memory_order_relaxed);
+  tail = atomic_load_explicit(&el->tail, memory_order_acquire);
+  if (head - tail + taglen + len + 1 > el->mask + 1 ||
+      (!note && take_tokens(el, taglen + len + 1) < 0)) {
+    atomic_fetch_add_explicit(&el->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  copy(el, head, tag, taglen);
+  copy(el, head + taglen, data, len);
+  copy(el, head + taglen + len, "\n", 1);
+  atomic_store_explicit(&el->head, head + taglen + len + 1,
+      memory_order_release);
+}
+
+int errlog_open(struct errlog *el, const char *path, int64_t maxbytes,
+    int64_t rate) {
+  int err;
+
+  memset(el, 0, sizeof(*el));
+  el->buf = malloc(ERRLOG_DEFAULT_SIZE);
+  if (el->buf == NULL) {
+    return -1;
+  }
+
+  el->mask = ERRLOG_DEFAULT_SIZE - 1;
+  el->maxbytes = maxbytes;
+  el->rate = rate;
+  el->tokens = rate;
+  clock_gettime(CLOCK_MONOTONIC, &el->refilled);
+  if (strcmp(path, "-") == 0) {
+    el->fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+  } else {
+    el->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  }
+
+  if (el->fd < 0) {
+    goto free_buf;
+  }
+
+  atomic_store(&el->running, 1);
+  err = pthread_create(&el->writer, NULL, writer, el);
+  if (err != 0) {
+    close(el->fd);
+    errno = err;
+    goto free_buf;
+  }
+
+  return 0;
+free_buf:
+  free(el->buf);
+  el->buf = NULL;
+  return -1;
+}
+
+int errlog_close(struct errlog *el) {
+  int status = 0;
+
+  atomic_store_explicit(&el->running, 0, memory_order_release);
+  if (pthread_join(el->writer, NULL) != 0) {
+    status = -1;
+  }
+
+  if (close(el->fd) < 0) {
+    status = -1;
+  }
+
+  free(el->buf);
+  el->buf = NULL;
+  return status;
+}
+
+void errlog_begin(struct errlog_stream *s, uint64_t reqid, pid_t pid) {
+  s->reqid = reqid;
+  s->pid = pid;
+  s->nbytes = 0;
+  s->len = 0;
+}
+
+void errlog_write(struct errlog *el, struct errlog_stream *s,
+    const char *data, size_t len) {
+  const char *end;
+  size_t n;
+
+  /* output past the cap is only counted */
+  if (el->maxbytes > 0) {
+    n = s->nbytes >= el->maxbytes ? 0 :
+        (size_t)(el->maxbytes - s->nbytes) < len ?
+        (size_t)(el->maxbytes - s->nbytes) : len;
+  } else {
+    n = len;
+  }
+
+  s->nbytes += len;
+  while (n > 0) {
+    end = memchr(data, '\n', n);
+    len = end != NULL ? (size_t)(end - data) : n;
+    if (len > ERRLOG_LINESZ - s->len) {
+      len = ERRLOG_LINESZ - s->len;
+      end = NULL;
+    }
+
+    memcpy(s->line + s->len, data, len);
+    s->len += len;
+    data += len;
+    n -= len;
+    if (end != NULL) {
+      data++;
+      n--;
+    }
+
+    if (end != NULL || s->len == ERRLOG_LINESZ) {
+      push(el, s, s->line, s->len, 0);
+      s->len = 0;
+    }
+  }
+}
+
+void errlog_end(struct errlog *el, struct errlog_stream *s) {
+  char note[64];
+  int ret;
+
+  if (s->len > 0) {
+    push(el, s, s->line, s->len, 0);
+    s->len = 0;
+  }
+
+  if (el->maxbytes > 0 && s->nbytes > el->maxbytes) {
+    ret = snprintf(note, sizeof(note), "discarded=%lld",
+        (long long)(s->nbytes - el->maxbytes));
+    push(el, s, note, ret, 1);
+  }
+}
+
+void errlog_flush(struct errlog *el) {
+  while (atomic_load_explicit(&el->tail, memory_order_acquire) !=
+      atomic_load_explicit(&el->head, memory_order_relaxed)) {
+    sleep_ms(1);
+  }
+}
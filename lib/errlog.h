@@ -0,0 +1,115 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_ERRLOG_H__
+#define LIB_ERRLOG_H__
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* The error log collects the stderr output of children, one line per
+ * record, tagged with the request ID and PID of the child. As for the
+ * access log, lines are copied to a fixed size ring by a single producer
+ * that never blocks or allocates, and written in batches by a writer
+ * thread.
+ *
+ * The output of a child is bounded by a per-stream byte cap: output past
+ * the cap is discarded, and the number of discarded bytes is logged when
+ * the stream ends, regardless of the rate. Lines are bounded by
+ * ERRLOG_LINESZ, and longer lines are split. The total rate of the log
+ * is bounded by a token bucket of bytes per second, with a burst of one
+ * second. Lines over the rate, or that do not fit the ring, are dropped
+ * and counted. */
+
+#define ERRLOG_DEFAULT_SIZE     (1 << 20) /* ring size, in bytes */
+#define ERRLOG_DEFAULT_MAXBYTES 65536     /* per-stream cap */
+#define ERRLOG_DEFAULT_RATE     (1 << 20) /* bytes per second */
+#define ERRLOG_LINESZ           1024
+#define ERRLOG_INTERVAL_MS      100       /* writer poll interval */
+
+struct errlog {
+  char *buf;
+  size_t mask;            /* ring size - 1 */
+  _Atomic uint64_t head;  /* next byte to write, owned by producer */
+  _Atomic uint64_t tail;  /* next byte to read, owned by consumer */
+  _Atomic uint64_t dropped;
+  _Atomic int running;
+  uint64_t reported;      /* dropped lines reported by the writer */
+  int64_t maxbytes;       /* per-stream cap, or 0 */
+  int64_t rate;           /* bytes per second, or 0 */
+  int64_t tokens;         /* bytes available at 'refilled' */
+  struct timespec refilled; /* CLOCK_MONOTONIC */
+  int fd;
+  pthread_t writer;
+};
+
+/* the output of a child, assembled into lines */
+struct errlog_stream {
+  uint64_t reqid;
+  pid_t pid;
+  int64_t nbytes;         /* bytes of output */
+  size_t len;             /* length of the incomplete line */
+  char line[ERRLOG_LINESZ];
+};
+
+/* errlog_open --
+ *   Opens 'path' for appending, or uses stderr if 'path' is "-", and
+ *   starts the writer thread. 'maxbytes' is the per-stream cap and
+ *   'rate' the max rate in bytes per second, zero meaning unbounded.
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int errlog_open(struct errlog *el, const char *path, int64_t maxbytes,
+    int64_t rate);
+
+/* errlog_close --
+ *   Writes any remaining lines, stops the writer thread and releases all
+ *   resources. Returns 0 on success, -1 on error. */
+int errlog_close(struct errlog *el);
+
+/* errlog_begin --
+ *   Starts stream 's' of request 'reqid' by child 'pid'. */
+void errlog_begin(struct errlog_stream *s, uint64_t reqid, pid_t pid);
+
+/* errlog_write --
+ *   Appends 'len' bytes of 'data' to stream 's', and logs its complete
+ *   lines. Must only be called from one thread, as must errlog_end. */
+void errlog_write(struct errlog *el, struct errlog_stream *s,
+    const char *data, size_t len);
+
+/* errlog_end --
+ *   Logs the incomplete line of stream 's', if any, and the number of
+ *   bytes discarded past the cap. */
+void errlog_end(struct errlog *el, struct errlog_stream *s);
+
+/* errlog_flush --
+ *   Waits until the writer thread has written all logged lines. */
+void errlog_flush(struct errlog *el);
+
+/* errlog_dropped --
+ *   Returns the total number of dropped lines. */
+static inline uint64_t errlog_dropped(struct errlog *el) {
+  return atomic_load_explicit(&el->dropped, memory_order_relaxed);
+}
+
+#endif
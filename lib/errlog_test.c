@@ -0,0 +1,186 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/errlog.h"
+#include "lib/test.h"
+
+#define TESTFILE ".errlog_test"
+
+static char buf_[1 << 16];
+
+/* reads TESTFILE into buf_ */
+static int read_log(void) {
+  FILE *fp;
+  size_t len;
+
+  fp = fopen(TESTFILE, "r");
+  if (fp == NULL) {
+    TEST_LOGF("%s: %s", TESTFILE, strerror(errno));
+    return -1;
+  }
+
+  len = fread(buf_, 1, sizeof(buf_) - 1, fp);
+  fclose(fp);
+  unlink(TESTFILE);
+  buf_[len] = '\0';
+  return 0;
+}
+
+static int test_lines(void) {
+  struct errlog el;
+  struct errlog_stream s;
+  const char *expected =
+      "id=1 pid=4711 first\n"
+      "id=1 pid=4711 second\n"
+      "id=2 pid=4712 \n"
+      "id=1 pid=4711 third\n";
+
+  unlink(TESTFILE);
+  if (errlog_open(&el, TESTFILE, 0, 0) < 0) {
+    TEST_LOGF("errlog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  /* lines are logged once complete */
+  errlog_begin(&s, 1, 4711);
+  errlog_write(&el, &s, "fir", 3);
+  errlog_write(&el, &s, "st\nsecond\nthi", 13);
+  errlog_begin(&s, 2, 4712);
+  errlog_write(&el, &s, "\n", 1);
+  errlog_begin(&s, 1, 4711);
+  errlog_write(&el, &s, "third", 5);
+  errlog_end(&el, &s);
+  errlog_close(&el);
+  if (read_log() < 0) {
+    return TEST_FAIL;
+  }
+
+  if (strcmp(buf_, expected) != 0) {
+    TEST_LOGF("unexpected log:\n%s", buf_);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_cap(void) {
+  struct errlog el;
+  struct errlog_stream s;
+  char line[ERRLOG_LINESZ + 10];
+  const char *expected =
+      "id=1 pid=1 0123\n"
+      "id=1 pid=1 4\n"
+      "id=1 pid=1 discarded=8\n";
+
+  unlink(TESTFILE);
+  if (errlog_open(&el, TESTFILE, 6, 0) < 0) {
+    TEST_LOGF("errlog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  errlog_begin(&s, 1, 1);
+  errlog_write(&el, &s, "0123\n456789\n", 12);
+  errlog_write(&el, &s, "ab", 2);
+  errlog_end(&el, &s);
+  errlog_close(&el);
+  if (read_log() < 0) {
+    return TEST_FAIL;
+  }
+
+  if (strcmp(buf_, expected) != 0) {
+    TEST_LOGF("unexpected log:\n%s", buf_);
+    return TEST_FAIL;
+  }
+
+  /* long lines are split */
+  if (errlog_open(&el, TESTFILE, 0, 0) < 0) {
+    TEST_LOGF("errlog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  memset(line, 'x', sizeof(line));
+  errlog_begin(&s, 1, 1);
+  errlog_write(&el, &s, line, sizeof(line));
+  errlog_end(&el, &s);
+  errlog_close(&el);
+  if (read_log() < 0) {
+    return TEST_FAIL;
+  }
+
+  if (strlen(buf_) != 2 * strlen("id=1 pid=1 \n") + sizeof(line) ||
+      strchr(buf_, '\n') - buf_ != strlen("id=1 pid=1 ") + ERRLOG_LINESZ) {
+    TEST_LOGF("unexpected split:\n%s", buf_);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_rate(void) {
+  struct errlog el;
+  struct errlog_stream s;
+  char *dropped;
+  int i;
+
+  unlink(TESTFILE);
+  if (errlog_open(&el, TESTFILE, 0, 100) < 0) {
+    TEST_LOGF("errlog_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  /* 20 bytes per line, of which 5 fit the burst of 100 bytes */
+  errlog_begin(&s, 1, 1);
+  for (i = 0; i < 10; i++) {
+    errlog_write(&el, &s, "warning\n", 8);
+  }
+
+  if (errlog_dropped(&el) != 5) {
+    TEST_LOGF("expected 5 dropped lines, got %llu",
+        (unsigned long long)errlog_dropped(&el));
+    errlog_close(&el);
+    return TEST_FAIL;
+  }
+
+  errlog_close(&el);
+  if (read_log() < 0) {
+    return TEST_FAIL;
+  }
+
+  dropped = strstr(buf_, "dropped=");
+  if (dropped == NULL || strtoull(dropped + 8, NULL, 10) != 5) {
+    TEST_LOGF("unexpected log:\n%s", buf_);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"lines", test_lines},
+  {"cap", test_cap},
+  {"rate", test_rate},
+);
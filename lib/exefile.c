@@ -0,0 +1,207 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* O_PATH */
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/exefile.h"
+
+#if defined(__linux__) && defined(O_PATH) && defined(SYS_execveat)
+#define EXEFILE_PINNED 1
+#endif
+
+#if defined(EXEFILE_PINNED)
+/* returns 1 if the file at 'path' starts with "#!", 0 if it does not or
+ * can not be read */
+static int is_script(const char *path) {
+  char magic[2];
+  ssize_t n;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    return 0;
+  }
+
+  n = read(fd, magic, sizeof(magic));
+  close(fd);
+  return n == 2 && magic[0] == '#' && magic[1] == '!';
+}
+
+/* open the executable at the path of 'ef' and replace the open one. The
+ * open one is kept on error. A replacement while the new one is opened
+ * is noticed by the next refresh */
+static int reopen(struct exefile *ef) {
+  struct stat sb;
+  int fd;
+
+  if (access(ef->path, F_OK | X_OK) < 0) {
+    return -1;
+  }
+
+  fd = open(ef->path, O_PATH | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  } else if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+    close(fd);
+    errno = EACCES;
+    return -1;
+  }
+
+  if (is_script(ef->path)) {
+    close(fd);
+    fd = -1;
+  }
+
+  if (ef->fd >= 0) {
+    close(ef->fd);
+  }
+
+  ef->fd = fd;
+  return 0;
+}
+
+static int watch(struct exefile *ef) {
+  char *dir;
+  int ret;
+
+  dir = ef->name == ef->path ? strdup(".") :
+      strndup(ef->path, ef->name - ef->path);
+  if (dir == NULL) {
+    return -1;
+  }
+
+  ef->wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (ef->wfd < 0) {
+    free(dir);
+    return -1;
+  }
+
+  ret = inotify_add_watch(ef->wfd, dir, IN_CREATE | IN_MOVED_TO |
+      IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR);
+  free(dir);
+  if (ret < 0) {
+    close(ef->wfd);
+    ef->wfd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+#endif
+
+int exefile_open(struct exefile *ef, const char *path) {
+  const char *sep;
+
+  sep = strrchr(path, '/');
+  ef->path = path;
+  ef->name = sep != NULL ? sep + 1 : path;
+  ef->fd = -1;
+  ef->wfd = -1;
+#if defined(EXEFILE_PINNED)
+  if (reopen(ef) < 0) {
+    return -1;
+  }
+
+  /* an unwatched executable would never be replaced */
+  if (watch(ef) < 0 && ef->fd >= 0) {
+    close(ef->fd);
+    ef->fd = -1;
+  }
+
+  return 0;
+#else
+  return access(path, F_OK | X_OK);
+#endif
+}
+
+void exefile_close(struct exefile *ef) {
+  if (ef->fd >= 0) {
+    close(ef->fd);
+    ef->fd = -1;
+  }
+
+  if (ef->wfd >= 0) {
+    close(ef->wfd);
+    ef->wfd = -1;
+  }
+}
+
+int exefile_watchfd(const struct exefile *ef) {
+  return ef->wfd;
+}
+
+int exefile_refresh(struct exefile *ef) {
+#if defined(EXEFILE_PINNED)
+  char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  int changed = 0;
+  ssize_t n;
+  char *p;
+
+  while ((n = read(ef->wfd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event *)p;
+      if ((ev->mask & IN_Q_OVERFLOW) ||
+          (ev->len > 0 && strcmp(ev->name, ef->name) == 0)) {
+        changed = 1;
+      }
+    }
+  }
+
+  if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    return -1;
+  } else if (!changed) {
+    return 0;
+  }
+
+  return reopen(ef) < 0 ? -1 : 1;
+#else
+  return 0;
+#endif
+}
+
+void exefile_exec(const struct exefile *ef, char *const argv[],
+    char *const envp[]) {
+#if defined(EXEFILE_PINNED)
+  if (ef->fd >= 0) {
+    syscall(SYS_execveat, ef->fd, "", argv, envp, AT_EMPTY_PATH);
+    return;
+  }
+#endif
+  execve(ef->path, argv, envp);
+}
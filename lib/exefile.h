@@ -0,0 +1,71 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_EXEFILE_H__
+#define LIB_EXEFILE_H__
+
+/* An exefile is the executable of children, opened once and executed by
+ * descriptor, without resolving its path on every exec. The directory of
+ * the executable is watched, and the executable re-opened when it is
+ * replaced, e.g., renamed over by a deploy. Until then, and if the new
+ * file can not be opened, the old file is executed.
+ *
+ * Only the last component of the path is watched: a replaced directory
+ * or symlink above it is not noticed. Scripts are executed by path, as
+ * an interpreter would see the descriptor and not the path as the
+ * script name. Where descriptors can not be executed, or watched, every
+ * executable is executed by path. */
+
+struct exefile {
+  const char *path;
+  const char *name;   /* last component of 'path' */
+  int fd;             /* executable, or -1 to execute by path */
+  int wfd;            /* watch, or -1 */
+};
+
+/* exefile_open --
+ *   Opens, and starts to watch, the executable at 'path', which must
+ *   remain valid. Returns 0 on success, -1 on error. Sets errno. */
+int exefile_open(struct exefile *ef, const char *path);
+
+/* exefile_close --
+ *   Closes the executable and its watch. */
+void exefile_close(struct exefile *ef);
+
+/* exefile_watchfd --
+ *   Returns a descriptor that becomes readable when the executable may
+ *   have been replaced, or -1 if it is not watched. */
+int exefile_watchfd(const struct exefile *ef);
+
+/* exefile_refresh --
+ *   Reads the pending changes of the watch, and re-opens the executable
+ *   if it was replaced. Does not block. Returns 1 if it was re-opened, 0
+ *   if not, and -1 on error. Sets errno. */
+int exefile_refresh(struct exefile *ef);
+
+/* exefile_exec --
+ *   Executes the executable with 'argv' and 'envp'. Only returns on
+ *   error, with errno set. */
+void exefile_exec(const struct exefile *ef, char *const argv[],
+    char *const envp[]);
+
+#endif
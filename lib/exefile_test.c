@@ -0,0 +1,184 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/exefile.h"
+#include "lib/fs.h"
+#include "lib/test.h"
+
+#define TESTDIR ".exefile_test"
+#define EXE     TESTDIR "/exe"
+#define NEWEXE  TESTDIR "/exe.new"
+
+static struct exefile exe_;
+
+/* write 'nbytes' of 'data', or the contents of 'src' if 'data' is NULL,
+ * to a new executable at 'path' */
+static int mkexe(const char *path, const char *src, const char *data,
+    size_t nbytes) {
+  char buf[8192];
+  ssize_t n = 0;
+  int in = -1;
+  int out;
+
+  out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+  if (out < 0) {
+    return -1;
+  }
+
+  if (data != NULL) {
+    n = write(out, data, nbytes) == (ssize_t)nbytes ? 0 : -1;
+  } else if ((in = open(src, O_RDONLY)) < 0) {
+    n = -1;
+  } else {
+    while ((n = read(in, buf, sizeof(buf))) > 0 &&
+        write(out, buf, n) == n);
+    close(in);
+  }
+
+  close(out);
+  return n == 0 ? 0 : -1;
+}
+
+/* returns the exit status of the executable run with 'argv' */
+static int run(char *const argv[]) {
+  char *envp[] = {NULL};
+  pid_t pid;
+  int status;
+
+  pid = fork();
+  if (pid < 0) {
+    return -1;
+  } else if (pid == 0) {
+    exefile_exec(&exe_, argv, envp);
+    _exit(127);
+  }
+
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+    return -1;
+  }
+
+  return WEXITSTATUS(status);
+}
+
+static int test_open(void) {
+  char *argv[] = {"sh", "-c", "exit 3", NULL};
+  int ret;
+
+  fs_remove_all(TESTDIR);
+  if (mkdir(TESTDIR, 0755) < 0 || mkexe(EXE, "/bin/sh", NULL, 0) < 0) {
+    TEST_LOGF("%s: %s", EXE, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (exefile_open(&exe_, TESTDIR "/missing") == 0) {
+    TEST_LOG("expected missing executable to fail");
+    return TEST_FAIL;
+  } else if (exefile_open(&exe_, EXE) < 0) {
+    TEST_LOGF("exefile_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  ret = run(argv);
+  if (ret != 3) {
+    TEST_LOGF("unexpected exit status: %d", ret);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_replace(void) {
+  static const char script[] = "#!/bin/sh\nexit 4\n";
+  char *argv[] = {"sh", "-c", "exit 3", NULL};
+  struct pollfd pfd;
+  int ret;
+
+  if (mkexe(NEWEXE, NULL, script, sizeof(script) - 1) < 0 ||
+      rename(NEWEXE, EXE) < 0) {
+    TEST_LOGF("%s: %s", EXE, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  /* without a watch, the executable is run by path */
+  if (exefile_watchfd(&exe_) < 0) {
+    TEST_LOG("not watched");
+    return run(argv) == 4 ? TEST_OK : TEST_FAIL;
+  }
+
+  /* the replaced binary remains open until the change is read */
+  ret = run(argv);
+  if (ret != 3) {
+    TEST_LOGF("unexpected exit status before refresh: %d", ret);
+    return TEST_FAIL;
+  }
+
+  pfd.fd = exefile_watchfd(&exe_);
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 1000) != 1) {
+    TEST_LOG("no change");
+    return TEST_FAIL;
+  }
+
+  ret = exefile_refresh(&exe_);
+  if (ret != 1) {
+    TEST_LOGF("exefile_refresh: %d", ret);
+    return TEST_FAIL;
+  } else if (exefile_refresh(&exe_) != 0) {
+    TEST_LOG("unexpected second refresh");
+    return TEST_FAIL;
+  }
+
+  ret = run(argv);
+  if (ret != 4) {
+    TEST_LOGF("unexpected exit status after refresh: %d", ret);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_cleanup(void) {
+  exefile_close(&exe_);
+  if (fs_remove_all(TESTDIR) < 0) {
+    TEST_LOGF("%s: %s", TESTDIR, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"open", test_open},
+  {"replace", test_replace},
+  {"cleanup", test_cleanup},
+);
@@ -26,9 +26,10 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
-#include <fts.h>
 
 #include "lib/fs.h"
 
@@ -143,39 +144,106 @@ int fs_mkdir_all(const char *path) {
   return 0;
 }
 
-int fs_remove_all(const char *path) {
-  char * const paths[] = {(char*)path, NULL};
-  FTSENT *ent;
-  FTS *fts = NULL;
+static int remove_ent(int dirfd, const char *name, int type);
+
+/* removes the entries of the directory 'fd'. Removing entries while
+ * reading a directory may make readdir(3) skip others, so the directory
+ * is read until it is empty */
+static int empty_dir(int fd) {
+  struct dirent *ent;
+  DIR *dir;
+  int dfd;
+  int nents;
+  int err;
+
+  /* fdopendir(3) takes ownership of its descriptor */
+  dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (dfd < 0) {
+    return -1;
+  }
 
-  fts = fts_open(paths, FTS_PHYSICAL, NULL);
-  if (fts == NULL) {
-    goto fail;
+  dir = fdopendir(dfd);
+  if (dir == NULL) {
+    err = errno;
+    close(dfd);
+    errno = err;
+    return -1;
   }
 
-  while ((ent = fts_read(fts)) != NULL) {
-    if (ent->fts_info == FTS_DP) {
-      if (rmdir(ent->fts_name) != 0) {
-        goto fts_close;
+  do {
+    nents = 0;
+    errno = 0;
+    while ((ent = readdir(dir)) != NULL) {
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+        continue;
       }
-    } else if (ent->fts_info == FTS_F ||
-        ent->fts_info == FTS_SL ||
-        ent->fts_info == FTS_SLNONE ||
-        ent->fts_info == FTS_DEFAULT) {
-      if (unlink(ent->fts_name) != 0) {
-        goto fts_close;
+
+      nents++;
+      if (remove_ent(fd, ent->d_name, ent->d_type) < 0) {
+        goto closedir;
       }
+      errno = 0;
+    }
+
+    if (errno != 0) {
+      goto closedir;
+    }
+
+    rewinddir(dir);
+  } while (nents > 0);
+
+  closedir(dir);
+  return 0;
+
+closedir:
+  err = errno;
+  closedir(dir);
+  errno = err;
+  return -1;
+}
+
+/* removes 'name' in 'dirfd', of dirent type 'type' */
+static int remove_ent(int dirfd, const char *name, int type) {
+  int fd;
+  int ret;
+
+  if (type != DT_DIR) {
+    if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT) {
+      return 0;
+    } else if (errno != EISDIR && errno != EPERM) {
+      return -1; /* EPERM is returned for directories on some systems */
     }
   }
 
-  if (fts_close(fts) != 0) {
-    goto fail;
+  fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      return 0;
+    } else if (errno == ENOTDIR || errno == ELOOP) {
+      /* not a directory (anymore), or a symlink to one */
+      ret = unlinkat(dirfd, name, 0);
+      return ret < 0 && errno != ENOENT ? -1 : 0;
+    }
+    return -1;
+  }
+
+  ret = empty_dir(fd);
+  close(fd);
+  if (ret < 0) {
+    return -1;
+  }
+
+  if (unlinkat(dirfd, name, AT_REMOVEDIR) < 0 && errno != ENOENT) {
+    return -1;
   }
 
   return 0;
+}
 
-fts_close:
-  fts_close(fts);
-fail:
-  return -1;
+int fs_remove_at(int dirfd, const char *name) {
+  return remove_ent(dirfd, name, DT_UNKNOWN);
+}
+
+int fs_remove_all(const char *path) {
+  return fs_remove_at(AT_FDCWD, path);
 }
@@ -37,9 +37,18 @@ int fs_mkdir_all(const char *path);
 
 /* fs_remove_all --
  *   Removes a file or directory. If path is a directory, the content of
- *   the directory will be removed recursively. Changes current working
- *   directory during directory traversal.
+ *   the directory will be removed recursively. Symbolic links are removed,
+ *   not followed. A path that does not exist is not an error.
  *   Returns 0 on success, -1 on error. Sets errno. */
 int fs_remove_all(const char *path);
 
+/* fs_remove_at --
+ *   Like fs_remove_all, for 'name' relative to the directory 'dirfd', or
+ *   to the current working directory if 'dirfd' is AT_FDCWD. Traverses
+ *   directories by descriptor and never changes the current working
+ *   directory, and is safe for threaded use. Keeps one descriptor open
+ *   per directory level.
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int fs_remove_at(int dirfd, const char *name);
+
 #endif
@@ -19,6 +19,7 @@
  * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 #include <errno.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <sys/socket.h>
@@ -32,6 +33,10 @@
 #define TESTDIR     ".fs_test"
 #define TESTDATADIR TESTDIR "/testdata"
 #define TESTSOCK    TESTDATADIR "/some.sock"
+#define TESTTREE    TESTDATADIR "/a/b/c"
+#define TESTLINK    TESTDATADIR "/a/link"
+#define OUTSIDEDIR  ".fs_test_outside"
+#define OUTSIDEFILE OUTSIDEDIR "/file"
 
 static int test_remove_all(void) {
   int ret;
@@ -93,6 +98,61 @@ done:
   return status;
 }
 
+static int mkfile(const char *path) {
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  close(fd);
+  return 0;
+}
+
+static int test_tree(void) {
+  char path[256];
+  int i;
+
+  if (fs_mkdir_all(TESTTREE) < 0 || fs_mkdir_all(OUTSIDEDIR) < 0 ||
+      mkfile(OUTSIDEFILE) < 0) {
+    TEST_LOGF("mkdir: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  for (i = 0; i < 100; i++) {
+    snprintf(path, sizeof(path), "%s/%d", i % 2 ? TESTTREE : TESTDATADIR, i);
+    if (mkfile(path) < 0) {
+      TEST_LOGF("%s: %s", path, strerror(errno));
+      return TEST_FAIL;
+    }
+  }
+
+  /* symlinks must be removed, not followed */
+  if (symlink("../../../" OUTSIDEDIR, TESTLINK) < 0) {
+    TEST_LOGF("symlink: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_outside(void) {
+  struct stat sb;
+
+  if (stat(OUTSIDEFILE, &sb) < 0) {
+    TEST_LOGF("%s: %s", OUTSIDEFILE, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (fs_remove_all(OUTSIDEDIR) < 0) {
+    TEST_LOGF("%s: %s", OUTSIDEDIR, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
 static int test_verify(void) {
   struct stat sb;
   int ret;
@@ -110,6 +170,8 @@ TEST_ENTRY(
   {"remove_all", test_remove_all},
   {"mkdir_all", test_mkdir_all},
   {"mksock", test_mksock},
+  {"tree", test_tree},
   {"remove_all (2nd)", test_remove_all},
   {"verify", test_verify},
+  {"outside", test_outside},
 );
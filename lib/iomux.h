@@ -21,11 +21,26 @@
 #ifndef LIB_IOMUX_H__
 #define LIB_IOMUX_H__
 
-#define IOMUX_NEVS 16
+#include <stdint.h>
+
+/* The number of events waited for at once adapts to readiness: it
+ * doubles while waits return as many events as waited for, and halves
+ * while they return less than a quarter of it, between IOMUX_NEVS and
+ * the max batch size. Optionally, the multiplexer busy-polls for a bounded
+ * time after handling events, before it blocks, to pick up bursts without
+ * the latency of a wakeup, at the cost of CPU time. */
+
+#define IOMUX_NEVS      16  /* initial, and min, # of events per wait */
+#define IOMUX_MAXNEVS   256 /* max # of events per wait */
 
 /* struct iomux_ctx flags */
 #define IOMUXF_RUNNING   (1 << 0) /* event loop is running */
 
+/* struct iomux_handler flags, set by iomux */
+#define IOMUXH_TIMER     (1 << 0) /* handler is a timer */
+#define IOMUXH_SINK      (1 << 1) /* handler waits for writability */
+#define IOMUXH_DISABLED  (1 << 2) /* handler is disabled (epoll only) */
+
 #define IOMUX_HANDLER(x) ((struct iomux_handler *)(x))
 
 struct iomux_ctx;
@@ -33,6 +48,7 @@ struct iomux_ctx;
 struct iomux_handler {
   void (*source_func)(struct iomux_ctx *ctx, struct iomux_handler *h);
   int fd;
+  int flags;
 };
 
 struct iomux_ctx {
@@ -40,8 +56,13 @@ struct iomux_ctx {
   int status;
   int qfd;
   int nhandlers;
-  struct iomux_handler *evs_to_close[IOMUX_NEVS]; /* kqueue only */
-  int nevs_to_close; /* kqueue only */
+  int nevs;      /* # of events waited for */
+  int maxnevs;   /* max # of events waited for */
+  int spin_us;   /* busy-poll time before blocking, or 0 */
+  uint64_t nwaits;  /* # of waits, blocking or not */
+  uint64_t nevents; /* # of events returned by waits */
+  int fds_to_close[IOMUX_MAXNEVS]; /* kqueue only */
+  int nfds_to_close; /* kqueue only */
 };
 
 /* iomux_init --
@@ -55,16 +76,78 @@ int iomux_cleanup(struct iomux_ctx *ctx);
 
 /* iomux_add_source --
  *   Add a source handler for a file descriptor to the iomux context.
- *   If/when the file descriptor becomes readable, the source_func of
- *   the handler will be called. Returns -1 on error, 0 on success. */
+ *   If/when the file descriptor becomes readable, reaches end-of-file or
+ *   fails, the source_func of the handler will be called. Returns -1 on
+ *   error, 0 on success. */
 int iomux_add_source(struct iomux_ctx *ctx, struct iomux_handler *h);
 
+/* iomux_add_sink --
+ *   Add a sink handler for a file descriptor to the iomux context. The
+ *   source_func of the handler is called when the file descriptor
+ *   becomes writable, or on error. Returns -1 on error, 0 on success. */
+int iomux_add_sink(struct iomux_ctx *ctx, struct iomux_handler *h);
+
+/* iomux_add_proc --
+ *   Add a source handler for a process descriptor (see lib/proc.h) to
+ *   the iomux context. When the process exits, the source_func of the
+ *   handler will be called. The handler is removed with
+ *   iomux_close_source. Returns -1 on error, 0 on success. */
+int iomux_add_proc(struct iomux_ctx *ctx, struct iomux_handler *h);
+
+/* iomux_add_timer --
+ *   Add a periodic timer to the iomux context. The source_func of the
+ *   handler is called every 'interval_ms' milliseconds. The fd of the
+ *   handler is set by iomux_add_timer, and is non-negative while the
+ *   timer is added. The caller may set it to -1 after removing the timer
+ *   with iomux_close_source, to tell whether the timer is added, but
+ *   must not otherwise use it. Returns -1 on error, 0 on success. */
+int iomux_add_timer(struct iomux_ctx *ctx, struct iomux_handler *h,
+    int interval_ms);
+
+/* iomux_disable_source --
+ *   Stop calling the source_func of a handler until it is enabled again
+ *   with iomux_enable_source. The handler remains in the iomux context.
+ *   Returns -1 on error, 0 on success. */
+int iomux_disable_source(struct iomux_ctx *ctx, struct iomux_handler *h);
+
+/* iomux_enable_source --
+ *   Re-enable a handler disabled by iomux_disable_source. Returns -1 on
+ *   error, 0 on success. */
+int iomux_enable_source(struct iomux_ctx *ctx, struct iomux_handler *h);
+
 /* iomux_close_source --
  *   Remove a source handler for a file descriptor from the iomux context and
  *   close the file descriptor. This function should only be called when
  *   iomux_run is active. Returns -1 on error, 0 on success. */
 int iomux_close_source(struct iomux_ctx *ctx, struct iomux_handler *h);
 
+/* iomux_set_batch --
+ *   Sets the max # of events waited for at once to 'maxnevs', at most
+ *   IOMUX_MAXNEVS. A 'maxnevs' of IOMUX_NEVS or less fixes the batch
+ *   size. Returns -1 on error, 0 on success. */
+static inline int iomux_set_batch(struct iomux_ctx *ctx, int maxnevs) {
+  if (maxnevs <= 0 || maxnevs > IOMUX_MAXNEVS) {
+    return -1;
+  }
+
+  ctx->maxnevs = maxnevs;
+  ctx->nevs = maxnevs < IOMUX_NEVS ? maxnevs : IOMUX_NEVS;
+  return 0;
+}
+
+/* iomux_set_spin --
+ *   Busy-polls for up to 'spin_us' microseconds after handling events,
+ *   before blocking. Zero, the default, blocks at once. Returns -1 on
+ *   error, 0 on success. */
+static inline int iomux_set_spin(struct iomux_ctx *ctx, int spin_us) {
+  if (spin_us < 0) {
+    return -1;
+  }
+
+  ctx->spin_us = spin_us;
+  return 0;
+}
+
 /* iomux_run --
  *   Run the multiplexer. Returns 0 on success, -1 on failure */
 int iomux_run(struct iomux_ctx *ctx);
@@ -20,6 +20,9 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -38,6 +41,8 @@ int iomux_init(struct iomux_ctx *ctx) {
   }
 
   ctx->qfd = qfd;
+  ctx->nevs = IOMUX_NEVS;
+  ctx->maxnevs = IOMUX_MAXNEVS;
   return 0;
 }
 
@@ -52,11 +57,12 @@ int iomux_cleanup(struct iomux_ctx *ctx) {
   return 0;
 }
 
-int iomux_add_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
+static int add_handler(struct iomux_ctx *ctx, struct iomux_handler *h,
+    uint32_t events) {
   struct epoll_event ev;
   int ret;
 
-  ev.events = EPOLLIN;
+  ev.events = events;
   ev.data.ptr = h;
   ret = epoll_ctl(ctx->qfd, EPOLL_CTL_ADD, h->fd, &ev);
   if (ret < 0) {
@@ -67,6 +73,79 @@ int iomux_add_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
   return 0;
 }
 
+int iomux_add_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  return add_handler(ctx, h, EPOLLIN);
+}
+
+int iomux_add_sink(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  h->flags |= IOMUXH_SINK;
+  return add_handler(ctx, h, EPOLLOUT);
+}
+
+int iomux_add_proc(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  /* pidfds become readable when the process exits */
+  return iomux_add_source(ctx, h);
+}
+
+int iomux_add_timer(struct iomux_ctx *ctx, struct iomux_handler *h,
+    int interval_ms) {
+  struct itimerspec its = {{0}};
+  int fd;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+  its.it_value = its.it_interval;
+  h->fd = fd;
+  h->flags |= IOMUXH_TIMER;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0 ||
+      iomux_add_source(ctx, h) < 0) {
+    close(fd);
+    h->fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* disabled handlers are removed from the epoll set, since hangups and
+ * errors are reported regardless of the events waited for */
+int iomux_disable_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct epoll_event ev = {0};
+
+  if (h->flags & IOMUXH_DISABLED) {
+    return 0;
+  }
+
+  if (epoll_ctl(ctx->qfd, EPOLL_CTL_DEL, h->fd, &ev) < 0) {
+    return -1;
+  }
+
+  h->flags |= IOMUXH_DISABLED;
+  return 0;
+}
+
+int iomux_enable_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct epoll_event ev;
+
+  if (!(h->flags & IOMUXH_DISABLED)) {
+    return 0;
+  }
+
+  ev.events = h->flags & IOMUXH_SINK ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = h;
+  if (epoll_ctl(ctx->qfd, EPOLL_CTL_ADD, h->fd, &ev) < 0) {
+    return -1;
+  }
+
+  h->flags &= ~IOMUXH_DISABLED;
+  return 0;
+}
+
 int iomux_close_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
   struct epoll_event ev;
   int ret;
@@ -74,11 +153,15 @@ int iomux_close_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
   /* pre 2.6.9 kernels required event to be set even though its ignored */
   ev.events = EPOLLIN;
   ev.data.ptr = h;
-  ret = epoll_ctl(ctx->qfd, EPOLL_CTL_DEL, h->fd, &ev);
-  if (ret < 0) {
-    return -1;
+  if (!(h->flags & IOMUXH_DISABLED)) {
+    ret = epoll_ctl(ctx->qfd, EPOLL_CTL_DEL, h->fd, &ev);
+    if (ret < 0) {
+      return -1;
+    }
   }
 
+  h->flags &= ~IOMUXH_DISABLED;
+
   ret = close(h->fd);
   ctx->nhandlers--;
   if (ret < 0) {
@@ -91,27 +174,69 @@ int iomux_close_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
 static void handle_events(struct iomux_ctx *ctx, struct epoll_event *evs,
     size_t nevs) {
   struct iomux_handler *h;
+  uint64_t nexp;
   size_t i;
 
   for (i = 0; i < nevs; i++) {
     h = evs[i].data.ptr;
 
-    if ((evs[i].events & EPOLLIN) == EPOLLIN) {
+    if (h->flags & IOMUXH_SINK) {
+      if (evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        h->source_func(ctx, h);
+      }
+    } else if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      /* e.g., pipes without writers are not readable, only hung up */
+      if (h->flags & IOMUXH_TIMER) {
+        /* the handler is called once, even if the timer expired more
+         * than once since the last call */
+        if (read(h->fd, &nexp, sizeof(nexp)) < 0) {
+          continue;
+        }
+      }
+
       h->source_func(ctx, h);
     }
   }
 }
 
+static int64_t now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* grow the batch while waits fill it, and shrink it while they use less
+ * than a quarter of it */
+static void adapt(struct iomux_ctx *ctx, int nready) {
+  if (nready == ctx->nevs) {
+    ctx->nevs = MIN(ctx->nevs * 2, ctx->maxnevs);
+  } else if (nready < ctx->nevs / 4) {
+    ctx->nevs = MAX(ctx->nevs / 2, MIN(IOMUX_NEVS, ctx->maxnevs));
+  }
+}
+
 int iomux_run(struct iomux_ctx *ctx) {
-  struct epoll_event evs[IOMUX_NEVS];
+  struct epoll_event evs[IOMUX_MAXNEVS];
+  int64_t spin_until = 0;
   int ret = 0;
 
   ctx->status = 0;
   ctx->flags |= IOMUXF_RUNNING;
   while (ctx->nhandlers > 0) {
-    ret = epoll_wait(ctx->qfd, evs, ARRAY_SIZE(evs), -1);
+    ret = epoll_wait(ctx->qfd, evs, ctx->nevs, spin_until > 0 ? 0 : -1);
+    ctx->nwaits++;
     if (ret > 0) {
+      ctx->nevents += ret;
+      adapt(ctx, ret);
       handle_events(ctx, evs, ret);
+      if (ctx->spin_us > 0) {
+        spin_until = now_us() + ctx->spin_us;
+      }
+    } else if (ret == 0) {
+      if (now_us() >= spin_until) {
+        spin_until = 0;
+      }
     } else if (ret < 0 && errno != EINTR) {
       iomux_err(ctx);
       break;
@@ -19,15 +19,20 @@
  * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
-#include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/event.h>
 
 #include "lib/macros.h"
 #include "lib/iomux.h"
 
+/* the fd of an added timer */
+#define TIMER_FD INT_MAX
+
 int iomux_init(struct iomux_ctx *ctx) {
   int qfd;
 
@@ -39,6 +44,8 @@ int iomux_init(struct iomux_ctx *ctx) {
   }
 
   ctx->qfd = qfd;
+  ctx->nevs = IOMUX_NEVS;
+  ctx->maxnevs = IOMUX_MAXNEVS;
   return 0;
 }
 
@@ -69,20 +76,108 @@ int iomux_add_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
   return 0;
 }
 
+int iomux_add_sink(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct kevent ev = {0};
+  int ret;
+
+  h->flags |= IOMUXH_SINK;
+  EV_SET(&ev, h->fd, EVFILT_WRITE, EV_ADD, 0, 0, h);
+  ret = kevent(ctx->qfd, &ev, 1, NULL, 0, NULL);
+  if (ret < 0) {
+    return -1;
+  }
+
+  ctx->nhandlers++;
+  return 0;
+}
+
+int iomux_add_proc(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct kevent ev = {0};
+  int ret;
+
+  EV_SET(&ev, h->fd, EVFILT_PROCDESC, EV_ADD, NOTE_EXIT, 0, h);
+  ret = kevent(ctx->qfd, &ev, 1, NULL, 0, NULL);
+  if (ret < 0) {
+    return -1;
+  }
+
+  ctx->nhandlers++;
+  return 0;
+}
+
+int iomux_add_timer(struct iomux_ctx *ctx, struct iomux_handler *h,
+    int interval_ms) {
+  struct kevent ev = {0};
+  int ret;
+
+  /* timers are identified by their handler, and have no fd. It is set
+   * to a non-negative value that is never a descriptor while the timer
+   * is added, as with epoll */
+  h->fd = TIMER_FD;
+  h->flags |= IOMUXH_TIMER;
+  EV_SET(&ev, (uintptr_t)h, EVFILT_TIMER, EV_ADD, 0, interval_ms, h);
+  ret = kevent(ctx->qfd, &ev, 1, NULL, 0, NULL);
+  if (ret < 0) {
+    h->fd = -1;
+    return -1;
+  }
+
+  ctx->nhandlers++;
+  return 0;
+}
+
+int iomux_disable_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct kevent ev = {0};
+
+  EV_SET(&ev, h->fd, h->flags & IOMUXH_SINK ? EVFILT_WRITE : EVFILT_READ,
+      EV_DISABLE, 0, 0, h);
+  return kevent(ctx->qfd, &ev, 1, NULL, 0, NULL) < 0 ? -1 : 0;
+}
+
+int iomux_enable_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct kevent ev = {0};
+
+  EV_SET(&ev, h->fd, h->flags & IOMUXH_SINK ? EVFILT_WRITE : EVFILT_READ,
+      EV_ENABLE, 0, 0, h);
+  return kevent(ctx->qfd, &ev, 1, NULL, 0, NULL) < 0 ? -1 : 0;
+}
+
+/* The fd is closed after all events of the current batch are handled.
+ * The fd, and not the handler, is queued since the handler may be reused
+ * for another fd before that. A handler may close more fds than fit in
+ * the queue, e.g., when writing to many sinks - the rest are closed
+ * immediately, as with epoll */
 static void queue_close(struct iomux_ctx *ctx, struct iomux_handler *h) {
   size_t i;
 
-  assert(ctx->nevs_to_close < ARRAY_SIZE(ctx->evs_to_close));
-  for (i = 0; i < ctx->nevs_to_close; i++) {
-    if (ctx->evs_to_close[i] == h) {
+  for (i = 0; i < ctx->nfds_to_close; i++) {
+    if (ctx->fds_to_close[i] == h->fd) {
       return; /* already queued for closing - do not enqueue again */
     }
   }
 
-  ctx->evs_to_close[ctx->nevs_to_close++] = h;
+  if (ctx->nfds_to_close == ARRAY_SIZE(ctx->fds_to_close)) {
+    close(h->fd);
+    ctx->nhandlers--;
+    return;
+  }
+
+  ctx->fds_to_close[ctx->nfds_to_close++] = h->fd;
 }
 
 int iomux_close_source(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct kevent ev = {0};
+
+  if (h->flags & IOMUXH_TIMER) {
+    EV_SET(&ev, (uintptr_t)h, EVFILT_TIMER, EV_DELETE, 0, 0, h);
+    if (kevent(ctx->qfd, &ev, 1, NULL, 0, NULL) < 0) {
+      return -1;
+    }
+
+    ctx->nhandlers--;
+    return 0;
+  }
+
   queue_close(ctx, h);
   return 0;
 }
@@ -93,7 +188,7 @@ static void handle_events(struct iomux_ctx *ctx, struct kevent *evs,
   struct iomux_handler *h;
   int n;
 
-  ctx->nevs_to_close = 0; /* clear # of handlers to close */
+  ctx->nfds_to_close = 0; /* clear # of handlers to close */
 
   for (i = 0; i < nevs; i++) {
     h = evs[i].udata;
@@ -101,26 +196,40 @@ static void handle_events(struct iomux_ctx *ctx, struct kevent *evs,
     if ((evs[i].flags & EV_ERROR) != 0 &&
         (evs[i].filter == EVFILT_READ || evs[i].filter == EVFILT_WRITE)) {
       queue_close(ctx, h);
-    } else if (evs[i].filter == EVFILT_READ) {
-      if (evs[i].data > 0 && h->source_func != NULL) {
-        h->source_func(ctx, h);
-      }
-
-      if (evs[i].flags & EV_EOF) {
-        queue_close(ctx, h);
-      }
+    } else {
+      /* end-of-file is seen by the handler, which closes the source */
+      h->source_func(ctx, h);
     }
   }
 
   /* close file descriptors queued for closing */
-  for (n = 0; n < ctx->nevs_to_close; n++) {
-    close(h->fd);
+  for (n = 0; n < ctx->nfds_to_close; n++) {
+    close(ctx->fds_to_close[n]);
     ctx->nhandlers--;
   }
 }
 
+static int64_t now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* grow the batch while waits fill it, and shrink it while they use less
+ * than a quarter of it */
+static void adapt(struct iomux_ctx *ctx, int nready) {
+  if (nready == ctx->nevs) {
+    ctx->nevs = MIN(ctx->nevs * 2, ctx->maxnevs);
+  } else if (nready < ctx->nevs / 4) {
+    ctx->nevs = MAX(ctx->nevs / 2, MIN(IOMUX_NEVS, ctx->maxnevs));
+  }
+}
+
 int iomux_run(struct iomux_ctx *ctx) {
-  struct kevent evs[IOMUX_NEVS];
+  static const struct timespec poll = {0, 0};
+  struct kevent evs[IOMUX_MAXNEVS];
+  int64_t spin_until = 0;
   int ret = 0;
 
   ctx->status = 0;
@@ -128,9 +237,20 @@ int iomux_run(struct iomux_ctx *ctx) {
   while (ctx->nhandlers > 0) {
     /* Room for improvement: add new events here instead of just
      * waiting for them */
-    ret = kevent(ctx->qfd, NULL, 0, evs, ARRAY_SIZE(evs), NULL);
+    ret = kevent(ctx->qfd, NULL, 0, evs, ctx->nevs,
+        spin_until > 0 ? &poll : NULL);
+    ctx->nwaits++;
     if (ret > 0) {
+      ctx->nevents += ret;
+      adapt(ctx, ret);
       handle_events(ctx, evs, ret);
+      if (ctx->spin_us > 0) {
+        spin_until = now_us() + ctx->spin_us;
+      }
+    } else if (ret == 0) {
+      if (now_us() >= spin_until) {
+        spin_until = 0;
+      }
     } else if (ret < 0 && errno != EINTR) {
       iomux_err(ctx);
       break;
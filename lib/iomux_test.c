@@ -174,7 +174,311 @@ done:
   return status;
 }
 
+struct timer_data {
+  struct iomux_handler h; /* must be first */
+  int ncalls;
+};
+
+static void timer_func(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct timer_data *data = (struct timer_data *)h;
+
+  if (++data->ncalls == 3 && iomux_close_source(ctx, h) < 0) {
+    iomux_err(ctx);
+  }
+}
+
+static int test_timer(void) {
+  int status = TEST_FAIL;
+  struct iomux_ctx ctx;
+  struct timer_data data = {{0}};
+  int ret;
+
+  alarm(5);
+  ret = iomux_init(&ctx);
+  if (ret != 0) {
+    TEST_LOGF("iomux_init return: %d", ret);
+    goto done;
+  }
+
+  data.h.source_func = &timer_func;
+  ret = iomux_add_timer(&ctx, &data.h, 10);
+  if (ret != 0) {
+    TEST_LOGF("iomux_add_timer: %s", strerror(errno));
+    goto iomux_cleanup;
+  }
+
+  /* callers tell added timers by their fd */
+  if (data.h.fd < 0) {
+    TEST_LOG("added timer has a negative fd");
+    goto iomux_cleanup;
+  }
+
+  ret = iomux_run(&ctx);
+  if (ret != 0) {
+    TEST_LOGF("iomux_run: %s", strerror(errno));
+    goto iomux_cleanup;
+  }
+
+  if (data.ncalls != 3) {
+    TEST_LOGF("timer called %d times, expected 3", data.ncalls);
+    goto iomux_cleanup;
+  }
+
+  status = TEST_OK;
+iomux_cleanup:
+  ret = iomux_cleanup(&ctx);
+  if (ret != 0) {
+    TEST_LOGF("iomux_cleanup return: %d", ret);
+    status = TEST_FAIL;
+  }
+done:
+  alarm(0);
+  return status;
+}
+
+struct sink_data {
+  struct iomux_handler h; /* must be first */
+  int ncalls;
+};
+
+static void sink_func(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct sink_data *data = (struct sink_data *)h;
+
+  data->ncalls++;
+  if (write(h->fd, "hello", 5) != 5 || iomux_close_source(ctx, h) < 0) {
+    iomux_err(ctx);
+  }
+}
+
+static int test_sink(void) {
+  int status = TEST_FAIL;
+  struct iomux_ctx ctx;
+  struct sink_data data = {{0}};
+  char buf[16];
+  int sv[2];
+  int ret;
+
+  alarm(5);
+  ret = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+  if (ret != 0) {
+    TEST_LOGF("socketpair: %s", strerror(errno));
+    goto done;
+  }
+
+  ret = iomux_init(&ctx);
+  if (ret != 0) {
+    TEST_LOGF("iomux_init return: %d", ret);
+    close(sv[0]);
+    goto close_sv;
+  }
+
+  data.h.fd = sv[0];
+  data.h.source_func = &sink_func;
+  ret = iomux_add_sink(&ctx, &data.h);
+  if (ret != 0) {
+    TEST_LOGF("iomux_add_sink: %s", strerror(errno));
+    close(sv[0]);
+    goto iomux_cleanup;
+  }
+
+  ret = iomux_run(&ctx);
+  if (ret != 0) {
+    TEST_LOGF("iomux_run: %s", strerror(errno));
+    goto iomux_cleanup;
+  }
+
+  if (data.ncalls != 1) {
+    TEST_LOGF("sink called %d times, expected 1", data.ncalls);
+    goto iomux_cleanup;
+  }
+
+  ret = read(sv[1], buf, sizeof(buf));
+  if (ret != 5 || memcmp(buf, "hello", 5) != 0) {
+    TEST_LOGF("unexpected read of %d bytes", ret);
+    goto iomux_cleanup;
+  }
+
+  status = TEST_OK;
+iomux_cleanup:
+  ret = iomux_cleanup(&ctx);
+  if (ret != 0) {
+    TEST_LOGF("iomux_cleanup return: %d", ret);
+    status = TEST_FAIL;
+  }
+close_sv:
+  close(sv[1]);
+done:
+  alarm(0);
+  return status;
+}
+
+#define NBATCH 64
+
+struct batch_data {
+  struct iomux_handler h; /* must be first */
+  int *ncalls;
+};
+
+static void batch_func(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct batch_data *data = (struct batch_data *)h;
+
+  (*data->ncalls)++;
+  if (iomux_close_source(ctx, h) < 0) {
+    iomux_err(ctx);
+  }
+}
+
+/* runs NBATCH readable sources, with batches of at most 'maxnevs'
+ * events. Returns the # of waits, or -1 on error */
+static int run_batch(int maxnevs) {
+  struct batch_data data[NBATCH];
+  struct iomux_ctx ctx;
+  int sv[NBATCH][2];
+  int ncalls = 0;
+  int ret = -1;
+  int i;
+
+  if (iomux_init(&ctx) < 0) {
+    TEST_LOGF("iomux_init: %s", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < NBATCH; i++) {
+    sv[i][0] = sv[i][1] = -1;
+  }
+
+  if (maxnevs > 0 && iomux_set_batch(&ctx, maxnevs) < 0) {
+    TEST_LOGF("iomux_set_batch: %d", maxnevs);
+    goto cleanup;
+  }
+
+  for (i = 0; i < NBATCH; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) < 0 ||
+        write(sv[i][1], "x", 1) != 1) {
+      TEST_LOGF("socketpair: %s", strerror(errno));
+      goto cleanup;
+    }
+
+    data[i].h.fd = sv[i][0];
+    data[i].h.flags = 0;
+    data[i].h.source_func = &batch_func;
+    data[i].ncalls = &ncalls;
+    if (iomux_add_source(&ctx, &data[i].h) < 0) {
+      TEST_LOGF("iomux_add_source: %s", strerror(errno));
+      goto cleanup;
+    }
+    sv[i][0] = -1; /* closed by the handler */
+  }
+
+  if (iomux_run(&ctx) != 0 || ncalls != NBATCH) {
+    TEST_LOGF("iomux_run: %d of %d sources handled", ncalls, NBATCH);
+    goto cleanup;
+  } else if (ctx.nevents != NBATCH) {
+    TEST_LOGF("unexpected # of events: %d", (int)ctx.nevents);
+    goto cleanup;
+  }
+
+  ret = (int)ctx.nwaits;
+cleanup:
+  for (i = 0; i < NBATCH; i++) {
+    if (sv[i][0] >= 0) {
+      close(sv[i][0]);
+    }
+    if (sv[i][1] >= 0) {
+      close(sv[i][1]);
+    }
+  }
+  iomux_cleanup(&ctx);
+  return ret;
+}
+
+static int test_batch(void) {
+  int status = TEST_FAIL;
+  int nwaits;
+
+  alarm(5);
+
+  /* 16 + 16 + 16 + 16 */
+  nwaits = run_batch(IOMUX_NEVS);
+  if (nwaits != NBATCH / IOMUX_NEVS) {
+    TEST_LOGF("fixed batches: %d waits", nwaits);
+    goto done;
+  }
+
+  /* 16 + 32 + 16 */
+  nwaits = run_batch(0);
+  if (nwaits != 3) {
+    TEST_LOGF("adaptive batches: %d waits", nwaits);
+    goto done;
+  }
+
+  status = TEST_OK;
+done:
+  alarm(0);
+  return status;
+}
+
+static int test_spin(void) {
+  int status = TEST_FAIL;
+  struct iomux_ctx ctx;
+  struct single_data data = {{0}};
+  int fd;
+
+  signal(SIGCHLD, SIG_IGN);
+  alarm(5);
+  if (iomux_init(&ctx) != 0) {
+    TEST_LOGF("iomux_init: %s", strerror(errno));
+    goto done;
+  } else if (iomux_set_spin(&ctx, 1000) < 0 ||
+      iomux_set_spin(&ctx, -1) == 0) {
+    TEST_LOG("iomux_set_spin");
+    goto iomux_cleanup;
+  }
+
+  fd = spawn_source();
+  if (fd < 0) {
+    TEST_LOGF("spawn_source: %s", strerror(errno));
+    goto iomux_cleanup;
+  }
+
+  data.h.fd = fd;
+  data.h.source_func = &single_handler_func;
+  if (iomux_add_source(&ctx, &data.h) != 0) {
+    TEST_LOGF("iomux_add_source: %s", strerror(errno));
+    close(fd);
+    goto iomux_cleanup;
+  }
+
+  if (iomux_run(&ctx) != 0) {
+    TEST_LOGF("iomux_run: %s", strerror(errno));
+    goto iomux_cleanup;
+  }
+
+  /* the data arrives 250 ms apart, after the spins have given up */
+  if (data.len != sizeof("oh\nhello\n") - 1 ||
+      memcmp(data.data, "oh\nhello\n", data.len) != 0) {
+    TEST_LOGF("unexpected data in buffer of length %zu", data.len);
+    goto iomux_cleanup;
+  } else if (ctx.nwaits <= ctx.nevents) {
+    TEST_LOGF("no polls: %d waits, %d events", (int)ctx.nwaits,
+        (int)ctx.nevents);
+    goto iomux_cleanup;
+  }
+
+  status = TEST_OK;
+iomux_cleanup:
+  iomux_cleanup(&ctx);
+done:
+  alarm(0);
+  signal(SIGCHLD, SIG_DFL);
+  return status;
+}
+
 TEST_ENTRY(
   {"run_empty", test_run_empty},
   {"run_single", test_run_single},
+  {"timer", test_timer},
+  {"sink", test_sink},
+  {"batch", test_batch},
+  {"spin", test_spin},
 );
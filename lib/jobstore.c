@@ -0,0 +1,759 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* copy_file_range */
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "lib/macros.h"
+#include "lib/fs.h"
+#include "lib/jobstore.h"
+
+#define IDX_MAGIC   0x4a584548 /* "HEXJ" */
+#define REC_MAGIC   0x52584548 /* "HEXR" */
+#define IDX_VERSION 1
+#define IDX_INITENTS 1024
+
+#define IDXF_VALID (1 << 0)
+
+#define MAXIOV 16
+
+/* index file header */
+struct idx_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t nextid;
+  uint32_t tailseg; /* oldest segment */
+  uint32_t headseg; /* segment currently appended to */
+  uint8_t reserved[40];
+};
+
+/* index entry, located at sizeof(struct idx_hdr) + id * sizeof(ent) */
+struct idx_ent {
+  uint32_t seg;
+  uint32_t flags;
+  uint64_t off;     /* offset of record header in segment */
+  uint64_t datalen;
+  uint32_t metalen;
+  int32_t status;
+  int64_t time;
+};
+
+/* segment record header, followed by metadata and data */
+struct rec_hdr {
+  uint32_t magic;
+  uint32_t metalen;
+  uint64_t id;
+  uint64_t datalen;
+  int64_t time;
+  int32_t status;
+  uint32_t reserved;
+};
+
+STATIC_ASSERT(sizeof(struct idx_hdr) == 64, "unexpected idx_hdr size");
+STATIC_ASSERT(sizeof(struct idx_ent) == 40, "unexpected idx_ent size");
+STATIC_ASSERT(sizeof(struct rec_hdr) == 40, "unexpected rec_hdr size");
+
+#define IDXHDR(js__) ((struct idx_hdr *)(js__)->idx)
+#define IDXENTS(js__) \
+    ((struct idx_ent *)((char *)(js__)->idx + sizeof(struct idx_hdr)))
+#define IDXCAP(js__) \
+    (((js__)->idxlen - sizeof(struct idx_hdr)) / sizeof(struct idx_ent))
+
+static int segname(char *buf, size_t len, uint32_t segno) {
+  int ret;
+
+  ret = snprintf(buf, len, "seg.%010u", segno);
+  if (ret < 0 || ret >= len) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int opensegat(int dirfd, uint32_t segno, int flags) {
+  char name[32];
+
+  if (segname(name, sizeof(name), segno) < 0) {
+    return -1;
+  }
+
+  return openat(dirfd, name, flags | O_CLOEXEC, 0666);
+}
+
+static int mapidx(struct jobstore *js, size_t len) {
+  void *idx;
+
+  idx = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, js->idxfd, 0);
+  if (idx == MAP_FAILED) {
+    return -1;
+  }
+
+  if (js->idx != NULL) {
+    munmap(js->idx, js->idxlen);
+  }
+
+  js->idx = idx;
+  js->idxlen = len;
+  return 0;
+}
+
+/* make sure 'id' has a mapped index entry */
+static int growidx(struct jobstore *js, uint64_t id) {
+  size_t cap;
+
+  cap = IDXCAP(js);
+  if (id < cap) {
+    return 0;
+  }
+
+  while (cap <= id) {
+    cap *= 2;
+  }
+
+  if (ftruncate(js->idxfd,
+      sizeof(struct idx_hdr) + cap * sizeof(struct idx_ent)) < 0) {
+    return -1;
+  }
+
+  return mapidx(js, sizeof(struct idx_hdr) + cap * sizeof(struct idx_ent));
+}
+
+static int openidx(struct jobstore *js) {
+  struct stat sb;
+  struct idx_hdr *hdr;
+  size_t len;
+
+  js->idxfd = openat(js->dirfd, "index", O_RDWR | O_CREAT | O_CLOEXEC,
+      0666);
+  if (js->idxfd < 0) {
+    return -1;
+  }
+
+  if (fstat(js->idxfd, &sb) < 0) {
+    return -1;
+  }
+
+  if (sb.st_size == 0) {
+    len = sizeof(struct idx_hdr) + IDX_INITENTS * sizeof(struct idx_ent);
+    if (ftruncate(js->idxfd, len) < 0 || mapidx(js, len) < 0) {
+      return -1;
+    }
+
+    hdr = IDXHDR(js);
+    hdr->magic = IDX_MAGIC;
+    hdr->version = IDX_VERSION;
+    hdr->nextid = 1;
+    return 0;
+  }
+
+  if (sb.st_size < sizeof(struct idx_hdr) + sizeof(struct idx_ent)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (mapidx(js, sb.st_size) < 0) {
+    return -1;
+  }
+
+  hdr = IDXHDR(js);
+  if (hdr->magic != IDX_MAGIC || hdr->version != IDX_VERSION ||
+      hdr->nextid == 0 || hdr->tailseg > hdr->headseg) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Truncate any partially written record at the end of the head segment,
+ * left there by an interrupted jobstore_put */
+static int recover_head(struct jobstore *js, off_t size) {
+  struct rec_hdr rec;
+  off_t off = 0;
+  off_t reclen;
+  ssize_t n;
+  int fd;
+
+  fd = opensegat(js->dirfd, js->segno, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  while (off < size) {
+    n = pread(fd, &rec, sizeof(rec), off);
+    if (n != sizeof(rec) || rec.magic != REC_MAGIC) {
+      break;
+    }
+
+    reclen = sizeof(rec) + rec.metalen + rec.datalen;
+    if (off + reclen > size) {
+      break;
+    }
+
+    off += reclen;
+  }
+
+  close(fd);
+  if (off < size && ftruncate(js->segfd, off) < 0) {
+    return -1;
+  }
+
+  js->segoff = off;
+  return 0;
+}
+
+static int openhead(struct jobstore *js) {
+  struct stat sb;
+
+  js->segno = IDXHDR(js)->headseg;
+  js->segfd = opensegat(js->dirfd, js->segno, O_WRONLY | O_CREAT);
+  if (js->segfd < 0) {
+    return -1;
+  }
+
+  if (fstat(js->segfd, &sb) < 0) {
+    return -1;
+  }
+
+  return recover_head(js, sb.st_size);
+}
+
+int jobstore_open(struct jobstore *js, const char *path, off_t segmax) {
+  size_t i;
+  int err;
+
+  memset(js, 0, sizeof(*js));
+  js->idxfd = -1;
+  js->segfd = -1;
+  js->segmax = segmax > 0 ? segmax : JOBSTORE_DEFAULT_SEGMAX;
+  for (i = 0; i < ARRAY_SIZE(js->segfds); i++) {
+    js->segfds[i] = -1;
+  }
+
+  if (fs_mkdir_all(path) < 0) {
+    return -1;
+  }
+
+  js->dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (js->dirfd < 0) {
+    return -1;
+  }
+
+  if (openidx(js) < 0 || openhead(js) < 0) {
+    err = errno;
+    jobstore_close(js);
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+int jobstore_close(struct jobstore *js) {
+  int status = 0;
+  size_t i;
+
+  for (i = 0; i < ARRAY_SIZE(js->segfds); i++) {
+    if (js->segfds[i] >= 0) {
+      close(js->segfds[i]);
+      js->segfds[i] = -1;
+    }
+  }
+
+  if (js->segfd >= 0 && close(js->segfd) < 0) {
+    status = -1;
+  }
+
+  if (js->idx != NULL && munmap(js->idx, js->idxlen) < 0) {
+    status = -1;
+  }
+
+  if (js->idxfd >= 0 && close(js->idxfd) < 0) {
+    status = -1;
+  }
+
+  if (js->dirfd >= 0 && close(js->dirfd) < 0) {
+    status = -1;
+  }
+
+  js->segfd = -1;
+  js->idx = NULL;
+  js->idxfd = -1;
+  js->dirfd = -1;
+  return status;
+}
+
+uint64_t jobstore_newid(struct jobstore *js) {
+  uint64_t id;
+
+  id = IDXHDR(js)->nextid;
+  if (growidx(js, id) < 0) {
+    return 0;
+  }
+
+  IDXHDR(js)->nextid = id + 1;
+  return id;
+}
+
+uint64_t jobstore_nextid(struct jobstore *js) {
+  return IDXHDR(js)->nextid;
+}
+
+/* returns a cached read-only fd for a segment */
+static int segfd(struct jobstore *js, uint32_t segno) {
+  size_t slot = segno % ARRAY_SIZE(js->segfds);
+  int fd;
+
+  if (js->segfds[slot] >= 0 && js->segfdnos[slot] == segno) {
+    return js->segfds[slot];
+  }
+
+  fd = opensegat(js->dirfd, segno, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (js->segfds[slot] >= 0) {
+    close(js->segfds[slot]);
+  }
+
+  js->segfds[slot] = fd;
+  js->segfdnos[slot] = segno;
+  return fd;
+}
+
+static void dropsegfd(struct jobstore *js, uint32_t segno) {
+  size_t slot = segno % ARRAY_SIZE(js->segfds);
+
+  if (js->segfds[slot] >= 0 && js->segfdnos[slot] == segno) {
+    close(js->segfds[slot]);
+    js->segfds[slot] = -1;
+  }
+}
+
+/* seal the head segment if a record of length 'reclen' does not fit */
+static int reserve(struct jobstore *js, off_t reclen) {
+  int fd;
+
+  if (js->segoff == 0 || js->segoff + reclen <= js->segmax) {
+    return 0;
+  }
+
+  fd = opensegat(js->dirfd, js->segno + 1, O_WRONLY | O_CREAT | O_TRUNC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  /* records compacted into the sealed segment must be on disk before
+   * the segment they were moved from is unlinked */
+  if (fdatasync(js->segfd) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  close(js->segfd);
+  js->segfd = fd;
+  js->segno++;
+  js->segoff = 0;
+  IDXHDR(js)->headseg = js->segno;
+  return 0;
+}
+
+static int pwritev_all(int fd, struct iovec *iov, int iovcnt, off_t off) {
+  ssize_t n;
+
+  while (iovcnt > 0) {
+    n = pwritev(fd, iov, iovcnt, off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+
+    off += n;
+    while (iovcnt > 0 && n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/* copy 'len' bytes from 'infd' to 'outfd' at 'outoff'. If 'inoff' is
+ * NULL, the current offset of 'infd' is used */
+static int copyfd(int infd, off_t *inoff, int outfd, off_t outoff,
+    size_t len) {
+  char buf[16384];
+  struct iovec iov;
+  ssize_t n;
+
+#if defined(__linux__)
+  while (len > 0) {
+    n = copy_file_range(infd, inoff, outfd, &outoff, len, 0);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+          errno == EOPNOTSUPP) {
+        break; /* not supported for these fds - fall back to copying */
+      }
+      return -1;
+    } else if (n == 0) {
+      errno = EIO; /* premature EOF */
+      return -1;
+    }
+
+    len -= n;
+  }
+#endif
+
+  while (len > 0) {
+    if (inoff != NULL) {
+      n = pread(infd, buf, MIN(len, sizeof(buf)), *inoff);
+    } else {
+      n = read(infd, buf, MIN(len, sizeof(buf)));
+    }
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    } else if (n == 0) {
+      errno = EIO;
+      return -1;
+    }
+
+    iov.iov_base = buf;
+    iov.iov_len = n;
+    if (pwritev_all(outfd, &iov, 1, outoff) < 0) {
+      return -1;
+    }
+
+    if (inoff != NULL) {
+      *inoff += n;
+    }
+    outoff += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+static void setent(struct jobstore *js, const struct rec_hdr *rec,
+    off_t off) {
+  struct idx_ent *ent = &IDXENTS(js)[rec->id];
+
+  ent->flags = 0;
+  ent->seg = js->segno;
+  ent->off = off;
+  ent->datalen = rec->datalen;
+  ent->metalen = rec->metalen;
+  ent->status = rec->status;
+  ent->time = rec->time;
+  ent->flags = IDXF_VALID; /* last - after the record is written */
+}
+
+static int put_begin(struct jobstore *js, struct rec_hdr *rec,
+    uint64_t id, int status, size_t metalen, size_t datalen) {
+  if (id == 0 || id >= IDXHDR(js)->nextid || metalen > UINT32_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  memset(rec, 0, sizeof(*rec));
+  rec->magic = REC_MAGIC;
+  rec->metalen = metalen;
+  rec->id = id;
+  rec->datalen = datalen;
+  rec->time = time(NULL);
+  rec->status = status;
+  return reserve(js, sizeof(*rec) + metalen + datalen);
+}
+
+int jobstore_put(struct jobstore *js, uint64_t id, int status,
+    const void *meta, size_t metalen, const struct iovec *iov, int iovcnt) {
+  struct iovec vec[MAXIOV];
+  struct rec_hdr rec;
+  size_t datalen = 0;
+  off_t off;
+  int i;
+
+  if (iovcnt < 0 || iovcnt > MAXIOV - 2) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    datalen += iov[i].iov_len;
+    vec[i + 2] = iov[i];
+  }
+
+  if (put_begin(js, &rec, id, status, metalen, datalen) < 0) {
+    return -1;
+  }
+
+  vec[0].iov_base = &rec;
+  vec[0].iov_len = sizeof(rec);
+  vec[1].iov_base = (void *)meta;
+  vec[1].iov_len = metalen;
+  off = js->segoff;
+  if (pwritev_all(js->segfd, vec, iovcnt + 2, off) < 0) {
+    return -1;
+  }
+
+  js->segoff += sizeof(rec) + metalen + datalen;
+  setent(js, &rec, off);
+  return 0;
+}
+
+int jobstore_put_fd(struct jobstore *js, uint64_t id, int status,
+    const void *meta, size_t metalen, int fd, size_t len) {
+  struct iovec vec[2];
+  struct rec_hdr rec;
+  off_t off;
+
+  if (put_begin(js, &rec, id, status, metalen, len) < 0) {
+    return -1;
+  }
+
+  vec[0].iov_base = &rec;
+  vec[0].iov_len = sizeof(rec);
+  vec[1].iov_base = (void *)meta;
+  vec[1].iov_len = metalen;
+  off = js->segoff;
+  if (pwritev_all(js->segfd, vec, 2, off) < 0 ||
+      copyfd(fd, NULL, js->segfd, off + sizeof(rec) + metalen, len) < 0) {
+    return -1;
+  }
+
+  js->segoff += sizeof(rec) + metalen + len;
+  setent(js, &rec, off);
+  return 0;
+}
+
+int jobstore_get(struct jobstore *js, uint64_t id,
+    struct jobstore_entry *ent) {
+  struct idx_ent *e;
+
+  if (id == 0 || id >= IDXHDR(js)->nextid || id >= IDXCAP(js)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  e = &IDXENTS(js)[id];
+  if (!(e->flags & IDXF_VALID)) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  ent->id = id;
+  ent->status = e->status;
+  ent->time = e->time;
+  ent->seg = e->seg;
+  ent->off = e->off + sizeof(struct rec_hdr) + e->metalen;
+  ent->metalen = e->metalen;
+  ent->datalen = e->datalen;
+  return 0;
+}
+
+ssize_t jobstore_read_meta(struct jobstore *js,
+    const struct jobstore_entry *ent, void *buf, size_t len) {
+  int fd;
+
+  fd = segfd(js, ent->seg);
+  if (fd < 0) {
+    return -1;
+  }
+
+  return pread(fd, buf, MIN(len, ent->metalen), ent->off - ent->metalen);
+}
+
+ssize_t jobstore_sendfile(struct jobstore *js,
+    const struct jobstore_entry *ent, int outfd, off_t *off) {
+  off_t inoff;
+  size_t left;
+  int fd;
+#if defined(__linux__)
+  ssize_t n;
+#else
+  off_t sbytes = 0;
+#endif
+
+  if (*off >= ent->datalen) {
+    return 0;
+  }
+
+  fd = segfd(js, ent->seg);
+  if (fd < 0) {
+    return -1;
+  }
+
+  inoff = ent->off + *off;
+  left = ent->datalen - *off;
+#if defined(__linux__)
+  n = sendfile(outfd, fd, &inoff, left);
+  if (n < 0) {
+    return -1;
+  }
+
+  *off += n;
+  return n;
+#else
+  if (sendfile(fd, outfd, inoff, left, NULL, &sbytes, 0) < 0 &&
+      (sbytes == 0 || (errno != EAGAIN && errno != EINTR))) {
+    return -1;
+  }
+
+  *off += sbytes;
+  return sbytes;
+#endif
+}
+
+int jobstore_remove(struct jobstore *js, uint64_t id) {
+  struct jobstore_entry ent;
+
+  if (jobstore_get(js, id, &ent) < 0) {
+    return -1;
+  }
+
+  IDXENTS(js)[id].flags = 0;
+  return 0;
+}
+
+/* move the live records of sealed segment 'seg' to the head segment */
+static int compact_seg(struct jobstore *js, uint32_t seg, time_t expire) {
+  struct rec_hdr rec;
+  struct idx_ent *ent;
+  off_t off = 0;
+  off_t inoff;
+  off_t reclen;
+  ssize_t n;
+  int fd;
+
+  fd = segfd(js, seg);
+  if (fd < 0) {
+    return errno == ENOENT ? 0 : -1;
+  }
+
+  for (;;) {
+    n = pread(fd, &rec, sizeof(rec), off);
+    if (n < 0) {
+      return -1;
+    } else if (n != sizeof(rec) || rec.magic != REC_MAGIC) {
+      break; /* end of segment */
+    }
+
+    reclen = sizeof(rec) + rec.metalen + rec.datalen;
+    if (rec.id == 0 || rec.id >= IDXCAP(js)) {
+      off += reclen;
+      continue;
+    }
+
+    ent = &IDXENTS(js)[rec.id];
+    if (!(ent->flags & IDXF_VALID) || ent->seg != seg || ent->off != off) {
+      off += reclen; /* removed or replaced */
+      continue;
+    }
+
+    if (rec.time < expire) {
+      ent->flags = 0;
+      off += reclen;
+      continue;
+    }
+
+    if (reserve(js, reclen) < 0) {
+      return -1;
+    }
+
+    inoff = off;
+    if (copyfd(fd, &inoff, js->segfd, js->segoff, reclen) < 0) {
+      return -1;
+    }
+
+    setent(js, &rec, js->segoff);
+    js->segoff += reclen;
+    off += reclen;
+  }
+
+  return 0;
+}
+
+int jobstore_compact(struct jobstore *js, unsigned int nsegs,
+    time_t expire) {
+  char name[32];
+  uint32_t seg;
+  int nretired = 0;
+
+  while (nretired < nsegs && IDXHDR(js)->tailseg < js->segno) {
+    seg = IDXHDR(js)->tailseg;
+    if (compact_seg(js, seg, expire) < 0) {
+      return -1;
+    }
+
+    /* the moved records, their index entries and the name of a head
+     * segment created while compacting must be on disk before the old
+     * segment is unlinked, or a crash could lose them */
+    if (fdatasync(js->segfd) < 0 ||
+        msync(js->idx, js->idxlen, MS_SYNC) < 0 || fsync(js->dirfd) < 0) {
+      return -1;
+    }
+
+    dropsegfd(js, seg);
+    if (segname(name, sizeof(name), seg) < 0) {
+      return -1;
+    }
+
+    if (unlinkat(js->dirfd, name, 0) < 0 && errno != ENOENT) {
+      return -1;
+    }
+
+    IDXHDR(js)->tailseg = seg + 1;
+    nretired++;
+  }
+
+  return nretired;
+}
@@ -0,0 +1,139 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_JOBSTORE_H__
+#define LIB_JOBSTORE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* A job store keeps the results of finished jobs in a directory of
+ * append-only segment files (seg.<n>). Each result is a record holding a
+ * header, caller defined metadata and the job output. An index file
+ * (index), mapped into memory, holds one fixed size entry per job ID
+ * with the location of the job's record. Job IDs are allocated by the
+ * store, starting at 1.
+ *
+ * The store is not thread safe. */
+
+#define JOBSTORE_DEFAULT_SEGMAX (64 << 20)
+#define JOBSTORE_NSEGFDS        8 /* # of cached read-only segment fds */
+
+struct jobstore_entry {
+  uint64_t id;
+  int status;       /* job exit status, as given to jobstore_put */
+  time_t time;      /* time of jobstore_put */
+  uint32_t seg;     /* segment number */
+  off_t off;        /* offset of job data in segment */
+  size_t metalen;   /* length of metadata, preceding data in segment */
+  size_t datalen;   /* length of job data */
+};
+
+struct jobstore {
+  int dirfd;
+  int idxfd;
+  void *idx;        /* mapped index file */
+  size_t idxlen;    /* length of mapping */
+  int segfd;        /* head segment, write-only */
+  uint32_t segno;   /* head segment number */
+  off_t segoff;     /* end of head segment */
+  off_t segmax;     /* soft segment size limit */
+  int segfds[JOBSTORE_NSEGFDS];
+  uint32_t segfdnos[JOBSTORE_NSEGFDS];
+};
+
+/* jobstore_open --
+ *   Opens a job store in directory 'path', creating it if needed.
+ *   'segmax' is the size at which the head segment is sealed and a new
+ *   segment is started. A value of zero means JOBSTORE_DEFAULT_SEGMAX.
+ *   Returns 0 on success, -1 on error. Sets errno. */
+int jobstore_open(struct jobstore *js, const char *path, off_t segmax);
+
+/* jobstore_close --
+ *   Releases all resources associated with a job store. Returns 0 on
+ *   success, -1 on error. Sets errno. */
+int jobstore_close(struct jobstore *js);
+
+/* jobstore_newid --
+ *   Allocates a new job ID. Returns the ID on success, 0 on error.
+ *   Sets errno. */
+uint64_t jobstore_newid(struct jobstore *js);
+
+/* jobstore_nextid --
+ *   Returns the ID that will be returned by the next call to
+ *   jobstore_newid. IDs below this value have been allocated. */
+uint64_t jobstore_nextid(struct jobstore *js);
+
+/* jobstore_put --
+ *   Appends the result of job 'id' to the head segment and points its
+ *   index entry to it. 'meta' is stored verbatim and can be read back
+ *   with jobstore_read_meta. The job data is gathered from 'iov'. Any
+ *   previous result of the job is replaced. Returns 0 on success, -1 on
+ *   error. Sets errno. */
+int jobstore_put(struct jobstore *js, uint64_t id, int status,
+    const void *meta, size_t metalen, const struct iovec *iov, int iovcnt);
+
+/* jobstore_put_fd --
+ *   Like jobstore_put, but the job data is 'len' bytes read from the
+ *   current offset of 'fd'. Returns 0 on success, -1 on error. Sets
+ *   errno. */
+int jobstore_put_fd(struct jobstore *js, uint64_t id, int status,
+    const void *meta, size_t metalen, int fd, size_t len);
+
+/* jobstore_get --
+ *   Looks up the result of job 'id'. Returns 0 on success, -1 on error.
+ *   Sets errno to ENOENT if there is no result for the job. */
+int jobstore_get(struct jobstore *js, uint64_t id,
+    struct jobstore_entry *ent);
+
+/* jobstore_read_meta --
+ *   Reads at most 'len' bytes of the metadata of 'ent' into 'buf'.
+ *   Returns the number of bytes read, or -1 on error. Sets errno. */
+ssize_t jobstore_read_meta(struct jobstore *js,
+    const struct jobstore_entry *ent, void *buf, size_t len);
+
+/* jobstore_sendfile --
+ *   Sends the job data of 'ent' to 'outfd' using sendfile(2), starting
+ *   at '*off' bytes into the data. '*off' is advanced by the number of
+ *   bytes sent. For non-blocking descriptors, a partial send is not an
+ *   error. Returns the number of bytes sent, or -1 on error. Sets
+ *   errno. */
+ssize_t jobstore_sendfile(struct jobstore *js,
+    const struct jobstore_entry *ent, int outfd, off_t *off);
+
+/* jobstore_remove --
+ *   Removes the result of job 'id' from the index. The space used by the
+ *   record is reclaimed by jobstore_compact. Returns 0 on success, -1 on
+ *   error. Sets errno to ENOENT if there is no result for the job. */
+int jobstore_remove(struct jobstore *js, uint64_t id);
+
+/* jobstore_compact --
+ *   Compacts at most 'nsegs' of the oldest sealed segments. Live records
+ *   are appended to the head segment, records of jobs finished before
+ *   'expire' are removed and the old segment files are unlinked, once
+ *   the head segment and the index are synced to disk. Returns the
+ *   number of retired segments, or -1 on error. Sets errno. */
+int jobstore_compact(struct jobstore *js, unsigned int nsegs,
+    time_t expire);
+
+#endif
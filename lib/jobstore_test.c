@@ -0,0 +1,319 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+#include <errno.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "lib/fs.h"
+#include "lib/jobstore.h"
+#include "lib/test.h"
+
+#define TESTDIR     ".jobstore_test"
+#define TESTFILE    TESTDIR "/input"
+#define SEGMAX      256
+#define NJOBS       32
+
+static struct jobstore js_;
+
+static int jobdata(char *buf, size_t len, uint64_t id) {
+  return snprintf(buf, len, "output of job %llu", (unsigned long long)id);
+}
+
+/* verify the metadata and data of a job, using sendfile over a pipe */
+static int check_job(uint64_t id) {
+  struct jobstore_entry ent;
+  char expected[64];
+  char meta[32];
+  char buf[64];
+  int explen;
+  int fds[2];
+  off_t off = 0;
+  ssize_t n;
+  int status = TEST_FAIL;
+
+  if (jobstore_get(&js_, id, &ent) < 0) {
+    TEST_LOGF("jobstore_get %llu: %s", (unsigned long long)id,
+        strerror(errno));
+    return TEST_FAIL;
+  }
+
+  explen = jobdata(expected, sizeof(expected), id);
+  if (ent.id != id || ent.status != (int)id ||
+      ent.datalen != explen || ent.metalen != sizeof(id)) {
+    TEST_LOGF("unexpected entry for job %llu", (unsigned long long)id);
+    return TEST_FAIL;
+  }
+
+  n = jobstore_read_meta(&js_, &ent, meta, sizeof(meta));
+  if (n != sizeof(id) || memcmp(meta, &id, sizeof(id)) != 0) {
+    TEST_LOGF("unexpected metadata for job %llu", (unsigned long long)id);
+    return TEST_FAIL;
+  }
+
+  if (pipe(fds) < 0) {
+    TEST_LOGF("pipe: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  while (off < ent.datalen) {
+    if (jobstore_sendfile(&js_, &ent, fds[1], &off) <= 0) {
+      TEST_LOGF("jobstore_sendfile: %s", strerror(errno));
+      goto close_fds;
+    }
+  }
+
+  n = read(fds[0], buf, sizeof(buf));
+  if (n != explen || memcmp(buf, expected, explen) != 0) {
+    TEST_LOGF("unexpected data for job %llu", (unsigned long long)id);
+    goto close_fds;
+  }
+
+  status = TEST_OK;
+close_fds:
+  close(fds[0]);
+  close(fds[1]);
+  return status;
+}
+
+static int test_open(void) {
+  fs_remove_all(TESTDIR);
+  if (jobstore_open(&js_, TESTDIR, SEGMAX) < 0) {
+    TEST_LOGF("jobstore_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_put(void) {
+  struct iovec iov[2];
+  char buf[64];
+  uint64_t id;
+  int i;
+  int len;
+
+  for (i = 0; i < NJOBS; i++) {
+    id = jobstore_newid(&js_);
+    if (id != i + 1) {
+      TEST_LOGF("jobstore_newid: expected %d, got %llu", i + 1,
+          (unsigned long long)id);
+      return TEST_FAIL;
+    }
+
+    /* split the data in two parts to exercise gathering */
+    len = jobdata(buf, sizeof(buf), id);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = buf + 4;
+    iov[1].iov_len = len - 4;
+    if (jobstore_put(&js_, id, (int)id, &id, sizeof(id), iov, 2) < 0) {
+      TEST_LOGF("jobstore_put: %s", strerror(errno));
+      return TEST_FAIL;
+    }
+  }
+
+  if (js_.segno == 0) {
+    TEST_LOG("expected the head segment to have been rotated");
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_put_fd(void) {
+  char buf[64];
+  uint64_t id;
+  int len;
+  int fd;
+  int status = TEST_FAIL;
+
+  id = jobstore_newid(&js_);
+  len = jobdata(buf, sizeof(buf), id);
+  fd = open(TESTFILE, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    TEST_LOGF("%s: %s", TESTFILE, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (write(fd, buf, len) != len || lseek(fd, 0, SEEK_SET) != 0) {
+    TEST_LOGF("%s: %s", TESTFILE, strerror(errno));
+    goto close_fd;
+  }
+
+  if (jobstore_put_fd(&js_, id, (int)id, &id, sizeof(id), fd, len) < 0) {
+    TEST_LOGF("jobstore_put_fd: %s", strerror(errno));
+    goto close_fd;
+  }
+
+  status = check_job(id);
+close_fd:
+  close(fd);
+  return status;
+}
+
+static int test_get(void) {
+  uint64_t id;
+
+  for (id = 1; id <= NJOBS; id++) {
+    if (check_job(id) != TEST_OK) {
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_remove(void) {
+  struct jobstore_entry ent;
+  uint64_t id;
+
+  for (id = 2; id <= NJOBS; id += 2) {
+    if (jobstore_remove(&js_, id) < 0) {
+      TEST_LOGF("jobstore_remove: %s", strerror(errno));
+      return TEST_FAIL;
+    }
+
+    if (jobstore_get(&js_, id, &ent) == 0 || errno != ENOENT) {
+      TEST_LOGF("job %llu: expected ENOENT", (unsigned long long)id);
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_compact(void) {
+  struct stat sb;
+  uint64_t id;
+  int ret;
+
+  ret = jobstore_compact(&js_, 1000, 0);
+  if (ret <= 0) {
+    TEST_LOGF("jobstore_compact: %d %s", ret, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (fstatat(js_.dirfd, "seg.0000000000", &sb, 0) == 0 ||
+      errno != ENOENT) {
+    TEST_LOG("expected first segment to be retired");
+    return TEST_FAIL;
+  }
+
+  for (id = 1; id <= NJOBS; id += 2) {
+    if (check_job(id) != TEST_OK) {
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_reopen(void) {
+  uint64_t nextid;
+  uint64_t id;
+
+  nextid = jobstore_nextid(&js_);
+  if (jobstore_close(&js_) < 0) {
+    TEST_LOGF("jobstore_close: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (jobstore_open(&js_, TESTDIR, SEGMAX) < 0) {
+    TEST_LOGF("jobstore_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (jobstore_nextid(&js_) != nextid) {
+    TEST_LOG("next ID not persisted");
+    return TEST_FAIL;
+  }
+
+  for (id = 1; id <= NJOBS; id += 2) {
+    if (check_job(id) != TEST_OK) {
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_expire(void) {
+  struct jobstore_entry ent;
+  uint64_t id;
+  int nremaining = 0;
+
+  /* seal the head, then expire everything sealed */
+  js_.segmax = 1;
+  id = jobstore_newid(&js_);
+  if (jobstore_put(&js_, id, 0, NULL, 0, NULL, 0) < 0 ||
+      jobstore_put(&js_, id, 0, NULL, 0, NULL, 0) < 0) {
+    TEST_LOGF("jobstore_put: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (jobstore_compact(&js_, 1000, time(NULL) + 1) < 0) {
+    TEST_LOGF("jobstore_compact: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  for (id = 1; id < jobstore_nextid(&js_); id++) {
+    if (jobstore_get(&js_, id, &ent) == 0) {
+      nremaining++;
+    }
+  }
+
+  /* only the last put, in the head segment, should remain */
+  if (nremaining != 1) {
+    TEST_LOGF("expected one remaining job, got %d", nremaining);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_close(void) {
+  if (jobstore_close(&js_) < 0) {
+    TEST_LOGF("jobstore_close: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (fs_remove_all(TESTDIR) < 0) {
+    TEST_LOGF("%s: %s", TESTDIR, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"open", test_open},
+  {"put", test_put},
+  {"put_fd", test_put_fd},
+  {"get", test_get},
+  {"remove", test_remove},
+  {"compact", test_compact},
+  {"reopen", test_reopen},
+  {"expire", test_expire},
+  {"close", test_close},
+);
@@ -0,0 +1,241 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/jobtable.h"
+
+/* FNV-1a */
+static uint32_t hash(const char *id) {
+  uint32_t h = 2166136261u;
+
+  while (*id != '\0') {
+    h = (h ^ (unsigned char)*id++) * 16777619u;
+  }
+
+  return h;
+}
+
+/* returns the slot of 'id', or the free slot where it would be added */
+static uint32_t find(const struct jobtable *t, const char *id) {
+  uint32_t i = hash(id) & t->mask;
+
+  while (t->slots[i].id[0] != '\0' && strcmp(t->slots[i].id, id) != 0) {
+    i = (i + 1) & t->mask;
+  }
+
+  return i;
+}
+
+static void lru_unlink(struct jobtable *t, uint32_t i) {
+  struct jobtable_entry *ent = &t->slots[i];
+
+  if (ent->prev != JOBTABLE_NONE) {
+    t->slots[ent->prev].next = ent->next;
+  } else {
+    t->head = ent->next;
+  }
+
+  if (ent->next != JOBTABLE_NONE) {
+    t->slots[ent->next].prev = ent->prev;
+  } else {
+    t->tail = ent->prev;
+  }
+}
+
+static void lru_push(struct jobtable *t, uint32_t i) {
+  struct jobtable_entry *ent = &t->slots[i];
+
+  ent->prev = JOBTABLE_NONE;
+  ent->next = t->head;
+  if (t->head != JOBTABLE_NONE) {
+    t->slots[t->head].prev = i;
+  } else {
+    t->tail = i;
+  }
+
+  t->head = i;
+}
+
+/* move the entry in slot 'from' to the free slot 'to' */
+static void move(struct jobtable *t, uint32_t from, uint32_t to) {
+  struct jobtable_entry *ent = &t->slots[to];
+
+  *ent = t->slots[from];
+  t->slots[from].id[0] = '\0';
+  if (ent->state == JOBTABLE_RUNNING) {
+    return;
+  }
+
+  if (ent->prev != JOBTABLE_NONE) {
+    t->slots[ent->prev].next = to;
+  } else {
+    t->head = to;
+  }
+
+  if (ent->next != JOBTABLE_NONE) {
+    t->slots[ent->next].prev = to;
+  } else {
+    t->tail = to;
+  }
+}
+
+/* delete the entry in slot 'i'. Entries after it in the probe sequence
+ * are moved back unless that would place them before their home slot */
+static void delete(struct jobtable *t, uint32_t i) {
+  uint32_t j = i;
+  uint32_t k;
+
+  if (t->slots[i].state != JOBTABLE_RUNNING) {
+    lru_unlink(t, i);
+    t->ndone--;
+  }
+
+  t->slots[i].id[0] = '\0';
+  t->nentries--;
+  for (;;) {
+    j = (j + 1) & t->mask;
+    if (t->slots[j].id[0] == '\0') {
+      break;
+    }
+
+    k = hash(t->slots[j].id) & t->mask;
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+
+    move(t, j, i);
+    i = j;
+  }
+}
+
+static void evict(struct jobtable *t) {
+  uint32_t i = t->tail;
+
+  if (t->evict != NULL) {
+    t->evict(&t->slots[i], t->arg);
+  }
+
+  delete(t, i);
+}
+
+int jobtable_init(struct jobtable *t, size_t maxentries, size_t maxdone,
+    void (*evict)(const struct jobtable_entry *ent, void *arg), void *arg) {
+  size_t nslots = 2;
+
+  if (maxentries == 0 || maxdone == 0 || maxentries > UINT32_MAX / 4) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  while (nslots < maxentries * 2) {
+    nslots *= 2;
+  }
+
+  memset(t, 0, sizeof(*t));
+  t->slots = calloc(nslots, sizeof(struct jobtable_entry));
+  if (t->slots == NULL) {
+    return -1;
+  }
+
+  t->mask = (uint32_t)(nslots - 1);
+  t->maxentries = maxentries;
+  t->maxdone = maxdone;
+  t->head = JOBTABLE_NONE;
+  t->tail = JOBTABLE_NONE;
+  t->evict = evict;
+  t->arg = arg;
+  return 0;
+}
+
+void jobtable_cleanup(struct jobtable *t) {
+  free(t->slots);
+  t->slots = NULL;
+}
+
+struct jobtable_entry *jobtable_add(struct jobtable *t, const char *id,
+    pid_t pid, time_t started) {
+  struct jobtable_entry *ent;
+  uint32_t i;
+
+  if (*id == '\0' || strlen(id) >= JOBTABLE_IDSZ) {
+    errno = EINVAL;
+    return NULL;
+  } else if (t->slots[find(t, id)].id[0] != '\0') {
+    errno = EEXIST;
+    return NULL;
+  } else if (t->nentries == t->maxentries) {
+    if (t->ndone == 0) {
+      errno = ENOSPC;
+      return NULL;
+    }
+    evict(t);
+  }
+
+  /* eviction may have moved the free slot */
+  i = find(t, id);
+  ent = &t->slots[i];
+  memset(ent, 0, sizeof(*ent));
+  strcpy(ent->id, id);
+  ent->state = JOBTABLE_RUNNING;
+  ent->pid = pid;
+  ent->started = started;
+  ent->prev = JOBTABLE_NONE;
+  ent->next = JOBTABLE_NONE;
+  t->nentries++;
+  return ent;
+}
+
+struct jobtable_entry *jobtable_get(struct jobtable *t, const char *id) {
+  uint32_t i;
+
+  if (*id == '\0' || strlen(id) >= JOBTABLE_IDSZ) {
+    return NULL;
+  }
+
+  i = find(t, id);
+  if (t->slots[i].id[0] == '\0') {
+    return NULL;
+  } else if (t->slots[i].state != JOBTABLE_RUNNING && t->head != i) {
+    lru_unlink(t, i);
+    lru_push(t, i);
+  }
+
+  return &t->slots[i];
+}
+
+void jobtable_finish(struct jobtable *t, struct jobtable_entry *ent,
+    int state, int status) {
+  uint32_t i = (uint32_t)(ent - t->slots);
+
+  if (ent->state != JOBTABLE_RUNNING) {
+    return;
+  }
+
+  ent->state = state;
+  ent->status = status;
+  lru_push(t, i);
+  if (++t->ndone > t->maxdone) {
+    evict(t);
+  }
+}
@@ -0,0 +1,109 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_JOBTABLE_H__
+#define LIB_JOBTABLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* A job table maps job IDs to the state of running and finished jobs in
+ * memory. It is an open addressing hash table with linear probing, of a
+ * fixed size of at least twice the max number of entries, so that
+ * lookups are O(1) and never allocate. Entries are deleted by shifting
+ * the entries after them back, without tombstones.
+ *
+ * Finished entries are kept in LRU order, and lookups make an entry the
+ * most recently used. When there are more finished entries than the
+ * finished limit, or no room for a new entry, the least recently used
+ * finished entry is evicted. Running entries are never evicted.
+ *
+ * The table is not thread safe. */
+
+#define JOBTABLE_IDSZ 48
+
+#define JOBTABLE_RUNNING 0
+#define JOBTABLE_DONE    1 /* exited, with a known status */
+#define JOBTABLE_LOST    2 /* exited, with an unknown status */
+
+#define JOBTABLE_NONE    UINT32_MAX
+
+struct jobtable_entry {
+  char id[JOBTABLE_IDSZ];   /* empty if the slot is free */
+  int state;
+  int cancelled;            /* set by the caller */
+  pid_t pid;
+  time_t started;
+  int status;               /* wait status, if done */
+  uint64_t ref;             /* set by the caller */
+  uint32_t prev;            /* more recently used finished entry */
+  uint32_t next;            /* less recently used finished entry */
+};
+
+struct jobtable {
+  struct jobtable_entry *slots;
+  uint32_t mask;            /* # of slots - 1 */
+  size_t maxentries;
+  size_t maxdone;
+  size_t nentries;
+  size_t ndone;
+  uint32_t head;            /* most recently used finished entry */
+  uint32_t tail;            /* least recently used finished entry */
+  void (*evict)(const struct jobtable_entry *ent, void *arg);
+  void *arg;
+};
+
+/* jobtable_init --
+ *   Sets up a table of at most 'maxentries' entries, at most 'maxdone' of
+ *   which are finished. 'evict', if not NULL, is called with 'arg' for
+ *   each evicted entry. Returns 0 on success, -1 on error. Sets
+ *   errno. */
+int jobtable_init(struct jobtable *t, size_t maxentries, size_t maxdone,
+    void (*evict)(const struct jobtable_entry *ent, void *arg), void *arg);
+
+/* jobtable_cleanup --
+ *   Releases all resources. */
+void jobtable_cleanup(struct jobtable *t);
+
+/* jobtable_add --
+ *   Adds the running job 'id' with process 'pid', started at 'started'.
+ *   Returns the entry on success, or NULL on error, with errno set to
+ *   EEXIST if the job is in the table, ENOSPC if all entries are running
+ *   or EINVAL if 'id' is empty or too long. Entries are valid until the
+ *   next call that adds, finishes or evicts an entry. */
+struct jobtable_entry *jobtable_add(struct jobtable *t, const char *id,
+    pid_t pid, time_t started);
+
+/* jobtable_get --
+ *   Returns the entry of job 'id', and makes it the most recently used
+ *   if it is finished, or NULL if the job is not in the table. */
+struct jobtable_entry *jobtable_get(struct jobtable *t, const char *id);
+
+/* jobtable_finish --
+ *   Marks the running entry 'ent' as finished, in 'state' JOBTABLE_DONE
+ *   with wait status 'status', or in JOBTABLE_LOST, and evicts the least
+ *   recently used finished entry if there are too many. */
+void jobtable_finish(struct jobtable *t, struct jobtable_entry *ent,
+    int state, int status);
+
+#endif
@@ -0,0 +1,199 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/jobtable.h"
+#include "lib/test.h"
+
+#define NCHURN 5000
+
+static char evicted_[JOBTABLE_IDSZ];
+static int nevicted_;
+static int alive_[NCHURN];
+
+static void on_evict(const struct jobtable_entry *ent, void *arg) {
+  snprintf(evicted_, sizeof(evicted_), "%s", ent->id);
+  nevicted_++;
+}
+
+static void on_evict_churn(const struct jobtable_entry *ent, void *arg) {
+  int n = atoi(ent->id + 1);
+
+  if (ent->state == JOBTABLE_RUNNING || !alive_[n]) {
+    *(int *)arg = 1; /* evicted twice, or while running */
+  }
+  alive_[n] = 0;
+}
+
+static int test_add_get(void) {
+  struct jobtable t;
+  struct jobtable_entry *ent;
+  char id[JOBTABLE_IDSZ + 1];
+
+  if (jobtable_init(&t, 4, 4, NULL, NULL) < 0) {
+    TEST_LOGF("jobtable_init: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (jobtable_add(&t, "a", 10, 100) == NULL ||
+      jobtable_add(&t, "b", 11, 101) == NULL) {
+    TEST_LOGF("jobtable_add: %s", strerror(errno));
+    return TEST_FAIL;
+  } else if (jobtable_add(&t, "a", 12, 102) != NULL || errno != EEXIST) {
+    TEST_LOG("expected duplicate to fail");
+    return TEST_FAIL;
+  }
+
+  memset(id, 'x', JOBTABLE_IDSZ);
+  id[JOBTABLE_IDSZ] = '\0';
+  if (jobtable_add(&t, "", 1, 1) != NULL || errno != EINVAL ||
+      jobtable_add(&t, id, 1, 1) != NULL || errno != EINVAL) {
+    TEST_LOG("expected invalid IDs to fail");
+    return TEST_FAIL;
+  }
+
+  ent = jobtable_get(&t, "b");
+  if (ent == NULL || ent->pid != 11 || ent->started != 101 ||
+      ent->state != JOBTABLE_RUNNING) {
+    TEST_LOG("unexpected entry");
+    return TEST_FAIL;
+  } else if (jobtable_get(&t, "c") != NULL || jobtable_get(&t, id) != NULL) {
+    TEST_LOG("unexpected entry for missing job");
+    return TEST_FAIL;
+  }
+
+  jobtable_finish(&t, ent, JOBTABLE_DONE, 256);
+  ent = jobtable_get(&t, "b");
+  if (ent == NULL || ent->state != JOBTABLE_DONE || ent->status != 256) {
+    TEST_LOG("unexpected finished entry");
+    return TEST_FAIL;
+  }
+
+  jobtable_cleanup(&t);
+  return TEST_OK;
+}
+
+/* the least recently used finished entry is evicted, and running
+ * entries are not */
+static int test_lru(void) {
+  struct jobtable t;
+
+  if (jobtable_init(&t, 3, 2, on_evict, NULL) < 0) {
+    TEST_LOGF("jobtable_init: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  jobtable_add(&t, "a", 1, 0);
+  jobtable_add(&t, "b", 2, 0);
+  jobtable_add(&t, "c", 3, 0);
+  if (jobtable_add(&t, "d", 4, 0) != NULL || errno != ENOSPC) {
+    TEST_LOG("expected a full table of running jobs to fail");
+    return TEST_FAIL;
+  }
+
+  jobtable_finish(&t, jobtable_get(&t, "a"), JOBTABLE_DONE, 0);
+  jobtable_finish(&t, jobtable_get(&t, "b"), JOBTABLE_DONE, 0);
+  jobtable_get(&t, "a");
+  jobtable_finish(&t, jobtable_get(&t, "c"), JOBTABLE_LOST, 0);
+  if (nevicted_ != 1 || strcmp(evicted_, "b") != 0) {
+    TEST_LOGF("unexpected eviction: %d %s", nevicted_, evicted_);
+    return TEST_FAIL;
+  }
+
+  /* a full table makes room for new jobs */
+  if (jobtable_add(&t, "d", 4, 0) == NULL ||
+      jobtable_add(&t, "e", 5, 0) == NULL || nevicted_ != 2 ||
+      strcmp(evicted_, "a") != 0) {
+    TEST_LOGF("unexpected eviction: %d %s", nevicted_, evicted_);
+    return TEST_FAIL;
+  } else if (jobtable_get(&t, "a") != NULL || jobtable_get(&t, "c") == NULL) {
+    TEST_LOG("unexpected entries after eviction");
+    return TEST_FAIL;
+  }
+
+  jobtable_cleanup(&t);
+  return TEST_OK;
+}
+
+/* many jobs through a small table, with entries moved on delete */
+static int test_churn(void) {
+  struct jobtable_entry *ent;
+  struct jobtable t;
+  char id[JOBTABLE_IDSZ];
+  int failed = 0;
+  int oldest = 0;
+  int i;
+  int j;
+
+  if (jobtable_init(&t, 64, 16, on_evict_churn, &failed) < 0) {
+    TEST_LOGF("jobtable_init: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  for (i = 0; i < NCHURN && !failed; i++) {
+    snprintf(id, sizeof(id), "j%d", i);
+    if (jobtable_add(&t, id, i + 1, 0) == NULL) {
+      TEST_LOGF("jobtable_add %d: %s", i, strerror(errno));
+      return TEST_FAIL;
+    }
+    alive_[i] = 1;
+
+    /* at most 40 running jobs, finished oldest first */
+    if (i - oldest >= 40) {
+      snprintf(id, sizeof(id), "j%d", oldest++);
+      ent = jobtable_get(&t, id);
+      if (ent == NULL) {
+        TEST_LOGF("running job %s not found", id);
+        return TEST_FAIL;
+      }
+      jobtable_finish(&t, ent, JOBTABLE_DONE, 0);
+    }
+
+    for (j = i > 100 ? i - 100 : 0; j <= i; j++) {
+      snprintf(id, sizeof(id), "j%d", j);
+      ent = jobtable_get(&t, id);
+      if ((ent != NULL) != alive_[j] ||
+          (ent != NULL && ent->pid != j + 1)) {
+        TEST_LOGF("unexpected entry for %s", id);
+        return TEST_FAIL;
+      }
+    }
+
+    if (t.nentries > t.maxentries || t.ndone > t.maxdone) {
+      TEST_LOG("too many entries");
+      return TEST_FAIL;
+    }
+  }
+
+  jobtable_cleanup(&t);
+  return failed ? TEST_FAIL : TEST_OK;
+}
+
+TEST_ENTRY(
+  {"add_get", test_add_get},
+  {"lru", test_lru},
+  {"churn", test_churn},
+)
@@ -0,0 +1,261 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/pipeline.h"
+
+#define BLANKS " \t"
+
+/* the stages of the running pipeline, for the alarm handler */
+static pid_t pids_[PIPELINE_MAXSTAGES + 1];
+static volatile sig_atomic_t npids_;
+static volatile sig_atomic_t timedout_;
+
+int pipeline_add(struct pipeline *p, const char *cmd) {
+  char **argv = NULL;
+  char *str;
+  char *tok;
+  char *save;
+  size_t nargs = 1;
+  size_t i;
+
+  if (p->nstages >= PIPELINE_MAXSTAGES) {
+    errno = E2BIG;
+    return -1;
+  }
+
+  for (i = 0; cmd[i] != '\0'; i++) {
+    nargs += strchr(BLANKS, cmd[i]) != NULL;
+  }
+
+  str = strdup(cmd);
+  if (str == NULL || (argv = calloc(nargs + 1, sizeof(char *))) == NULL) {
+    free(str);
+    return -1;
+  }
+
+  /* the arguments point into 'str', which is freed with argv[0] */
+  for (i = 0, tok = strtok_r(str, BLANKS, &save); tok != NULL;
+      tok = strtok_r(NULL, BLANKS, &save)) {
+    argv[i++] = tok;
+  }
+
+  if (i == 0 || argv[0] != str) {
+    free(str);
+    free(argv);
+    errno = EINVAL;
+    return -1;
+  }
+
+  p->stages[p->nstages++] = argv;
+  return 0;
+}
+
+void pipeline_free(struct pipeline *p) {
+  int i;
+
+  for (i = 0; i < p->nstages; i++) {
+    free(p->stages[i][0]);
+    free(p->stages[i]);
+    p->stages[i] = NULL;
+  }
+
+  p->nstages = 0;
+}
+
+static void kill_stages(void) {
+  int i;
+
+  for (i = 0; i < npids_; i++) {
+    kill(pids_[i], SIGKILL);
+  }
+}
+
+static void on_alarm(int sig) {
+  timedout_ = 1;
+  kill_stages();
+}
+
+static int pipe_cloexec(int fds[2], int pipesize) {
+  if (pipe(fds) < 0) {
+    return -1;
+  } else if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) < 0 ||
+      fcntl(fds[1], F_SETFD, FD_CLOEXEC) < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+
+#ifdef F_SETPIPE_SZ
+  /* sizes above the system limit are refused, and the default is kept */
+  if (pipesize > 0) {
+    fcntl(fds[1], F_SETPIPE_SZ, pipesize);
+  }
+#endif
+  return 0;
+}
+
+/* waits for all stages, and returns the wait status of the last one */
+static int wait_stages(void) {
+  int nleft = npids_;
+  int status = 0;
+  int wstatus;
+  pid_t pid;
+
+  while (nleft > 0) {
+    pid = waitpid(-1, &wstatus, 0);
+    if (pid < 0 && errno == EINTR) {
+      continue;
+    } else if (pid < 0) {
+      break;
+    }
+
+    if (pid == pids_[npids_ - 1]) {
+      status = wstatus;
+    }
+    nleft--;
+  }
+
+  return status;
+}
+
+int pipeline_run(const struct pipeline *p, int pipesize,
+    void (*exec_first)(char *const envp[]), char *const envp[]) {
+  struct sigaction sa;
+  int fds[2] = {-1, -1};
+  int in = STDIN_FILENO;
+#ifdef PR_SET_PDEATHSIG
+  pid_t self = getpid();
+#endif
+  int status;
+  pid_t pid;
+  int i;
+
+  /* the stages join the process group of the pipeline, before any of
+   * them is started, so that killing the group kills all of them */
+  if (setpgid(0, 0) < 0) {
+    return -1;
+  }
+
+  /* no SA_RESTART: a timeout interrupts the wait */
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_alarm;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGALRM, &sa, NULL) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i <= p->nstages; i++) {
+    if (i < p->nstages && pipe_cloexec(fds, pipesize) < 0) {
+      goto fail;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+      if (i < p->nstages) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+      goto fail;
+    } else if (pid == 0) {
+#ifdef PR_SET_PDEATHSIG
+      /* a pipeline killed by a signal the group did not get, e.g., by
+       * pid, does not leave its stages running */
+      if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0 || getppid() != self) {
+        _exit(127);
+      }
+#endif
+      signal(SIGALRM, SIG_DFL);
+      if (in != STDIN_FILENO) {
+        dup2(in, STDIN_FILENO);
+      }
+      if (i < p->nstages) {
+        dup2(fds[1], STDOUT_FILENO);
+      }
+
+      if (i == 0) {
+        exec_first(envp);
+      } else {
+        execve(p->stages[i - 1][0], p->stages[i - 1], envp);
+        perror(p->stages[i - 1][0]);
+      }
+      _exit(127);
+    }
+
+    pids_[i] = pid;
+    npids_ = i + 1;
+    if (in != STDIN_FILENO) {
+      close(in);
+    }
+    if (i < p->nstages) {
+      close(fds[1]);
+      in = fds[0];
+    }
+  }
+
+  /* the stages hold the only copies of the connection, so that it is
+   * closed when the last stage exits */
+  close(STDIN_FILENO);
+  close(STDOUT_FILENO);
+  status = wait_stages();
+  if (timedout_) {
+    signal(SIGALRM, SIG_DFL);
+    raise(SIGALRM);
+  } else if (WIFSIGNALED(status)) {
+    signal(WTERMSIG(status), SIG_DFL);
+    raise(WTERMSIG(status));
+  }
+
+  _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 127);
+
+fail:
+  if (in != STDIN_FILENO) {
+    close(in);
+  }
+  i = errno;
+  kill_stages();
+  wait_stages();
+  errno = i;
+  return -1;
+}
+
+int pipeline_kill(pid_t pid, int sig) {
+  /* only a pipeline leads a process group, and until it does, it has no
+   * stages */
+  if (kill(-pid, sig) == 0) {
+    return 0;
+  }
+
+  return kill(pid, sig);
+}
@@ -0,0 +1,76 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_PIPELINE_H__
+#define LIB_PIPELINE_H__
+
+/* A pipeline runs a child as the first of a chain of executables, each
+ * reading the output of the one before it from a pipe, as a shell runs
+ * 'a | b | c', but without the shell. The stages are run by a process
+ * forked from the caller, which waits for all of them: the caller sees
+ * one process, with the exit status of the last stage and the resource
+ * usage of the whole chain.
+ *
+ * A pending alarm of the calling process, e.g., a request timeout, kills
+ * every stage, and the pipeline is then killed by SIGALRM as a single
+ * child would be. The pipeline leads a process group of its own with
+ * its stages, so that pipeline_kill signals all of them. On Linux, the
+ * stages are also killed when the pipeline dies. */
+
+#include <sys/types.h>
+
+#define PIPELINE_MAXSTAGES 16
+
+struct pipeline {
+  char **stages[PIPELINE_MAXSTAGES]; /* argv of the stages after the first */
+  int nstages;
+};
+
+/* pipeline_add --
+ *   Adds a stage running 'cmd', a path followed by arguments separated
+ *   by blanks. The path is not searched for. Returns 0 on success, -1 on
+ *   error. Sets errno. */
+int pipeline_add(struct pipeline *p, const char *cmd);
+
+/* pipeline_free --
+ *   Releases the stages of 'p'. */
+void pipeline_free(struct pipeline *p);
+
+/* pipeline_run --
+ *   Runs the pipeline in the calling process, which must be a child
+ *   with its stdin, stdout and stderr set up. The first stage reads
+ *   stdin and is executed by 'exec_first', called with 'envp', which
+ *   only returns on error. The last stage writes to stdout. The stages
+ *   are connected by pipes of 'pipesize' bytes, where it can be set, or
+ *   of the default size if 'pipesize' is 0.
+ *
+ *   Exits with the status of the last stage. Returns -1 if the stages
+ *   could not be started, with errno set. */
+int pipeline_run(const struct pipeline *p, int pipesize,
+    void (*exec_first)(char *const envp[]), char *const envp[]);
+
+/* pipeline_kill --
+ *   Sends 'sig' to the child 'pid' and, if it runs a pipeline, to all
+ *   of its stages. Returns 0 on success, -1 on error. Sets errno. */
+int pipeline_kill(pid_t pid, int sig);
+
+#endif
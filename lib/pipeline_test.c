@@ -0,0 +1,294 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/pipeline.h"
+#include "lib/test.h"
+
+static char *first_[8];
+
+static void exec_first(char *const envp[]) {
+  execve(first_[0], first_, envp);
+  perror(first_[0]);
+}
+
+/* runs 'p' after 'first_' in a child, with 'input' on stdin and an alarm
+ * of 'timeout' seconds if not 0. Stores up to 'size' bytes of output in
+ * 'out'. Returns the wait status, or -1 on error */
+static int run(const struct pipeline *p, const char *input, unsigned int
+    timeout, char *out, size_t size) {
+  char *envp[] = {NULL};
+  int in[2];
+  int res[2];
+  size_t len = 0;
+  ssize_t n;
+  int status;
+  pid_t pid;
+
+  if (pipe(in) < 0 || pipe(res) < 0) {
+    return -1;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    return -1;
+  } else if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(res[1], STDOUT_FILENO);
+    close(in[0]);
+    close(in[1]);
+    close(res[0]);
+    close(res[1]);
+    alarm(timeout);
+    pipeline_run(p, 65536, exec_first, envp);
+    _exit(99);
+  }
+
+  close(in[0]);
+  close(res[1]);
+  if (write(in[1], input, strlen(input)) < 0) {
+    return -1;
+  }
+  close(in[1]);
+  while (len < size - 1 &&
+      (n = read(res[0], out + len, size - 1 - len)) > 0) {
+    len += n;
+  }
+  out[len] = '\0';
+  close(res[0]);
+  if (waitpid(pid, &status, 0) < 0) {
+    return -1;
+  }
+
+  return status;
+}
+
+static int test_add(void) {
+  struct pipeline p = {{0}};
+  int i;
+
+  if (pipeline_add(&p, "") == 0 || errno != EINVAL ||
+      pipeline_add(&p, " \t") == 0 || errno != EINVAL) {
+    TEST_LOG("expected empty stages to fail");
+    return TEST_FAIL;
+  } else if (pipeline_add(&p, " /bin/cat") == 0) {
+    TEST_LOG("expected leading blank to fail");
+    return TEST_FAIL;
+  }
+
+  if (pipeline_add(&p, "/usr/bin/tr  a-z\tA-Z") < 0) {
+    TEST_LOGF("pipeline_add: %s", strerror(errno));
+    return TEST_FAIL;
+  } else if (strcmp(p.stages[0][0], "/usr/bin/tr") != 0 ||
+      strcmp(p.stages[0][1], "a-z") != 0 ||
+      strcmp(p.stages[0][2], "A-Z") != 0 || p.stages[0][3] != NULL) {
+    TEST_LOG("unexpected arguments");
+    return TEST_FAIL;
+  }
+
+  for (i = 1; i < PIPELINE_MAXSTAGES; i++) {
+    if (pipeline_add(&p, "/bin/cat") < 0) {
+      TEST_LOGF("pipeline_add: %s", strerror(errno));
+      return TEST_FAIL;
+    }
+  }
+
+  if (pipeline_add(&p, "/bin/cat") == 0 || errno != E2BIG) {
+    TEST_LOG("expected too many stages to fail");
+    return TEST_FAIL;
+  }
+
+  pipeline_free(&p);
+  return p.nstages == 0 ? TEST_OK : TEST_FAIL;
+}
+
+static int test_run(void) {
+  struct pipeline p = {{0}};
+  char out[64];
+  int status;
+
+  first_[0] = "/bin/cat";
+  first_[1] = NULL;
+  if (pipeline_add(&p, "/usr/bin/tr a-z A-Z") < 0 ||
+      pipeline_add(&p, "/bin/cat") < 0) {
+    TEST_LOGF("pipeline_add: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  status = run(&p, "hello\n", 0, out, sizeof(out));
+  pipeline_free(&p);
+  if (status < 0) {
+    TEST_LOGF("run: %s", strerror(errno));
+    return TEST_FAIL;
+  } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    TEST_LOGF("unexpected status: %d", status);
+    return TEST_FAIL;
+  } else if (strcmp(out, "HELLO\n") != 0) {
+    TEST_LOGF("unexpected output: %s", out);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+/* the status is that of the last stage, as with a shell */
+static int test_status(void) {
+  struct pipeline p = {{0}};
+  char out[64];
+  int status;
+
+  first_[0] = "/bin/cat";
+  first_[1] = NULL;
+  if (pipeline_add(&p, "/usr/bin/false") < 0) {
+    TEST_LOGF("pipeline_add: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  status = run(&p, "", 0, out, sizeof(out));
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 1) {
+    TEST_LOGF("unexpected status: %d", status);
+    return TEST_FAIL;
+  }
+
+  pipeline_free(&p);
+  if (pipeline_add(&p, "/nonexistent") < 0) {
+    TEST_LOGF("pipeline_add: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  status = run(&p, "", 0, out, sizeof(out));
+  pipeline_free(&p);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 127) {
+    TEST_LOGF("unexpected status: %d", status);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+/* an alarm kills all stages, not only the last */
+static int test_timeout(void) {
+  struct pipeline p = {{0}};
+  struct timespec start;
+  struct timespec end;
+  char out[64];
+  int status;
+
+  first_[0] = "/bin/sleep";
+  first_[1] = "10";
+  first_[2] = NULL;
+  if (pipeline_add(&p, "/bin/cat") < 0) {
+    TEST_LOGF("pipeline_add: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  status = run(&p, "", 1, out, sizeof(out));
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  pipeline_free(&p);
+  if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGALRM) {
+    TEST_LOGF("unexpected status: %d", status);
+    return TEST_FAIL;
+  } else if (end.tv_sec - start.tv_sec > 5) {
+    TEST_LOG("stages outlived the timeout");
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+/* killing a pipeline kills all stages, which hold its output open */
+static int test_kill(void) {
+  static const struct timespec started = {0, 200000000};
+  struct pipeline p = {{0}};
+  char *envp[] = {NULL};
+  struct pollfd pfd;
+  char buf[64];
+  int out[2];
+  int status = TEST_FAIL;
+  pid_t pid;
+
+  first_[0] = "/bin/sleep";
+  first_[1] = "10";
+  first_[2] = NULL;
+  if (pipeline_add(&p, "/bin/cat") < 0 || pipe(out) < 0) {
+    TEST_LOGF("setup: %s", strerror(errno));
+    pipeline_free(&p);
+    return TEST_FAIL;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    TEST_LOGF("fork: %s", strerror(errno));
+    goto done;
+  } else if (pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    pipeline_run(&p, 0, exec_first, envp);
+    _exit(99);
+  }
+
+  close(out[1]);
+  out[1] = -1;
+  nanosleep(&started, NULL);
+  if (pipeline_kill(pid, SIGKILL) < 0) {
+    TEST_LOGF("pipeline_kill: %s", strerror(errno));
+    goto done;
+  }
+
+  pfd.fd = out[0];
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, 5000) != 1 || read(out[0], buf, sizeof(buf)) != 0) {
+    TEST_LOG("stages outlived the pipeline");
+    goto done;
+  }
+
+  status = TEST_OK;
+done:
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+  close(out[0]);
+  if (out[1] >= 0) {
+    close(out[1]);
+  }
+  pipeline_free(&p);
+  return status;
+}
+
+TEST_ENTRY(
+  {"add", test_add},
+  {"run", test_run},
+  {"status", test_status},
+  {"timeout", test_timeout},
+  {"kill", test_kill},
+)
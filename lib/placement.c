@@ -0,0 +1,360 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#if defined(__linux__)
+#define _GNU_SOURCE /* sched_setaffinity, SCHED_BATCH, SCHED_IDLE */
+#endif
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#if defined(__FreeBSD__)
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/placement.h"
+
+#if defined(__linux__)
+typedef cpu_set_t cpumask_t;
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#elif defined(__FreeBSD__)
+typedef cpuset_t cpumask_t;
+#endif
+
+#if defined(__linux__) || defined(__FreeBSD__)
+static int getmask(cpumask_t *mask) {
+#if defined(__linux__)
+  return sched_getaffinity(0, sizeof(*mask), mask);
+#else
+  return cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+      sizeof(*mask), mask);
+#endif
+}
+
+static int setmask(const cpumask_t *mask) {
+#if defined(__linux__)
+  return sched_setaffinity(0, sizeof(*mask), mask);
+#else
+  return cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+      sizeof(*mask), mask);
+#endif
+}
+#endif
+
+/* parses a non-negative CPU number. Returns the number of digits */
+static int parse_cpu(const char *s, int *cpu) {
+  int i;
+
+  *cpu = 0;
+  for (i = 0; s[i] >= '0' && s[i] <= '9'; i++) {
+    *cpu = *cpu * 10 + (s[i] - '0');
+    if (*cpu >= PLACEMENT_MAXCPUS) {
+      return 0;
+    }
+  }
+
+  return i;
+}
+
+int placement_parse_cpus(const char *s, int *cpus, int maxcpus) {
+  char set[PLACEMENT_MAXCPUS] = {0};
+  int first;
+  int last;
+  int ncpus = 0;
+  int n;
+  int i;
+
+  do {
+    if ((n = parse_cpu(s, &first)) == 0) {
+      goto invalid;
+    }
+
+    s += n;
+    last = first;
+    if (*s == '-') {
+      s++;
+      if ((n = parse_cpu(s, &last)) == 0 || last < first) {
+        goto invalid;
+      }
+      s += n;
+    }
+
+    for (i = first; i <= last; i++) {
+      set[i] = 1;
+    }
+  } while (*s++ == ',');
+
+  if (s[-1] != '\0') {
+    goto invalid;
+  }
+
+  for (i = 0; i < PLACEMENT_MAXCPUS; i++) {
+    if (set[i]) {
+      if (ncpus == maxcpus) {
+        goto invalid;
+      }
+      cpus[ncpus++] = i;
+    }
+  }
+
+  return ncpus;
+invalid:
+  errno = EINVAL;
+  return -1;
+}
+
+int placement_init(struct placement *p, const char *cpus, int mode) {
+#if defined(__linux__) || defined(__FreeBSD__)
+  cpumask_t mask;
+#endif
+  int i;
+
+  memset(p, 0, sizeof(*p));
+  p->mode = mode;
+  if (cpus != NULL) {
+    p->ncpus = placement_parse_cpus(cpus, p->cpus, PLACEMENT_MAXCPUS);
+    return p->ncpus < 0 ? -1 : 0;
+  }
+
+#if defined(__linux__) || defined(__FreeBSD__)
+  CPU_ZERO(&mask);
+  if (getmask(&mask) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < PLACEMENT_MAXCPUS && i < CPU_SETSIZE; i++) {
+    if (CPU_ISSET(i, &mask)) {
+      p->cpus[p->ncpus++] = i;
+    }
+  }
+
+  return 0;
+#else
+  (void)i;
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+int placement_remove(struct placement *p, int cpu) {
+  int i;
+
+  for (i = 0; i < p->ncpus && p->cpus[i] != cpu; i++);
+  if (i == p->ncpus) {
+    return 0;
+  } else if (p->ncpus == 1) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  p->ncpus--;
+  memmove(&p->cpus[i], &p->cpus[i + 1], (p->ncpus - i) * sizeof(int));
+  memmove(&p->load[i], &p->load[i + 1], (p->ncpus - i) * sizeof(int));
+  p->next %= p->ncpus;
+  return 0;
+}
+
+int placement_get(struct placement *p) {
+  int best;
+  int i;
+  int j;
+
+  if (p->mode == PLACEMENT_SET) {
+    return -1;
+  }
+
+  best = p->next;
+  if (p->mode == PLACEMENT_LEAST) {
+    /* ties go to the next CPU in round-robin order */
+    for (i = 1; i < p->ncpus; i++) {
+      j = (p->next + i) % p->ncpus;
+      if (p->load[j] < p->load[best]) {
+        best = j;
+      }
+    }
+  }
+
+  p->next = (best + 1) % p->ncpus;
+  p->load[best]++;
+  return best;
+}
+
+void placement_put(struct placement *p, int i) {
+  if (i >= 0 && i < p->ncpus && p->load[i] > 0) {
+    p->load[i]--;
+  }
+}
+
+int placement_apply(const struct placement *p, int i) {
+#if defined(__linux__) || defined(__FreeBSD__)
+  cpumask_t mask;
+
+  CPU_ZERO(&mask);
+  if (i >= 0) {
+    CPU_SET(p->cpus[i], &mask);
+  } else {
+    for (i = 0; i < p->ncpus; i++) {
+      CPU_SET(p->cpus[i], &mask);
+    }
+  }
+
+  return setmask(&mask);
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+int placement_pin(int cpu) {
+#if defined(__linux__) || defined(__FreeBSD__)
+  cpumask_t mask;
+
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  CPU_ZERO(&mask);
+  CPU_SET(cpu, &mask);
+  return setmask(&mask);
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+/* parses a decimal integer in [min, max] of length 'len' */
+static int parse_int(const char *s, size_t len, int min, int max, int *val) {
+  char buf[8];
+  char *end;
+  long l;
+
+  if (len == 0 || len >= sizeof(buf)) {
+    return -1;
+  }
+
+  memcpy(buf, s, len);
+  buf[len] = '\0';
+  l = strtol(buf, &end, 10);
+  if (*end != '\0' || l < min || l > max) {
+    return -1;
+  }
+
+  *val = (int)l;
+  return 0;
+}
+
+#define ISTOKEN(s, len, tok) \
+    ((len) == sizeof(tok) - 1 && strncmp((s), (tok), (len)) == 0)
+
+static int parse_token(const char *s, size_t len, struct placement_class *c) {
+  if (len > 5 && strncmp(s, "nice:", 5) == 0) {
+    c->setnice = 1;
+    return parse_int(s + 5, len - 5, -20, 19, &c->nice);
+  } else if (ISTOKEN(s, len, "other")) {
+    c->policy = PLACEMENT_POLICY_OTHER;
+    return 0;
+  }
+
+#if defined(__linux__)
+  if (ISTOKEN(s, len, "batch")) {
+    c->policy = PLACEMENT_POLICY_BATCH;
+    return 0;
+  } else if (ISTOKEN(s, len, "idle")) {
+    c->policy = PLACEMENT_POLICY_IDLE;
+    return 0;
+  } else if (ISTOKEN(s, len, "io:idle")) {
+    c->ioclass = PLACEMENT_IO_IDLE;
+    return 0;
+  } else if (len > 6 && strncmp(s, "io:rt/", 6) == 0) {
+    c->ioclass = PLACEMENT_IO_RT;
+    return parse_int(s + 6, len - 6, 0, 7, &c->iolevel);
+  } else if (len > 6 && strncmp(s, "io:be/", 6) == 0) {
+    c->ioclass = PLACEMENT_IO_BE;
+    return parse_int(s + 6, len - 6, 0, 7, &c->iolevel);
+  }
+#endif
+
+  return -1;
+}
+
+int placement_parse_class(const char *s, struct placement_class *c) {
+  const char *end;
+  size_t len;
+
+  memset(c, 0, sizeof(*c));
+  do {
+    end = strchr(s, ',');
+    len = end != NULL ? (size_t)(end - s) : strlen(s);
+    if (parse_token(s, len, c) < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    s += len + 1;
+  } while (end != NULL);
+
+  return 0;
+}
+
+int placement_apply_class(const struct placement_class *c) {
+#if defined(__linux__)
+  static const int policies[] = {
+    [PLACEMENT_POLICY_OTHER] = SCHED_OTHER,
+    [PLACEMENT_POLICY_BATCH] = SCHED_BATCH,
+    [PLACEMENT_POLICY_IDLE]  = SCHED_IDLE,
+  };
+  struct sched_param param = {0};
+
+  if (c->policy != PLACEMENT_POLICY_KEEP &&
+      sched_setscheduler(0, policies[c->policy], &param) < 0) {
+    return -1;
+  }
+
+  if (c->ioclass != PLACEMENT_IO_KEEP && syscall(SYS_ioprio_set,
+      IOPRIO_WHO_PROCESS, 0,
+      (c->ioclass << IOPRIO_CLASS_SHIFT) | c->iolevel) < 0) {
+    return -1;
+  }
+#else
+  if (c->policy != PLACEMENT_POLICY_KEEP &&
+      c->policy != PLACEMENT_POLICY_OTHER) {
+    errno = ENOTSUP;
+    return -1;
+  }
+#endif
+
+  if (c->setnice && setpriority(PRIO_PROCESS, 0, c->nice) < 0) {
+    return -1;
+  }
+
+  return 0;
+}
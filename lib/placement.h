@@ -0,0 +1,120 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_PLACEMENT_H__
+#define LIB_PLACEMENT_H__
+
+/* Placement of processes on CPUs, and their scheduling class.
+ *
+ * A placement is a set of CPUs that children run on. Children either
+ * share the whole set, or are pinned to one CPU each, chosen round-robin
+ * or as the CPU with the fewest placed children. The caller keeps track
+ * of placed children with placement_get and placement_put, and a child
+ * applies its placement to itself with placement_apply.
+ *
+ * A scheduling class is a nice value, a scheduling policy and an IO
+ * priority, each of which is optional. Policies other than "other" and
+ * IO priorities are only supported on Linux. */
+
+#define PLACEMENT_MAXCPUS   1024
+
+#define PLACEMENT_SET       0 /* children share the set */
+#define PLACEMENT_RR        1 /* round-robin, one CPU per child */
+#define PLACEMENT_LEAST     2 /* fewest children, one CPU per child */
+
+#define PLACEMENT_POLICY_KEEP  0
+#define PLACEMENT_POLICY_OTHER 1
+#define PLACEMENT_POLICY_BATCH 2
+#define PLACEMENT_POLICY_IDLE  3
+
+#define PLACEMENT_IO_KEEP   0
+#define PLACEMENT_IO_RT     1
+#define PLACEMENT_IO_BE     2
+#define PLACEMENT_IO_IDLE   3
+
+struct placement {
+  int mode;
+  int ncpus;
+  int next;                     /* round-robin position */
+  int cpus[PLACEMENT_MAXCPUS];  /* in ascending order */
+  int load[PLACEMENT_MAXCPUS];  /* # of children placed on cpus[i] */
+};
+
+struct placement_class {
+  int policy;   /* PLACEMENT_POLICY_* */
+  int setnice;  /* 1 if 'nice' is set */
+  int nice;
+  int ioclass;  /* PLACEMENT_IO_* */
+  int iolevel;  /* 0-7, for the RT and BE IO classes */
+};
+
+/* placement_parse_cpus --
+ *   Parses a CPU list, e.g., "0-3,8", into at most 'maxcpus' CPU numbers
+ *   in ascending order without duplicates. Returns the number of CPUs,
+ *   or -1 on error. Sets errno. */
+int placement_parse_cpus(const char *s, int *cpus, int maxcpus);
+
+/* placement_init --
+ *   Initializes a placement of 'mode' on the CPU list 'cpus', or on the
+ *   CPUs the calling thread may run on if 'cpus' is NULL. Returns 0 on
+ *   success, -1 on error. Sets errno. */
+int placement_init(struct placement *p, const char *cpus, int mode);
+
+/* placement_remove --
+ *   Removes 'cpu', e.g., a CPU reserved for the caller, from the set.
+ *   Returns 0 on success, -1 on error. Sets errno, to EINVAL if the set
+ *   would become empty. */
+int placement_remove(struct placement *p, int cpu);
+
+/* placement_get --
+ *   Places a child. Returns the index of its CPU in 'cpus', or -1 if it
+ *   shares the whole set. */
+int placement_get(struct placement *p);
+
+/* placement_put --
+ *   Releases a placement returned by placement_get. */
+void placement_put(struct placement *p, int i);
+
+/* placement_apply --
+ *   Restricts the calling thread to CPU 'cpus[i]', or to the whole set
+ *   if 'i' is -1. Does not allocate. Returns 0 on success, -1 on error.
+ *   Sets errno. */
+int placement_apply(const struct placement *p, int i);
+
+/* placement_pin --
+ *   Restricts the calling thread to 'cpu'. Returns 0 on success, -1 on
+ *   error. Sets errno. */
+int placement_pin(int cpu);
+
+/* placement_parse_class --
+ *   Parses a comma separated scheduling class, of "nice:<n>", one of the
+ *   policies "other", "batch" and "idle", and one of the IO priorities
+ *   "io:rt/<n>", "io:be/<n>" and "io:idle". Returns 0 on success, -1 on
+ *   error. Sets errno. */
+int placement_parse_class(const char *s, struct placement_class *c);
+
+/* placement_apply_class --
+ *   Applies a scheduling class to the calling process. Does not
+ *   allocate. Returns 0 on success, -1 on error. Sets errno. */
+int placement_apply_class(const struct placement_class *c);
+
+#endif
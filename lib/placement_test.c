@@ -0,0 +1,216 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "lib/placement.h"
+#include "lib/test.h"
+
+static int test_parse_cpus(void) {
+  int cpus[8];
+  int n;
+  size_t i;
+  static const char *invalid[] = {
+    "", ",", "1,", ",1", "a", "1-", "-1", "3-1", "1;2", "1024", "0-8",
+  };
+
+  n = placement_parse_cpus("3,0-2,2,6", cpus, 8);
+  if (n != 5 || cpus[0] != 0 || cpus[1] != 1 || cpus[2] != 2 ||
+      cpus[3] != 3 || cpus[4] != 6) {
+    TEST_LOGF("unexpected result: %d", n);
+    return TEST_FAIL;
+  }
+
+  for (i = 0; i < sizeof(invalid) / sizeof(*invalid); i++) {
+    if (placement_parse_cpus(invalid[i], cpus, 8) != -1 || errno != EINVAL) {
+      TEST_LOGF("\"%s\": expected invalid", invalid[i]);
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_rr(void) {
+  struct placement p;
+  int i;
+
+  if (placement_init(&p, "4-6", PLACEMENT_RR) < 0) {
+    TEST_LOG("placement_init failure");
+    return TEST_FAIL;
+  }
+
+  for (i = 0; i < 6; i++) {
+    if (placement_get(&p) != i % 3) {
+      TEST_LOGF("child %d: unexpected placement", i);
+      return TEST_FAIL;
+    }
+  }
+
+  if (placement_remove(&p, 5) < 0 || p.ncpus != 2 || p.cpus[1] != 6 ||
+      p.load[1] != 2) {
+    TEST_LOG("placement_remove failure");
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_least(void) {
+  struct placement p;
+  int a;
+  int b;
+  int c;
+
+  if (placement_init(&p, "0-2", PLACEMENT_LEAST) < 0) {
+    TEST_LOG("placement_init failure");
+    return TEST_FAIL;
+  }
+
+  a = placement_get(&p);
+  b = placement_get(&p);
+  c = placement_get(&p);
+  if (a != 0 || b != 1 || c != 2) {
+    TEST_LOGF("unexpected placements: %d %d %d", a, b, c);
+    return TEST_FAIL;
+  }
+
+  /* the CPU with the fewest children is chosen over the next one */
+  placement_put(&p, b);
+  if ((a = placement_get(&p)) != 1) {
+    TEST_LOGF("unexpected placement: %d", a);
+    return TEST_FAIL;
+  }
+
+  /* ties continue in round-robin order */
+  if (placement_get(&p) != 2) {
+    TEST_LOG("unexpected placement of tie");
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_set(void) {
+  struct placement p;
+
+  if (placement_init(&p, NULL, PLACEMENT_SET) < 0 || p.ncpus <= 0) {
+    TEST_LOG("placement_init failure");
+    return TEST_FAIL;
+  }
+
+  if (placement_get(&p) != -1) {
+    TEST_LOG("unexpected placement");
+    return TEST_FAIL;
+  }
+
+  if (placement_apply(&p, -1) < 0 || placement_apply(&p, 0) < 0 ||
+      placement_apply(&p, -1) < 0) {
+    TEST_LOG("placement_apply failure");
+    return TEST_FAIL;
+  }
+
+  if (placement_remove(&p, p.cpus[0]) < 0 && p.ncpus > 1) {
+    TEST_LOG("placement_remove failure");
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_parse_class(void) {
+  struct placement_class c;
+  size_t i;
+  static const char *invalid[] = {
+    "", "nice", "nice:", "nice:20", "nice:-21", "nice:1x", "other,",
+    "fast",
+  };
+
+  if (placement_parse_class("nice:-5,other", &c) < 0 || !c.setnice ||
+      c.nice != -5 || c.policy != PLACEMENT_POLICY_OTHER ||
+      c.ioclass != PLACEMENT_IO_KEEP) {
+    TEST_LOG("unexpected class");
+    return TEST_FAIL;
+  }
+
+#if defined(__linux__)
+  if (placement_parse_class("io:be/7,batch", &c) < 0 || c.setnice ||
+      c.policy != PLACEMENT_POLICY_BATCH || c.ioclass != PLACEMENT_IO_BE ||
+      c.iolevel != 7) {
+    TEST_LOG("unexpected class");
+    return TEST_FAIL;
+  }
+#endif
+
+  for (i = 0; i < sizeof(invalid) / sizeof(*invalid); i++) {
+    if (placement_parse_class(invalid[i], &c) != -1) {
+      TEST_LOGF("\"%s\": expected invalid", invalid[i]);
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_apply_class(void) {
+  struct placement_class c;
+  int status;
+  pid_t pid;
+
+  if (placement_parse_class("nice:19", &c) < 0) {
+    TEST_LOG("placement_parse_class failure");
+    return TEST_FAIL;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    TEST_LOG("fork failure");
+    return TEST_FAIL;
+  } else if (pid == 0) {
+    if (placement_apply_class(&c) < 0) {
+      _exit(1);
+    }
+    errno = 0;
+    _exit(getpriority(PRIO_PROCESS, 0) == 19 && errno == 0 ? 0 : 2);
+  }
+
+  if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    TEST_LOG("class not applied");
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"parse_cpus", test_parse_cpus},
+  {"rr", test_rr},
+  {"least", test_least},
+  {"set", test_set},
+  {"parse_class", test_parse_class},
+  {"apply_class", test_apply_class},
+);
@@ -0,0 +1,177 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/macros.h"
+#include "lib/pressure.h"
+
+static const char *psipaths_[PRESSURE_NPSI] = {
+  [PRESSURE_CPU]    = "/proc/pressure/cpu",
+  [PRESSURE_MEMORY] = "/proc/pressure/memory",
+  [PRESSURE_IO]     = "/proc/pressure/io",
+};
+
+/* opens a file that may be missing */
+static int open_optional(const char *path, int *fd) {
+  *fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (*fd < 0 && errno != ENOENT && errno != ENOTDIR) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int pressure_open(struct pressure *p) {
+  int err;
+  int i;
+
+  for (i = 0; i < PRESSURE_NPSI; i++) {
+    p->psifds[i] = -1;
+  }
+  p->meminfofd = -1;
+
+  for (i = 0; i < PRESSURE_NPSI; i++) {
+    if (open_optional(psipaths_[i], &p->psifds[i]) < 0) {
+      goto fail;
+    }
+  }
+
+  if (open_optional("/proc/meminfo", &p->meminfofd) < 0) {
+    goto fail;
+  }
+
+  return 0;
+fail:
+  err = errno;
+  pressure_close(p);
+  errno = err;
+  return -1;
+}
+
+void pressure_close(struct pressure *p) {
+  int i;
+
+  for (i = 0; i < PRESSURE_NPSI; i++) {
+    if (p->psifds[i] >= 0) {
+      close(p->psifds[i]);
+      p->psifds[i] = -1;
+    }
+  }
+
+  if (p->meminfofd >= 0) {
+    close(p->meminfofd);
+    p->meminfofd = -1;
+  }
+}
+
+static ssize_t read_file(int fd, char *buf, size_t len) {
+  ssize_t n;
+
+  do {
+    n = pread(fd, buf, len - 1, 0);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    return -1;
+  }
+
+  buf[n] = '\0';
+  return n;
+}
+
+int pressure_sample(struct pressure *p, struct pressure_sample *s) {
+  char buf[2048];
+  int i;
+
+  for (i = 0; i < PRESSURE_NPSI; i++) {
+    s->psi[i] = 0;
+    if (p->psifds[i] >= 0) {
+      if (read_file(p->psifds[i], buf, sizeof(buf)) < 0) {
+        return -1;
+      }
+      s->psi[i] = MAX(pressure_parse_psi(buf), 0);
+    }
+  }
+
+  s->mem_avail_kb = -1;
+  if (p->meminfofd >= 0) {
+    if (read_file(p->meminfofd, buf, sizeof(buf)) < 0) {
+      return -1;
+    }
+    s->mem_avail_kb = pressure_parse_meminfo(buf);
+  }
+
+  return 0;
+}
+
+double pressure_parse_psi(const char *buf) {
+  const char *s;
+
+  /* "some avg10=0.00 avg60=0.00 avg300=0.00 total=0" */
+  if (strncmp(buf, "some ", 5) != 0) {
+    return -1;
+  }
+
+  s = strstr(buf, "avg10=");
+  if (s == NULL) {
+    return -1;
+  }
+
+  return strtod(s + 6, NULL);
+}
+
+long pressure_parse_meminfo(const char *buf) {
+  const char *s;
+
+  /* "MemAvailable:    5615544 kB" */
+  s = strstr(buf, "MemAvailable:");
+  if (s == NULL) {
+    return -1;
+  }
+
+  return strtol(s + 13, NULL, 10);
+}
+
+int pressure_check(const struct pressure_limits *limits,
+    const struct pressure_sample *s, int high) {
+  double scale;
+  int i;
+
+  scale = high ? (100.0 - limits->hysteresis) / 100.0 : 1.0;
+  for (i = 0; i < PRESSURE_NPSI; i++) {
+    if (limits->psi[i] > 0 && s->psi[i] > limits->psi[i] * scale) {
+      return 1;
+    }
+  }
+
+  scale = high ? (100.0 + limits->hysteresis) / 100.0 : 1.0;
+  if (limits->mem_avail_kb > 0 && s->mem_avail_kb >= 0 &&
+      s->mem_avail_kb < limits->mem_avail_kb * scale) {
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_PRESSURE_H__
+#define LIB_PRESSURE_H__
+
+/* System pressure: the share of time, in percent over the last ten
+ * seconds, that some task stalled on CPU, memory or IO, from Linux
+ * pressure stall information (/proc/pressure), and the amount of
+ * available memory (/proc/meminfo). The files are kept open and re-read
+ * from the start on every sample. Missing files, e.g., on kernels
+ * without PSI or on other systems, read as no pressure. */
+
+#define PRESSURE_CPU     0
+#define PRESSURE_MEMORY  1
+#define PRESSURE_IO      2
+#define PRESSURE_NPSI    3
+
+struct pressure {
+  int psifds[PRESSURE_NPSI];
+  int meminfofd;
+};
+
+struct pressure_sample {
+  double psi[PRESSURE_NPSI]; /* "some" avg10, in percent */
+  long mem_avail_kb;         /* -1 if unknown */
+};
+
+/* Thresholds for pressure_check. A zero threshold is not checked */
+struct pressure_limits {
+  double psi[PRESSURE_NPSI]; /* max "some" avg10, in percent */
+  long mem_avail_kb;         /* min available memory */
+  int hysteresis;            /* in percent of a threshold */
+};
+
+/* pressure_open --
+ *   Opens the pressure files. Returns 0 on success, -1 on error. Sets
+ *   errno. */
+int pressure_open(struct pressure *p);
+
+/* pressure_close --
+ *   Closes the pressure files. */
+void pressure_close(struct pressure *p);
+
+/* pressure_sample --
+ *   Reads the current pressure. Returns 0 on success, -1 on error. Sets
+ *   errno. */
+int pressure_sample(struct pressure *p, struct pressure_sample *s);
+
+/* pressure_parse_psi --
+ *   Returns the "some" avg10 value of the contents of a /proc/pressure
+ *   file, or -1 if not found. */
+double pressure_parse_psi(const char *buf);
+
+/* pressure_parse_meminfo --
+ *   Returns MemAvailable, in kB, of the contents of /proc/meminfo, or -1
+ *   if not found. */
+long pressure_parse_meminfo(const char *buf);
+
+/* pressure_check --
+ *   Returns 1 if a sample exceeds any of the limits, 0 otherwise. 'high'
+ *   is the previous result: once exceeded, a limit is considered
+ *   exceeded until the sample is 'hysteresis' percent below it. */
+int pressure_check(const struct pressure_limits *limits,
+    const struct pressure_sample *s, int high);
+
+#endif
@@ -0,0 +1,126 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+#include <errno.h>
+#include <string.h>
+
+#include "lib/pressure.h"
+#include "lib/test.h"
+
+static int test_parse(void) {
+  double val;
+  long kb;
+
+  val = pressure_parse_psi(
+      "some avg10=12.50 avg60=3.55 avg300=3.12 total=40199359\n"
+      "full avg10=1.00 avg60=0.00 avg300=0.00 total=0\n");
+  if (val != 12.5) {
+    TEST_LOGF("unexpected psi value: %f", val);
+    return TEST_FAIL;
+  }
+
+  val = pressure_parse_psi("garbage");
+  if (val != -1) {
+    TEST_LOGF("unexpected psi value for garbage: %f", val);
+    return TEST_FAIL;
+  }
+
+  kb = pressure_parse_meminfo(
+      "MemTotal:       16384000 kB\n"
+      "MemFree:         1000000 kB\n"
+      "MemAvailable:    5615544 kB\n");
+  if (kb != 5615544) {
+    TEST_LOGF("unexpected MemAvailable: %ld", kb);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_check(void) {
+  struct pressure_limits limits = {{0}};
+  struct pressure_sample s = {{0}};
+  int high = 0;
+  size_t i;
+  static const struct {
+    double cpu;
+    long mem_avail_kb;
+    int high;
+  } steps[] = {
+    {10, 8000, 0},
+    {25, 8000, 1}, /* above cpu threshold */
+    {19, 8000, 1}, /* below, but within hysteresis */
+    {15, 8000, 0},
+    {10, 900, 1},  /* below memory threshold */
+    {10, 1100, 1}, /* above, but within hysteresis */
+    {10, 1300, 0},
+  };
+
+  limits.psi[PRESSURE_CPU] = 20;
+  limits.mem_avail_kb = 1000;
+  limits.hysteresis = 20;
+  for (i = 0; i < sizeof(steps) / sizeof(*steps); i++) {
+    s.psi[PRESSURE_CPU] = steps[i].cpu;
+    s.mem_avail_kb = steps[i].mem_avail_kb;
+    high = pressure_check(&limits, &s, high);
+    if (high != steps[i].high) {
+      TEST_LOGF("step %zu: high is %d, expected %d", i, high,
+          steps[i].high);
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_sample(void) {
+  struct pressure p;
+  struct pressure_sample s;
+  int status = TEST_FAIL;
+  int i;
+
+  if (pressure_open(&p) < 0) {
+    TEST_LOGF("pressure_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (pressure_sample(&p, &s) < 0) {
+    TEST_LOGF("pressure_sample: %s", strerror(errno));
+    goto close;
+  }
+
+  for (i = 0; i < PRESSURE_NPSI; i++) {
+    if (s.psi[i] < 0 || s.psi[i] > 100) {
+      TEST_LOGF("psi %d out of range: %f", i, s.psi[i]);
+      goto close;
+    }
+  }
+
+  status = TEST_OK;
+close:
+  pressure_close(&p);
+  return status;
+}
+
+TEST_ENTRY(
+  {"parse", test_parse},
+  {"check", test_check},
+  {"sample", test_sample},
+);
@@ -0,0 +1,56 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_PROC_H__
+#define LIB_PROC_H__
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* Process descriptors: file descriptors referring to a child process,
+ * pidfds on Linux and process descriptors from pdfork(2) on FreeBSD.
+ * They can be added to an iomux context with iomux_add_proc. Process
+ * descriptors are close-on-exec. */
+
+/* proc_check --
+ *   Returns 0 if process descriptors are supported by the running
+ *   kernel, or -1 with errno set to ENOSYS if they are not. */
+int proc_check(void);
+
+/* proc_fork --
+ *   Like fork(2), but in the parent '*pfd' is set to a process
+ *   descriptor for the child. Returns the PID of the child in the
+ *   parent, 0 in the child and -1 on error. Sets errno. */
+pid_t proc_fork(int *pfd);
+
+/* proc_open --
+ *   Returns a process descriptor for the existing child 'pid', or -1 on
+ *   error. Sets errno. */
+int proc_open(pid_t pid);
+
+/* proc_wait --
+ *   Reaps the child referred to by 'pfd' and 'pid' without blocking.
+ *   '*status' is set as by waitpid(2) and '*ru' to the resource usage of
+ *   the child. Returns 1 if the child was reaped, 0 if it is still
+ *   running and -1 on error. Sets errno. */
+int proc_wait(int pfd, pid_t pid, int *status, struct rusage *ru);
+
+#endif
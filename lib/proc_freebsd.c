@@ -0,0 +1,56 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/types.h>
+#include <sys/procdesc.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "lib/proc.h"
+
+int proc_check(void) {
+  return 0;
+}
+
+pid_t proc_fork(int *pfd) {
+  /* PD_DAEMON: closing the descriptor must not kill the child */
+  return pdfork(pfd, PD_CLOEXEC | PD_DAEMON);
+}
+
+int proc_open(pid_t pid) {
+  /* there is no way to get a process descriptor for an existing PID */
+  errno = ENOSYS;
+  return -1;
+}
+
+int proc_wait(int pfd, pid_t pid, int *status, struct rusage *ru) {
+  pid_t ret;
+
+  do {
+    ret = wait4(pid, status, WNOHANG, ru);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0) {
+    return -1;
+  }
+
+  return ret == pid ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#define _GNU_SOURCE /* syscall */
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/proc.h"
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+int proc_check(void) {
+  siginfo_t info;
+  int ret;
+  int err;
+  int fd;
+
+  /* pidfd_open is in Linux 5.3 and waitid(P_PIDFD) in 5.4. A pidfd for
+   * ourselves is never a child of ours, so waitid fails with ECHILD if
+   * P_PIDFD is known */
+  fd = syscall(SYS_pidfd_open, getpid(), 0);
+  if (fd < 0) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  memset(&info, 0, sizeof(info));
+  ret = syscall(SYS_waitid, P_PIDFD, fd, &info, WEXITED | WNOHANG, NULL);
+  err = errno;
+  close(fd);
+  if (ret < 0 && err != ECHILD) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  return 0;
+}
+
+pid_t proc_fork(int *pfd) {
+  pid_t pid;
+  int fd;
+  int err;
+
+  pid = fork();
+  if (pid <= 0) {
+    return pid;
+  }
+
+  /* the child can not be reaped, and its PID reused, before this */
+  fd = proc_open(pid);
+  if (fd < 0) {
+    err = errno;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    errno = err;
+    return -1;
+  }
+
+  *pfd = fd;
+  return pid;
+}
+
+int proc_open(pid_t pid) {
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+int proc_wait(int pfd, pid_t pid, int *status, struct rusage *ru) {
+  siginfo_t info;
+  int ret;
+
+  /* the glibc waitid wrapper does not expose the rusage argument */
+  memset(&info, 0, sizeof(info));
+  do {
+    ret = syscall(SYS_waitid, P_PIDFD, pfd, &info, WEXITED | WNOHANG, ru);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret < 0) {
+    return -1;
+  } else if (info.si_pid == 0) {
+    return 0; /* still running */
+  }
+
+  switch (info.si_code) {
+  case CLD_EXITED:
+    *status = (info.si_status & 0xff) << 8;
+    break;
+  case CLD_KILLED:
+    *status = info.si_status & 0x7f;
+    break;
+  case CLD_DUMPED:
+    *status = (info.si_status & 0x7f) | 0x80;
+    break;
+  default:
+    *status = 0;
+    break;
+  }
+
+  return 1;
+}
@@ -0,0 +1,175 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lib/iomux.h"
+#include "lib/proc.h"
+#include "lib/test.h"
+
+#define NCHILDREN 4
+
+struct child {
+  struct iomux_handler h; /* must be first */
+  pid_t pid;
+  int reaped;
+  int status;
+};
+
+static int nreaped_;
+
+static void on_proc_exit(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  struct child *child = (struct child *)h;
+  struct rusage ru;
+  int ret;
+
+  ret = proc_wait(h->fd, child->pid, &child->status, &ru);
+  if (ret < 0) {
+    iomux_err(ctx);
+    return;
+  } else if (ret == 0) {
+    return;
+  }
+
+  child->reaped = 1;
+  nreaped_++;
+  if (iomux_close_source(ctx, h) < 0) {
+    iomux_err(ctx);
+  }
+}
+
+/* children exiting in different ways are reaped through their process
+ * descriptors, each by its own handler */
+static int test_exit(void) {
+  struct child children[NCHILDREN] = {{{0}}};
+  struct iomux_ctx ctx;
+  int status = TEST_FAIL;
+  int i;
+
+  alarm(5);
+  if (iomux_init(&ctx) < 0) {
+    TEST_LOGF("iomux_init: %s", strerror(errno));
+    goto done;
+  }
+
+  nreaped_ = 0;
+  for (i = 0; i < NCHILDREN; i++) {
+    children[i].pid = proc_fork(&children[i].h.fd);
+    if (children[i].pid < 0) {
+      TEST_LOGF("proc_fork: %s", strerror(errno));
+      goto iomux_cleanup;
+    } else if (children[i].pid == 0) {
+      usleep(50000 * (NCHILDREN - i));
+      if (i == 0) {
+        raise(SIGKILL);
+      }
+      _exit(i);
+    }
+
+    children[i].h.source_func = on_proc_exit;
+    if (iomux_add_proc(&ctx, &children[i].h) < 0) {
+      TEST_LOGF("iomux_add_proc: %s", strerror(errno));
+      goto iomux_cleanup;
+    }
+  }
+
+  if (iomux_run(&ctx) < 0) {
+    TEST_LOGF("iomux_run: %s", strerror(errno));
+    goto iomux_cleanup;
+  }
+
+  if (nreaped_ != NCHILDREN) {
+    TEST_LOGF("reaped %d children, expected %d", nreaped_, NCHILDREN);
+    goto iomux_cleanup;
+  }
+
+  if (!WIFSIGNALED(children[0].status) ||
+      WTERMSIG(children[0].status) != SIGKILL) {
+    TEST_LOGF("child 0: unexpected status %d", children[0].status);
+    goto iomux_cleanup;
+  }
+
+  for (i = 1; i < NCHILDREN; i++) {
+    if (!WIFEXITED(children[i].status) ||
+        WEXITSTATUS(children[i].status) != i) {
+      TEST_LOGF("child %d: unexpected status %d", i, children[i].status);
+      goto iomux_cleanup;
+    }
+  }
+
+  status = TEST_OK;
+iomux_cleanup:
+  iomux_cleanup(&ctx);
+done:
+  alarm(0);
+  return status;
+}
+
+/* proc_wait does not reap a running child */
+static int test_running(void) {
+  int status = TEST_FAIL;
+  struct rusage ru;
+  int wstatus;
+  int pfd;
+  pid_t pid;
+
+  pid = proc_fork(&pfd);
+  if (pid < 0) {
+    TEST_LOGF("proc_fork: %s", strerror(errno));
+    return TEST_FAIL;
+  } else if (pid == 0) {
+    pause();
+    _exit(0);
+  }
+
+  if (proc_wait(pfd, pid, &wstatus, &ru) != 0) {
+    TEST_LOG("running child was reaped");
+    goto kill_child;
+  }
+
+  status = TEST_OK;
+kill_child:
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(pfd);
+  return status;
+}
+
+/* proc_check succeeds where proc_fork does */
+static int test_check(void) {
+  if (proc_check() < 0) {
+    TEST_LOGF("proc_check: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"check", test_check},
+  {"exit", test_exit},
+  {"running", test_running},
+);
@@ -0,0 +1,102 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/scgi.h"
+
+int scgi_parse(const char *buf, size_t len, struct scgi_header *hdr) {
+  size_t varslen = 0;
+  size_t i;
+
+  for (i = 0; i < len && buf[i] != ':'; i++) {
+    if (buf[i] < '0' || buf[i] > '9' || i >= SCGI_MAXLENDIGITS) {
+      return -1;
+    }
+    varslen = varslen * 10 + (buf[i] - '0');
+  }
+
+  if (i == len) {
+    return 0;
+  } else if (i == 0) {
+    return -1;
+  }
+
+  i++; /* ':' */
+  if (len - i < varslen + 1) {
+    return 0;
+  }
+
+  /* the headers end with a NUL terminated value, followed by ',' */
+  if (buf[i + varslen] != ',' || varslen == 0 ||
+      buf[i + varslen - 1] != '\0') {
+    return -1;
+  }
+
+  hdr->vars = buf + i;
+  hdr->varslen = varslen;
+  hdr->len = i + varslen + 1;
+  return 1;
+}
+
+const char *scgi_get(const struct scgi_header *hdr, const char *name) {
+  const char *curr = hdr->vars;
+  const char *end = hdr->vars + hdr->varslen;
+  const char *value;
+
+  while (curr < end) {
+    value = curr + strlen(curr) + 1;
+    if (value >= end) {
+      break; /* name without value */
+    }
+
+    if (strcmp(curr, name) == 0) {
+      return value;
+    }
+
+    curr = value + strlen(value) + 1;
+  }
+
+  return NULL;
+}
+
+size_t scgi_request_len(const struct scgi_header *hdr, size_t max) {
+  const char *val;
+  char *end;
+  unsigned long long len;
+
+  val = scgi_get(hdr, "CONTENT_LENGTH");
+  if (val == NULL || *val < '0' || *val > '9') {
+    return 0;
+  }
+
+  errno = 0;
+  len = strtoull(val, &end, 10);
+  if (*end != '\0') {
+    return 0;
+  } else if (errno != 0 || hdr->len > max || len > max - hdr->len) {
+    return max + 1;
+  }
+
+  return hdr->len + (size_t)len;
+}
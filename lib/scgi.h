@@ -0,0 +1,57 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#ifndef LIB_SCGI_H__
+#define LIB_SCGI_H__
+
+#include <stddef.h>
+
+/* SCGI request headers: a netstring, "<len>:<headers>,", where headers
+ * are NUL terminated names, each followed by a NUL terminated value.
+ * The parser does not copy or allocate; names and values point into the
+ * parsed buffer. */
+
+#define SCGI_MAXLENDIGITS 10 /* max # of digits in the netstring length */
+
+struct scgi_header {
+  const char *vars; /* first name */
+  size_t varslen;   /* length of names and values */
+  size_t len;       /* length of the netstring, including length and ',' */
+};
+
+/* scgi_parse --
+ *   Parses the header netstring at the start of 'buf'. Returns 1 if the
+ *   header is complete, 0 if more data is needed and -1 if the header is
+ *   invalid. */
+int scgi_parse(const char *buf, size_t len, struct scgi_header *hdr);
+
+/* scgi_get --
+ *   Returns the value of header 'name', or NULL if not present. */
+const char *scgi_get(const struct scgi_header *hdr, const char *name);
+
+/* scgi_request_len --
+ *   Returns the length of the request with header 'hdr': the length of
+ *   the header netstring plus CONTENT_LENGTH, if at most 'max', 'max' + 1
+ *   if it is longer, or 0 if CONTENT_LENGTH is missing or invalid. 'max'
+ *   must be less than SIZE_MAX. */
+size_t scgi_request_len(const struct scgi_header *hdr, size_t max);
+
+#endif
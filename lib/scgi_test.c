@@ -0,0 +1,153 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+#include <string.h>
+
+#include "lib/scgi.h"
+#include "lib/test.h"
+
+#define REQ "70:CONTENT_LENGTH\0" "27\0SCGI\0" "1\0REQUEST_METHOD\0" \
+    "POST\0REQUEST_URI\0/deepthought\0,What is the answer to life?"
+
+static int test_parse(void) {
+  struct scgi_header hdr;
+  const char *val;
+  int ret;
+
+  ret = scgi_parse(REQ, sizeof(REQ) - 1, &hdr);
+  if (ret != 1) {
+    TEST_LOGF("scgi_parse: %d", ret);
+    return TEST_FAIL;
+  }
+
+  if (hdr.len != 74 || hdr.varslen != 70) {
+    TEST_LOGF("unexpected lengths: %zu %zu", hdr.len, hdr.varslen);
+    return TEST_FAIL;
+  }
+
+  val = scgi_get(&hdr, "REQUEST_URI");
+  if (val == NULL || strcmp(val, "/deepthought") != 0) {
+    TEST_LOG("unexpected REQUEST_URI");
+    return TEST_FAIL;
+  }
+
+  val = scgi_get(&hdr, "CONTENT_LENGTH");
+  if (val == NULL || strcmp(val, "27") != 0) {
+    TEST_LOG("unexpected CONTENT_LENGTH");
+    return TEST_FAIL;
+  }
+
+  if (scgi_get(&hdr, "QUERY_STRING") != NULL ||
+      scgi_get(&hdr, "/deepthought") != NULL) {
+    TEST_LOG("unexpected header");
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_incomplete(void) {
+  struct scgi_header hdr;
+  size_t i;
+  int ret;
+
+  for (i = 0; i < 74; i++) {
+    ret = scgi_parse(REQ, i, &hdr);
+    if (ret != 0) {
+      TEST_LOGF("scgi_parse of %zu bytes: %d", i, ret);
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_invalid(void) {
+  struct scgi_header hdr;
+  size_t i;
+  static const struct {
+    const char *data;
+    size_t len;
+  } reqs[] = {
+    {":", 1},
+    {"x:", 2},
+    {"12345678901:", 12},
+    {"3:a\0b;", 6},
+    {"3:abc,", 6},
+    {"0:,", 3},
+  };
+
+  for (i = 0; i < sizeof(reqs) / sizeof(*reqs); i++) {
+    if (scgi_parse(reqs[i].data, reqs[i].len, &hdr) != -1) {
+      TEST_LOGF("request %zu: expected invalid", i);
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_request_len(void) {
+  struct scgi_header hdr;
+  size_t i;
+  size_t len;
+  static const struct {
+    const char *data;
+    size_t len;
+    size_t max;
+    size_t expected;
+  } reqs[] = {
+    {REQ, sizeof(REQ) - 1, 1024, 101},
+    {REQ, sizeof(REQ) - 1, 101, 101},
+    {REQ, sizeof(REQ) - 1, 100, 101},
+    {REQ, sizeof(REQ) - 1, 10, 11},
+    {"17:CONTENT_LENGTH\0" "0\0,", 21, 1024, 21},
+    {"24:CONTENT_LENGTH\0" "99999999\0,", 28, 1024, 1025},
+    {"36:CONTENT_LENGTH\0" "18446744073709551615\0,", 40, 1024, 1025},
+    {"38:CONTENT_LENGTH\0" "1844674407370955161500\0,", 42, 1024, 1025},
+    {"18:CONTENT_LENGTH\0" "-1\0,", 22, 1024, 0},
+    {"19:CONTENT_LENGTH\0" "12x\0,", 23, 1024, 0},
+    {"16:CONTENT_LENGTH\0\0,", 20, 1024, 0},
+    {"7:SCGI\0" "1\0,", 10, 1024, 0},
+  };
+
+  for (i = 0; i < sizeof(reqs) / sizeof(*reqs); i++) {
+    if (scgi_parse(reqs[i].data, reqs[i].len, &hdr) != 1) {
+      TEST_LOGF("request %zu: scgi_parse failed", i);
+      return TEST_FAIL;
+    }
+
+    len = scgi_request_len(&hdr, reqs[i].max);
+    if (len != reqs[i].expected) {
+      TEST_LOGF("request %zu: expected %zu, was %zu", i, reqs[i].expected,
+          len);
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"parse", test_parse},
+  {"incomplete", test_incomplete},
+  {"invalid", test_invalid},
+  {"request_len", test_request_len},
+);
@@ -0,0 +1,283 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/fs.h"
+#include "lib/spool.h"
+
+#define SHARDSZ 6 /* "xx/xx" */
+
+static unsigned int shard_of(const char *name) {
+  uint32_t hash = 2166136261u; /* FNV-1a */
+
+  while (*name != '\0') {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+
+  return (hash ^ (hash >> 16)) & (SPOOL_NSHARDS - 1);
+}
+
+static void shard_name(unsigned int shard, char *buf) {
+  static const char hex[] = "0123456789abcdef";
+
+  buf[0] = hex[(shard >> 12) & 0xf];
+  buf[1] = hex[(shard >> 8) & 0xf];
+  buf[2] = '/';
+  buf[3] = hex[(shard >> 4) & 0xf];
+  buf[4] = hex[shard & 0xf];
+  buf[5] = '\0';
+}
+
+int spool_open(struct spool *sp, const char *path, size_t ncached) {
+  int err;
+
+  memset(sp, 0, sizeof(*sp));
+  sp->fd = -1;
+  sp->ncached = ncached > 0 ? ncached : SPOOL_DEFAULT_NCACHED;
+  if (sp->ncached > UINT16_MAX) {
+    sp->ncached = UINT16_MAX;
+  }
+
+  if (fs_mkdir_all(path) < 0) {
+    return -1;
+  }
+
+  sp->path = strdup(path);
+  sp->cache = calloc(sp->ncached, sizeof(struct spool_shard));
+  sp->index = calloc(SPOOL_NSHARDS, sizeof(uint16_t));
+  if (sp->path == NULL || sp->cache == NULL || sp->index == NULL) {
+    goto fail;
+  }
+
+  sp->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (sp->fd < 0) {
+    goto fail;
+  }
+
+  return 0;
+fail:
+  err = errno;
+  spool_close(sp);
+  errno = err;
+  return -1;
+}
+
+void spool_close(struct spool *sp) {
+  size_t i;
+
+  for (i = 0; i < sp->nused; i++) {
+    close(sp->cache[i].fd);
+  }
+
+  if (sp->fd >= 0) {
+    close(sp->fd);
+  }
+
+  free(sp->path);
+  free(sp->cache);
+  free(sp->index);
+  memset(sp, 0, sizeof(*sp));
+  sp->fd = -1;
+}
+
+static void unlink_lru(struct spool *sp, struct spool_shard *s) {
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  } else {
+    sp->head = s->next;
+  }
+
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  } else {
+    sp->tail = s->prev;
+  }
+}
+
+static void push_lru(struct spool *sp, struct spool_shard *s) {
+  s->prev = NULL;
+  s->next = sp->head;
+  if (sp->head != NULL) {
+    sp->head->prev = s;
+  } else {
+    sp->tail = s;
+  }
+  sp->head = s;
+}
+
+/* opens the shard directory, creating it if needed */
+static int open_shard(struct spool *sp, unsigned int shard) {
+  char name[SHARDSZ];
+  int fd;
+
+  shard_name(shard, name);
+  fd = openat(sp->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0 || errno != ENOENT) {
+    return fd;
+  }
+
+  name[2] = '\0';
+  if (mkdirat(sp->fd, name, 0777) < 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  name[2] = '/';
+  if (mkdirat(sp->fd, name, 0777) < 0 && errno != EEXIST) {
+    return -1;
+  }
+
+  return openat(sp->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+int spool_dirfd(struct spool *sp, const char *name) {
+  unsigned int shard = shard_of(name);
+  struct spool_shard *s;
+  int fd;
+
+  if (sp->index[shard] != 0) {
+    s = &sp->cache[sp->index[shard] - 1];
+    if (s != sp->head) {
+      unlink_lru(sp, s);
+      push_lru(sp, s);
+    }
+    return s->fd;
+  }
+
+  fd = open_shard(sp, shard);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (sp->nused < sp->ncached) {
+    s = &sp->cache[sp->nused++];
+  } else {
+    s = sp->tail;
+    unlink_lru(sp, s);
+    sp->index[s->shard] = 0;
+    close(s->fd);
+  }
+
+  s->fd = fd;
+  s->shard = shard;
+  sp->index[shard] = s - sp->cache + 1;
+  push_lru(sp, s);
+  return fd;
+}
+
+/* drops the cached shard directory of 'name', e.g., after it has been
+ * removed by expiry */
+static void invalidate(struct spool *sp, const char *name) {
+  unsigned int shard = shard_of(name);
+  struct spool_shard *s;
+
+  if (sp->index[shard] == 0) {
+    return;
+  }
+
+  /* move the last used entry into the hole, keeping entries contiguous */
+  s = &sp->cache[sp->index[shard] - 1];
+  unlink_lru(sp, s);
+  sp->index[shard] = 0;
+  close(s->fd);
+  if (--sp->nused != (size_t)(s - sp->cache)) {
+    *s = sp->cache[sp->nused];
+    if (s->prev != NULL) {
+      s->prev->next = s;
+    } else {
+      sp->head = s;
+    }
+    if (s->next != NULL) {
+      s->next->prev = s;
+    } else {
+      sp->tail = s;
+    }
+    sp->index[s->shard] = s - sp->cache + 1;
+  }
+}
+
+int spool_openat(struct spool *sp, const char *name, int flags,
+    mode_t mode) {
+  int retried = 0;
+  int dirfd;
+  int fd;
+
+  for (;;) {
+    dirfd = spool_dirfd(sp, name);
+    if (dirfd < 0) {
+      return -1;
+    }
+
+    fd = openat(dirfd, name, flags | O_CLOEXEC, mode);
+    if (fd >= 0 || errno != ENOENT || !(flags & O_CREAT) || retried) {
+      return fd;
+    }
+
+    /* the shard directory may have been removed */
+    invalidate(sp, name);
+    retried = 1;
+  }
+}
+
+int spool_mkdir(struct spool *sp, const char *name, mode_t mode) {
+  int retried = 0;
+  int dirfd;
+
+  for (;;) {
+    dirfd = spool_dirfd(sp, name);
+    if (dirfd < 0) {
+      return -1;
+    }
+
+    if (mkdirat(dirfd, name, mode) == 0) {
+      return 0;
+    } else if (errno != ENOENT || retried) {
+      return -1;
+    }
+
+    /* the shard directory may have been removed */
+    invalidate(sp, name);
+    retried = 1;
+  }
+}
+
+int spool_path(const struct spool *sp, const char *name, char *buf,
+    size_t len) {
+  char shard[SHARDSZ];
+  int ret;
+
+  shard_name(shard_of(name), shard);
+  ret = snprintf(buf, len, "%s/%s/%s", sp->path, shard, name);
+  if (ret < 0 || (size_t)ret >= len) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  return ret;
+}
@@ -0,0 +1,92 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_SPOOL_H__
+#define LIB_SPOOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A spool is a directory of named entries, sharded by a hash of the
+ * name into a two-level hex fan-out, e.g., "name" is stored as
+ * "3f/a0/name". Shard directories are created on first use, and open
+ * shard directory descriptors are kept in an LRU cache, so that creating
+ * an entry in a cached shard is a single openat(2) or mkdirat(2), and
+ * lookups do not slow down as the spool grows.
+ *
+ * A spool is not thread safe. */
+
+#define SPOOL_NSHARDS         65536 /* 256 * 256 */
+#define SPOOL_DEFAULT_NCACHED 64
+
+struct spool_shard {
+  struct spool_shard *prev; /* more recently used */
+  struct spool_shard *next; /* less recently used */
+  int fd;
+  unsigned int shard;
+};
+
+struct spool {
+  char *path;
+  int fd;
+  struct spool_shard *cache;
+  uint16_t *index;          /* shard -> cache entry + 1, or 0 */
+  size_t ncached;
+  size_t nused;
+  struct spool_shard *head; /* most recently used */
+  struct spool_shard *tail; /* least recently used */
+};
+
+/* spool_open --
+ *   Opens the spool at 'path', creating the directory if needed, with
+ *   room for 'ncached' open shard directories, or SPOOL_DEFAULT_NCACHED
+ *   if 'ncached' is 0. Returns 0 on success, -1 on error. Sets errno. */
+int spool_open(struct spool *sp, const char *path, size_t ncached);
+
+/* spool_close --
+ *   Closes all descriptors and releases all resources. */
+void spool_close(struct spool *sp);
+
+/* spool_dirfd --
+ *   Returns the descriptor of the shard directory of 'name', creating
+ *   the directory if needed, or -1 on error. Sets errno. The descriptor
+ *   is owned by the spool, and valid until the next spool call. */
+int spool_dirfd(struct spool *sp, const char *name);
+
+/* spool_openat --
+ *   Opens entry 'name', as for openat(2). Returns a descriptor on
+ *   success, -1 on error. Sets errno. */
+int spool_openat(struct spool *sp, const char *name, int flags, mode_t mode);
+
+/* spool_mkdir --
+ *   Creates the directory entry 'name', as for mkdirat(2). Returns 0 on
+ *   success, -1 on error. Sets errno. */
+int spool_mkdir(struct spool *sp, const char *name, mode_t mode);
+
+/* spool_path --
+ *   Writes the path of entry 'name' to 'buf' of size 'len'. Returns the
+ *   length of the path, or -1 if it does not fit. Sets errno. */
+int spool_path(const struct spool *sp, const char *name, char *buf,
+    size_t len);
+
+#endif
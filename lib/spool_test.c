@@ -0,0 +1,132 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/fs.h"
+#include "lib/spool.h"
+#include "lib/test.h"
+
+#define TESTDIR ".spool_test"
+#define SPOOL   TESTDIR "/spool"
+
+static struct spool spool_;
+
+static int test_open(void) {
+  fs_remove_all(TESTDIR);
+  if (spool_open(&spool_, SPOOL, 4) < 0) {
+    TEST_LOGF("spool_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_create(void) {
+  char name[32];
+  char path[256];
+  struct stat sb;
+  int fd;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "entry%d", i);
+    fd = spool_openat(&spool_, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      TEST_LOGF("%s: %s", name, strerror(errno));
+      return TEST_FAIL;
+    }
+    close(fd);
+
+    if (spool_path(&spool_, name, path, sizeof(path)) < 0 ||
+        stat(path, &sb) < 0) {
+      TEST_LOGF("%s: %s", path, strerror(errno));
+      return TEST_FAIL;
+    }
+
+    /* SPOOL/xx/xx/name */
+    if (strlen(path) != strlen(SPOOL) + 7 + strlen(name) ||
+        path[strlen(SPOOL) + 3] != '/') {
+      TEST_LOGF("unexpected path: %s", path);
+      return TEST_FAIL;
+    }
+  }
+
+  if (spool_.nused != 4) {
+    TEST_LOGF("unexpected # of cached shards: %zu", spool_.nused);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_removed(void) {
+  char name[32];
+  char path[256];
+  struct stat sb;
+  int i;
+
+  /* shard directories removed behind the spool's back, e.g., by expiry,
+   * are created again */
+  for (i = 0; i < 100; i++) {
+    snprintf(name, sizeof(name), "dir%d", i % 10);
+    if (spool_mkdir(&spool_, name, 0755) < 0) {
+      TEST_LOGF("%s: %s", name, strerror(errno));
+      return TEST_FAIL;
+    }
+
+    if (spool_path(&spool_, name, path, sizeof(path)) < 0 ||
+        stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+      TEST_LOGF("%s: not a directory", path);
+      return TEST_FAIL;
+    }
+
+    path[strlen(SPOOL) + 3] = '\0'; /* SPOOL/xx */
+    if (fs_remove_all(path) < 0) {
+      TEST_LOGF("%s: %s", path, strerror(errno));
+      return TEST_FAIL;
+    }
+  }
+
+  return TEST_OK;
+}
+
+static int test_cleanup(void) {
+  spool_close(&spool_);
+  if (fs_remove_all(TESTDIR) < 0) {
+    TEST_LOGF("%s: %s", TESTDIR, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"open", test_open},
+  {"create", test_create},
+  {"removed", test_removed},
+  {"cleanup", test_cleanup},
+);
@@ -0,0 +1,531 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/fs.h"
+#include "lib/sweep.h"
+
+struct sweep_task {
+  struct sweep_task *next;    /* next in queue */
+  struct sweep_task *parent;  /* directory task waiting for this one */
+  int dirfd;                  /* directory of 'name' */
+  int owns_dirfd;
+  int fd;                     /* the directory, while it is emptied */
+  int pending;                /* # of subtasks, +1 while scanning */
+  int expiry;                 /* queued by an expiry scan */
+  char name[];
+};
+
+static struct sweep_task *new_task(int dirfd, const char *name) {
+  struct sweep_task *t;
+  size_t len;
+
+  len = strlen(name) + 1;
+  t = malloc(sizeof(*t) + len);
+  if (t == NULL) {
+    return NULL;
+  }
+
+  memset(t, 0, sizeof(*t));
+  t->dirfd = dirfd;
+  t->fd = -1;
+  memcpy(t->name, name, len);
+  return t;
+}
+
+/* must be called with the mutex held */
+static void push(struct sweep *sw, struct sweep_task *t) {
+  t->next = NULL;
+  if (sw->tail == NULL) {
+    sw->head = t;
+  } else {
+    sw->tail->next = t;
+  }
+
+  sw->tail = t;
+  sw->ntasks++;
+  if (t->expiry) {
+    sw->nexpire_tasks++;
+  }
+  pthread_cond_signal(&sw->cond);
+}
+
+static void release(struct sweep *sw, struct sweep_task *t);
+static void drop(struct sweep_task *t);
+
+/* removes the directory of a task once its entries are removed */
+static void finish(struct sweep *sw, struct sweep_task *t) {
+  struct sweep_task *parent = t->parent;
+  int failed = 0;
+
+  if (t->fd >= 0) {
+    close(t->fd);
+    /* entries skipped by readdir(3) are removed by fs_remove_at */
+    if (unlinkat(t->dirfd, t->name, AT_REMOVEDIR) < 0 && errno != ENOENT &&
+        fs_remove_at(t->dirfd, t->name) < 0) {
+      failed = 1;
+    }
+  }
+
+  if (t->owns_dirfd) {
+    close(t->dirfd);
+  }
+
+  pthread_mutex_lock(&sw->mtx);
+  sw->ntasks--;
+  sw->nerrors += failed;
+  if (t->expiry) {
+    sw->nexpire_tasks--;
+  }
+  if (sw->ntasks == 0) {
+    pthread_cond_broadcast(&sw->done);
+  }
+  pthread_mutex_unlock(&sw->mtx);
+  free(t);
+
+  if (parent != NULL) {
+    release(sw, parent);
+  }
+}
+
+static void release(struct sweep *sw, struct sweep_task *t) {
+  int pending;
+
+  pthread_mutex_lock(&sw->mtx);
+  pending = --t->pending;
+  pthread_mutex_unlock(&sw->mtx);
+  if (pending == 0) {
+    finish(sw, t);
+  }
+}
+
+/* queues the removal of subdirectory 'name' of 't'. Returns 1 if it was
+ * queued, 0 if there is no room */
+static int split(struct sweep *sw, struct sweep_task *t, const char *name) {
+  struct sweep_task *sub;
+
+  sub = new_task(t->fd, name);
+  if (sub == NULL) {
+    return 0;
+  }
+
+  sub->parent = t;
+  pthread_mutex_lock(&sw->mtx);
+  if (!sw->running || sw->ntasks >= sw->maxtasks) {
+    pthread_mutex_unlock(&sw->mtx);
+    free(sub);
+    return 0;
+  }
+
+  t->pending++;
+  push(sw, sub);
+  pthread_mutex_unlock(&sw->mtx);
+  return 1;
+}
+
+static void run(struct sweep *sw, struct sweep_task *t) {
+  struct dirent *ent;
+  DIR *dir;
+  int dfd;
+  int failed = 0;
+
+  t->fd = openat(t->dirfd, t->name,
+      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (t->fd < 0) {
+    /* not a directory, or gone */
+    if (errno != ENOENT && fs_remove_at(t->dirfd, t->name) < 0) {
+      pthread_mutex_lock(&sw->mtx);
+      sw->nerrors++;
+      pthread_mutex_unlock(&sw->mtx);
+    }
+    finish(sw, t);
+    return;
+  }
+
+  t->pending = 1;
+  dfd = fcntl(t->fd, F_DUPFD_CLOEXEC, 0);
+  dir = dfd < 0 ? NULL : fdopendir(dfd);
+  if (dir == NULL) {
+    if (dfd >= 0) {
+      close(dfd);
+    }
+    release(sw, t); /* fs_remove_at is tried when it is removed */
+    return;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    } else if (ent->d_type == DT_DIR) {
+      if (sw->nthreads > 1 && split(sw, t, ent->d_name)) {
+        continue;
+      }
+    } else if (unlinkat(t->fd, ent->d_name, 0) == 0) {
+      continue;
+    }
+
+    if (fs_remove_at(t->fd, ent->d_name) < 0) {
+      failed++;
+    }
+  }
+
+  closedir(dir);
+  if (failed > 0) {
+    pthread_mutex_lock(&sw->mtx);
+    sw->nerrors += failed;
+    pthread_mutex_unlock(&sw->mtx);
+  }
+
+  release(sw, t);
+}
+
+/* returns 1 if entry 'name' of 'fd' is marked as kept */
+static int kept(struct sweep *sw, int fd, const char *name) {
+  char path[PATH_MAX];
+  struct stat sb;
+
+  return sw->expire_keep != NULL &&
+      snprintf(path, sizeof(path), "%s/%s", name, sw->expire_keep) <
+      (int)sizeof(path) &&
+      fstatat(fd, path, &sb, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/* queues the removal of expired entries 'depth' levels below 'fd', or
+ * removes them if there is no room */
+static void expire_dir(struct sweep *sw, int fd, int depth, time_t cutoff) {
+  struct sweep_task *t;
+  struct dirent *ent;
+  struct stat sb;
+  DIR *dir;
+  int dfd;
+  int subfd;
+  int queued;
+
+  dfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  dir = dfd < 0 ? NULL : fdopendir(dfd);
+  if (dir == NULL) {
+    if (dfd >= 0) {
+      close(dfd);
+    }
+    return;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    } else if (depth > 1) {
+      subfd = openat(fd, ent->d_name,
+          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (subfd >= 0) {
+        expire_dir(sw, subfd, depth - 1, cutoff);
+        close(subfd);
+      }
+      continue;
+    } else if (fstatat(fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+        sb.st_mtime >= cutoff ||
+        (S_ISDIR(sb.st_mode) && kept(sw, fd, ent->d_name))) {
+      continue;
+    }
+
+    queued = 0;
+    t = new_task(-1, ent->d_name);
+    if (t != NULL) {
+      t->dirfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+      t->owns_dirfd = t->dirfd >= 0;
+      t->expiry = 1;
+    }
+
+    pthread_mutex_lock(&sw->mtx);
+    if (!sw->running) {
+      pthread_mutex_unlock(&sw->mtx);
+      drop(t);
+      break;
+    } else if (t != NULL && t->owns_dirfd && sw->ntasks < sw->maxtasks) {
+      push(sw, t);
+      queued = 1;
+    }
+    pthread_mutex_unlock(&sw->mtx);
+
+    if (!queued) {
+      drop(t);
+      if (fs_remove_at(fd, ent->d_name) < 0) {
+        pthread_mutex_lock(&sw->mtx);
+        sw->nerrors++;
+        pthread_mutex_unlock(&sw->mtx);
+      }
+    }
+  }
+
+  closedir(dir);
+}
+
+static void expire(struct sweep *sw) {
+  expire_dir(sw, sw->expire_fd, sw->expire_depth,
+      time(NULL) - sw->expire_age);
+}
+
+static void add_ms(struct timespec *ts, int ms) {
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (long)(ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static int expiry_due(struct sweep *sw) {
+  struct timespec now;
+
+  if (sw->expire_fd < 0) {
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec < sw->next_expiry.tv_sec ||
+      (now.tv_sec == sw->next_expiry.tv_sec &&
+      now.tv_nsec < sw->next_expiry.tv_nsec)) {
+    return 0;
+  }
+
+  sw->next_expiry = now;
+  add_ms(&sw->next_expiry, sw->expire_interval_ms);
+
+  /* skip the scan while the previous one is in progress, or the same
+   * entries would be queued again */
+  return !sw->expiring && sw->nexpire_tasks == 0;
+}
+
+static void *sweeper(void *arg) {
+  struct sweep *sw = arg;
+  struct sweep_task *t;
+
+  pthread_mutex_lock(&sw->mtx);
+  while (sw->running) {
+    if (expiry_due(sw)) {
+      sw->expiring = 1;
+      pthread_mutex_unlock(&sw->mtx);
+      expire(sw);
+      pthread_mutex_lock(&sw->mtx);
+      sw->expiring = 0;
+    } else if (sw->head != NULL) {
+      t = sw->head;
+      sw->head = t->next;
+      if (sw->head == NULL) {
+        sw->tail = NULL;
+      }
+      pthread_mutex_unlock(&sw->mtx);
+      run(sw, t);
+      pthread_mutex_lock(&sw->mtx);
+    } else if (sw->expire_fd >= 0) {
+      pthread_cond_timedwait(&sw->cond, &sw->mtx, &sw->next_expiry);
+    } else {
+      pthread_cond_wait(&sw->cond, &sw->mtx);
+    }
+  }
+  pthread_mutex_unlock(&sw->mtx);
+
+  return NULL;
+}
+
+static void stop(struct sweep *sw, int nthreads) {
+  int i;
+
+  pthread_mutex_lock(&sw->mtx);
+  sw->running = 0;
+  pthread_cond_broadcast(&sw->cond);
+  pthread_mutex_unlock(&sw->mtx);
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(sw->threads[i], NULL);
+  }
+}
+
+/* releases a task that is not run, and the parents only it waited for */
+static void drop(struct sweep_task *t) {
+  struct sweep_task *parent;
+
+  while (t != NULL) {
+    parent = t->parent;
+    if (t->fd >= 0) {
+      close(t->fd);
+    }
+    if (t->owns_dirfd) {
+      close(t->dirfd);
+    }
+    free(t);
+
+    if (parent == NULL || --parent->pending > 0) {
+      break;
+    }
+    t = parent;
+  }
+}
+
+int sweep_open(struct sweep *sw, int nthreads, size_t maxtasks) {
+  pthread_condattr_t attr;
+  int err;
+  int i;
+
+  memset(sw, 0, sizeof(*sw));
+  sw->maxtasks = maxtasks > 0 ? maxtasks : SWEEP_DEFAULT_NTASKS;
+  sw->expire_fd = -1;
+  sw->threads = calloc(nthreads > 0 ? nthreads : 1, sizeof(pthread_t));
+  if (sw->threads == NULL) {
+    return -1;
+  }
+
+  /* expiry deadlines are monotonic */
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&sw->mtx, NULL);
+  pthread_cond_init(&sw->cond, &attr);
+  pthread_cond_init(&sw->done, NULL);
+  pthread_condattr_destroy(&attr);
+
+  sw->running = 1;
+  sw->nthreads = nthreads;
+  for (i = 0; i < nthreads; i++) {
+    err = pthread_create(&sw->threads[i], NULL, sweeper, sw);
+    if (err != 0) {
+      stop(sw, i);
+      sw->nthreads = 0;
+      sweep_close(sw);
+      errno = err;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void sweep_close(struct sweep *sw) {
+  struct sweep_task *t;
+
+  if (sw->threads == NULL) {
+    return;
+  }
+
+  stop(sw, sw->nthreads);
+  while ((t = sw->head) != NULL) {
+    sw->head = t->next;
+    drop(t);
+  }
+
+  if (sw->expire_fd >= 0) {
+    close(sw->expire_fd);
+  }
+
+  pthread_cond_destroy(&sw->done);
+  pthread_cond_destroy(&sw->cond);
+  pthread_mutex_destroy(&sw->mtx);
+  free(sw->threads);
+  sw->threads = NULL;
+}
+
+int sweep_remove(struct sweep *sw, int dirfd, const char *name) {
+  struct sweep_task *t;
+
+  t = new_task(dirfd, name);
+  if (t == NULL) {
+    return -1;
+  }
+
+  if (dirfd != AT_FDCWD) {
+    t->dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+    if (t->dirfd < 0) {
+      free(t);
+      return -1;
+    }
+    t->owns_dirfd = 1;
+  }
+
+  pthread_mutex_lock(&sw->mtx);
+  if (sw->ntasks >= sw->maxtasks) {
+    pthread_mutex_unlock(&sw->mtx);
+    drop(t);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  push(sw, t);
+  pthread_mutex_unlock(&sw->mtx);
+  return 0;
+}
+
+int sweep_expire(struct sweep *sw, const char *path, int depth,
+    int max_age, int interval_ms) {
+  int fd;
+
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&sw->mtx);
+  if (sw->expire_fd >= 0) {
+    pthread_mutex_unlock(&sw->mtx);
+    close(fd);
+    errno = EBUSY;
+    return -1;
+  }
+
+  sw->expire_fd = fd;
+  sw->expire_depth = depth;
+  sw->expire_age = max_age;
+  sw->expire_interval_ms = interval_ms;
+  clock_gettime(CLOCK_MONOTONIC, &sw->next_expiry);
+  pthread_cond_broadcast(&sw->cond);
+  pthread_mutex_unlock(&sw->mtx);
+  return 0;
+}
+
+void sweep_expire_keep(struct sweep *sw, const char *name) {
+  pthread_mutex_lock(&sw->mtx);
+  sw->expire_keep = name;
+  pthread_mutex_unlock(&sw->mtx);
+}
+
+void sweep_wait(struct sweep *sw) {
+  pthread_mutex_lock(&sw->mtx);
+  while (sw->ntasks > 0) {
+    pthread_cond_wait(&sw->done, &sw->mtx);
+  }
+  pthread_mutex_unlock(&sw->mtx);
+}
+
+uint64_t sweep_nerrors(struct sweep *sw) {
+  uint64_t nerrors;
+
+  pthread_mutex_lock(&sw->mtx);
+  nerrors = sw->nerrors;
+  pthread_mutex_unlock(&sw->mtx);
+  return nerrors;
+}
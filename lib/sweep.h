@@ -0,0 +1,113 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_SWEEP_H__
+#define LIB_SWEEP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/* The sweeper removes files and directory trees in background threads,
+ * so that the caller never blocks on the file system. Removals are
+ * queued as tasks, and the number of tasks is bounded. With more than
+ * one thread, the subdirectories of a tree are queued as tasks of their
+ * own while there is room, and are removed in parallel. A directory is
+ * removed when all of its subdirectory tasks are done.
+ *
+ * Optionally, the entries of a directory, e.g., a spool, are expired:
+ * entries with a modification time older than a max age are removed
+ * periodically, except for directories marked as kept by a file of a
+ * given name. */
+
+#define SWEEP_DEFAULT_NTASKS 1024
+
+struct sweep_task;
+
+struct sweep {
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;        /* tasks queued, or expiry due */
+  pthread_cond_t done;        /* no tasks left */
+  pthread_t *threads;
+  int nthreads;
+  int running;
+  struct sweep_task *head;    /* queue */
+  struct sweep_task *tail;
+  size_t ntasks;              /* queued and unfinished tasks */
+  size_t maxtasks;
+  uint64_t nerrors;           /* failed removals */
+  int expire_fd;              /* directory to expire, or -1 */
+  int expire_depth;           /* levels below expire_fd to expire */
+  int expire_age;             /* max age, in seconds */
+  const char *expire_keep;    /* file marking kept directories, or NULL */
+  int expire_interval_ms;
+  int expiring;               /* an expiry scan is running */
+  size_t nexpire_tasks;       /* unfinished tasks from expiry scans */
+  struct timespec next_expiry; /* CLOCK_MONOTONIC */
+};
+
+/* sweep_open --
+ *   Starts 'nthreads' sweeper threads with room for 'maxtasks' tasks, or
+ *   SWEEP_DEFAULT_NTASKS if 'maxtasks' is 0. Returns 0 on success, -1
+ *   on error. Sets errno. */
+int sweep_open(struct sweep *sw, int nthreads, size_t maxtasks);
+
+/* sweep_close --
+ *   Stops the sweeper threads once their current tasks are done, and
+ *   releases all resources. Queued removals are not done. */
+void sweep_close(struct sweep *sw);
+
+/* sweep_remove --
+ *   Queues the removal of 'name' relative to the directory 'dirfd', as
+ *   for fs_remove_at. 'dirfd' is duplicated, unless it is AT_FDCWD, in
+ *   which case 'name' is resolved when it is removed. Never blocks on
+ *   the file system. Returns 0 on success, -1 on error. Sets errno, to
+ *   EAGAIN if there is no room for the task. */
+int sweep_remove(struct sweep *sw, int dirfd, const char *name);
+
+/* sweep_expire --
+ *   Removes the entries 'depth' levels below directory 'path' that are
+ *   older than 'max_age' seconds, checked every 'interval_ms'
+ *   milliseconds, until the sweeper is closed. With a 'depth' of 1, the
+ *   entries of 'path' are expired, with 2 the entries of its
+ *   subdirectories, and so on. Can be called once. Returns 0 on success,
+ *   -1 on error. Sets errno. */
+int sweep_expire(struct sweep *sw, const char *path, int depth,
+    int max_age, int interval_ms);
+
+/* sweep_expire_keep --
+ *   Keeps the directories to expire that contain an entry 'name', e.g.,
+ *   directories owned by something other than their creator. Call before
+ *   sweep_expire. 'name' must remain valid until the sweeper is
+ *   closed. */
+void sweep_expire_keep(struct sweep *sw, const char *name);
+
+/* sweep_wait --
+ *   Waits until all queued removals are done. */
+void sweep_wait(struct sweep *sw);
+
+/* sweep_nerrors --
+ *   Returns the number of failed removals. */
+uint64_t sweep_nerrors(struct sweep *sw);
+
+#endif
@@ -0,0 +1,226 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/fs.h"
+#include "lib/sweep.h"
+#include "lib/test.h"
+
+#define TESTDIR ".sweep_test"
+#define TREE    TESTDIR "/tree"
+#define SPOOL   TESTDIR "/spool"
+
+static int mkfile(const char *path) {
+  int fd;
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  close(fd);
+  return 0;
+}
+
+/* creates 'width' files and subdirectories per directory, 'depth'
+ * levels deep */
+static int mktree(const char *path, int width, int depth) {
+  char sub[256];
+  int i;
+
+  if (fs_mkdir_all(path) < 0) {
+    return -1;
+  }
+
+  for (i = 0; i < width; i++) {
+    snprintf(sub, sizeof(sub), "%s/f%d", path, i);
+    if (mkfile(sub) < 0) {
+      return -1;
+    }
+
+    if (depth > 1) {
+      snprintf(sub, sizeof(sub), "%s/d%d", path, i);
+      if (mktree(sub, width, depth - 1) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int exists(const char *path) {
+  struct stat sb;
+
+  return lstat(path, &sb) == 0;
+}
+
+static int remove_tree(int nthreads, size_t maxtasks) {
+  struct sweep sw;
+  int status = TEST_FAIL;
+
+  if (mktree(TREE, 4, 4) < 0) {
+    TEST_LOGF("mktree: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (sweep_open(&sw, nthreads, maxtasks) < 0) {
+    TEST_LOGF("sweep_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (sweep_remove(&sw, AT_FDCWD, TREE) < 0) {
+    TEST_LOGF("sweep_remove: %s", strerror(errno));
+    goto done;
+  }
+
+  sweep_wait(&sw);
+  if (exists(TREE) || sweep_nerrors(&sw) != 0) {
+    TEST_LOGF("%s not removed, %d errors", TREE, (int)sweep_nerrors(&sw));
+    goto done;
+  }
+
+  status = TEST_OK;
+done:
+  sweep_close(&sw);
+  return status;
+}
+
+static int test_serial(void) {
+  return remove_tree(1, 0);
+}
+
+static int test_parallel(void) {
+  return remove_tree(4, 0);
+}
+
+static int test_bounded(void) {
+  /* subdirectories are removed inline when there is no room */
+  return remove_tree(4, 2);
+}
+
+static int test_full(void) {
+  struct sweep sw;
+  int fd;
+  int status = TEST_FAIL;
+
+  fd = open(TESTDIR, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || sweep_open(&sw, 0, 1) < 0) {
+    TEST_LOGF("open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  /* without threads, queued tasks are never run */
+  if (sweep_remove(&sw, fd, "a") < 0) {
+    TEST_LOGF("sweep_remove: %s", strerror(errno));
+    goto done;
+  }
+
+  if (sweep_remove(&sw, fd, "b") != -1 || errno != EAGAIN) {
+    TEST_LOG("expected EAGAIN");
+    goto done;
+  }
+
+  status = TEST_OK;
+done:
+  sweep_close(&sw);
+  close(fd);
+  return status;
+}
+
+static int test_expire(void) {
+  struct timespec times[2] = {{0}, {0}};
+  struct sweep sw;
+  int status = TEST_FAIL;
+  int i;
+
+  if (mktree(SPOOL "/old", 2, 2) < 0 || mktree(SPOOL "/new", 2, 2) < 0 ||
+      mktree(SPOOL "/kept", 2, 2) < 0 || mkfile(SPOOL "/kept/keep") < 0 ||
+      mkfile(SPOOL "/oldfile") < 0) {
+    TEST_LOGF("mktree: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  times[0].tv_sec = times[1].tv_sec = time(NULL) - 3600;
+  if (utimensat(AT_FDCWD, SPOOL "/old", times, 0) < 0 ||
+      utimensat(AT_FDCWD, SPOOL "/kept", times, 0) < 0 ||
+      utimensat(AT_FDCWD, SPOOL "/oldfile", times, 0) < 0) {
+    TEST_LOGF("utimensat: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  if (sweep_open(&sw, 2, 0) < 0) {
+    TEST_LOGF("sweep_open: %s", strerror(errno));
+    return TEST_FAIL;
+  }
+
+  sweep_expire_keep(&sw, "keep");
+  if (sweep_expire(&sw, TESTDIR, 2, 60, 10) < 0) {
+    TEST_LOGF("sweep_expire: %s", strerror(errno));
+    goto done;
+  }
+
+  for (i = 0; i < 100 && (exists(SPOOL "/old") || exists(SPOOL "/oldfile"));
+      i++) {
+    usleep(10000);
+  }
+
+  if (exists(SPOOL "/old") || exists(SPOOL "/oldfile")) {
+    TEST_LOG("expired entries not removed");
+    goto done;
+  } else if (!exists(SPOOL "/new/d1/f1")) {
+    TEST_LOG("unexpired entry removed");
+    goto done;
+  } else if (!exists(SPOOL "/kept/d1/f1")) {
+    TEST_LOG("kept entry removed");
+    goto done;
+  }
+
+  status = TEST_OK;
+done:
+  sweep_close(&sw);
+  return status;
+}
+
+static int test_cleanup(void) {
+  if (fs_remove_all(TESTDIR) < 0) {
+    TEST_LOGF("%s: %s", TESTDIR, strerror(errno));
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"serial", test_serial},
+  {"parallel", test_parallel},
+  {"bounded", test_bounded},
+  {"full", test_full},
+  {"expire", test_expire},
+  {"cleanup", test_cleanup},
+);
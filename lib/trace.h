@@ -0,0 +1,50 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_TRACE_H__
+#define LIB_TRACE_H__
+
+/* Static tracepoints. Built with HEXEC_USDT defined, e.g., with
+ * 'make USDT=1', tracepoints are USDT probes of the provider "hexec",
+ * defined with <sys/sdt.h> from SystemTap, and can be attached to with
+ * bpftrace, perf or stap:
+ *
+ *   bpftrace -e 'usdt:app/hexec:hexec:spawn_done { printf("%d\n", arg1); }'
+ *
+ * A probe is a nop until attached to. Built without HEXEC_USDT, the
+ * tracepoints are removed, and their arguments are not evaluated. */
+
+#if defined(HEXEC_USDT)
+#include <sys/sdt.h>
+
+#define TRACE0(probe)             DTRACE_PROBE(hexec, probe)
+#define TRACE1(probe, a)          DTRACE_PROBE1(hexec, probe, a)
+#define TRACE2(probe, a, b)       DTRACE_PROBE2(hexec, probe, a, b)
+#define TRACE3(probe, a, b, c)    DTRACE_PROBE3(hexec, probe, a, b, c)
+#else
+#define TRACE0(probe)             ((void)0)
+#define TRACE1(probe, a)          ((void)0)
+#define TRACE2(probe, a, b)       ((void)0)
+#define TRACE3(probe, a, b, c)    ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,246 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/macros.h"
+#include "lib/worker.h"
+
+#define READSZ  16384 /* min buffer space per read */
+#define FRAMESZ (SCGI_MAXLENDIGITS + 1) /* max "<len>:" length */
+
+struct inbuf {
+  char *buf;
+  size_t cap;
+  size_t off;  /* start of the next request frame */
+  size_t len;
+};
+
+static int grow(char **buf, size_t *cap, size_t mincap) {
+  size_t newcap = MAX(*cap, READSZ);
+  char *newbuf;
+
+  while (newcap < mincap) {
+    newcap *= 2;
+  }
+
+  if (newcap == *cap) {
+    return 0;
+  }
+
+  newbuf = realloc(*buf, newcap);
+  if (newbuf == NULL) {
+    return -1;
+  }
+
+  *buf = newbuf;
+  *cap = newcap;
+  return 0;
+}
+
+int worker_write(struct worker_resp *resp, const void *data, size_t len) {
+  if (grow(&resp->buf, &resp->cap, resp->len + len) < 0) {
+    return -1;
+  }
+
+  memcpy(resp->buf + resp->len, data, len);
+  resp->len += len;
+  return 0;
+}
+
+int worker_printf(struct worker_resp *resp, const char *fmt, ...) {
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (n < 0 || grow(&resp->buf, &resp->cap, resp->len + n + 1) < 0) {
+    return -1;
+  }
+
+  va_start(ap, fmt);
+  vsnprintf(resp->buf + resp->len, n + 1, fmt, ap);
+  va_end(ap);
+  resp->len += n;
+  return 0;
+}
+
+/* returns the length of the request frame at the start of 'in', with
+ * its request at *req. Returns 0 if the frame is incomplete, -1 if it
+ * is invalid */
+static size_t parse_frame(struct inbuf *in, const char **req,
+    size_t *reqlen) {
+  const char *data = in->buf + in->off;
+  size_t avail = in->len - in->off;
+  size_t len = 0;
+  size_t i;
+
+  for (i = 0; i < avail && data[i] != ':'; i++) {
+    if (data[i] < '0' || data[i] > '9' || i >= SCGI_MAXLENDIGITS) {
+      return -1;
+    }
+    len = len * 10 + (data[i] - '0');
+  }
+
+  if (i == avail) {
+    return 0;
+  } else if (i == 0 || len > WORKER_MAXREQ) {
+    return -1;
+  } else if (avail - i - 1 < len + 1) {
+    return 0;
+  } else if (data[i + 1 + len] != ',') {
+    return -1;
+  }
+
+  *req = data + i + 1;
+  *reqlen = len;
+  return i + len + 2;
+}
+
+/* reads more input. Returns the number of bytes read, 0 on end-of-file
+ * or -1 on error */
+static ssize_t fill(int fd, struct inbuf *in) {
+  ssize_t n;
+
+  if (in->off > 0) {
+    memmove(in->buf, in->buf + in->off, in->len - in->off);
+    in->len -= in->off;
+    in->off = 0;
+  }
+
+  /* room for the largest frame */
+  if (grow(&in->buf, &in->cap,
+      MIN(in->len + READSZ, FRAMESZ + WORKER_MAXREQ + 1)) < 0) {
+    return -1;
+  }
+
+  do {
+    n = read(fd, in->buf + in->len, in->cap - in->len);
+  } while (n < 0 && errno == EINTR);
+
+  if (n > 0) {
+    in->len += n;
+  }
+
+  return n;
+}
+
+static int write_resp(int fd, const struct worker_resp *resp) {
+  char frame[FRAMESZ + 1];
+  struct iovec iov[3];
+  struct iovec *curr = iov;
+  int niov = 3;
+  ssize_t n;
+
+  iov[0].iov_base = frame;
+  iov[0].iov_len = snprintf(frame, sizeof(frame), "%zu:", resp->len);
+  iov[1].iov_base = resp->buf;
+  iov[1].iov_len = resp->len;
+  iov[2].iov_base = ",";
+  iov[2].iov_len = 1;
+  while (niov > 0) {
+    n = writev(fd, curr, niov);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0) {
+      return -1;
+    }
+
+    while (niov > 0 && (size_t)n >= curr->iov_len) {
+      n -= curr->iov_len;
+      curr++;
+      niov--;
+    }
+
+    if (niov > 0) {
+      curr->iov_base = (char *)curr->iov_base + n;
+      curr->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+int worker_serve(int in, int out, worker_handler handler, void *arg) {
+  struct inbuf inbuf = {0};
+  struct worker_resp resp = {0};
+  struct worker_req req;
+  const char *data = NULL;
+  size_t datalen = 0;
+  size_t framelen;
+  ssize_t n;
+  int ret = -1;
+
+  for (;;) {
+    framelen = parse_frame(&inbuf, &data, &datalen);
+    if (framelen == (size_t)-1) {
+      goto eproto;
+    } else if (framelen == 0) {
+      n = fill(in, &inbuf);
+      if (n < 0) {
+        goto done;
+      } else if (n == 0 && inbuf.len == 0) {
+        ret = 0;
+        goto done;
+      } else if (n == 0) {
+        goto eproto; /* truncated request */
+      }
+      continue;
+    }
+
+    if (scgi_parse(data, datalen, &req.hdr) != 1) {
+      goto eproto;
+    }
+
+    req.body = data + req.hdr.len;
+    req.bodylen = datalen - req.hdr.len;
+    resp.len = 0;
+    if (handler(arg, &req, &resp) < 0) {
+      resp.len = 0;
+      if (worker_write(&resp, WORKER_ESERVER,
+          sizeof(WORKER_ESERVER) - 1) < 0) {
+        goto done;
+      }
+    }
+
+    if (write_resp(out, &resp) < 0) {
+      goto done;
+    }
+
+    inbuf.off += framelen;
+  }
+
+eproto:
+  errno = EPROTO;
+done:
+  free(inbuf.buf);
+  free(resp.buf);
+  return ret;
+}
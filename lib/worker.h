@@ -0,0 +1,83 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+#ifndef LIB_WORKER_H__
+#define LIB_WORKER_H__
+
+#include <stddef.h>
+
+#include "lib/scgi.h"
+
+/* The worker side of the hexec batch and worker protocols. Requests
+ * arrive on an input stream as netstrings, each holding a complete SCGI
+ * request, and one netstring framed response is written per request, in
+ * request order:
+ *
+ *   in:  <len>:<SCGI request>,<len>:<SCGI request>,...
+ *   out: <len>:<response>,<len>:<response>,...
+ *
+ * The response is what a CGI program would write to stdout, i.e.,
+ * headers, an empty line and the body. The input ends at end-of-file. A
+ * persistent worker keeps its process state, e.g., caches and
+ * connections, between requests. */
+
+#define WORKER_MAXREQ (1 << 20) /* max request length, with body */
+
+#define WORKER_ESERVER "Status: 500 Internal Server Error\r\n\r\n"
+
+struct worker_req {
+  struct scgi_header hdr; /* use scgi_get to get header values */
+  const char *body;
+  size_t bodylen;
+};
+
+struct worker_resp {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/* worker_handler --
+ *   Handles 'req', whose memory is valid until the handler returns, by
+ *   appending the response to 'resp'. If the handler returns -1, the
+ *   response is replaced by WORKER_ESERVER. */
+typedef int (*worker_handler)(void *arg, const struct worker_req *req,
+    struct worker_resp *resp);
+
+/* worker_write --
+ *   Appends 'len' bytes of 'data' to the response. Returns 0 on success,
+ *   -1 on error. */
+int worker_write(struct worker_resp *resp, const void *data, size_t len);
+
+/* worker_printf --
+ *   Appends formatted output to the response. Returns 0 on success, -1
+ *   on error. */
+int worker_printf(struct worker_resp *resp, const char *fmt, ...);
+
+/* worker_serve --
+ *   Reads requests from 'in' and writes responses to 'out', until
+ *   end-of-file on 'in'. Both descriptors are expected to be blocking.
+ *   Returns 0 on end-of-file between requests, -1 on error. Sets errno,
+ *   to EPROTO on invalid framing. */
+int worker_serve(int in, int out, worker_handler handler, void *arg);
+
+#endif
@@ -0,0 +1,128 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lib/test.h"
+#include "lib/worker.h"
+
+#define REQ(body) \
+    "33:" "24:CONTENT_LENGTH\0" "5\0SCGI\0" "1\0," body ","
+
+static int echo(void *arg, const struct worker_req *req,
+    struct worker_resp *resp) {
+  int *nreqs = arg;
+
+  (*nreqs)++;
+  if (req->bodylen == 5 && memcmp(req->body, "fail!", 5) == 0) {
+    worker_write(resp, "partial", 7);
+    return -1;
+  }
+
+  return worker_printf(resp, "Status: 200 OK\r\n\r\n%s:%.*s",
+      scgi_get(&req->hdr, "SCGI"), (int)req->bodylen, req->body);
+}
+
+/* serves 'len' bytes of 'in' and reads the response into 'out'. Returns
+ * the worker_serve result */
+static int serve(const char *in, size_t len, char *out, size_t outlen,
+    int *nreqs) {
+  int inp[2];
+  int outp[2];
+  ssize_t n;
+  int ret;
+
+  if (pipe(inp) < 0 || pipe(outp) < 0) {
+    return -2;
+  }
+
+  write(inp[1], in, len);
+  close(inp[1]);
+  ret = worker_serve(inp[0], outp[1], echo, nreqs);
+  close(inp[0]);
+  close(outp[1]);
+  n = read(outp[0], out, outlen - 1);
+  out[n < 0 ? 0 : n] = '\0';
+  close(outp[0]);
+  return ret;
+}
+
+static int test_serve(void) {
+  static const char in[] = REQ("hello") REQ("world") REQ("fail!");
+  static const char expected[] =
+      "25:Status: 200 OK\r\n\r\n1:hello,"
+      "25:Status: 200 OK\r\n\r\n1:world,"
+      "37:" WORKER_ESERVER ",";
+  char out[256];
+  int nreqs = 0;
+  int ret;
+
+  ret = serve(in, sizeof(in) - 1, out, sizeof(out), &nreqs);
+  if (ret != 0) {
+    TEST_LOGF("worker_serve: %d", ret);
+    return TEST_FAIL;
+  }
+
+  if (nreqs != 3 || strcmp(out, expected) != 0) {
+    TEST_LOGF("unexpected response (%d requests): %s", nreqs, out);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+static int test_invalid(void) {
+  static const struct {
+    const char *data;
+    size_t len;
+  } ins[] = {
+    {"x:", 2},
+    {"3:abc,", 6},
+    {"33:" "24:CONTENT_LENGTH\0" "5\0SCGI\0" "1\0,hello;", 37},
+    {"33:" "24:CONTENT_LENGTH\0" "5\0SCGI\0" "1\0,hel", 34},
+  };
+  char out[256];
+  int nreqs = 0;
+  size_t i;
+
+  for (i = 0; i < sizeof(ins) / sizeof(*ins); i++) {
+    errno = 0;
+    if (serve(ins[i].data, ins[i].len, out, sizeof(out), &nreqs) != -1 ||
+        errno != EPROTO) {
+      TEST_LOGF("input %zu: expected EPROTO", i);
+      return TEST_FAIL;
+    }
+  }
+
+  if (nreqs != 0) {
+    TEST_LOGF("unexpected # of requests: %d", nreqs);
+    return TEST_FAIL;
+  }
+
+  return TEST_OK;
+}
+
+TEST_ENTRY(
+  {"serve", test_serve},
+  {"invalid", test_invalid},
+);
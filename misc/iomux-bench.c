@@ -0,0 +1,231 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+
+/* A latency benchmark of the iomux event loop. A client process sends a
+ * byte on each of n connections, waits for all of them to be echoed by
+ * an iomux server, and pauses before the next round. Run with different
+ * batch sizes and spin times, e.g.:
+ *
+ *   misc/iomux-bench -c 64 -g 0
+ *   misc/iomux-bench -c 1 -g 100 -s 200
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib/iomux.h"
+
+#define MAXCONNS 1024
+
+struct echo {
+  struct iomux_handler h; /* must be first */
+};
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void on_echo(struct iomux_ctx *ctx, struct iomux_handler *h) {
+  char buf[64];
+  ssize_t n;
+
+  n = read(h->fd, buf, sizeof(buf));
+  if (n <= 0 || write(h->fd, buf, n) != n) {
+    iomux_close_source(ctx, h);
+  }
+}
+
+/* runs 'nrounds' rounds on 'fds' and reports the round trip times */
+static int client(int *fds, int nconns, int nrounds, int gap_us) {
+  struct timespec gap = {gap_us / 1000000, (gap_us % 1000000) * 1000L};
+  int64_t *rtts;
+  int64_t start;
+  int64_t total = 0;
+  char c = 'x';
+  int i;
+  int j;
+
+  rtts = calloc(nrounds, sizeof(*rtts));
+  if (rtts == NULL) {
+    perror("calloc");
+    return -1;
+  }
+
+  for (i = 0; i < nrounds; i++) {
+    start = now_ns();
+    for (j = 0; j < nconns; j++) {
+      if (write(fds[j], &c, 1) != 1) {
+        perror("write");
+        goto fail;
+      }
+    }
+
+    for (j = 0; j < nconns; j++) {
+      if (read(fds[j], &c, 1) != 1) {
+        perror("read");
+        goto fail;
+      }
+    }
+
+    rtts[i] = now_ns() - start;
+    total += rtts[i];
+    if (gap_us > 0) {
+      nanosleep(&gap, NULL);
+    }
+  }
+
+  qsort(rtts, nrounds, sizeof(*rtts), cmp_int64);
+  printf("rounds: %d, conns: %d, gap_us: %d\n", nrounds, nconns, gap_us);
+  printf("rtt_us: avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+      total / 1000.0 / nrounds, rtts[nrounds / 2] / 1000.0,
+      rtts[nrounds - 1 - nrounds / 100] / 1000.0,
+      rtts[nrounds - 1] / 1000.0);
+  free(rtts);
+  return 0;
+fail:
+  free(rtts);
+  return -1;
+}
+
+int main(int argc, char *argv[]) {
+  static struct echo echoes[MAXCONNS];
+  static int fds[MAXCONNS];
+  struct iomux_ctx ctx;
+  struct rusage ru;
+  int maxnevs = IOMUX_MAXNEVS;
+  int nrounds = 10000;
+  int nconns = 1;
+  int spin_us = 0;
+  int gap_us = 50;
+  int status;
+  int sv[2];
+  pid_t pid;
+  int ch;
+  int i;
+
+  while ((ch = getopt(argc, argv, "b:s:n:c:g:")) != -1) {
+    switch (ch) {
+    case 'b':
+      maxnevs = atoi(optarg);
+      break;
+    case 's':
+      spin_us = atoi(optarg);
+      break;
+    case 'n':
+      nrounds = atoi(optarg);
+      break;
+    case 'c':
+      nconns = atoi(optarg);
+      break;
+    case 'g':
+      gap_us = atoi(optarg);
+      break;
+    default:
+      goto usage;
+    }
+  }
+
+  if (nrounds <= 0 || nconns <= 0 || nconns > MAXCONNS || gap_us < 0) {
+    goto usage;
+  }
+
+  if (iomux_init(&ctx) < 0) {
+    perror("iomux_init");
+    return EXIT_FAILURE;
+  } else if (iomux_set_batch(&ctx, maxnevs) < 0 ||
+      iomux_set_spin(&ctx, spin_us) < 0) {
+    iomux_cleanup(&ctx);
+    goto usage;
+  }
+
+  for (i = 0; i < nconns; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+      perror("socketpair");
+      return EXIT_FAILURE;
+    }
+
+    fds[i] = sv[1];
+    echoes[i].h.fd = sv[0];
+    echoes[i].h.source_func = on_echo;
+    if (iomux_add_source(&ctx, &echoes[i].h) < 0) {
+      perror("iomux_add_source");
+      return EXIT_FAILURE;
+    }
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return EXIT_FAILURE;
+  } else if (pid == 0) {
+    iomux_cleanup(&ctx);
+    for (i = 0; i < nconns; i++) {
+      close(echoes[i].h.fd);
+    }
+    status = client(fds, nconns, nrounds, gap_us);
+    fflush(stdout);
+    _exit(status < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  for (i = 0; i < nconns; i++) {
+    close(fds[i]);
+  }
+
+  if (iomux_run(&ctx) < 0) {
+    perror("iomux_run");
+  }
+
+  waitpid(pid, &status, 0);
+  getrusage(RUSAGE_SELF, &ru);
+  printf("server: waits %llu, events %llu (%.2f per wait), batch %d/%d, "
+      "spin_us %d, cpu_ms %ld\n", (unsigned long long)ctx.nwaits,
+      (unsigned long long)ctx.nevents,
+      ctx.nwaits > 0 ? (double)ctx.nevents / ctx.nwaits : 0.0, ctx.nevs,
+      ctx.maxnevs, spin_us,
+      (long)((ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+      (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000));
+  iomux_cleanup(&ctx);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+usage:
+  fprintf(stderr, "usage: %s [-b max batch] [-s spin us] [-n rounds] "
+      "[-c conns] [-g gap us]\n", argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,53 @@
+/* Copyright (c) 2019 Sebastian Cato
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+
+/* A worker for hexec sync --worker, or --batch. State, here a request
+ * counter, is kept between requests of a worker. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "lib/worker.h"
+
+static int hello(void *arg, const struct worker_req *req,
+    struct worker_resp *resp) {
+  unsigned long *nreqs = arg;
+  const char *uri;
+
+  uri = scgi_get(&req->hdr, "REQUEST_URI");
+  return worker_printf(resp,
+      "Status: 200 OK\r\nContent-Type: text/plain\r\n\r\n"
+      "O Hai %s, from %d (request %lu)\n", uri != NULL ? uri : "",
+      (int)getpid(), ++*nreqs);
+}
+
+int main(void) {
+  unsigned long nreqs = 0;
+
+  if (worker_serve(STDIN_FILENO, STDOUT_FILENO, hello, &nreqs) < 0) {
+    perror("worker_serve");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}